@@ -0,0 +1,411 @@
+/*
+ * 記録した割り当てと解放の列を再生し、TLSFと単純なファーストフィットのサブアロケーションを比較する
+ * GPUを使わず、オフセットの管理だけを計測する
+ *
+ * bench_allocator [TRACE] [--write PATH]
+ * TRACEはMemoryAllocator::recordTrace()で記録したファイル ("a ID SIZE ALIGNMENT ..." と "f ID" の行)
+ * 省略した場合は、乱数で生成した列を使う
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "console.hh"
+#include "tlsf.hh"
+
+namespace {
+constexpr uint64_t BLOCK_SIZE = 64ull << 20;
+// これを超える割り当ては専用の割り当てとし、ブロックには入れない
+constexpr uint64_t DEDICATED_THRESHOLD = BLOCK_SIZE / 2;
+constexpr size_t SYNTHETIC_OPERATIONS = 1'000'000;
+constexpr size_t SYNTHETIC_LIVE = 4096;
+
+struct Operation {
+  bool allocate;
+  uint64_t id;
+  uint64_t size;
+  uint64_t alignment;
+};
+
+std::vector<Operation> loadTrace(const std::string& path) {
+  std::ifstream in(path);
+
+  if (!in) {
+    throw std::runtime_error("Failed to open " + path);
+  }
+
+  std::vector<Operation> operations;
+  std::string line;
+
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    std::string kind;
+    Operation op{};
+    fields >> kind >> op.id;
+
+    if (kind == "a") {
+      op.allocate = true;
+      fields >> op.size >> op.alignment;
+    } else if (kind != "f") {
+      continue;
+    }
+
+    if (!fields) {
+      throw std::runtime_error("Invalid trace line: " + line);
+    }
+
+    operations.push_back(op);
+  }
+
+  return operations;
+}
+
+// 大小のバッファーとイメージが入り混じる列を生成する
+std::vector<Operation> generateTrace() {
+  std::mt19937_64 random(1);
+  // サイズは256 Bから16 MiBまで対数的に分布させる
+  std::uniform_real_distribution<double> logSize(8.0, 24.0);
+  std::uniform_int_distribution<int> logAlignment(8, 16);
+
+  std::vector<Operation> operations;
+  std::vector<uint64_t> live;
+  uint64_t nextId = 1;
+
+  while (operations.size() < SYNTHETIC_OPERATIONS) {
+    bool allocate = live.size() < SYNTHETIC_LIVE / 2 ||
+                    (live.size() < SYNTHETIC_LIVE && random() % 2 == 0);
+
+    if (allocate) {
+      uint64_t size = static_cast<uint64_t>(std::exp2(logSize(random)));
+      uint64_t alignment = uint64_t{1} << logAlignment(random);
+      operations.push_back(Operation{true, nextId, size, alignment});
+      live.push_back(nextId++);
+    } else {
+      size_t index = random() % live.size();
+      operations.push_back(Operation{false, live[index], 0, 0});
+      live[index] = live.back();
+      live.pop_back();
+    }
+  }
+
+  for (uint64_t id : live) {
+    operations.push_back(Operation{false, id, 0, 0});
+  }
+
+  return operations;
+}
+
+void writeTrace(const std::string& path,
+                const std::vector<Operation>& operations) {
+  std::ofstream out(path);
+
+  if (!out) {
+    throw std::runtime_error("Failed to open " + path);
+  }
+
+  for (auto&& op : operations) {
+    if (op.allocate) {
+      out << "a " << op.id << " " << op.size << " " << op.alignment << "\n";
+    } else {
+      out << "f " << op.id << "\n";
+    }
+  }
+}
+
+// 空き領域をオフセット順に持ち、先頭から探すアロケーター
+class FirstFit {
+  uint64_t usedSize = 0;
+  // オフセットからサイズ
+  std::map<uint64_t, uint64_t> freeRanges;
+  std::unordered_map<uint64_t, uint64_t> allocations;
+
+ public:
+  explicit FirstFit(uint64_t capacity) {
+    freeRanges.emplace(0, capacity);
+  }
+
+  std::optional<uint64_t> allocate(uint64_t size, uint64_t alignment) {
+    for (auto it = freeRanges.begin(); it != freeRanges.end(); ++it) {
+      auto [offset, rangeSize] = *it;
+      uint64_t aligned = (offset + alignment - 1) & ~(alignment - 1);
+
+      if (aligned + size > offset + rangeSize) {
+        continue;
+      }
+
+      freeRanges.erase(it);
+
+      if (aligned > offset) {
+        freeRanges.emplace(offset, aligned - offset);
+      }
+
+      if (aligned + size < offset + rangeSize) {
+        freeRanges.emplace(aligned + size,
+                           offset + rangeSize - aligned - size);
+      }
+
+      allocations.emplace(aligned, size);
+      usedSize += size;
+      return aligned;
+    }
+
+    return std::nullopt;
+  }
+
+  void free(uint64_t offset) {
+    auto allocation = allocations.find(offset);
+    uint64_t size = allocation->second;
+    allocations.erase(allocation);
+    usedSize -= size;
+
+    auto next = freeRanges.emplace(offset, size).first;
+
+    // 後ろの空き領域と結合する
+    auto after = std::next(next);
+
+    if (after != freeRanges.end() && offset + size == after->first) {
+      next->second += after->second;
+      freeRanges.erase(after);
+    }
+
+    // 前の空き領域と結合する
+    if (next != freeRanges.begin()) {
+      auto before = std::prev(next);
+
+      if (before->first + before->second == offset) {
+        before->second += next->second;
+        freeRanges.erase(next);
+      }
+    }
+  }
+
+  bool isEmpty() const { return allocations.empty(); }
+  uint64_t getUsedSize() const { return usedSize; }
+
+  uint64_t getLargestFreeSize() const {
+    uint64_t largest = 0;
+
+    for (auto&& [offset, size] : freeRanges) {
+      largest = std::max(largest, size);
+    }
+
+    return largest;
+  }
+};
+
+// TLSFのハンドルとファーストフィットのオフセットを同じように扱う
+struct TlsfArena {
+  Tlsf tlsf{BLOCK_SIZE};
+
+  std::optional<uint64_t> allocate(uint64_t size, uint64_t alignment) {
+    std::optional<Tlsf::Allocation> allocation = tlsf.allocate(size, alignment);
+    return allocation.has_value() ? std::optional<uint64_t>(allocation->handle)
+                                  : std::nullopt;
+  }
+
+  void free(uint64_t handle) { tlsf.free(static_cast<Tlsf::Handle>(handle)); }
+  bool isEmpty() const { return tlsf.isEmpty(); }
+  uint64_t getUsedSize() const { return tlsf.getUsedSize(); }
+  uint64_t getLargestFreeSize() const { return tlsf.getLargestFreeSize(); }
+};
+
+struct FirstFitArena {
+  FirstFit firstFit{BLOCK_SIZE};
+
+  std::optional<uint64_t> allocate(uint64_t size, uint64_t alignment) {
+    return firstFit.allocate(size, alignment);
+  }
+
+  void free(uint64_t offset) { firstFit.free(offset); }
+  bool isEmpty() const { return firstFit.isEmpty(); }
+  uint64_t getUsedSize() const { return firstFit.getUsedSize(); }
+  uint64_t getLargestFreeSize() const { return firstFit.getLargestFreeSize(); }
+};
+
+struct Result {
+  double nanosecondsPerOperation = 0.0;
+  size_t peakBlocks = 0;
+  size_t dedicated = 0;
+  // ブロック数が最大の時点での、使用中の割合と空き領域の断片化の度合い
+  // 断片化は、各ブロックの最大の空き領域に入らない空き領域の割合
+  double utilization = 0.0;
+  double fragmentation = 0.0;
+};
+
+// MemoryAllocatorと同じく、空いているブロックを先頭から探し、無ければブロックを追加する
+// 空のブロックは1つだけ残す
+template <typename Arena>
+Result replay(const std::vector<Operation>& operations) {
+  struct Location {
+    size_t block;
+    uint64_t handle;
+  };
+
+  std::vector<std::unique_ptr<Arena>> blocks;
+  std::unordered_map<uint64_t, Location> locations;
+  size_t blockCount = 0;
+  size_t emptyCount = 0;
+  Result result;
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (auto&& op : operations) {
+    if (!op.allocate) {
+      auto location = locations.find(op.id);
+
+      if (location == locations.end()) {
+        continue;
+      }
+
+      std::unique_ptr<Arena>& block = blocks[location->second.block];
+      block->free(location->second.handle);
+      locations.erase(location);
+
+      if (block->isEmpty()) {
+        if (emptyCount > 0) {
+          block.reset();
+          blockCount--;
+        } else {
+          emptyCount++;
+        }
+      }
+
+      continue;
+    }
+
+    if (op.size > DEDICATED_THRESHOLD) {
+      result.dedicated++;
+      continue;
+    }
+
+    std::optional<uint64_t> handle;
+    size_t index = 0;
+
+    for (; index < blocks.size() && !handle.has_value(); index++) {
+      if (blocks[index]) {
+        bool wasEmpty = blocks[index]->isEmpty();
+        handle = blocks[index]->allocate(op.size, op.alignment);
+
+        if (handle.has_value() && wasEmpty) {
+          emptyCount--;
+        }
+      }
+    }
+
+    if (handle.has_value()) {
+      index--;
+    } else {
+      index = 0;
+
+      while (index < blocks.size() && blocks[index]) {
+        index++;
+      }
+
+      if (index == blocks.size()) {
+        blocks.emplace_back();
+      }
+
+      blocks[index] = std::make_unique<Arena>();
+      handle = blocks[index]->allocate(op.size, op.alignment);
+      blockCount++;
+    }
+
+    locations.emplace(op.id, Location{index, *handle});
+
+    if (blockCount <= result.peakBlocks) {
+      continue;
+    }
+
+    // ブロックが増えた時点の状態を記録する (計測時間に含まれるが、回数は少ない)
+    uint64_t used = 0;
+    uint64_t freeSize = 0;
+    // ブロックごとの最大の空き領域の合計
+    uint64_t largestFree = 0;
+
+    for (auto&& block : blocks) {
+      if (block) {
+        used += block->getUsedSize();
+        freeSize += BLOCK_SIZE - block->getUsedSize();
+        largestFree += block->getLargestFreeSize();
+      }
+    }
+
+    result.peakBlocks = blockCount;
+    result.utilization = static_cast<double>(used) /
+                         static_cast<double>(blockCount * BLOCK_SIZE);
+    result.fragmentation =
+        freeSize > 0 ? 1.0 - static_cast<double>(largestFree) /
+                                 static_cast<double>(freeSize)
+                     : 0.0;
+  }
+
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  result.nanosecondsPerOperation = elapsed.count() / operations.size();
+  return result;
+}
+
+void showResult(const char* name, const Result& result) {
+  std::cout << "| " << name << ": " << result.nanosecondsPerOperation
+            << " ns/op, peak blocks: " << result.peakBlocks
+            << ", utilization: " << result.utilization * 100.0
+            << "%, fragmentation: " << result.fragmentation * 100.0 << "%"
+            << std::endl;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  try {
+    std::optional<std::string> tracePath;
+    std::optional<std::string> writePath;
+
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+
+      if (arg == "--write" && i + 1 < argc) {
+        writePath = argv[++i];
+      } else {
+        tracePath = arg;
+      }
+    }
+
+    std::vector<Operation> operations =
+        tracePath.has_value() ? loadTrace(*tracePath) : generateTrace();
+
+    if (writePath.has_value()) {
+      writeTrace(*writePath, operations);
+    }
+
+    std::cout << "# " << (tracePath.has_value() ? *tracePath : "Synthetic")
+              << ": " << operations.size() << " operations, "
+              << (BLOCK_SIZE >> 20) << " MiB blocks" << std::endl;
+
+    Result tlsf = replay<TlsfArena>(operations);
+    Result firstFit = replay<FirstFitArena>(operations);
+
+    showResult("TLSF", tlsf);
+    showResult("First fit", firstFit);
+    std::cout << "| Dedicated: " << tlsf.dedicated << std::endl;
+  } catch (const std::exception& e) {
+    std::cerr << Console::fgRed << "# " << e.what() << Console::fgDefault
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,110 @@
+/*
+ * ローダーのトランポリン経由の呼び出しと、vkGetDeviceProcAddr()で取得した関数の直接呼び出しのオーバーヘッドを比較する
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "console.hh"
+#include "vulkan_dispatch.hh"
+
+namespace {
+constexpr uint64_t DEFAULT_ITERATIONS = 10'000'000;
+
+template <typename F>
+double measure(uint64_t iterations, F&& f) {
+  auto start = std::chrono::steady_clock::now();
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    f();
+  }
+
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+void check(VkResult result, const char* name) {
+  if (result != VK_SUCCESS) {
+    throw std::runtime_error(std::string(name) +
+                             " failed; result: " + std::to_string(result));
+  }
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  VkInstance instance = VK_NULL_HANDLE;
+  VkDevice device = VK_NULL_HANDLE;
+
+  try {
+    uint64_t iterations = argc > 1 ? std::stoull(argv[1]) : DEFAULT_ITERATIONS;
+
+    VkApplicationInfo appInfo{};
+    appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    appInfo.pApplicationName = "bench_dispatch";
+    appInfo.apiVersion = VK_API_VERSION_1_0;
+
+    VkInstanceCreateInfo instanceInfo{};
+    instanceInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    instanceInfo.pApplicationInfo = &appInfo;
+
+    // 最初の呼び出しでlibvulkanがロードされる
+    check(vkCreateInstance(&instanceInfo, nullptr, &instance),
+          "vkCreateInstance()");
+    vulkanLoadInstance(instance);
+
+    uint32_t physicalDeviceCount = 1;
+    VkPhysicalDevice physicalDevice;
+    VkResult result = vkEnumeratePhysicalDevices(
+        instance, &physicalDeviceCount, &physicalDevice);
+
+    if ((result != VK_SUCCESS && result != VK_INCOMPLETE) ||
+        physicalDeviceCount == 0) {
+      throw std::runtime_error("No physical device");
+    }
+
+    float queuePriority = 1.0f;
+    VkDeviceQueueCreateInfo queueInfo{};
+    queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queueInfo.queueFamilyIndex = 0;
+    queueInfo.queueCount = 1;
+    queueInfo.pQueuePriorities = &queuePriority;
+
+    VkDeviceCreateInfo deviceInfo{};
+    deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    deviceInfo.queueCreateInfoCount = 1;
+    deviceInfo.pQueueCreateInfos = &queueInfo;
+
+    check(vkCreateDevice(physicalDevice, &deviceInfo, nullptr, &device),
+          "vkCreateDevice()");
+
+    // vulkanLoadInstance()で取得したデバイスレベルの関数はトランポリンを指している
+    PFN_vkGetDeviceQueue trampoline = vkGetDeviceQueue;
+
+    VulkanDeviceTable table;
+    vulkanLoadDeviceTable(device, &table);
+
+    VkQueue queue;
+    double trampolineTime =
+        measure(iterations, [&] { trampoline(device, 0, 0, &queue); });
+    double directTime = measure(
+        iterations, [&] { table.vkGetDeviceQueue(device, 0, 0, &queue); });
+
+    std::cout << "# vkGetDeviceQueue() x " << iterations << std::endl;
+    std::cout << "| Trampoline: " << trampolineTime << " ns/call" << std::endl;
+    std::cout << "| Direct: " << directTime << " ns/call" << std::endl;
+
+    table.vkDestroyDevice(device, nullptr);
+    vkDestroyInstance(instance, nullptr);
+  } catch (const std::exception& e) {
+    std::cerr << Console::fgRed << "# " << e.what() << Console::fgDefault
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
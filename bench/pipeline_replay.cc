@@ -0,0 +1,367 @@
+/*
+ * 記録したパイプラインのマニフェストを再生し、パイプラインごとの作成時間を計測する
+ *
+ * bench_pipeline_replay MANIFEST [--device INDEX] [--cache PATH]
+ * MANIFESTは05_swapchain_hppの--pipeline-manifestで記録したファイル
+ * --cacheを指定すると、そのパイプラインキャッシュを読み込んでから作成する (保存はしない)
+ * 記録したデバイスと異なる場合も、警告して再生する
+ *
+ * グラフィックスパイプラインは、記録したカラーアタッチメントのフォーマットで互換なレンダーパスを作って再生する
+ * VK_EXT_graphics_pipeline_libraryが使えれば、アプリケーションと同じくライブラリーを作成して最適化したリンクを行い、
+ * 使えなければ一括で作成する
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include "console.hh"
+#include "pipeline_cache.hh"
+#include "pipeline_compiler.hh"
+#include "pipeline_library.hh"
+#include "pipeline_manifest.hh"
+
+namespace {
+struct Options {
+  std::string manifestPath;
+  size_t deviceIndex = 0;
+  std::optional<std::string> cachePath;
+};
+
+Options parseArguments(int argc, char* argv[]) {
+  Options options;
+  bool hasManifest = false;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "--device" && i + 1 < argc) {
+      options.deviceIndex = std::stoul(argv[++i]);
+    } else if (arg == "--cache" && i + 1 < argc) {
+      options.cachePath = argv[++i];
+    } else if (!hasManifest) {
+      options.manifestPath = arg;
+      hasManifest = true;
+    } else {
+      throw std::runtime_error("Unknown argument: " + arg);
+    }
+  }
+
+  if (!hasManifest) {
+    throw std::runtime_error(
+        "Usage: bench_pipeline_replay MANIFEST [--device INDEX] [--cache "
+        "PATH]");
+  }
+
+  return options;
+}
+
+bool hasExtension(const vk::raii::PhysicalDevice& physicalDevice,
+                  const char* name) {
+  for (auto&& extension : physicalDevice.enumerateDeviceExtensionProperties()) {
+    if (std::string(extension.extensionName.data()) == name) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// パイプラインライブラリーは、エクステンションとフィーチャーの両方が必要となる
+bool isGraphicsPipelineLibrarySupported(
+    const vk::raii::PhysicalDevice& physicalDevice) {
+  if (physicalDevice.getProperties().apiVersion < VK_API_VERSION_1_1 ||
+      !hasExtension(physicalDevice, VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME) ||
+      !hasExtension(physicalDevice,
+                    VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME)) {
+    return false;
+  }
+
+  return physicalDevice
+      .getFeatures2<vk::PhysicalDeviceFeatures2,
+                    vk::PhysicalDeviceGraphicsPipelineLibraryFeaturesEXT>()
+      .get<vk::PhysicalDeviceGraphicsPipelineLibraryFeaturesEXT>()
+      .graphicsPipelineLibrary;
+}
+
+// 互換性はアタッチメントのフォーマットとサンプル数で決まるので、ロードやストアの指定は何でもよい
+vk::raii::RenderPass createRenderPass(const vk::raii::Device& device,
+                                      vk::Format format) {
+  vk::AttachmentDescription attachment{
+      /* flags = */ {},
+      /* format = */ format,
+      /* samples = */ vk::SampleCountFlagBits::e1,
+      /* loadOp = */ vk::AttachmentLoadOp::eClear,
+      /* storeOp = */ vk::AttachmentStoreOp::eStore,
+      /* stencilLoadOp = */ vk::AttachmentLoadOp::eDontCare,
+      /* stencilStoreOp = */ vk::AttachmentStoreOp::eDontCare,
+      /* initialLayout = */ vk::ImageLayout::eUndefined,
+      /* finalLayout = */ vk::ImageLayout::eColorAttachmentOptimal};
+  vk::AttachmentReference colorReference{
+      /* attachment = */ 0,
+      /* layout = */ vk::ImageLayout::eColorAttachmentOptimal};
+  vk::SubpassDescription subpass{
+      /* flags = */ {},
+      /* pipelineBindPoint = */ vk::PipelineBindPoint::eGraphics,
+      /* inputAttachments = */ {},
+      /* colorAttachments = */ colorReference};
+  return vk::raii::RenderPass(
+      device, vk::RenderPassCreateInfo{/* flags = */ {},
+                                       /* attachments = */ attachment,
+                                       /* subpasses = */ subpass});
+}
+
+void showValues(const std::vector<uint32_t>& values) {
+  std::cout << "[";
+
+  for (size_t i = 0; i < values.size(); i++) {
+    std::cout << (i > 0 ? ", " : "") << values[i];
+  }
+
+  std::cout << "]";
+}
+
+void showDescription(size_t index,
+                     const ComputePipelineDescription& description) {
+  std::cout << "| #" << index << " " << std::hex << std::setw(16)
+            << std::setfill('0') << description.hash() << std::dec
+            << std::setfill(' ') << " " << description.entryPoint << " ";
+  showValues(description.specializationConstants);
+}
+
+void showDescription(size_t index,
+                     const GraphicsPipelineDescription& description) {
+  std::cout << "| #" << index << " "
+            << description.preRasterization.shaderName << " ";
+  showValues(description.preRasterization.specializationConstants);
+  std::cout << " + " << description.fragmentShader.shaderName << " ";
+  showValues(description.fragmentShader.specializationConstants);
+  std::cout << " " << vk::to_string(description.fragmentOutput.colorFormat)
+            << (description.fragmentOutput.blendEnabled ? " blend" : "");
+}
+
+// グラフィックスパイプラインはライブラリーごとに結果が得られるので、ヒットした数も出力する
+void showFeedback(const PipelineCache::Statistics& before,
+                  const PipelineCache::Statistics& after) {
+  uint32_t feedbackCount = after.feedbackCount - before.feedbackCount;
+  uint32_t hitCount = after.hitCount - before.hitCount;
+
+  if (feedbackCount == 0) {
+    return;
+  }
+
+  if (hitCount == feedbackCount) {
+    std::cout << " (hit)";
+  } else if (hitCount == 0) {
+    std::cout << " (miss)";
+  } else {
+    std::cout << " (" << hitCount << "/" << feedbackCount << " hits)";
+  }
+}
+
+void showTotal(const char* kind, std::vector<double> times) {
+  if (times.empty()) {
+    return;
+  }
+
+  double total = 0.0;
+
+  for (double time : times) {
+    total += time;
+  }
+
+  std::sort(times.begin(), times.end());
+
+  std::cout << "# " << kind << ": " << total << " ms (p50 "
+            << times[times.size() / 2] << " ms, max " << times.back()
+            << " ms)" << std::endl;
+}
+
+// 1つずつ呼び出し元のスレッドで作成し、他のパイプラインの作成と重ならないようにする
+template <typename Description, typename Create>
+std::vector<double> replay(PipelineCache& cache,
+                           const std::vector<Description>& descriptions,
+                           Create&& create) {
+  std::vector<double> times;
+
+  for (size_t i = 0; i < descriptions.size(); i++) {
+    PipelineCache::Statistics before = cache.getStatistics();
+    auto start = std::chrono::steady_clock::now();
+    create(descriptions[i]);
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    times.push_back(elapsed.count());
+    showDescription(i, descriptions[i]);
+    std::cout << ": " << elapsed.count() << " ms";
+    showFeedback(before, cache.getStatistics());
+    std::cout << std::endl;
+  }
+
+  return times;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  try {
+    Options options = parseArguments(argc, argv);
+    std::shared_ptr<PipelineManifest> manifest =
+        PipelineManifest::read(options.manifestPath);
+
+    if (!manifest) {
+      throw std::runtime_error("No such file: " + options.manifestPath);
+    }
+
+    vk::raii::Context context;
+    vk::ApplicationInfo appInfo{
+        /* pApplicationName = */ "bench_pipeline_replay",
+        /* applicationVersion = */ 1,
+        /* pEngineName = */ nullptr,
+        /* engineVersion = */ 0,
+        /* apiVersion = */ VK_API_VERSION_1_1};
+    vk::raii::Instance instance(context,
+                                vk::InstanceCreateInfo{{}, &appInfo});
+    vk::raii::PhysicalDevices physicalDevices(instance);
+
+    if (options.deviceIndex >= physicalDevices.size()) {
+      throw std::runtime_error("No physical device " +
+                               std::to_string(options.deviceIndex));
+    }
+
+    vk::raii::PhysicalDevice& physicalDevice =
+        physicalDevices[options.deviceIndex];
+    vk::PhysicalDeviceProperties properties = physicalDevice.getProperties();
+
+    if (auto reason = manifest->validateDevice(properties)) {
+      std::cout << Console::fgYellow << "# "
+                << "Replaying on a different device: " << *reason
+                << Console::fgDefault << std::endl;
+    }
+
+    // パイプラインの作成にキューは使わないが、1つは作成する必要がある
+    float queuePriority = 1.0f;
+    vk::DeviceQueueCreateInfo queueInfo{
+        /* flags = */ {},
+        /* queueFamilyIndex = */ 0,
+        /* queuePriorities = */ queuePriority};
+
+    std::vector<const char*> extensions;
+    bool feedbackEnabled = hasExtension(
+        physicalDevice, VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME);
+
+    if (feedbackEnabled) {
+      extensions.push_back(VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME);
+    }
+
+    bool libraryEnabled = isGraphicsPipelineLibrarySupported(physicalDevice);
+    vk::PhysicalDeviceGraphicsPipelineLibraryFeaturesEXT libraryFeatures{
+        /* graphicsPipelineLibrary = */ VK_TRUE};
+
+    if (libraryEnabled) {
+      extensions.push_back(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+      extensions.push_back(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+    }
+
+    auto device = std::make_shared<vk::raii::Device>(
+        physicalDevice,
+        vk::DeviceCreateInfo{
+            /* flags = */ {},
+            /* queueCreateInfos = */ queueInfo,
+            /* pEnabledLayerNames = */ {},
+            /* pEnabledExtensionNames = */ extensions,
+            /* pEnabledFeatures = */ nullptr,
+            /* pNext = */ libraryEnabled ? &libraryFeatures : nullptr});
+
+    std::shared_ptr<PipelineCache> cache;
+
+    if (options.cachePath.has_value()) {
+      cache = PipelineCache::open(device, properties, feedbackEnabled,
+                                  *options.cachePath);
+
+      if (cache->getRejectionReason().has_value()) {
+        std::cout << Console::fgYellow << "# "
+                  << "Discarded pipeline cache: "
+                  << *cache->getRejectionReason() << Console::fgDefault
+                  << std::endl;
+      }
+    } else {
+      cache = std::make_shared<PipelineCache>(device, properties,
+                                              feedbackEnabled);
+    }
+
+    auto compiler = std::make_shared<PipelineCompiler>(device, cache, 1);
+    std::vector<ComputePipelineDescription> computeDescriptions =
+        manifest->getComputePipelines();
+    std::vector<GraphicsPipelineDescription> graphicsDescriptions =
+        manifest->getGraphicsPipelines();
+
+    std::cout << "# " << properties.deviceName << ": "
+              << computeDescriptions.size() << " compute pipelines, "
+              << graphicsDescriptions.size() << " graphics pipelines ("
+              << (libraryEnabled ? "libraries" : "monolithic") << "), "
+              << manifest->getShaderCount() << " shaders" << std::endl;
+
+    std::vector<double> computeTimes =
+        replay(*cache, computeDescriptions,
+               [&](const ComputePipelineDescription& description) {
+                 compiler->compileNow(description);
+               });
+
+    // アプリケーションと同じく、空のパイプラインレイアウトを使う
+    vk::raii::PipelineLayout pipelineLayout(*device,
+                                            vk::PipelineLayoutCreateInfo{});
+    // フォーマットごとのレンダーパスと、それを使うライブラリー
+    std::map<vk::Format, vk::raii::RenderPass> renderPasses;
+    std::map<vk::Format, std::shared_ptr<GraphicsPipelineLibrary>> libraries;
+
+    std::vector<double> graphicsTimes = replay(
+        *cache, graphicsDescriptions,
+        [&](const GraphicsPipelineDescription& description) {
+          vk::Format format = description.fragmentOutput.colorFormat;
+          std::shared_ptr<GraphicsPipelineLibrary>& library = libraries[format];
+
+          if (!library) {
+            auto it =
+                renderPasses.emplace(format, createRenderPass(*device, format))
+                    .first;
+            library = std::make_shared<GraphicsPipelineLibrary>(
+                device, cache, compiler, *pipelineLayout, *it->second);
+          }
+
+          if (libraryEnabled) {
+            library->createLinked(description);
+          } else {
+            library->createMonolithic(
+                description.vertexInput, description.preRasterization,
+                description.fragmentShader, description.fragmentOutput);
+          }
+        });
+
+    showTotal("Compute total", computeTimes);
+    showTotal("Graphics total", graphicsTimes);
+
+    if (feedbackEnabled) {
+      PipelineCache::Statistics stats = cache->getStatistics();
+      std::cout << "# "
+                << "Cache hits: " << stats.hitCount << " / "
+                << stats.feedbackCount << std::endl;
+    }
+  } catch (const std::exception& e) {
+    std::cerr << Console::fgRed << "# " << e.what() << Console::fgDefault
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
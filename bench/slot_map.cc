@@ -0,0 +1,164 @@
+/*
+ * 多数のリソースの参照を、スロットマップとstd::shared_ptrのハッシュマップで比較する
+ * 作成と削除を繰り返しながら、ハンドルからの検索と全要素の走査の時間を計測する
+ *
+ * bench_slot_map [COUNT]
+ * COUNTは同時に存在するリソースの数 (省略時は50000)
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "console.hh"
+#include "slot_map.hh"
+
+namespace {
+constexpr size_t LOOKUPS = 10'000'000;
+// 1回の入れ替えで削除して作り直すリソースの数
+constexpr size_t CHURN = 1000;
+
+// バッファーのハンドルと割り当て程度の大きさ
+struct Resource {
+  uint64_t handle;
+  uint64_t memory;
+  uint64_t offset;
+  uint64_t size;
+};
+
+using Clock = std::chrono::steady_clock;
+
+double nanosecondsSince(Clock::time_point start, size_t count) {
+  std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+  return elapsed.count() / static_cast<double>(count);
+}
+
+struct Result {
+  double churn = 0.0;
+  double lookup = 0.0;
+  double iterate = 0.0;
+  // 最適化で計算が消えないように、参照した値を合計する
+  uint64_t checksum = 0;
+};
+
+Result runSlotMap(size_t count) {
+  std::mt19937 random(1);
+  SlotMap<Resource> resources;
+  std::vector<SlotMap<Resource>::Handle> handles;
+  Result result;
+
+  for (size_t i = 0; i < count; i++) {
+    handles.push_back(resources.insert(Resource{i, i, 0, 256}));
+  }
+
+  auto start = Clock::now();
+
+  for (size_t i = 0; i < CHURN; i++) {
+    size_t index = random() % handles.size();
+    resources.erase(handles[index]);
+    handles[index] = resources.insert(Resource{i, i, 0, 256});
+  }
+
+  result.churn = nanosecondsSince(start, CHURN);
+
+  start = Clock::now();
+
+  for (size_t i = 0; i < LOOKUPS; i++) {
+    result.checksum += resources.at(handles[random() % handles.size()]).size;
+  }
+
+  result.lookup = nanosecondsSince(start, LOOKUPS);
+
+  start = Clock::now();
+
+  for (auto&& resource : resources) {
+    result.checksum += resource.offset + resource.size;
+  }
+
+  result.iterate = nanosecondsSince(start, count);
+  return result;
+}
+
+Result runSharedPtr(size_t count) {
+  std::mt19937 random(1);
+  std::unordered_map<uint32_t, std::shared_ptr<Resource>> resources;
+  std::vector<uint32_t> handles;
+  uint32_t nextHandle = 1;
+  Result result;
+
+  for (size_t i = 0; i < count; i++) {
+    handles.push_back(nextHandle);
+    resources.emplace(nextHandle++,
+                      std::make_shared<Resource>(Resource{i, i, 0, 256}));
+  }
+
+  auto start = Clock::now();
+
+  for (size_t i = 0; i < CHURN; i++) {
+    size_t index = random() % handles.size();
+    resources.erase(handles[index]);
+    handles[index] = nextHandle;
+    resources.emplace(nextHandle++,
+                      std::make_shared<Resource>(Resource{i, i, 0, 256}));
+  }
+
+  result.churn = nanosecondsSince(start, CHURN);
+
+  start = Clock::now();
+
+  for (size_t i = 0; i < LOOKUPS; i++) {
+    // 利用側が参照を保持する場合を模して、コピーしてから読む
+    std::shared_ptr<Resource> resource =
+        resources.at(handles[random() % handles.size()]);
+    result.checksum += resource->size;
+  }
+
+  result.lookup = nanosecondsSince(start, LOOKUPS);
+
+  start = Clock::now();
+
+  for (auto&& [handle, resource] : resources) {
+    result.checksum += resource->offset + resource->size;
+  }
+
+  result.iterate = nanosecondsSince(start, count);
+  return result;
+}
+
+void showResult(const char* name, const Result& result) {
+  std::cout << "| " << name << ": churn " << result.churn
+            << " ns/op, lookup " << result.lookup << " ns/op, iterate "
+            << result.iterate << " ns/element (checksum " << result.checksum
+            << ")" << std::endl;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  try {
+    size_t count = argc > 1 ? std::stoul(argv[1]) : 50'000;
+
+    if (count == 0 || count > SlotMap<Resource>::CAPACITY) {
+      throw std::runtime_error("COUNT must be between 1 and " +
+                               std::to_string(SlotMap<Resource>::CAPACITY));
+    }
+
+    std::cout << "# " << count << " resources, " << LOOKUPS << " lookups"
+              << std::endl;
+
+    showResult("SlotMap", runSlotMap(count));
+    showResult("shared_ptr + unordered_map", runSharedPtr(count));
+  } catch (const std::exception& e) {
+    std::cerr << Console::fgRed << "# " << e.what() << Console::fgDefault
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
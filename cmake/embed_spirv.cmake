@@ -0,0 +1,58 @@
+# SPIR-Vのファイルを、constexprな配列としてヘッダーに埋め込む
+#
+# cmake -DOUTPUT=header.hh -DINPUTS="a.comp.spv;b.vert.spv" -P embed_spirv.cmake
+#
+# 配列の名前はファイル名から決める (empty.comp.spv -> EMPTY_COMPUTE)
+# ファイルはリトルエンディアンのワード列なので、4バイトずつ並べ替えて32ビットの値にする
+
+set(STAGE_NAMES_vert VERTEX)
+set(STAGE_NAMES_frag FRAGMENT)
+set(STAGE_NAMES_comp COMPUTE)
+
+set(content "// embed_spirv.cmakeで生成したファイル (編集しないこと)\n\n")
+string(APPEND content "#pragma once\n\n#include <cstdint>\n\nnamespace BuiltinShaders {\n")
+
+foreach(input ${INPUTS})
+  get_filename_component(fileName ${input} NAME)
+
+  if(NOT fileName MATCHES "^([A-Za-z0-9_]+)\\.(vert|frag|comp)(\\.hlsl)?\\.spv$")
+    message(FATAL_ERROR "Unexpected shader file name: ${fileName}")
+  endif()
+
+  string(TOUPPER ${CMAKE_MATCH_1} baseName)
+  set(name "${baseName}_${STAGE_NAMES_${CMAKE_MATCH_2}}")
+
+  file(READ ${input} hex HEX)
+  string(LENGTH "${hex}" length)
+  math(EXPR remainder "${length} % 8")
+
+  if(length EQUAL 0 OR NOT remainder EQUAL 0)
+    message(FATAL_ERROR "Not a SPIR-V binary: ${input}")
+  endif()
+
+  string(REGEX REPLACE
+    "([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])([0-9a-f][0-9a-f])"
+    "0x\\4\\3\\2\\1, " words "${hex}")
+  # 1行に6ワードずつ並べる
+  set(word "0x[0-9a-f]+, ")
+  set(line "${word}${word}${word}${word}${word}${word}")
+  string(REGEX REPLACE "(${line})" "\\1\n    " words "${words}")
+  string(REPLACE ", \n" ",\n" words "${words}")
+  string(STRIP "${words}" words)
+  string(REGEX REPLACE ",$" "" words "${words}")
+
+  string(APPEND content "\n// ${fileName}\n")
+  string(APPEND content "inline constexpr uint32_t ${name}[] = {\n    ${words}};\n")
+  string(APPEND content "static_assert(${name}[0] == 0x07230203, \"SPIR-V magic\");\n")
+endforeach()
+
+string(APPEND content "\n}  // namespace BuiltinShaders\n")
+
+# 内容が変わらなければ書き込まず、インクルードしているファイルを再コンパイルさせない
+if(EXISTS ${OUTPUT})
+  file(READ ${OUTPUT} previous)
+endif()
+
+if(NOT previous STREQUAL content)
+  file(WRITE ${OUTPUT} "${content}")
+endif()
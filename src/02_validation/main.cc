@@ -3,6 +3,7 @@
  */
 
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
 #include <string>
@@ -10,18 +11,16 @@
 
 #include <SDL.h>
 #include <SDL_vulkan.h>
-#include <vulkan/vulkan.h>
 
+#include "config.hh"
 #include "console.hh"
-
-// MoltenVKサポート用のコードを有効/無効にする
-#define SUPPORT_MOLTENVK 1
-// バリエーションレイヤー有効/無効
-#define ENABLE_VALIDATION 1
+#include "tracer.hh"
+#include "vulkan_dispatch.hh"
 
 class Application {
  public:
   static constexpr char NAME[] = "02_validation";
+  static constexpr char VALIDATION_LAYER_NAME[] = "VK_LAYER_KHRONOS_validation";
   static constexpr uint32_t WIDTH = 960;
   static constexpr uint32_t HEIGHT = 570;
 
@@ -29,21 +28,44 @@ class Application {
   SDL_Window* window;
   VkInstance instance;
   VkDebugUtilsMessengerEXT debugMessenger;
+  Config config;
+  // configと利用可能なレイヤー/エクステンションから決定した値
+  bool validationEnabled = false;
+  bool portabilityEnabled = false;
 
  public:
   void run(const std::vector<std::string>& args) {
+    parseArguments(args);
+
+    if (config.trace.has_value()) {
+      Tracer::get().start(*config.trace);
+    }
+
     initialize();
     loop();
     finalize();
+    Tracer::get().stop();
   }
 
  private:
+  void parseArguments(const std::vector<std::string>& args) {
+    config = Config::parse(args);
+
+    if (!config.unparsed.empty()) {
+      throw std::runtime_error("Unknown argument: " + config.unparsed[0]);
+    }
+  }
+
   void initialize() {
+    TRACE_SCOPE("initialize");
+
     initializeSDL();
     initializeVulkan();
   }
 
   void initializeSDL() {
+    TRACE_SCOPE("initializeSDL");
+
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
       throw std::runtime_error(SDL_GetError());
     }
@@ -58,6 +80,8 @@ class Application {
   }
 
   void initializeVulkan() {
+    TRACE_SCOPE("initializeVulkan");
+
     // *Infoと名付けられた構造体は、言わば関数への引数をまとめたもの
     // VkApplicationInfoは、アプリケーションの情報を指定する構造体
     VkApplicationInfo appInfo{};
@@ -77,6 +101,11 @@ class Application {
     // 使用するAPIのバージョン
     appInfo.apiVersion = VK_API_VERSION_1_0;
 
+    validationEnabled =
+        config.enableValidation(isLayerAvailable(VALIDATION_LAYER_NAME));
+    portabilityEnabled = config.enablePortability(
+        isExtensionAvailable(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME));
+
     VkInstanceCreateFlags instanceFlags = getInstanceFlags();
     showInstanceFlags(instanceFlags);
 
@@ -92,18 +121,13 @@ class Application {
 
     const void* instanceNext = nullptr;
 
-#if ENABLE_VALIDATION
     // バリデーションレイヤーの出力をコールバックで受け取る為には、VkDebugUtilsMessengerを作らなければならない
     VkDebugUtilsMessengerCreateInfoEXT messengerInfo{};
     messengerInfo.sType =
         VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
     messengerInfo.pNext = nullptr;
     messengerInfo.flags = 0;
-    messengerInfo.messageSeverity =
-        VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT |
-        /*VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT |*/
-        VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT |
-        VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+    messengerInfo.messageSeverity = config.messageSeverity;
     messengerInfo.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT |
                                 VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
                                 VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
@@ -112,8 +136,9 @@ class Application {
 
     // エクステンションとレイヤーを登録するだけでは、インスタンス生成/削除時のバリデーションが行われない
     // インスタンス生成/削除時のバリデーションを有効にするには、VkInstanceCreateInfoのpNextにVkDebugUtilsMessengerCreateInfoEXTへのポインターを与える
-    instanceNext = reinterpret_cast<void*>(&messengerInfo);
-#endif
+    if (validationEnabled) {
+      instanceNext = reinterpret_cast<void*>(&messengerInfo);
+    }
 
     // インスタンスの設定
     VkInstanceCreateInfo instanceInfo{};
@@ -133,7 +158,12 @@ class Application {
 
     // vkCreateInstance(pCreateInfo, pAllocator, pInstance)
     // 今回はアロケータを使用しない (nullptr)
-    VkResult result = vkCreateInstance(&instanceInfo, nullptr, &instance);
+    VkResult result;
+
+    {
+      TRACE_SCOPE("vkCreateInstance");
+      result = vkCreateInstance(&instanceInfo, nullptr, &instance);
+    }
 
     if (result != VK_SUCCESS) {
       throw std::runtime_error("vkCreateInstance() failed; result: " +
@@ -144,15 +174,18 @@ class Application {
                 << std::endl;
     }
 
-#if ENABLE_VALIDATION
-    // vkCreateDebugUtilsMessengerEXT(instance, pCreateInfo, pAllocator,
-    // pMessenger)
-    // VkDebugUtilsMessengerを作る
-    // この関数は自動的にロードされないので、アプリケーション側でロードしなければならない
-    // (vulkan_ext.cc参照)
-    vkCreateDebugUtilsMessengerEXT(instance, &messengerInfo, nullptr,
-                                   &debugMessenger);
-#endif
+    // インスタンスレベルの関数をこのインスタンス用に一度だけ取得する
+    vulkanLoadInstance(instance);
+
+    if (validationEnabled) {
+      // vkCreateDebugUtilsMessengerEXT(instance, pCreateInfo, pAllocator,
+      // pMessenger)
+      // VkDebugUtilsMessengerを作る
+      // この関数は自動的にロードされないので、アプリケーション側でロードしなければならない
+      // (vulkan_dispatch.cc参照)
+      vkCreateDebugUtilsMessengerEXT(instance, &messengerInfo, nullptr,
+                                     &debugMessenger);
+    }
   }
 
   static VKAPI_ATTR VkBool32 VKAPI_CALL
@@ -192,21 +225,28 @@ class Application {
   }
 
   void finalize() {
+    TRACE_SCOPE("finalize");
+
     finalizeVulkan();
     finalizeSDL();
   }
 
   void finalizeVulkan() {
-#if ENABLE_VALIDATION
-    // vkDestroyDebugUtilsMessengerEXT(instance, messenger, pAllocator)
-    vkDestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
-#endif
+    TRACE_SCOPE("finalizeVulkan");
+
+    if (validationEnabled) {
+      // vkDestroyDebugUtilsMessengerEXT(instance, messenger, pAllocator)
+      vkDestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
+    }
 
     // vkDestroyInstance(instance, pAllocator)
     vkDestroyInstance(instance, nullptr);
+    vulkanUnloadInstance(instance);
   }
 
   void finalizeSDL() {
+    TRACE_SCOPE("finalizeSDL");
+
     SDL_DestroyWindow(window);
     SDL_Quit();
   }
@@ -214,10 +254,10 @@ class Application {
   VkInstanceCreateFlags getInstanceFlags() {
     VkInstanceCreateFlags flags = 0;
 
-#if SUPPORT_MOLTENVK
-    // MoltenVKに対応する場合は、VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHRフラグを指定する
-    flags |= VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHR;
-#endif
+    if (portabilityEnabled) {
+      // MoltenVKに対応する場合は、VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHRフラグを指定する
+      flags |= VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHR;
+    }
 
     return flags;
   }
@@ -263,16 +303,20 @@ class Application {
     SDL_Vulkan_GetInstanceExtensions(window, &sdlExtensionCount,
                                      extensionNames.data());
 
-#if SUPPORT_MOLTENVK
-    // MoltenVKに対応する場合は、以下のエクステンションが必要となる
-    extensionNames.push_back(
-        VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
-    extensionNames.push_back(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
-#endif
+    if (portabilityEnabled) {
+      // MoltenVKに対応する場合は、以下のエクステンションが必要となる
+      extensionNames.push_back(
+          VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+      extensionNames.push_back(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
+    }
+
+    if (validationEnabled) {
+      extensionNames.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+    }
 
-#if ENABLE_VALIDATION
-    extensionNames.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
-#endif
+    for (auto&& ext : config.extensions) {
+      extensionNames.push_back(ext.c_str());
+    }
 
     return extensionNames;
   }
@@ -308,13 +352,37 @@ class Application {
     }
   }
 
+  bool isLayerAvailable(const char* name) {
+    for (auto&& layer : getAvailableLayers()) {
+      if (std::strcmp(layer.layerName, name) == 0) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  bool isExtensionAvailable(const char* name) {
+    for (auto&& ext : getAvailableExtensions()) {
+      if (std::strcmp(ext.extensionName, name) == 0) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
   // 必要なレイヤーを取得する
   std::vector<const char*> getRequiredLayers() {
     std::vector<const char*> layerNames;
 
-#if ENABLE_VALIDATION
-    layerNames.push_back("VK_LAYER_KHRONOS_validation");
-#endif
+    if (validationEnabled) {
+      layerNames.push_back(VALIDATION_LAYER_NAME);
+    }
+
+    for (auto&& layer : config.layers) {
+      layerNames.push_back(layer.c_str());
+    }
 
     return layerNames;
   }
@@ -0,0 +1,154 @@
+#include "vulkan_dispatch.hh"
+
+#include <stdexcept>
+#include <type_traits>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+namespace {
+void* library = nullptr;
+VkInstance loadedInstance = VK_NULL_HANDLE;
+VkDevice loadedDevice = VK_NULL_HANDLE;
+
+void* openLibrary() {
+#if defined(_WIN32)
+  return LoadLibraryA("vulkan-1.dll");
+#else
+#if defined(__APPLE__)
+  const char* names[] = {"libvulkan.dylib", "libvulkan.1.dylib",
+                         "libMoltenVK.dylib"};
+#else
+  const char* names[] = {"libvulkan.so.1", "libvulkan.so"};
+#endif
+
+  for (auto&& name : names) {
+    if (void* handle = dlopen(name, RTLD_NOW | RTLD_LOCAL)) {
+      return handle;
+    }
+  }
+
+  return nullptr;
+#endif
+}
+
+PFN_vkVoidFunction getLibrarySymbol(const char* name) {
+#if defined(_WIN32)
+  return reinterpret_cast<PFN_vkVoidFunction>(
+      GetProcAddress(static_cast<HMODULE>(library), name));
+#else
+  return reinterpret_cast<PFN_vkVoidFunction>(dlsym(library, name));
+#endif
+}
+
+// グローバルな関数の初期値
+// 最初の呼び出しでlibvulkanをロードし、本物の関数に転送する
+template <auto& Pointer,
+          typename PFN = std::remove_reference_t<decltype(Pointer)>>
+struct LazyGlobalFunction;
+
+template <auto& Pointer, typename R, typename... Args>
+struct LazyGlobalFunction<Pointer, R(VKAPI_PTR*)(Args...)> {
+  static VKAPI_ATTR R VKAPI_CALL call(Args... args) {
+    vulkanInitialize();
+    return Pointer(args...);
+  }
+};
+}  // namespace
+
+PFN_vkGetInstanceProcAddr vkGetInstanceProcAddr = nullptr;
+
+#define VULKAN_GLOBAL_FUNCTION(name) \
+  PFN_##name name = LazyGlobalFunction<name>::call;
+#define VULKAN_INSTANCE_FUNCTION(name) PFN_##name name = nullptr;
+#define VULKAN_DEVICE_FUNCTION(name) PFN_##name name = nullptr;
+#include "vulkan_functions.inc"
+#undef VULKAN_GLOBAL_FUNCTION
+#undef VULKAN_INSTANCE_FUNCTION
+#undef VULKAN_DEVICE_FUNCTION
+
+void vulkanInitialize() {
+  if (library != nullptr) {
+    return;
+  }
+
+  library = openLibrary();
+
+  if (library == nullptr) {
+    throw std::runtime_error("Failed to load the Vulkan library");
+  }
+
+  vkGetInstanceProcAddr = reinterpret_cast<PFN_vkGetInstanceProcAddr>(
+      getLibrarySymbol("vkGetInstanceProcAddr"));
+
+  if (vkGetInstanceProcAddr == nullptr) {
+    throw std::runtime_error("vkGetInstanceProcAddr not found");
+  }
+
+#define VULKAN_GLOBAL_FUNCTION(name)                                         \
+  name =                                                                     \
+      reinterpret_cast<PFN_##name>(vkGetInstanceProcAddr(nullptr, #name)); \
+  if (name == nullptr) {                                                     \
+    throw std::runtime_error(#name " not found");                            \
+  }
+#include "vulkan_functions.inc"
+#undef VULKAN_GLOBAL_FUNCTION
+}
+
+void vulkanLoadInstance(VkInstance instance) {
+  if (instance == loadedInstance) {
+    return;
+  }
+
+  vulkanInitialize();
+
+  // エクステンションの関数など、存在しないものはnullptrになる
+#define VULKAN_INSTANCE_FUNCTION(name) \
+  name = reinterpret_cast<PFN_##name>(vkGetInstanceProcAddr(instance, #name));
+#define VULKAN_DEVICE_FUNCTION(name) \
+  name = reinterpret_cast<PFN_##name>(vkGetInstanceProcAddr(instance, #name));
+#include "vulkan_functions.inc"
+#undef VULKAN_INSTANCE_FUNCTION
+#undef VULKAN_DEVICE_FUNCTION
+
+  loadedInstance = instance;
+  loadedDevice = VK_NULL_HANDLE;
+}
+
+void vulkanUnloadInstance(VkInstance instance) {
+  if (instance == loadedInstance) {
+    loadedInstance = VK_NULL_HANDLE;
+    loadedDevice = VK_NULL_HANDLE;
+  }
+}
+
+void vulkanLoadDevice(VkDevice device) {
+  if (device == loadedDevice) {
+    return;
+  }
+
+  // vkGetDeviceProcAddr()で取得した関数は、ローダーを経由せずにドライバーを直接呼び出す
+#define VULKAN_DEVICE_FUNCTION(name) \
+  name = reinterpret_cast<PFN_##name>(vkGetDeviceProcAddr(device, #name));
+#include "vulkan_functions.inc"
+#undef VULKAN_DEVICE_FUNCTION
+
+  loadedDevice = device;
+}
+
+void vulkanUnloadDevice(VkDevice device) {
+  if (device == loadedDevice) {
+    loadedDevice = VK_NULL_HANDLE;
+  }
+}
+
+void vulkanLoadDeviceTable(VkDevice device, VulkanDeviceTable* table) {
+#define VULKAN_DEVICE_FUNCTION(name) \
+  table->name =                      \
+      reinterpret_cast<PFN_##name>(vkGetDeviceProcAddr(device, #name));
+#include "vulkan_functions.inc"
+#undef VULKAN_DEVICE_FUNCTION
+}
@@ -0,0 +1,249 @@
+/*
+ * 区間の計測
+ *
+ * TRACE_SCOPE("name") を置いたスコープの開始から終了までを1つの区間として記録し、
+ * ChromeのTrace Event Format (chrome://tracing, Perfetto) のJSONで書き出す
+ * 区間はスレッドごとのバッファーに記録するので、記録時はそのスレッドのロックだけを取る
+ * (stop()がバッファーを書き出す時以外は競合しない)
+ * バッファーが一杯になったら、ロックを取ってファイルに書き出して空にする
+ * 無効な時は、区間ごとにアトミック変数を1回読むだけである
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class Tracer {
+ public:
+  // スレッドごとに、書き出さずに溜めておく区間の数
+  static constexpr size_t BUFFER_CAPACITY = 1 << 16;
+
+ private:
+  struct Event {
+    // 文字列リテラルを指す
+    const char* name;
+    // 計測開始からの時間 (ナノ秒)
+    uint64_t begin;
+    uint64_t end;
+  };
+
+  struct ThreadBuffer {
+    // 記録するスレッドと、stop()の間で保護する
+    std::mutex mutex;
+    uint32_t threadId;
+    // 終了していない区間 (スコープは入れ子になるので、最後のものから終わる)
+    std::vector<Event> open;
+    // 終了した区間
+    std::vector<Event> events;
+  };
+
+  // get()の初期化の確認を避けるため、静的メンバーにする
+  static inline std::atomic<bool> enabled{false};
+  std::chrono::steady_clock::time_point origin;
+  std::string path;
+  // 以下はmutexで保護する
+  std::mutex mutex;
+  std::vector<std::shared_ptr<ThreadBuffer>> threads;
+  std::ofstream out;
+  bool firstRecord = true;
+
+ public:
+  class Zone {
+    ThreadBuffer* buffer = nullptr;
+
+   public:
+    explicit Zone(const char* name) {
+      if (!enabled.load(std::memory_order_relaxed)) {
+        return;
+      }
+
+      Tracer& tracer = get();
+      buffer = &tracer.getThreadBuffer();
+      std::lock_guard<std::mutex> lock(buffer->mutex);
+      buffer->open.push_back(Event{name, tracer.now(), 0});
+    }
+
+    ~Zone() {
+      if (buffer != nullptr) {
+        get().finish(*buffer);
+      }
+    }
+
+    Zone(const Zone&) = delete;
+    Zone& operator=(const Zone&) = delete;
+  };
+
+  // 例外で終了した場合も、書き出しているJSONを閉じる
+  ~Tracer() { stop(); }
+
+  static Tracer& get() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  static bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+  // 計測を開始し、pathにJSONを書き始める
+  // stop()で残りを書き出して閉じる
+  void start(const std::string& outputPath) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    path = outputPath;
+    out.open(path);
+
+    if (!out) {
+      throw std::runtime_error("Failed to open " + path);
+    }
+
+    out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+    firstRecord = true;
+
+    // 前回の計測で登録したスレッドの名前も書き出す
+    for (auto&& thread : threads) {
+      writeThreadName(*thread);
+    }
+
+    origin = std::chrono::steady_clock::now();
+    enabled.store(true, std::memory_order_relaxed);
+  }
+
+  // 計測を終了して書き出す
+  // 他のスレッドが記録中でもよく、終了していない区間はこの時点で終わったものとして書き出す
+  void stop() {
+    if (!enabled.exchange(false, std::memory_order_relaxed)) {
+      return;
+    }
+
+    uint64_t stopTime = now();
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      buffers = threads;
+    }
+
+    // finish()からflush()を呼ぶ時と同じく、スレッドのロックを先に取る
+    for (auto&& thread : buffers) {
+      std::lock_guard<std::mutex> threadLock(thread->mutex);
+      std::lock_guard<std::mutex> lock(mutex);
+
+      for (Event event : thread->open) {
+        event.end = stopTime;
+        writeEvent(*thread, event);
+      }
+
+      writeBuffer(*thread);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    out << "\n]}\n";
+    out.close();
+  }
+
+ private:
+  uint64_t now() const {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - origin)
+            .count());
+  }
+
+  // 呼び出したスレッドのバッファーを返す
+  // 最初の呼び出しでのみロックを取って登録する
+  ThreadBuffer& getThreadBuffer() {
+    thread_local std::shared_ptr<ThreadBuffer> buffer;
+
+    if (!buffer) {
+      buffer = std::make_shared<ThreadBuffer>();
+
+      std::lock_guard<std::mutex> lock(mutex);
+      // 最初に区間を記録したスレッド (通常はメインスレッド) を0とする
+      buffer->threadId = static_cast<uint32_t>(threads.size());
+      threads.push_back(buffer);
+      writeThreadName(*buffer);
+    }
+
+    return *buffer;
+  }
+
+  // 最後に始まった区間を終了する
+  void finish(ThreadBuffer& buffer) {
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    Event event = buffer.open.back();
+    buffer.open.pop_back();
+
+    // stop()の後に終わった区間は、stop()で書き出し済み
+    if (!isEnabled()) {
+      return;
+    }
+
+    event.end = now();
+    buffer.events.push_back(event);
+
+    if (buffer.events.size() >= BUFFER_CAPACITY) {
+      flush(buffer);
+    }
+  }
+
+  // バッファーのロックを取ってから呼ぶ
+  void flush(ThreadBuffer& buffer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    writeBuffer(buffer);
+  }
+
+  // 以下はmutexを取ってから呼ぶ
+
+  // 終了した区間を書き出し、バッファーを空にする
+  void writeBuffer(ThreadBuffer& buffer) {
+    for (auto&& event : buffer.events) {
+      writeEvent(buffer, event);
+    }
+
+    buffer.events.clear();
+  }
+
+  void writeEvent(const ThreadBuffer& buffer, const Event& event) {
+    beginRecord();
+
+    // tsとdurはマイクロ秒なので、小数点以下3桁でナノ秒まで表す
+    out << "{\"name\": \"" << event.name
+        << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer.threadId
+        << ", \"ts\": " << toMicroseconds(event.begin)
+        << ", \"dur\": " << toMicroseconds(event.end - event.begin) << "}";
+  }
+
+  void writeThreadName(const ThreadBuffer& buffer) {
+    beginRecord();
+
+    out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+        << "\"tid\": " << buffer.threadId << ", \"args\": {\"name\": \""
+        << (buffer.threadId == 0 ? "main" : "worker") << "\"}}";
+  }
+
+  void beginRecord() {
+    out << (firstRecord ? "\n" : ",\n");
+    firstRecord = false;
+  }
+
+  static std::string toMicroseconds(uint64_t nanoseconds) {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%llu.%03llu",
+                  static_cast<unsigned long long>(nanoseconds / 1000),
+                  static_cast<unsigned long long>(nanoseconds % 1000));
+    return text;
+  }
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+// スコープの終わりまでを区間として記録する
+#define TRACE_SCOPE(name) Tracer::Zone TRACE_CONCAT(traceZone, __LINE__)(name)
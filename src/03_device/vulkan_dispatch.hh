@@ -0,0 +1,55 @@
+/*
+ * Vulkanの関数ポインターを直接呼び出すためのディスパッチテーブル
+ *
+ * ローダーのエクスポートする関数(トランポリン)は、呼び出しの度にディスパッチを挟む
+ * ここではlibvulkanを実行時にロードし、インスタンスレベルの関数はVkInstanceごとに、
+ * デバイスレベルの関数はvkGetDeviceProcAddr()でVkDeviceごとに一度だけ取得する
+ */
+
+#pragma once
+
+#ifndef VK_NO_PROTOTYPES
+#define VK_NO_PROTOTYPES
+#endif
+#include <vulkan/vulkan.h>
+
+// libvulkanをロードし、グローバルな関数を取得する
+// 2回目以降の呼び出しは何もしない
+// グローバルな関数は最初の呼び出し時に自動的にこの関数を呼ぶので、明示的に呼ぶ必要はない
+void vulkanInitialize();
+
+// インスタンスレベルの関数を取得する
+// この時点ではデバイスレベルの関数もvkGetInstanceProcAddr()で取得するので、ローダーのトランポリンを経由する
+// 同じインスタンスで再度呼び出した場合は何もしない
+void vulkanLoadInstance(VkInstance instance);
+
+// インスタンスを破棄した後に呼ぶ
+// 同じ値のハンドルが再利用されても、新しいインスタンスとして関数を取得し直すようにする
+void vulkanUnloadInstance(VkInstance instance);
+
+// デバイスレベルの関数をvkGetDeviceProcAddr()で取得し、グローバルな関数ポインターを置き換える
+// 同じデバイスで再度呼び出した場合は何もしない
+void vulkanLoadDevice(VkDevice device);
+
+// デバイスを破棄した後に呼ぶ
+void vulkanUnloadDevice(VkDevice device);
+
+// デバイスごとのディスパッチテーブル
+// 複数のデバイスを扱う場合は、グローバルな関数ポインターの代わりにこちらを使用する
+struct VulkanDeviceTable {
+#define VULKAN_DEVICE_FUNCTION(name) PFN_##name name = nullptr;
+#include "vulkan_functions.inc"
+#undef VULKAN_DEVICE_FUNCTION
+};
+
+void vulkanLoadDeviceTable(VkDevice device, VulkanDeviceTable* table);
+
+#define VULKAN_GLOBAL_FUNCTION(name) extern PFN_##name name;
+#define VULKAN_INSTANCE_FUNCTION(name) extern PFN_##name name;
+#define VULKAN_DEVICE_FUNCTION(name) extern PFN_##name name;
+#include "vulkan_functions.inc"
+#undef VULKAN_GLOBAL_FUNCTION
+#undef VULKAN_INSTANCE_FUNCTION
+#undef VULKAN_DEVICE_FUNCTION
+
+extern PFN_vkGetInstanceProcAddr vkGetInstanceProcAddr;
@@ -3,6 +3,7 @@
  */
 
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <optional>
 #include <set>
@@ -12,18 +13,16 @@
 
 #include <SDL.h>
 #include <SDL_vulkan.h>
-#include <vulkan/vulkan.h>
 
+#include "config.hh"
 #include "console.hh"
-
-// MoltenVKサポート用のコードを有効/無効にする
-#define SUPPORT_MOLTENVK 1
-// バリエーションレイヤー有効/無効
-#define ENABLE_VALIDATION 1
+#include "tracer.hh"
+#include "vulkan_dispatch.hh"
 
 class Application {
  public:
   static constexpr char NAME[] = "04_surface";
+  static constexpr char VALIDATION_LAYER_NAME[] = "VK_LAYER_KHRONOS_validation";
   static constexpr uint32_t WIDTH = 960;
   static constexpr uint32_t HEIGHT = 570;
 
@@ -36,16 +35,37 @@ class Application {
   VkDevice device;
   VkQueue graphicsQueue;
   VkQueue presentQueue;
+  Config config;
+  // configと利用可能なレイヤー/エクステンションから決定した値
+  bool validationEnabled = false;
+  bool portabilityEnabled = false;
 
  public:
   void run(const std::vector<std::string>& args) {
+    parseArguments(args);
+
+    if (config.trace.has_value()) {
+      Tracer::get().start(*config.trace);
+    }
+
     initialize();
     loop();
     finalize();
+    Tracer::get().stop();
   }
 
  private:
+  void parseArguments(const std::vector<std::string>& args) {
+    config = Config::parse(args);
+
+    if (!config.unparsed.empty()) {
+      throw std::runtime_error("Unknown argument: " + config.unparsed[0]);
+    }
+  }
+
   void initialize() {
+    TRACE_SCOPE("initialize");
+
     initializeWindow();
     initializeInstance();
     initializeSurface();
@@ -53,6 +73,8 @@ class Application {
   }
 
   void initializeWindow() {
+    TRACE_SCOPE("initializeWindow");
+
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
       throw std::runtime_error(SDL_GetError());
     }
@@ -67,6 +89,8 @@ class Application {
   }
 
   void initializeInstance() {
+    TRACE_SCOPE("initializeInstance");
+
     // *Infoと名付けられた構造体は、言わば関数への引数をまとめたもの
     // VkApplicationInfoは、アプリケーションの情報を指定する構造体
     VkApplicationInfo appInfo{};
@@ -86,6 +110,11 @@ class Application {
     // 使用するAPIのバージョン
     appInfo.apiVersion = VK_API_VERSION_1_0;
 
+    validationEnabled =
+        config.enableValidation(isLayerAvailable(VALIDATION_LAYER_NAME));
+    portabilityEnabled = config.enablePortability(
+        isExtensionAvailable(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME));
+
     VkInstanceCreateFlags instanceFlags = getInstanceFlags();
     showInstanceFlags("Instance flags", instanceFlags);
 
@@ -101,18 +130,13 @@ class Application {
 
     const void* instanceNext = nullptr;
 
-#if ENABLE_VALIDATION
     // バリデーションレイヤーの出力をコールバックで受け取る為には、VkDebugUtilsMessengerを作らなければならない
     VkDebugUtilsMessengerCreateInfoEXT messengerInfo{};
     messengerInfo.sType =
         VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
     messengerInfo.pNext = nullptr;
     messengerInfo.flags = 0;
-    messengerInfo.messageSeverity =
-        VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT |
-        /*VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT |*/
-        VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT |
-        VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+    messengerInfo.messageSeverity = config.messageSeverity;
     messengerInfo.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT |
                                 VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
                                 VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
@@ -121,8 +145,9 @@ class Application {
 
     // エクステンションとレイヤーを登録するだけでは、インスタンス生成/削除時のバリデーションが行われない
     // インスタンス生成/削除時のバリデーションを有効にするには、VkInstanceCreateInfoのpNextにVkDebugUtilsMessengerCreateInfoEXTへのポインターを与える
-    instanceNext = reinterpret_cast<void*>(&messengerInfo);
-#endif
+    if (validationEnabled) {
+      instanceNext = reinterpret_cast<void*>(&messengerInfo);
+    }
 
     // インスタンスの設定
     VkInstanceCreateInfo instanceInfo{};
@@ -142,7 +167,12 @@ class Application {
 
     // vkCreateInstance(pCreateInfo, pAllocator, pInstance)
     // 今回はアロケータを使用しない (nullptr)
-    VkResult result = vkCreateInstance(&instanceInfo, nullptr, &instance);
+    VkResult result;
+
+    {
+      TRACE_SCOPE("vkCreateInstance");
+      result = vkCreateInstance(&instanceInfo, nullptr, &instance);
+    }
 
     if (result != VK_SUCCESS) {
       throw std::runtime_error("vkCreateInstance() failed; result: " +
@@ -153,18 +183,23 @@ class Application {
                 << std::endl;
     }
 
-#if ENABLE_VALIDATION
-    // vkCreateDebugUtilsMessengerEXT(instance, pCreateInfo, pAllocator,
-    // pMessenger)
-    // VkDebugUtilsMessengerを作る
-    // この関数は自動的にロードされないので、アプリケーション側でロードしなければならない
-    // (vulkan_ext.cc参照)
-    vkCreateDebugUtilsMessengerEXT(instance, &messengerInfo, nullptr,
-                                   &debugMessenger);
-#endif
+    // インスタンスレベルの関数をこのインスタンス用に一度だけ取得する
+    vulkanLoadInstance(instance);
+
+    if (validationEnabled) {
+      // vkCreateDebugUtilsMessengerEXT(instance, pCreateInfo, pAllocator,
+      // pMessenger)
+      // VkDebugUtilsMessengerを作る
+      // この関数は自動的にロードされないので、アプリケーション側でロードしなければならない
+      // (vulkan_dispatch.cc参照)
+      vkCreateDebugUtilsMessengerEXT(instance, &messengerInfo, nullptr,
+                                     &debugMessenger);
+    }
   }
 
   void initializeSurface() {
+    TRACE_SCOPE("initializeSurface");
+
     SDL_bool sResult = SDL_Vulkan_CreateSurface(window, instance, &surface);
 
     if (sResult != SDL_TRUE) {
@@ -177,6 +212,8 @@ class Application {
   }
 
   void initializeDevice() {
+    TRACE_SCOPE("initializeDevice");
+
     showPhysicalDevices("Available physical devices", getPhysicalDevices());
 
     // 使用する物理デバイスを選択する
@@ -248,8 +285,12 @@ class Application {
 
     // vkCreateDevice(physicalDevice, pCreateInfo, pAllocator, pDevice)
     // 論理デバイスを作成する
-    VkResult result =
-        vkCreateDevice(physicalDevice, &deviceInfo, nullptr, &device);
+    VkResult result;
+
+    {
+      TRACE_SCOPE("vkCreateDevice");
+      result = vkCreateDevice(physicalDevice, &deviceInfo, nullptr, &device);
+    }
 
     if (result != VK_SUCCESS) {
       throw std::runtime_error("vkCreateDevice() failed; result: " +
@@ -260,6 +301,9 @@ class Application {
                 << std::endl;
     }
 
+    // デバイスレベルの関数をvkGetDeviceProcAddr()で取得し直し、ローダーを経由せずに呼び出す
+    vulkanLoadDevice(device);
+
     // vkGetDeviceQueue(device, queueFamilyIndex, queueIndex, pQueue)
     // 作成したキューを取得する
     // queueIndexはキューファミリー内のキューのインデックス
@@ -309,6 +353,8 @@ class Application {
   }
 
   void finalize() {
+    TRACE_SCOPE("finalize");
+
     finalizeDevice();
     finalizeSurface();
     finalizeInstance();
@@ -316,25 +362,35 @@ class Application {
   }
 
   void finalizeDevice() {
+    TRACE_SCOPE("finalizeDevice");
+
     // vkDestroyDevice(device, pAllocator)
     vkDestroyDevice(device, nullptr);
+    vulkanUnloadDevice(device);
   }
 
   void finalizeSurface() {
+    TRACE_SCOPE("finalizeSurface");
+
     vkDestroySurfaceKHR(instance, surface, nullptr);
   }
 
   void finalizeInstance() {
-#if ENABLE_VALIDATION
-    // vkDestroyDebugUtilsMessengerEXT(instance, messenger, pAllocator)
-    vkDestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
-#endif
+    TRACE_SCOPE("finalizeInstance");
+
+    if (validationEnabled) {
+      // vkDestroyDebugUtilsMessengerEXT(instance, messenger, pAllocator)
+      vkDestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
+    }
 
     // vkDestroyInstance(instance, pAllocator)
     vkDestroyInstance(instance, nullptr);
+    vulkanUnloadInstance(instance);
   }
 
   void finalizeWindow() {
+    TRACE_SCOPE("finalizeWindow");
+
     SDL_DestroyWindow(window);
     SDL_Quit();
   }
@@ -342,10 +398,10 @@ class Application {
   VkInstanceCreateFlags getInstanceFlags() {
     VkInstanceCreateFlags flags = 0;
 
-#if SUPPORT_MOLTENVK
-    // MoltenVKに対応する場合は、VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHRフラグを指定する
-    flags |= VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHR;
-#endif
+    if (portabilityEnabled) {
+      // MoltenVKに対応する場合は、VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHRフラグを指定する
+      flags |= VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHR;
+    }
 
     return flags;
   }
@@ -402,16 +458,20 @@ class Application {
     SDL_Vulkan_GetInstanceExtensions(window, &sdlExtensionCount,
                                      extensionNames.data());
 
-#if SUPPORT_MOLTENVK
-    // MoltenVKに対応する場合は、以下のエクステンションが必要となる
-    extensionNames.push_back(
-        VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
-    extensionNames.push_back(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
-#endif
+    if (portabilityEnabled) {
+      // MoltenVKに対応する場合は、以下のエクステンションが必要となる
+      extensionNames.push_back(
+          VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+      extensionNames.push_back(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
+    }
+
+    if (validationEnabled) {
+      extensionNames.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+    }
 
-#if ENABLE_VALIDATION
-    extensionNames.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
-#endif
+    for (auto&& ext : config.extensions) {
+      extensionNames.push_back(ext.c_str());
+    }
 
     return extensionNames;
   }
@@ -449,13 +509,37 @@ class Application {
     }
   }
 
+  bool isLayerAvailable(const char* name) {
+    for (auto&& layer : getAvailableLayers()) {
+      if (std::strcmp(layer.layerName, name) == 0) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  bool isExtensionAvailable(const char* name) {
+    for (auto&& ext : getAvailableExtensions()) {
+      if (std::strcmp(ext.extensionName, name) == 0) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
   // 必要なレイヤーを取得する
   std::vector<const char*> getRequiredLayers() {
     std::vector<const char*> layerNames;
 
-#if ENABLE_VALIDATION
-    layerNames.push_back("VK_LAYER_KHRONOS_validation");
-#endif
+    if (validationEnabled) {
+      layerNames.push_back(VALIDATION_LAYER_NAME);
+    }
+
+    for (auto&& layer : config.layers) {
+      layerNames.push_back(layer.c_str());
+    }
 
     return layerNames;
   }
@@ -649,9 +733,13 @@ class Application {
       VkPhysicalDevice physicalDevice) {
     std::vector<const char*> extensions;
 
-#if SUPPORT_MOLTENVK
-    extensions.push_back("VK_KHR_portability_subset");
-#endif
+    // VK_KHR_portability_subsetはサポートしているデバイスでのみ有効化する
+    // ポータビリティ実装でないデバイスはこのエクステンションを持たない
+    for (auto&& ext : getDeviceExtensionProperties(physicalDevice)) {
+      if (std::strcmp(ext.extensionName, "VK_KHR_portability_subset") == 0) {
+        extensions.push_back("VK_KHR_portability_subset");
+      }
+    }
 
     return extensions;
   }
@@ -3,6 +3,7 @@
  */
 
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <optional>
@@ -17,12 +18,9 @@
 #include <SDL.h>
 #include <SDL_vulkan.h>
 
+#include "config.hh"
 #include "console.hh"
-
-// MoltenVKサポート用のコードを有効/無効にする
-#define SUPPORT_MOLTENVK 1
-// バリエーションレイヤー有効/無効
-#define ENABLE_VALIDATION 1
+#include "tracer.hh"
 
 class SDLApplication {
  public:
@@ -38,6 +36,7 @@ class SDLApplication {
 class Application : public SDLApplication {
  public:
   static constexpr char NAME[] = "04_surface_hpp";
+  static constexpr char VALIDATION_LAYER_NAME[] = "VK_LAYER_KHRONOS_validation";
   static constexpr uint32_t WIDTH = 960;
   static constexpr uint32_t HEIGHT = 570;
 
@@ -51,16 +50,37 @@ class Application : public SDLApplication {
   std::shared_ptr<vk::raii::Device> device;
   std::shared_ptr<vk::raii::Queue> graphicsQueue;
   std::shared_ptr<vk::raii::Queue> presentQueue;
+  Config config;
+  // configと利用可能なレイヤー/エクステンションから決定した値
+  bool validationEnabled = false;
+  bool portabilityEnabled = false;
 
  public:
   void run(const std::vector<std::string>& args) {
+    parseArguments(args);
+
+    if (config.trace.has_value()) {
+      Tracer::get().start(*config.trace);
+    }
+
     initialize();
     loop();
     finalize();
+    Tracer::get().stop();
   }
 
  private:
+  void parseArguments(const std::vector<std::string>& args) {
+    config = Config::parse(args);
+
+    if (!config.unparsed.empty()) {
+      throw std::runtime_error("Unknown argument: " + config.unparsed[0]);
+    }
+  }
+
   void initialize() {
+    TRACE_SCOPE("initialize");
+
     initializeWindow();
     initializeInstance();
     initializeSurface();
@@ -68,6 +88,8 @@ class Application : public SDLApplication {
   }
 
   void initializeWindow() {
+    TRACE_SCOPE("initializeWindow");
+
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
       throw std::runtime_error(SDL_GetError());
     }
@@ -84,6 +106,8 @@ class Application : public SDLApplication {
   }
 
   void initializeInstance() {
+    TRACE_SCOPE("initializeInstance");
+
     // *Infoと名付けられた構造体は、言わば関数への引数をまとめたもの
     // vk::ApplicationInfoは、アプリケーションの情報を指定する構造体
     vk::ApplicationInfo appInfo{
@@ -98,6 +122,11 @@ class Application : public SDLApplication {
         // 使用するAPIのバージョン
         /* apiVersion = */ VK_API_VERSION_1_0};
 
+    validationEnabled =
+        config.enableValidation(isLayerAvailable(VALIDATION_LAYER_NAME));
+    portabilityEnabled = config.enablePortability(
+        isExtensionAvailable(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME));
+
     vk::InstanceCreateFlags instanceFlags = getInstanceFlags();
     showInstanceFlags("Instance flags", instanceFlags);
 
@@ -124,21 +153,16 @@ class Application : public SDLApplication {
         // 有効化するエクステンションを登録する
         /* pEnabledExtensionNames = */ extensionNames};
 
-#if ENABLE_VALIDATION
     // バリデーションレイヤーの出力をコールバックで受け取る為には、vk::DebugUtilsMessengerを作らなければならない
     vk::DebugUtilsMessengerCreateInfoEXT messengerInfo{
         /* flags = */ {},
         /* messageSeverity = */
-        vk::DebugUtilsMessageSeverityFlagBitsEXT::eVerbose |
-            /*vk::DebugUtilsMessageSeverityFlagBitsEXT::eInfo |*/
-            vk::DebugUtilsMessageSeverityFlagBitsEXT::eWarning |
-            vk::DebugUtilsMessageSeverityFlagBitsEXT::eError,
+        vk::DebugUtilsMessageSeverityFlagsEXT(config.messageSeverity),
         /* messageType = */ vk::DebugUtilsMessageTypeFlagBitsEXT::eGeneral |
             vk::DebugUtilsMessageTypeFlagBitsEXT::eValidation |
             vk::DebugUtilsMessageTypeFlagBitsEXT::ePerformance,
         /* pfnUserCallback = */ &messageCallBack,
         /* pUserData = */ nullptr};
-#endif
 
     // エクステンションとレイヤーを登録するだけでは、インスタンス生成/削除時のバリデーションが行われない
     // インスタンス生成/削除時のバリデーションを有効にするには、vk::InstanceCreateInfoのpNextにvk::DebugUtilsMessengerCreateInfoEXTへのポインターを与える必要がある
@@ -147,24 +171,34 @@ class Application : public SDLApplication {
                        vk::DebugUtilsMessengerCreateInfoEXT>
         instanceChain{instanceInfo, messengerInfo};
 
+    if (!validationEnabled) {
+      // バリデーションを使用しない場合は、pNextからvk::DebugUtilsMessengerCreateInfoEXTを外す
+      instanceChain.unlink<vk::DebugUtilsMessengerCreateInfoEXT>();
+    }
+
     // vkCreateInstance(pCreateInfo, pAllocator, pInstance)に相当
-    instance = std::make_shared<vk::raii::Instance>(
-        context, instanceChain.get<vk::InstanceCreateInfo>());
+    {
+      TRACE_SCOPE("vkCreateInstance");
+      instance = std::make_shared<vk::raii::Instance>(
+          context, instanceChain.get<vk::InstanceCreateInfo>());
+    }
 
     std::cout << Console::fgGreen << "# "
               << "vkCreateInstance() succeeded" << Console::fgDefault
               << std::endl;
 
-#if ENABLE_VALIDATION
-    // vkCreateDebugUtilsMessengerEXT(instance, pCreateInfo, pAllocator,
-    // pMessenger)に相当
-    // vk::DebugUtilsMessengerを作成する
-    debugMessenger = std::make_shared<vk::raii::DebugUtilsMessengerEXT>(
-        *instance, messengerInfo);
-#endif
+    if (validationEnabled) {
+      // vkCreateDebugUtilsMessengerEXT(instance, pCreateInfo, pAllocator,
+      // pMessenger)に相当
+      // vk::DebugUtilsMessengerを作成する
+      debugMessenger = std::make_shared<vk::raii::DebugUtilsMessengerEXT>(
+          *instance, messengerInfo);
+    }
   }
 
   void initializeSurface() {
+    TRACE_SCOPE("initializeSurface");
+
     VkSurfaceKHR cSurface;
     // ウィンドウの描画サーフェイスを作成する
     SDL_bool sResult =
@@ -181,6 +215,8 @@ class Application : public SDLApplication {
   }
 
   void initializeDevice() {
+    TRACE_SCOPE("initializeDevice");
+
     vk::raii::PhysicalDevices devices(*instance);
 
     showPhysicalDevices("Available physical devices", devices);
@@ -244,7 +280,10 @@ class Application : public SDLApplication {
 
     // vkCreateDevice(physicalDevice, pCreateInfo, pAllocator, pDevice)に相当
     // 論理デバイスを作成する
-    device = std::make_shared<vk::raii::Device>(*physicalDevice, deviceInfo);
+    {
+      TRACE_SCOPE("vkCreateDevice");
+      device = std::make_shared<vk::raii::Device>(*physicalDevice, deviceInfo);
+    }
 
     std::cout << Console::fgGreen << "# "
               << "vkCreateDevice() succeeded" << Console::fgDefault
@@ -306,10 +345,10 @@ class Application : public SDLApplication {
   vk::InstanceCreateFlags getInstanceFlags() {
     vk::InstanceCreateFlags flags{};
 
-#if SUPPORT_MOLTENVK
-    // MoltenVKに対応する場合は、VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHRフラグを指定する
-    flags |= vk::InstanceCreateFlagBits::eEnumeratePortabilityKHR;
-#endif
+    if (portabilityEnabled) {
+      // MoltenVKに対応する場合は、VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHRフラグを指定する
+      flags |= vk::InstanceCreateFlagBits::eEnumeratePortabilityKHR;
+    }
 
     return flags;
   }
@@ -351,16 +390,20 @@ class Application : public SDLApplication {
     SDL_Vulkan_GetInstanceExtensions(window.get(), &sdlExtensionCount,
                                      extensionNames.data());
 
-#if SUPPORT_MOLTENVK
-    // MoltenVKに対応する場合は、以下のエクステンションが必要となる
-    extensionNames.push_back(
-        VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
-    extensionNames.push_back(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
-#endif
+    if (portabilityEnabled) {
+      // MoltenVKに対応する場合は、以下のエクステンションが必要となる
+      extensionNames.push_back(
+          VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+      extensionNames.push_back(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
+    }
 
-#if ENABLE_VALIDATION
-    extensionNames.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
-#endif
+    if (validationEnabled) {
+      extensionNames.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+    }
+
+    for (auto&& ext : config.extensions) {
+      extensionNames.push_back(ext.c_str());
+    }
 
     return extensionNames;
   }
@@ -386,13 +429,37 @@ class Application : public SDLApplication {
     }
   }
 
+  bool isLayerAvailable(const char* name) {
+    for (auto&& layer : context.enumerateInstanceLayerProperties()) {
+      if (std::strcmp(layer.layerName.data(), name) == 0) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  bool isExtensionAvailable(const char* name) {
+    for (auto&& ext : context.enumerateInstanceExtensionProperties()) {
+      if (std::strcmp(ext.extensionName.data(), name) == 0) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
   // 必要なレイヤーを取得する
   std::vector<const char*> getRequiredLayers() {
     std::vector<const char*> layerNames;
 
-#if ENABLE_VALIDATION
-    layerNames.push_back("VK_LAYER_KHRONOS_validation");
-#endif
+    if (validationEnabled) {
+      layerNames.push_back(VALIDATION_LAYER_NAME);
+    }
+
+    for (auto&& layer : config.layers) {
+      layerNames.push_back(layer.c_str());
+    }
 
     return layerNames;
   }
@@ -549,9 +616,14 @@ class Application : public SDLApplication {
       const vk::raii::PhysicalDevice& physicalDevice) {
     std::vector<const char*> extensions;
 
-#if SUPPORT_MOLTENVK
-    extensions.push_back("VK_KHR_portability_subset");
-#endif
+    // VK_KHR_portability_subsetはサポートしているデバイスでのみ有効化する
+    // ポータビリティ実装でないデバイスはこのエクステンションを持たない
+    for (auto&& ext : physicalDevice.enumerateDeviceExtensionProperties()) {
+      if (std::strcmp(ext.extensionName.data(), "VK_KHR_portability_subset") ==
+          0) {
+        extensions.push_back("VK_KHR_portability_subset");
+      }
+    }
 
     return extensions;
   }
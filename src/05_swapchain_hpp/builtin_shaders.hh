@@ -0,0 +1,265 @@
+/*
+ * 組み込みのシェーダー (SPIR-V)
+ *
+ * ビルド時にshaders/のGLSL/HLSLをコンパイルした場合は (COMPILED_SHADERS)、生成したヘッダーに埋め込んだものを使う
+ * シェーダーのコンパイル環境が無くてもビルドできるよう、同じ内容のものを直接書いたものも持っている
+ *
+ * 開発用のビルドでは (SHADER_DIRECTORY)、起動時にビルドディレクトリーの.spvを読み込む
+ * シェーダーだけをビルドし直せば、アプリケーションを再ビルドせずに試せる
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "file_io.hh"
+
+#ifdef COMPILED_SHADERS
+#include "compiled_shaders.hh"
+#else
+namespace BuiltinShaders {
+// 何もしないコンピュートシェーダー
+// ワークグループのxのサイズを特殊化定数0で指定するので、値ごとに異なるパイプラインになる
+//
+// #version 450
+// layout(local_size_x_id = 0) in;
+// void main() {}
+inline constexpr uint32_t EMPTY_COMPUTE[] = {
+    // マジックナンバー、バージョン1.0、ジェネレーター、IDの上限、予約
+    0x07230203, 0x00010000, 0x00000000, 10, 0,
+    // OpCapability Shader
+    0x00020011, 1,
+    // OpMemoryModel Logical GLSL450
+    0x0003000e, 0, 1,
+    // OpEntryPoint GLCompute %1 "main"
+    0x0005000f, 5, 1, 0x6e69616d, 0x00000000,
+    // OpExecutionMode %1 LocalSize 1 1 1
+    0x00060010, 1, 17, 1, 1, 1,
+    // OpDecorate %5 SpecId 0
+    0x00040047, 5, 1, 0,
+    // OpDecorate %8 BuiltIn WorkgroupSize
+    0x00040047, 8, 11, 25,
+    // %2 = OpTypeVoid
+    0x00020013, 2,
+    // %3 = OpTypeFunction %2
+    0x00030021, 3, 2,
+    // %4 = OpTypeInt 32 0
+    0x00040015, 4, 32, 0,
+    // %5 = OpSpecConstant %4 1
+    0x00040032, 4, 5, 1,
+    // %6 = OpConstant %4 1
+    0x0004002b, 4, 6, 1,
+    // %7 = OpTypeVector %4 3
+    0x00040017, 7, 4, 3,
+    // %8 = OpSpecConstantComposite %7 %5 %6 %6
+    0x00060033, 7, 8, 5, 6, 6,
+    // %1 = OpFunction %2 None %3
+    0x00050036, 2, 1, 0, 3,
+    // %9 = OpLabel
+    0x000200f8, 9,
+    // OpReturn
+    0x000100fd,
+    // OpFunctionEnd
+    0x00010038,
+};
+
+// 画面全体を覆う三角形を描く頂点シェーダー (頂点バッファーは使わない)
+// 特殊化定数0で三角形を縮小するので、値ごとに異なるパイプラインになる
+//
+// #version 450
+// layout(constant_id = 0) const float SCALE = 1.0;
+// void main() {
+//   vec2 p = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+//   gl_Position = vec4((p * 2.0 - 1.0) * SCALE, 0.0, 1.0);
+// }
+inline constexpr uint32_t FULLSCREEN_VERTEX[] = {
+    // マジックナンバー、バージョン1.0、ジェネレーター、IDの上限、予約
+    0x07230203, 0x00010000, 0x00000000, 33, 0,
+    // OpCapability Shader
+    0x00020011, 1,
+    // OpMemoryModel Logical GLSL450
+    0x0003000e, 0, 1,
+    // OpEntryPoint Vertex %1 "main" %10 %11
+    0x0007000f, 0, 1, 0x6e69616d, 0, 10, 11,
+    // OpDecorate %10 BuiltIn VertexIndex
+    0x00040047, 10, 11, 42,
+    // OpDecorate %11 BuiltIn Position
+    0x00040047, 11, 11, 0,
+    // OpDecorate %18 SpecId 0
+    0x00040047, 18, 1, 0,
+    // %2 = OpTypeVoid
+    0x00020013, 2,
+    // %3 = OpTypeFunction %2
+    0x00030021, 3, 2,
+    // %4 = OpTypeInt 32 1
+    0x00040015, 4, 32, 1,
+    // %5 = OpTypeFloat 32
+    0x00030016, 5, 32,
+    // %6 = OpTypeVector %5 2
+    0x00040017, 6, 5, 2,
+    // %7 = OpTypeVector %5 4
+    0x00040017, 7, 5, 4,
+    // %8 = OpTypePointer Input %4
+    0x00040020, 8, 1, 4,
+    // %9 = OpTypePointer Output %7
+    0x00040020, 9, 3, 7,
+    // %10 = OpVariable %8 Input
+    0x0004003b, 8, 10, 1,
+    // %11 = OpVariable %9 Output
+    0x0004003b, 9, 11, 3,
+    // %12 = OpConstant %4 1
+    0x0004002b, 4, 12, 1,
+    // %13 = OpConstant %4 2
+    0x0004002b, 4, 13, 2,
+    // %14 = OpConstant %5 2.0
+    0x0004002b, 5, 14, 0x40000000,
+    // %15 = OpConstant %5 1.0
+    0x0004002b, 5, 15, 0x3f800000,
+    // %16 = OpConstant %5 0.0
+    0x0004002b, 5, 16, 0,
+    // %17 = OpConstantComposite %6 %15 %15
+    0x0005002c, 6, 17, 15, 15,
+    // %18 = OpSpecConstant %5 1.0
+    0x00040032, 5, 18, 0x3f800000,
+    // %1 = OpFunction %2 None %3
+    0x00050036, 2, 1, 0, 3,
+    // %19 = OpLabel
+    0x000200f8, 19,
+    // %20 = OpLoad %4 %10
+    0x0004003d, 4, 20, 10,
+    // %21 = OpShiftLeftLogical %4 %20 %12
+    0x000500c4, 4, 21, 20, 12,
+    // %22 = OpBitwiseAnd %4 %21 %13
+    0x000500c7, 4, 22, 21, 13,
+    // %23 = OpBitwiseAnd %4 %20 %13
+    0x000500c7, 4, 23, 20, 13,
+    // %24 = OpConvertSToF %5 %22
+    0x0004006f, 5, 24, 22,
+    // %25 = OpConvertSToF %5 %23
+    0x0004006f, 5, 25, 23,
+    // %26 = OpCompositeConstruct %6 %24 %25
+    0x00050050, 6, 26, 24, 25,
+    // %27 = OpVectorTimesScalar %6 %26 %14
+    0x0005008e, 6, 27, 26, 14,
+    // %28 = OpFSub %6 %27 %17
+    0x00050083, 6, 28, 27, 17,
+    // %29 = OpVectorTimesScalar %6 %28 %18
+    0x0005008e, 6, 29, 28, 18,
+    // %30 = OpCompositeExtract %5 %29 0
+    0x00050051, 5, 30, 29, 0,
+    // %31 = OpCompositeExtract %5 %29 1
+    0x00050051, 5, 31, 29, 1,
+    // %32 = OpCompositeConstruct %7 %30 %31 %16 %15
+    0x00070050, 7, 32, 30, 31, 16, 15,
+    // OpStore %11 %32
+    0x0003003e, 11, 32,
+    // OpReturn
+    0x000100fd,
+    // OpFunctionEnd
+    0x00010038,
+};
+
+// 特殊化定数0から2で指定した色で塗るフラグメントシェーダー
+//
+// #version 450
+// layout(constant_id = 0) const float R = 1.0;
+// layout(constant_id = 1) const float G = 1.0;
+// layout(constant_id = 2) const float B = 1.0;
+// layout(location = 0) out vec4 color;
+// void main() { color = vec4(R, G, B, 1.0); }
+inline constexpr uint32_t SOLID_FRAGMENT[] = {
+    // マジックナンバー、バージョン1.0、ジェネレーター、IDの上限、予約
+    0x07230203, 0x00010000, 0x00000000, 14, 0,
+    // OpCapability Shader
+    0x00020011, 1,
+    // OpMemoryModel Logical GLSL450
+    0x0003000e, 0, 1,
+    // OpEntryPoint Fragment %1 "main" %7
+    0x0006000f, 4, 1, 0x6e69616d, 0, 7,
+    // OpExecutionMode %1 OriginUpperLeft
+    0x00030010, 1, 7,
+    // OpDecorate %7 Location 0
+    0x00040047, 7, 30, 0,
+    // OpDecorate %8 SpecId 0
+    0x00040047, 8, 1, 0,
+    // OpDecorate %9 SpecId 1
+    0x00040047, 9, 1, 1,
+    // OpDecorate %10 SpecId 2
+    0x00040047, 10, 1, 2,
+    // %2 = OpTypeVoid
+    0x00020013, 2,
+    // %3 = OpTypeFunction %2
+    0x00030021, 3, 2,
+    // %4 = OpTypeFloat 32
+    0x00030016, 4, 32,
+    // %5 = OpTypeVector %4 4
+    0x00040017, 5, 4, 4,
+    // %6 = OpTypePointer Output %5
+    0x00040020, 6, 3, 5,
+    // %7 = OpVariable %6 Output
+    0x0004003b, 6, 7, 3,
+    // %8 = OpSpecConstant %4 1.0
+    0x00040032, 4, 8, 0x3f800000,
+    // %9 = OpSpecConstant %4 1.0
+    0x00040032, 4, 9, 0x3f800000,
+    // %10 = OpSpecConstant %4 1.0
+    0x00040032, 4, 10, 0x3f800000,
+    // %11 = OpConstant %4 1.0
+    0x0004002b, 4, 11, 0x3f800000,
+    // %12 = OpSpecConstantComposite %5 %8 %9 %10 %11
+    0x00070033, 5, 12, 8, 9, 10, 11,
+    // %1 = OpFunction %2 None %3
+    0x00050036, 2, 1, 0, 3,
+    // %13 = OpLabel
+    0x000200f8, 13,
+    // OpStore %7 %12
+    0x0003003e, 7, 12,
+    // OpReturn
+    0x000100fd,
+    // OpFunctionEnd
+    0x00010038,
+};
+}  // namespace BuiltinShaders
+#endif
+
+namespace BuiltinShaders {
+// fileNameはshaders/のソースのファイル名
+// SHADER_DIRECTORYの.spvが読み込めなければ、embeddedを返す
+inline std::span<const uint32_t> get(const std::string& fileName,
+                                     std::span<const uint32_t> embedded) {
+#ifdef SHADER_DIRECTORY
+  // 返したspanが無効にならないよう、読み込んだものは終了まで持っておく
+  static std::mutex mutex;
+  static std::map<std::string, std::vector<uint32_t>> loaded;
+
+  std::lock_guard lock(mutex);
+  auto it = loaded.find(fileName);
+
+  if (it == loaded.end()) {
+    std::optional<std::vector<uint8_t>> data =
+        readFile(std::string(SHADER_DIRECTORY) + "/" + fileName + ".spv");
+
+    if (!data.has_value() || data->empty() ||
+        data->size() % sizeof(uint32_t) != 0) {
+      return embedded;
+    }
+
+    std::vector<uint32_t> code(data->size() / sizeof(uint32_t));
+    std::memcpy(code.data(), data->data(), data->size());
+    it = loaded.emplace(fileName, std::move(code)).first;
+  }
+
+  return it->second;
+#else
+  return embedded;
+#endif
+}
+}  // namespace BuiltinShaders
@@ -0,0 +1,191 @@
+/*
+ * 実行時の設定
+ * 有効化するレイヤー、エクステンション、デバッグメッセージの重要度を、コマンドライン引数と環境変数から決める
+ * コマンドライン引数は環境変数より優先される
+ * --layerと--extensionを指定した場合は、環境変数のリストに追加せず置き換える
+ *
+ * --validation, --no-validation              VULKAN_PRACTICE_VALIDATION=1|0
+ * --portability, --no-portability            VULKAN_PRACTICE_PORTABILITY=1|0
+ * --layer NAME (複数指定可)                  VULKAN_PRACTICE_LAYERS=NAME,...
+ * --extension NAME (複数指定可)              VULKAN_PRACTICE_EXTENSIONS=NAME,...
+ * --message-severity verbose,info,warning,error
+ *                                            VULKAN_PRACTICE_MESSAGE_SEVERITY=...
+ * --trace PATH                               VULKAN_PRACTICE_TRACE=PATH
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+struct Config {
+  // バリデーションレイヤーとVK_EXT_debug_utilsを有効にするか
+  // 指定が無い場合、デバッグビルドでレイヤーが利用可能な時のみ有効にする
+  std::optional<bool> validation;
+  // VK_KHR_portability_enumerationを有効にするか (MoltenVKなど)
+  // 指定が無い場合、エクステンションが利用可能な時のみ有効にする
+  std::optional<bool> portability;
+  // 追加で有効化するインスタンスレイヤー
+  std::vector<std::string> layers;
+  // 追加で有効化するインスタンスエクステンション
+  std::vector<std::string> extensions;
+  // デバッグメッセンジャーが受け取る重要度
+  VkDebugUtilsMessageSeverityFlagsEXT messageSeverity =
+      VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT |
+      VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+  // 起動処理などの区間を計測し、Chromeのトレース形式で書き出す先
+  std::optional<std::string> trace;
+  // 認識できなかった引数 (args[0]を除く)
+  std::vector<std::string> unparsed;
+
+  static Config parse(const std::vector<std::string>& args) {
+    Config config;
+
+    if (const char* value = std::getenv("VULKAN_PRACTICE_VALIDATION")) {
+      config.validation = parseBool(value);
+    }
+
+    if (const char* value = std::getenv("VULKAN_PRACTICE_PORTABILITY")) {
+      config.portability = parseBool(value);
+    }
+
+    if (const char* value = std::getenv("VULKAN_PRACTICE_LAYERS")) {
+      config.layers = split(value);
+    }
+
+    if (const char* value = std::getenv("VULKAN_PRACTICE_EXTENSIONS")) {
+      config.extensions = split(value);
+    }
+
+    if (const char* value = std::getenv("VULKAN_PRACTICE_MESSAGE_SEVERITY")) {
+      config.messageSeverity = parseSeverity(value);
+    }
+
+    if (const char* value = std::getenv("VULKAN_PRACTICE_TRACE")) {
+      config.trace = value;
+    }
+
+    // 最初の--layer/--extensionで、環境変数から読んだリストを捨てる
+    bool layersFromArgs = false;
+    bool extensionsFromArgs = false;
+
+    for (size_t i = 1; i < args.size(); i++) {
+      const std::string& arg = args[i];
+      bool hasValue = i + 1 < args.size();
+
+      if (arg == "--validation") {
+        config.validation = true;
+      } else if (arg == "--no-validation") {
+        config.validation = false;
+      } else if (arg == "--portability") {
+        config.portability = true;
+      } else if (arg == "--no-portability") {
+        config.portability = false;
+      } else if (arg == "--layer" && hasValue) {
+        if (!std::exchange(layersFromArgs, true)) {
+          config.layers.clear();
+        }
+
+        config.layers.push_back(args[++i]);
+      } else if (arg == "--extension" && hasValue) {
+        if (!std::exchange(extensionsFromArgs, true)) {
+          config.extensions.clear();
+        }
+
+        config.extensions.push_back(args[++i]);
+      } else if (arg == "--message-severity" && hasValue) {
+        config.messageSeverity = parseSeverity(args[++i]);
+      } else if (arg == "--trace" && hasValue) {
+        config.trace = args[++i];
+      } else {
+        config.unparsed.push_back(arg);
+      }
+    }
+
+    return config;
+  }
+
+  // バリデーションを有効にするかを決める
+  bool enableValidation(bool layerAvailable) const {
+    if (validation.has_value()) {
+      return *validation;
+    }
+
+#ifdef NDEBUG
+    return false;
+#else
+    return layerAvailable;
+#endif
+  }
+
+  // ポータビリティ列挙を有効にするかを決める
+  bool enablePortability(bool extensionAvailable) const {
+    return portability.value_or(extensionAvailable);
+  }
+
+ private:
+  static bool parseBool(const std::string& value) {
+    if (value == "1" || value == "true" || value == "on") {
+      return true;
+    } else if (value == "0" || value == "false" || value == "off") {
+      return false;
+    }
+
+    throw std::runtime_error("Invalid boolean value: " + value);
+  }
+
+  // カンマ区切りのリストを分割する
+  static std::vector<std::string> split(const std::string& value) {
+    std::vector<std::string> items;
+    size_t begin = 0;
+
+    while (begin <= value.size()) {
+      size_t end = value.find(',', begin);
+
+      if (end == std::string::npos) {
+        end = value.size();
+      }
+
+      if (end > begin) {
+        items.push_back(value.substr(begin, end - begin));
+      }
+
+      begin = end + 1;
+    }
+
+    return items;
+  }
+
+  static VkDebugUtilsMessageSeverityFlagsEXT parseSeverity(
+      const std::string& value) {
+    VkDebugUtilsMessageSeverityFlagsEXT severity = 0;
+
+    for (auto&& item : split(value)) {
+      if (item == "verbose") {
+        severity |= VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT;
+      } else if (item == "info") {
+        severity |= VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT;
+      } else if (item == "warning") {
+        severity |= VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT;
+      } else if (item == "error") {
+        severity |= VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+      } else {
+        throw std::runtime_error("Invalid message severity: " + item);
+      }
+    }
+
+    // 空の場合にメッセージを受け取らなくなるのは意図しないはずなので、エラーにする
+    if (severity == 0) {
+      throw std::runtime_error("Empty message severity: \"" + value + "\"");
+    }
+
+    return severity;
+  }
+};
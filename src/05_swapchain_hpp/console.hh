@@ -1,3 +1,5 @@
+#pragma once
+
 namespace Console {
 constexpr char fgBlack[] = "\x1b[30m";
 constexpr char fgRed[] = "\x1b[31m";
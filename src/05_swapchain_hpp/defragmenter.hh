@@ -0,0 +1,592 @@
+/*
+ * デバイスメモリーのデフラグメンテーション
+ *
+ * リソースの作成と解放を繰り返すと、ブロックの空き領域が細切れになり、
+ * 合計では足りていても大きな割り当てができなくなる
+ * 毎フレーム、使用率の低いブロックにあるリソースを、使用率の高いブロックへ少しずつ移す
+ * 空になったブロックはアロケーターが解放する
+ *
+ * コピーは転送のキューで行い、フェンスがシグナルされた後のupdate()で新しいリソースに差し替える
+ * 実行中のフレームが使っているリソースは移動せず、コピーのサブミットはセマフォをシグナルする
+ * 描画のサブミットでtakeSignalSemaphore()を待てば、差し替え前に移動元を使ってもコピーと重ならない
+ * リソースは転送とグラフィックスのキューファミリーで共有する (VK_SHARING_MODE_CONCURRENT) ので、所有権の移動は要らない
+ * リソースはResourceRegistryに登録し、そのハンドルで参照させる
+ * 移動してもハンドルは変わらないが、vk::Buffer/vk::Imageが変わるので、利用側は毎フレームget*()で取得し直すか、
+ * コールバックでディスクリプターを更新する
+ * 移動前のリソースは、実行中のフレームが終わるまで破棄待ちのキューに入れておく
+ * コピー中にGPUが書き込んだ内容は失われるので、主に読み込み専用のリソースを対象とする
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include "memory_allocator.hh"
+#include "resource_registry.hh"
+#include "tracer.hh"
+
+class Defragmenter {
+  // 移動に使う情報 (リソースとその割り当てはregistryが持つ)
+  struct Resource {
+    // どちらか一方だけが有効
+    BufferHandle buffer;
+    ImageHandle image;
+    vk::BufferCreateInfo bufferInfo;
+    vk::ImageCreateInfo imageInfo;
+    // イメージを使用する時のレイアウト (eUndefinedなら内容をコピーしない)
+    vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+    uint64_t lastUsedFrame = 0;
+  };
+
+ public:
+  // 移動が完了し、新しいリソースに差し替えた時に呼ぶ
+  // 移動したリソースのハンドルを渡す (どちらか一方だけが有効)
+  using MoveCallback = std::function<void(BufferHandle, ImageHandle)>;
+
+  // 1フレームあたりの移動の上限
+  struct Budget {
+    uint32_t maxMoves = 16;
+    vk::DeviceSize maxBytes = 16 << 20;
+    // 移動先の割り当てとコマンドの記録にかけるCPU時間
+    std::chrono::microseconds maxTime{500};
+  };
+
+  struct Statistics {
+    uint64_t moveCount = 0;
+    vk::DeviceSize movedBytes = 0;
+    // サブミットしたコピーの回数
+    uint64_t batchCount = 0;
+    // 時間の上限で、候補を調べ終わる前に打ち切った回数
+    uint64_t timeLimitCount = 0;
+  };
+
+  // ブロックの使用率がこれ未満のリソースを移動の候補とする
+  static constexpr double SOURCE_USAGE_THRESHOLD = 0.75;
+
+ private:
+  // コピー中の移動
+  struct Move {
+    Resource resource;
+    // 移動先
+    std::shared_ptr<vk::raii::Buffer> buffer;
+    std::shared_ptr<vk::raii::Image> image;
+    MemoryAllocation allocation;
+  };
+
+  std::shared_ptr<vk::raii::Device> device;
+  std::shared_ptr<MemoryAllocator> allocator;
+  std::shared_ptr<ResourceRegistry> registry;
+  std::shared_ptr<vk::raii::Queue> queue;
+  std::shared_ptr<vk::raii::CommandPool> commandPool;
+  vk::raii::CommandBuffer commandBuffer{nullptr};
+  vk::raii::Fence fence{nullptr};
+  // コピーの完了をグラフィックスのキューに通知する
+  vk::raii::Semaphore semaphore{nullptr};
+  // シグナルするサブミットをしたが、takeSignalSemaphore()でまだ渡していない
+  bool semaphorePending = false;
+  std::vector<uint32_t> queueFamilyIndices;
+  Budget budget;
+  uint32_t framesInFlight;
+  MoveCallback moveCallback;
+
+  // このデフラグメンターで作成したリソース
+  std::map<BufferHandle, Resource> buffers;
+  std::map<ImageHandle, Resource> images;
+  // サブミットしたコピー (空でなければフェンスを待っている)
+  std::vector<Move> moves;
+  uint64_t currentFrame = 0;
+  Statistics statistics;
+
+ public:
+  Defragmenter(std::shared_ptr<vk::raii::Device> device,
+               std::shared_ptr<MemoryAllocator> allocator,
+               std::shared_ptr<ResourceRegistry> registry,
+               std::shared_ptr<vk::raii::Queue> queue,
+               uint32_t queueFamilyIndex,
+               std::vector<uint32_t> queueFamilyIndices,
+               const Budget& budget,
+               uint32_t framesInFlight)
+      : device(std::move(device)),
+        allocator(std::move(allocator)),
+        registry(std::move(registry)),
+        queue(std::move(queue)),
+        queueFamilyIndices(std::move(queueFamilyIndices)),
+        budget(budget),
+        framesInFlight(framesInFlight) {
+    commandPool = std::make_shared<vk::raii::CommandPool>(
+        *this->device,
+        vk::CommandPoolCreateInfo{
+            vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+            queueFamilyIndex});
+
+    vk::raii::CommandBuffers commandBuffers(
+        *this->device,
+        vk::CommandBufferAllocateInfo{**commandPool,
+                                      vk::CommandBufferLevel::ePrimary, 1});
+    commandBuffer = std::move(commandBuffers[0]);
+    fence = vk::raii::Fence(*this->device, vk::FenceCreateInfo{});
+    semaphore = vk::raii::Semaphore(*this->device, vk::SemaphoreCreateInfo{});
+  }
+
+  ~Defragmenter() {
+    waitIdle();
+
+    while (!buffers.empty()) {
+      destroy(buffers.begin()->first);
+    }
+
+    while (!images.empty()) {
+      destroy(images.begin()->first);
+    }
+  }
+
+  Defragmenter(const Defragmenter&) = delete;
+  Defragmenter& operator=(const Defragmenter&) = delete;
+
+  void setMoveCallback(MoveCallback callback) {
+    moveCallback = std::move(callback);
+  }
+
+  // 移動できるバッファーを作成する
+  BufferHandle createBuffer(vk::DeviceSize size,
+                            vk::BufferUsageFlags usage,
+                            MemoryUsage memoryUsage) {
+    Resource resource;
+    // 移動のため、転送元と転送先にもできるようにする
+    resource.bufferInfo = vk::BufferCreateInfo{
+        /* flags = */ {},
+        /* size = */ size,
+        /* usage = */ usage | vk::BufferUsageFlagBits::eTransferSrc |
+            vk::BufferUsageFlagBits::eTransferDst,
+        /* sharingMode = */ getSharingMode(),
+        /* queueFamilyIndices = */ queueFamilyIndices};
+    resource.lastUsedFrame = currentFrame;
+    resource.buffer = registry->createBuffer(resource.bufferInfo, memoryUsage);
+    buffers.emplace(resource.buffer, resource);
+    return resource.buffer;
+  }
+
+  // 移動できるイメージを作成する
+  // layoutは使用する時のレイアウトで、最初の使用の前に利用側で移行する
+  ImageHandle createImage(vk::ImageCreateInfo imageInfo,
+                          vk::ImageLayout layout,
+                          MemoryUsage memoryUsage) {
+    Resource resource;
+    imageInfo.usage |= vk::ImageUsageFlagBits::eTransferSrc |
+                       vk::ImageUsageFlagBits::eTransferDst;
+    imageInfo.setSharingMode(getSharingMode());
+    imageInfo.setQueueFamilyIndices(queueFamilyIndices);
+    resource.imageInfo = imageInfo;
+    resource.layout = layout;
+    resource.lastUsedFrame = currentFrame;
+    resource.image = registry->createImage(imageInfo, memoryUsage);
+    images.emplace(resource.image, resource);
+    return resource.image;
+  }
+
+  void destroy(BufferHandle handle) {
+    waitForMove(buffers.at(handle));
+    registry->destroy(handle);
+    buffers.erase(handle);
+  }
+
+  void destroy(ImageHandle handle) {
+    waitForMove(images.at(handle));
+    registry->destroy(handle);
+    images.erase(handle);
+  }
+
+  // このフレームでリソースを使うことを知らせる
+  // 実行中のフレームが使っている可能性のあるリソースは移動しない
+  void use(BufferHandle handle) {
+    buffers.at(handle).lastUsedFrame = currentFrame;
+  }
+
+  void use(ImageHandle handle) {
+    images.at(handle).lastUsedFrame = currentFrame;
+  }
+
+  vk::Buffer getBuffer(BufferHandle handle) const {
+    return registry->getBuffer(handle);
+  }
+
+  vk::Image getImage(ImageHandle handle) const {
+    return registry->getImage(handle);
+  }
+
+  // フレームの開始時に呼ぶ
+  // 完了したコピーを差し替え、予算の範囲で次のコピーをサブミットする
+  void update(uint64_t frame) {
+    TRACE_SCOPE("Defragmenter::update");
+
+    currentFrame = frame;
+    finishMoves(false);
+
+    // 前回のセマフォの待機がサブミットされるまでは、再びシグナルできない
+    if (moves.empty() && !semaphorePending) {
+      beginMoves();
+    }
+
+    if (Tracer::isEnabled()) {
+      recordCounters();
+    }
+  }
+
+  // サブミットしたコピーの完了を待って差し替える
+  void waitIdle() { finishMoves(true); }
+
+  // 前回から後にサブミットしたコピーがシグナルするセマフォを返す (無ければnullptr)
+  // 返したセマフォは、次の描画のサブミットで必ず待つこと
+  vk::Semaphore takeSignalSemaphore() {
+    if (!std::exchange(semaphorePending, false)) {
+      return nullptr;
+    }
+
+    return *semaphore;
+  }
+
+  const Statistics& getStatistics() const { return statistics; }
+
+ private:
+  vk::SharingMode getSharingMode() const {
+    return queueFamilyIndices.size() > 1 ? vk::SharingMode::eConcurrent
+                                         : vk::SharingMode::eExclusive;
+  }
+
+  // コピー中であれば、転送のキューはフレームの通し番号では追えないので、完了を待つ
+  void waitForMove(const Resource& resource) {
+    if (std::any_of(moves.begin(), moves.end(), [&](const Move& move) {
+          return move.resource.buffer == resource.buffer &&
+                 move.resource.image == resource.image;
+        })) {
+      finishMoves(true);
+    }
+  }
+
+  const MemoryAllocation& getAllocation(const Resource& resource) const {
+    return resource.buffer ? registry->get(resource.buffer).allocation
+                           : registry->get(resource.image).allocation;
+  }
+
+  // 使用率の低いブロックのリソースから順に、移動先を割り当ててコピーを記録する
+  void beginMoves() {
+    auto start = std::chrono::steady_clock::now();
+
+    struct Candidate {
+      const Resource* resource;
+      double usage;
+    };
+
+    std::vector<Candidate> candidates;
+
+    auto addCandidate = [&](const Resource& resource) {
+      const MemoryAllocation& allocation = getAllocation(resource);
+
+      // update()はフレームのフェンスを待つ前に呼ぶので、framesInFlight前のフレームもまだ実行中でありうる
+      if (allocation.dedicated ||
+          resource.lastUsedFrame + framesInFlight >= currentFrame) {
+        return;
+      }
+
+      double usage = allocator->getBlockUsage(allocation);
+
+      if (usage < SOURCE_USAGE_THRESHOLD) {
+        candidates.push_back(Candidate{&resource, usage});
+      }
+    };
+
+    for (auto&& [handle, resource] : buffers) {
+      addCandidate(resource);
+    }
+
+    for (auto&& [handle, resource] : images) {
+      addCandidate(resource);
+    }
+
+    if (candidates.empty()) {
+      return;
+    }
+
+    std::sort(candidates.begin(), candidates.end(),
+              [](auto&& a, auto&& b) { return a.usage < b.usage; });
+
+    vk::DeviceSize bytes = 0;
+
+    for (auto&& candidate : candidates) {
+      if (moves.size() >= budget.maxMoves) {
+        break;
+      }
+
+      if (std::chrono::steady_clock::now() - start >= budget.maxTime) {
+        statistics.timeLimitCount++;
+        break;
+      }
+
+      const Resource& resource = *candidate.resource;
+      const MemoryAllocation& source = getAllocation(resource);
+
+      if (bytes + source.size > budget.maxBytes) {
+        continue;
+      }
+
+      // 同じ作成情報であれば、メモリーの要件も同じになる
+      vk::MemoryRequirements requirements =
+          resource.buffer
+              ? registry->get(resource.buffer).buffer.getMemoryRequirements()
+              : registry->get(resource.image).image.getMemoryRequirements();
+      std::optional<MemoryAllocation> allocation =
+          allocator->allocateForMove(source, requirements);
+
+      if (!allocation.has_value()) {
+        continue;
+      }
+
+      Move move;
+      move.resource = resource;
+      move.allocation = *allocation;
+
+      // movesに入れるまでは、失敗した場合に移動先のメモリーを解放する者がいない
+      try {
+        if (resource.buffer) {
+          move.buffer =
+              std::make_shared<vk::raii::Buffer>(*device, resource.bufferInfo);
+          move.buffer->bindMemory(allocation->memory, allocation->offset);
+        } else {
+          move.image =
+              std::make_shared<vk::raii::Image>(*device, resource.imageInfo);
+          move.image->bindMemory(allocation->memory, allocation->offset);
+        }
+
+        moves.push_back(std::move(move));
+      } catch (...) {
+        move.buffer.reset();
+        move.image.reset();
+        allocator->free(*allocation);
+        // まだサブミットしていないので、準備済みの移動も取りやめる
+        discardMoves();
+        throw;
+      }
+
+      bytes += source.size;
+    }
+
+    if (moves.empty()) {
+      return;
+    }
+
+    try {
+      recordCopies();
+
+      vk::SubmitInfo submitInfo;
+      submitInfo.setCommandBuffers(*commandBuffer);
+      submitInfo.setSignalSemaphores(*semaphore);
+      queue->submit(submitInfo, *fence);
+    } catch (...) {
+      discardMoves();
+      throw;
+    }
+
+    semaphorePending = true;
+    statistics.batchCount++;
+  }
+
+  // サブミットする前の移動を取りやめ、移動先を破棄する
+  void discardMoves() {
+    for (auto&& move : moves) {
+      move.buffer.reset();
+      move.image.reset();
+      allocator->free(move.allocation);
+    }
+
+    moves.clear();
+  }
+
+  void recordCopies() {
+    commandBuffer.reset();
+    commandBuffer.begin(vk::CommandBufferBeginInfo{
+        vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+
+    std::vector<vk::ImageMemoryBarrier> preCopyBarriers;
+    std::vector<vk::ImageMemoryBarrier> postCopyBarriers;
+
+    for (auto&& move : moves) {
+      const Resource& resource = move.resource;
+
+      if (!move.image || resource.layout == vk::ImageLayout::eUndefined) {
+        continue;
+      }
+
+      vk::Image image = registry->getImage(resource.image);
+      vk::ImageSubresourceRange range = getSubresourceRange(resource);
+      preCopyBarriers.push_back(vk::ImageMemoryBarrier{
+          /* srcAccessMask = */ {},
+          /* dstAccessMask = */ vk::AccessFlagBits::eTransferRead,
+          /* oldLayout = */ resource.layout,
+          /* newLayout = */ vk::ImageLayout::eTransferSrcOptimal,
+          /* srcQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+          /* dstQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+          /* image = */ image,
+          /* subresourceRange = */ range});
+      preCopyBarriers.push_back(vk::ImageMemoryBarrier{
+          /* srcAccessMask = */ {},
+          /* dstAccessMask = */ vk::AccessFlagBits::eTransferWrite,
+          /* oldLayout = */ vk::ImageLayout::eUndefined,
+          /* newLayout = */ vk::ImageLayout::eTransferDstOptimal,
+          /* srcQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+          /* dstQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+          /* image = */ **move.image,
+          /* subresourceRange = */ range});
+      // 差し替えるまでは、getImage()が移動元を返すのでレイアウトを戻す
+      postCopyBarriers.push_back(vk::ImageMemoryBarrier{
+          /* srcAccessMask = */ vk::AccessFlagBits::eTransferRead,
+          /* dstAccessMask = */ {},
+          /* oldLayout = */ vk::ImageLayout::eTransferSrcOptimal,
+          /* newLayout = */ resource.layout,
+          /* srcQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+          /* dstQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+          /* image = */ image,
+          /* subresourceRange = */ range});
+      postCopyBarriers.push_back(vk::ImageMemoryBarrier{
+          /* srcAccessMask = */ vk::AccessFlagBits::eTransferWrite,
+          /* dstAccessMask = */ {},
+          /* oldLayout = */ vk::ImageLayout::eTransferDstOptimal,
+          /* newLayout = */ resource.layout,
+          /* srcQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+          /* dstQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+          /* image = */ **move.image,
+          /* subresourceRange = */ range});
+    }
+
+    if (!preCopyBarriers.empty()) {
+      commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe,
+                                    vk::PipelineStageFlagBits::eTransfer, {},
+                                    nullptr, nullptr, preCopyBarriers);
+    }
+
+    for (auto&& move : moves) {
+      const Resource& resource = move.resource;
+
+      if (move.buffer) {
+        commandBuffer.copyBuffer(
+            registry->getBuffer(resource.buffer), **move.buffer,
+            vk::BufferCopy{0, 0, resource.bufferInfo.size});
+      } else if (resource.layout != vk::ImageLayout::eUndefined) {
+        commandBuffer.copyImage(
+            registry->getImage(resource.image),
+            vk::ImageLayout::eTransferSrcOptimal,
+            **move.image, vk::ImageLayout::eTransferDstOptimal,
+            getImageCopies(resource));
+      }
+    }
+
+    if (!postCopyBarriers.empty()) {
+      commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                    vk::PipelineStageFlagBits::eBottomOfPipe,
+                                    {}, nullptr, nullptr, postCopyBarriers);
+    }
+
+    commandBuffer.end();
+  }
+
+  // カラーイメージのみを扱う
+  static vk::ImageSubresourceRange getSubresourceRange(
+      const Resource& resource) {
+    return vk::ImageSubresourceRange{
+        /* aspectMask = */ vk::ImageAspectFlagBits::eColor,
+        /* baseMipLevel = */ 0,
+        /* levelCount = */ resource.imageInfo.mipLevels,
+        /* baseArrayLayer = */ 0,
+        /* layerCount = */ resource.imageInfo.arrayLayers};
+  }
+
+  // ミップレベルごとに、全レイヤーをコピーする
+  static std::vector<vk::ImageCopy> getImageCopies(const Resource& resource) {
+    std::vector<vk::ImageCopy> regions;
+    vk::Extent3D extent = resource.imageInfo.extent;
+
+    for (uint32_t level = 0; level < resource.imageInfo.mipLevels; level++) {
+      vk::ImageSubresourceLayers subresource{
+          vk::ImageAspectFlagBits::eColor, level, 0,
+          resource.imageInfo.arrayLayers};
+      regions.push_back(vk::ImageCopy{subresource, vk::Offset3D{0, 0, 0},
+                                      subresource, vk::Offset3D{0, 0, 0},
+                                      extent});
+      extent = vk::Extent3D{std::max(extent.width / 2, 1u),
+                            std::max(extent.height / 2, 1u),
+                            std::max(extent.depth / 2, 1u)};
+    }
+
+    return regions;
+  }
+
+  // コピーが完了していれば、新しいリソースに差し替える
+  // waitがfalseであれば、完了していない場合は何もしない
+  void finishMoves(bool wait) {
+    if (moves.empty()) {
+      return;
+    }
+
+    vk::Result result = device->waitForFences(
+        {*fence}, VK_TRUE, wait ? std::numeric_limits<uint64_t>::max() : 0);
+
+    if (result == vk::Result::eTimeout) {
+      return;
+    }
+
+    if (result != vk::Result::eSuccess) {
+      throw std::runtime_error("Failed to wait for defragmentation fence: " +
+                               vk::to_string(result));
+    }
+
+    device->resetFences({*fence});
+
+    // 移動前のリソースは、registryが破棄待ちのキューに移す
+    for (auto&& move : moves) {
+      if (move.buffer) {
+        registry->replace(move.resource.buffer, std::move(*move.buffer),
+                          move.allocation);
+      } else {
+        registry->replace(move.resource.image, std::move(*move.image),
+                          move.allocation);
+      }
+
+      statistics.moveCount++;
+      statistics.movedBytes += move.allocation.size;
+
+      if (moveCallback) {
+        moveCallback(move.resource.buffer, move.resource.image);
+      }
+    }
+
+    moves.clear();
+  }
+
+  // ヒープごとの断片化の割合をトレースに記録する
+  void recordCounters() {
+    std::vector<MemoryAllocator::FragmentationStatistics> fragmentation =
+        allocator->getFragmentationStatistics();
+
+    for (uint32_t i = 0; i < fragmentation.size(); i++) {
+      Tracer::get().counter(
+          "Fragmentation " + std::to_string(i),
+          {{"percent", fragmentation[i].getFragmentation() * 100.0},
+           {"free", static_cast<double>(fragmentation[i].freeBytes >> 20)}});
+    }
+
+    Tracer::get().counter(
+        "Defragmenter", {{"moves", static_cast<double>(statistics.moveCount)}});
+  }
+};
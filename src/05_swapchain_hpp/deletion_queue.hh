@@ -0,0 +1,134 @@
+/*
+ * 破棄待ちのキュー
+ *
+ * GPUがまだ使っているかもしれないオブジェクトを、vkDeviceWaitIdle()で待たずに手放すため、
+ * 次のサブミットの通し番号を付けてキューに入れ、そのサブミットの完了を観測してから破棄する
+ * 通し番号は増える一方なので、先頭から完了したものだけを取り出せばよい
+ * メモリーは、取り出した分をまとめてアロケーターに返す
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "memory_allocator.hh"
+#include "tracer.hh"
+
+class DeletionQueue {
+ public:
+  struct Statistics {
+    uint64_t destroyedCount = 0;
+    // collect()で実際に破棄した回数
+    uint64_t batchCount = 0;
+    size_t peakPendingCount = 0;
+  };
+
+ private:
+  struct Entry {
+    uint64_t serial;
+    // 最後の参照を持つ (他に参照があれば、その参照が無くなった時に破棄される)
+    std::shared_ptr<void> object;
+    // オブジェクトを破棄した後に解放するメモリー
+    std::optional<MemoryAllocation> allocation;
+  };
+
+  std::shared_ptr<MemoryAllocator> allocator;
+  std::deque<Entry> entries;
+  // メモリータイプごとの、解放待ちのメモリーの量
+  std::map<uint32_t, vk::DeviceSize> pendingBytes;
+  // 次のサブミットの通し番号
+  uint64_t serial = 1;
+  Statistics statistics;
+
+ public:
+  explicit DeletionQueue(std::shared_ptr<MemoryAllocator> allocator)
+      : allocator(std::move(allocator)) {}
+
+  // デバイスがアイドルになってから破棄する
+  ~DeletionQueue() { collect(std::numeric_limits<uint64_t>::max()); }
+
+  DeletionQueue(const DeletionQueue&) = delete;
+  DeletionQueue& operator=(const DeletionQueue&) = delete;
+
+  // フレームの開始時に、そのフレームのサブミットの通し番号を設定する
+  // 以降にキューに入れたものは、このサブミットが完了するまで破棄しない
+  void beginFrame(uint64_t nextSerial) {
+    serial = nextSerial;
+
+    if (Tracer::isEnabled()) {
+      Tracer::get().counter(
+          "Deletion queue",
+          {{"pending", static_cast<double>(entries.size())}});
+    }
+  }
+
+  template <typename T>
+  void push(std::shared_ptr<T> object) {
+    push(std::move(object), std::nullopt);
+  }
+
+  void push(const MemoryAllocation& allocation) {
+    push(std::shared_ptr<void>(), allocation);
+  }
+
+  template <typename T>
+  void push(std::shared_ptr<T> object,
+            std::optional<MemoryAllocation> allocation) {
+    if (allocation.has_value()) {
+      pendingBytes[allocation->memoryTypeIndex] += allocation->size;
+    }
+
+    entries.push_back(
+        Entry{serial, std::shared_ptr<void>(std::move(object)), allocation});
+    statistics.peakPendingCount =
+        std::max(statistics.peakPendingCount, entries.size());
+  }
+
+  // completedSerialまでのサブミットが完了したものを破棄する
+  void collect(uint64_t completedSerial) {
+    if (entries.empty() || entries.front().serial > completedSerial) {
+      return;
+    }
+
+    TRACE_SCOPE("DeletionQueue::collect");
+
+    std::vector<MemoryAllocation> allocations;
+
+    while (!entries.empty() && entries.front().serial <= completedSerial) {
+      Entry& entry = entries.front();
+      // メモリーより先にオブジェクトを破棄する
+      entry.object.reset();
+
+      if (entry.allocation.has_value()) {
+        pendingBytes[entry.allocation->memoryTypeIndex] -=
+            entry.allocation->size;
+        allocations.push_back(*entry.allocation);
+      }
+
+      entries.pop_front();
+      statistics.destroyedCount++;
+    }
+
+    allocator->free(allocations);
+    statistics.batchCount++;
+  }
+
+  size_t getPendingCount() const { return entries.size(); }
+
+  // アロケーターの使用量には含まれるが、まもなく解放されるメモリーの量
+  vk::DeviceSize getPendingBytes(uint32_t memoryTypeIndex) const {
+    auto it = pendingBytes.find(memoryTypeIndex);
+    return it != pendingBytes.end() ? it->second : 0;
+  }
+
+  const Statistics& getStatistics() const { return statistics; }
+};
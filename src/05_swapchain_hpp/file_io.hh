@@ -0,0 +1,46 @@
+/*
+ * 起動をまたいで保存するデータの読み書き
+ *
+ * 書き込みは一時ファイルに書いてから名前を変えるので、途中で終了しても壊れたファイルは残らない
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// ファイルが無ければnulloptを返す
+inline std::optional<std::vector<uint8_t>> readFile(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+
+  if (!file) {
+    return std::nullopt;
+  }
+
+  return std::vector<uint8_t>(std::istreambuf_iterator<char>(file),
+                              std::istreambuf_iterator<char>());
+}
+
+inline void writeFileAtomically(const std::string& path,
+                                const std::vector<uint8_t>& data) {
+  std::string temporaryPath = path + ".tmp";
+
+  {
+    std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(data.data()),
+               static_cast<std::streamsize>(data.size()));
+
+    if (!file.flush()) {
+      throw std::runtime_error("Failed to write " + temporaryPath);
+    }
+  }
+
+  // 同じファイルシステム内の名前の変更は、置き換えが一度に行われる
+  std::filesystem::rename(temporaryPath, path);
+}
@@ -0,0 +1,203 @@
+/*
+ * ホストメモリーのインポート
+ *
+ * VK_EXT_external_memory_hostがあれば、既にホストにあるデータ (mmapしたファイルなど) を
+ * コピーせずにvk::DeviceMemoryとして取り込み、バッファーにバインドする
+ * ポインターとサイズがminImportedHostPointerAlignmentに揃っていない場合や、
+ * エクステンションが無い場合は、ステージングリングを通してデバイスローカルなバッファーにコピーする
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include "memory_allocator.hh"
+#include "staging_ring.hh"
+#include "tracer.hh"
+
+// インポートまたはコピーしたバッファー
+// インポートした場合、元のホストメモリーはこのバッファーより長く生存させなければならない
+struct HostBuffer {
+  std::shared_ptr<vk::raii::Buffer> buffer;
+  // インポートしたメモリー (コピーした場合はnullptr)
+  std::shared_ptr<vk::raii::DeviceMemory> importedMemory;
+  // コピーした場合の割り当て
+  std::optional<MemoryAllocation> allocation;
+};
+
+class HostMemoryImporter {
+  std::shared_ptr<vk::raii::Device> device;
+  std::shared_ptr<MemoryAllocator> allocator;
+  std::shared_ptr<StagingRing> stagingRing;
+  // コピーしたバッファーを使うキューファミリー
+  std::vector<uint32_t> queueFamilyIndices;
+  // インポートできない場合は0
+  vk::DeviceSize importAlignment = 0;
+
+ public:
+  // externalMemoryHostEnabledは、VK_EXT_external_memory_hostを有効にしてデバイスを作成したか
+  HostMemoryImporter(std::shared_ptr<vk::raii::Device> device,
+                     const vk::raii::PhysicalDevice& physicalDevice,
+                     std::shared_ptr<MemoryAllocator> allocator,
+                     std::shared_ptr<StagingRing> stagingRing,
+                     std::vector<uint32_t> queueFamilyIndices,
+                     bool externalMemoryHostEnabled)
+      : device(std::move(device)),
+        allocator(std::move(allocator)),
+        stagingRing(std::move(stagingRing)),
+        queueFamilyIndices(std::move(queueFamilyIndices)) {
+    if (externalMemoryHostEnabled) {
+      // VK_KHR_get_physical_device_properties2が必要
+      auto properties = physicalDevice.getProperties2KHR<
+          vk::PhysicalDeviceProperties2,
+          vk::PhysicalDeviceExternalMemoryHostPropertiesEXT>();
+      importAlignment =
+          properties.get<vk::PhysicalDeviceExternalMemoryHostPropertiesEXT>()
+              .minImportedHostPointerAlignment;
+    }
+  }
+
+  bool isImportSupported() const { return importAlignment != 0; }
+
+  // インポートに必要なアライメント (インポートできない場合は0)
+  vk::DeviceSize getImportAlignment() const { return importAlignment; }
+
+  bool canImport(const void* pointer, vk::DeviceSize size) const {
+    return isImportSupported() &&
+           reinterpret_cast<uintptr_t>(pointer) % importAlignment == 0 &&
+           size % importAlignment == 0;
+  }
+
+  // ホストメモリーをバッファーとして使えるようにする
+  // インポートできなければコピーし、コピーが完了するまで待つ
+  HostBuffer createBuffer(const void* pointer,
+                          vk::DeviceSize size,
+                          vk::BufferUsageFlags usage) {
+    if (canImport(pointer, size)) {
+      try {
+        std::optional<HostBuffer> buffer = importBuffer(pointer, size, usage);
+
+        if (buffer.has_value()) {
+          return std::move(*buffer);
+        }
+      } catch (const vk::SystemError&) {
+        // ドライバーが受け付けないポインター (デバイスメモリーのマップなど) であればコピーする
+      }
+    }
+
+    return copyBuffer(pointer, size, usage);
+  }
+
+  // インポートできる場合でも、ステージングリングを通してコピーする
+  HostBuffer copyBuffer(const void* pointer,
+                        vk::DeviceSize size,
+                        vk::BufferUsageFlags usage) {
+    TRACE_SCOPE("HostMemoryImporter::copyBuffer");
+
+    vk::SharingMode sharingMode = queueFamilyIndices.size() > 1
+                                      ? vk::SharingMode::eConcurrent
+                                      : vk::SharingMode::eExclusive;
+    auto [buffer, allocation] = allocator->createBuffer(
+        vk::BufferCreateInfo{
+            /* flags = */ {},
+            /* size = */ size,
+            /* usage = */ usage | vk::BufferUsageFlagBits::eTransferDst,
+            /* sharingMode = */ sharingMode,
+            /* queueFamilyIndices = */ queueFamilyIndices},
+        MemoryUsage::eGpuOnly);
+
+    // リングに収まるように分割する
+    vk::DeviceSize chunkSize = stagingRing->getCapacity() / 2;
+    auto bytes = static_cast<const char*>(pointer);
+
+    for (vk::DeviceSize offset = 0; offset < size; offset += chunkSize) {
+      stagingRing->uploadBuffer(*buffer, offset, bytes + offset,
+                                std::min(chunkSize, size - offset));
+    }
+
+    stagingRing->waitIdle();
+
+    HostBuffer result;
+    result.buffer = std::make_shared<vk::raii::Buffer>(std::move(buffer));
+    result.allocation = allocation;
+    return result;
+  }
+
+  // コピーした場合は割り当てを解放する
+  void destroyBuffer(HostBuffer& buffer) {
+    buffer.buffer.reset();
+    buffer.importedMemory.reset();
+
+    if (buffer.allocation.has_value()) {
+      allocator->free(*buffer.allocation);
+      buffer.allocation.reset();
+    }
+  }
+
+ private:
+  std::optional<HostBuffer> importBuffer(const void* pointer,
+                                         vk::DeviceSize size,
+                                         vk::BufferUsageFlags usage) {
+    TRACE_SCOPE("HostMemoryImporter::importBuffer");
+
+    constexpr auto handleType =
+        vk::ExternalMemoryHandleTypeFlagBits::eHostAllocationEXT;
+
+    // ポインターをインポートできるメモリータイプ
+    vk::MemoryHostPointerPropertiesEXT pointerProperties =
+        device->getMemoryHostPointerPropertiesEXT(handleType, pointer);
+
+    // インポートしたメモリーにバインドするバッファーは、ハンドルの種類を指定して作成する
+    vk::StructureChain<vk::BufferCreateInfo, vk::ExternalMemoryBufferCreateInfo>
+        bufferChain{vk::BufferCreateInfo{
+                        /* flags = */ {},
+                        /* size = */ size,
+                        /* usage = */ usage,
+                        /* sharingMode = */
+                        queueFamilyIndices.size() > 1
+                            ? vk::SharingMode::eConcurrent
+                            : vk::SharingMode::eExclusive,
+                        /* queueFamilyIndices = */ queueFamilyIndices},
+                    vk::ExternalMemoryBufferCreateInfo{handleType}};
+    auto buffer = std::make_shared<vk::raii::Buffer>(
+        *device, bufferChain.get<vk::BufferCreateInfo>());
+
+    vk::MemoryRequirements requirements = buffer->getMemoryRequirements();
+
+    // 実装によってはバッファーがsizeより大きなメモリーを要求するが、インポートする範囲は広げられない
+    if (requirements.size > size) {
+      return std::nullopt;
+    }
+
+    // バッファーとポインターの両方が受け付けるメモリータイプから、GPUが読むのに適したものを選ぶ
+    std::optional<uint32_t> memoryTypeIndex = allocator->findMemoryType(
+        requirements.memoryTypeBits & pointerProperties.memoryTypeBits,
+        MemoryUsage::eGpuOnly);
+
+    if (!memoryTypeIndex.has_value()) {
+      return std::nullopt;
+    }
+
+    // pHostPointerは非constだが、GPUから書き込まない限り変更されない
+    vk::StructureChain<vk::MemoryAllocateInfo,
+                       vk::ImportMemoryHostPointerInfoEXT>
+        allocateChain{vk::MemoryAllocateInfo{size, *memoryTypeIndex},
+                      vk::ImportMemoryHostPointerInfoEXT{
+                          handleType, const_cast<void*>(pointer)}};
+
+    HostBuffer result;
+    result.importedMemory = std::make_shared<vk::raii::DeviceMemory>(
+        *device, allocateChain.get<vk::MemoryAllocateInfo>());
+    buffer->bindMemory(**result.importedMemory, 0);
+    result.buffer = buffer;
+    return result;
+  }
+};
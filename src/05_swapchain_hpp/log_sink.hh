@@ -0,0 +1,460 @@
+/*
+ * デバッグメッセンジャー用の非同期ログ出力
+ *
+ * コールバックはドライバーのスレッドから呼ばれるので、そこでは固定長のリングバッファーに
+ * メッセージをコピーするだけにし、出力はバックグラウンドスレッドで行う
+ * コールバック側ではメモリ確保もロックも行わない
+ *
+ * 同じメッセージIDは最初の1件だけを出力し、以降は繰り返しの数だけを数えて定期的と終了時に報告する
+ * IDで重複を除けないメッセージ (IDが0のものや、カウンターが足りなかったもの) は、レート制限だけをかける
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "console.hh"
+
+class LogSink {
+ public:
+  // リングバッファーのスロット数 (2のべき乗)
+  static constexpr size_t CAPACITY = 256;
+  // 1メッセージあたりの最大長 (超えた分は切り捨てる)
+  static constexpr size_t MAX_MESSAGE_LENGTH = 2048;
+  static constexpr size_t MAX_ID_NAME_LENGTH = 64;
+  // メッセージIDごとのカウンター数 (2のべき乗)
+  static constexpr size_t MAX_IDS = 1024;
+  // 同じIDの繰り返しの数を報告する間隔 (ミリ秒)
+  static constexpr uint64_t REPEAT_REPORT_INTERVAL = 5000;
+
+ private:
+  struct Entry {
+    VkDebugUtilsMessageSeverityFlagBitsEXT severity;
+    int32_t messageId;
+    // 0以外の場合は、メッセージの代わりに前回の報告以降の繰り返しの数を報告する
+    uint32_t repeats;
+    std::array<char, MAX_ID_NAME_LENGTH> idName;
+    std::array<char, MAX_MESSAGE_LENGTH> message;
+  };
+
+  struct Slot {
+    // Dmitry Vyukovの有界MPMCキューと同じ方式で、スロットの状態を表す通し番号
+    std::atomic<size_t> sequence;
+    Entry entry;
+  };
+
+  struct IdCounter {
+    // 0は未使用、それ以外は (1 << 32) | messageId
+    std::atomic<uint64_t> key{0};
+    std::atomic<uint32_t> total{0};
+    // 最初の1件以降で、まだ報告していない繰り返しの数
+    std::atomic<uint32_t> unreported{0};
+    // 前回、繰り返しの数を報告した時刻 (ミリ秒)
+    std::atomic<uint64_t> reportedTime{0};
+  };
+
+  struct RateCounter {
+    // 現在のレート制限の区間 (秒) と、その区間で出力を許可した数
+    std::atomic<uint64_t> window{0};
+    std::atomic<uint32_t> windowCount{0};
+    std::atomic<uint64_t> suppressed{0};
+  };
+
+  std::array<Slot, CAPACITY> slots;
+  std::atomic<size_t> enqueuePosition{0};
+  size_t dequeuePosition = 0;
+  // 書き込みが完了したメッセージ数 (バックグラウンドスレッドの起床に使用する)
+  std::atomic<uint64_t> published{0};
+
+  std::array<IdCounter, MAX_IDS> idCounters;
+  // バッファーが一杯で捨てたメッセージ数
+  std::atomic<uint64_t> dropped{0};
+  // IDのカウンターが足りずに重複を除けなかったメッセージ数
+  std::atomic<uint64_t> untracked{0};
+  // IDで重複を除けないメッセージのレート制限
+  RateCounter unidentified;
+  std::array<std::atomic<uint64_t>, 4> severityCounts{};
+
+  // IDで重複を除けないメッセージを、1秒あたりに出力する数の上限
+  uint32_t rateLimit;
+  std::atomic<bool> running{true};
+  std::thread thread;
+
+  // 以下はバックグラウンドスレッドのみが触る
+  std::map<int32_t, std::string> idNames;
+
+ public:
+  explicit LogSink(uint32_t rateLimit = 10) : rateLimit(rateLimit) {
+    for (size_t i = 0; i < CAPACITY; i++) {
+      slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    thread = std::thread([this] { drainLoop(); });
+  }
+
+  ~LogSink() {
+    running.store(false, std::memory_order_release);
+    published.fetch_add(1, std::memory_order_release);
+    published.notify_one();
+    thread.join();
+
+    drain();
+    reportRepeats();
+    showSummary();
+  }
+
+  LogSink(const LogSink&) = delete;
+  LogSink& operator=(const LogSink&) = delete;
+
+  // デバッグメッセンジャーのコールバックから呼ばれる
+  // メモリ確保もロックもしない
+  void push(VkDebugUtilsMessageSeverityFlagBitsEXT severity,
+            int32_t messageId,
+            const char* idName,
+            const char* message) {
+    severityCounts[severityIndex(severity)].fetch_add(
+        1, std::memory_order_relaxed);
+
+    IdCounter* counter = messageId != 0 ? findIdCounter(messageId) : nullptr;
+
+    if (counter != nullptr) {
+      if (counter->total.fetch_add(1, std::memory_order_relaxed) == 0) {
+        enqueue(severity, messageId, idName, message, 0);
+        return;
+      }
+
+      counter->unreported.fetch_add(1, std::memory_order_relaxed);
+
+      if (acquireReport(*counter)) {
+        uint32_t repeats =
+            counter->unreported.exchange(0, std::memory_order_relaxed);
+
+        // 書き込めなかった分は、次の報告に回す
+        if (repeats > 0 &&
+            !enqueue(severity, messageId, idName, nullptr, repeats)) {
+          counter->unreported.fetch_add(repeats, std::memory_order_relaxed);
+        }
+      }
+
+      return;
+    }
+
+    if (messageId != 0) {
+      untracked.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (!acquireRate(unidentified)) {
+      unidentified.suppressed.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    enqueue(severity, messageId, idName, message, 0);
+  }
+
+ private:
+  // リングバッファーにメッセージを書き込む
+  // バッファーが一杯の場合はfalseを返す
+  bool enqueue(VkDebugUtilsMessageSeverityFlagBitsEXT severity,
+               int32_t messageId,
+               const char* idName,
+               const char* message,
+               uint32_t repeats) {
+    size_t position = enqueuePosition.load(std::memory_order_relaxed);
+    Slot* slot;
+
+    for (;;) {
+      slot = &slots[position & (CAPACITY - 1)];
+      size_t sequence = slot->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<intptr_t>(sequence) -
+                  static_cast<intptr_t>(position);
+
+      if (diff == 0) {
+        if (enqueuePosition.compare_exchange_weak(
+                position, position + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // バッファーが一杯
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        position = enqueuePosition.load(std::memory_order_relaxed);
+      }
+    }
+
+    Entry& entry = slot->entry;
+    entry.severity = severity;
+    entry.messageId = messageId;
+    entry.repeats = repeats;
+    copyString(entry.idName, idName);
+    copyString(entry.message, message);
+
+    slot->sequence.store(position + 1, std::memory_order_release);
+
+    published.fetch_add(1, std::memory_order_release);
+    published.notify_one();
+    return true;
+  }
+
+  template <size_t N>
+  static void copyString(std::array<char, N>& dst, const char* src) {
+    size_t i = 0;
+
+    if (src != nullptr) {
+      for (; i < N - 1 && src[i] != '\0'; i++) {
+        dst[i] = src[i];
+      }
+    }
+
+    dst[i] = '\0';
+  }
+
+  static size_t severityIndex(VkDebugUtilsMessageSeverityFlagBitsEXT severity) {
+    switch (severity) {
+      case VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT:
+        return 0;
+      case VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT:
+        return 1;
+      case VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT:
+        return 2;
+      default:
+        return 3;
+    }
+  }
+
+  // 開番地法のハッシュテーブルからIDのカウンターを探す
+  // 無ければ空きスロットを確保する
+  IdCounter* findIdCounter(int32_t messageId) {
+    uint64_t key = (uint64_t{1} << 32) | static_cast<uint32_t>(messageId);
+    size_t index = (static_cast<uint32_t>(messageId) * 2654435761u) &
+                   (MAX_IDS - 1);
+
+    for (size_t i = 0; i < MAX_IDS; i++) {
+      IdCounter& counter = idCounters[(index + i) & (MAX_IDS - 1)];
+      uint64_t current = counter.key.load(std::memory_order_acquire);
+
+      if (current == key) {
+        return &counter;
+      }
+
+      if (current == 0) {
+        if (counter.key.compare_exchange_strong(current, key,
+                                                std::memory_order_acq_rel)) {
+          return &counter;
+        }
+
+        // 他のスレッドが先に確保した
+        if (current == key) {
+          return &counter;
+        }
+      }
+    }
+
+    return nullptr;
+  }
+
+  static uint64_t now() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+  }
+
+  // 前回の報告からREPEAT_REPORT_INTERVALが経っていれば、1つのスレッドだけに報告を許可する
+  static bool acquireReport(IdCounter& counter) {
+    uint64_t time = now();
+    uint64_t reported = counter.reportedTime.load(std::memory_order_relaxed);
+
+    // 最初の繰り返しでは、間隔の起点を記録するだけにする
+    if (reported == 0) {
+      counter.reportedTime.compare_exchange_strong(reported, time,
+                                                   std::memory_order_relaxed);
+      return false;
+    }
+
+    return time - reported >= REPEAT_REPORT_INTERVAL &&
+           counter.reportedTime.compare_exchange_strong(
+               reported, time, std::memory_order_relaxed);
+  }
+
+  // 1秒ごとの区間で、rateLimit件まで出力を許可する
+  bool acquireRate(RateCounter& counter) {
+    uint64_t second = now() / 1000;
+    uint64_t window = counter.window.load(std::memory_order_relaxed);
+
+    if (window != second && counter.window.compare_exchange_strong(
+                                window, second, std::memory_order_relaxed)) {
+      counter.windowCount.store(0, std::memory_order_relaxed);
+    }
+
+    return counter.windowCount.fetch_add(1, std::memory_order_relaxed) <
+           rateLimit;
+  }
+
+  void drainLoop() {
+    for (;;) {
+      // 出力前に読んでおくことで、出力中に書き込まれたメッセージの通知を取りこぼさない
+      uint64_t seen = published.load(std::memory_order_acquire);
+
+      // seenを読んだ後に確認する
+      // 先に確認すると、その間に終了の通知が来た場合にseenが通知後の値となり、待ち続けてしまう
+      if (!running.load(std::memory_order_acquire)) {
+        return;
+      }
+
+      drain();
+      // 新しいメッセージが書き込まれるまで待つ
+      published.wait(seen, std::memory_order_acquire);
+    }
+  }
+
+  // 書き込み済みのメッセージをすべて出力する
+  void drain() {
+    bool wrote = false;
+
+    for (;;) {
+      Slot& slot = slots[dequeuePosition & (CAPACITY - 1)];
+      size_t sequence = slot.sequence.load(std::memory_order_acquire);
+
+      if (sequence != dequeuePosition + 1) {
+        break;
+      }
+
+      write(slot.entry);
+      wrote = true;
+
+      slot.sequence.store(dequeuePosition + CAPACITY,
+                          std::memory_order_release);
+      dequeuePosition++;
+    }
+
+    if (wrote) {
+      std::cerr.flush();
+    }
+  }
+
+  void write(const Entry& entry) {
+    const char* color = "";
+
+    if (entry.severity == VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT) {
+      color = Console::fgYellow;
+    } else if (entry.severity ==
+               VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT) {
+      color = Console::fgRed;
+    }
+
+    if (entry.idName[0] != '\0' && idNames.count(entry.messageId) == 0) {
+      idNames[entry.messageId] = entry.idName.data();
+    }
+
+    if (entry.repeats > 0) {
+      writeRepeats(color, entry.messageId, entry.repeats);
+    } else {
+      std::cerr << color << "$ " << entry.message.data() << Console::fgDefault
+                << '\n';
+    }
+  }
+
+  void writeRepeats(const char* color, int32_t messageId, uint32_t repeats) {
+    std::cerr << color << "$ (" << repeats << " repeats of ";
+    auto name = idNames.find(messageId);
+
+    if (name != idNames.end()) {
+      std::cerr << name->second;
+    } else {
+      std::cerr << "# " << messageId;
+    }
+
+    std::cerr << ")" << Console::fgDefault << '\n';
+  }
+
+  // 終了時に、まだ報告していない繰り返しの数を出力する
+  void reportRepeats() {
+    bool wrote = false;
+
+    for (auto&& counter : idCounters) {
+      uint64_t key = counter.key.load(std::memory_order_acquire);
+      uint32_t repeats =
+          counter.unreported.exchange(0, std::memory_order_relaxed);
+
+      if (key != 0 && repeats > 0) {
+        writeRepeats("", static_cast<int32_t>(key & 0xffffffffu), repeats);
+        wrote = true;
+      }
+    }
+
+    if (wrote) {
+      std::cerr.flush();
+    }
+  }
+
+  void showSummary() {
+    static constexpr const char* severityNames[] = {"Verbose", "Info",
+                                                    "Warning", "Error"};
+
+    struct IdSummary {
+      int32_t messageId;
+      uint32_t total;
+    };
+
+    std::vector<IdSummary> ids;
+
+    for (auto&& counter : idCounters) {
+      uint64_t key = counter.key.load(std::memory_order_acquire);
+
+      if (key != 0) {
+        ids.push_back(IdSummary{static_cast<int32_t>(key & 0xffffffffu),
+                                counter.total.load(std::memory_order_relaxed)});
+      }
+    }
+
+    if (ids.empty() && dropped.load() == 0 && untracked.load() == 0 &&
+        unidentified.suppressed.load() == 0) {
+      return;
+    }
+
+    std::sort(ids.begin(), ids.end(),
+              [](auto&& a, auto&& b) { return a.total > b.total; });
+
+    std::cerr << "# Debug messenger summary:" << '\n';
+
+    for (size_t i = 0; i < severityCounts.size(); i++) {
+      std::cerr << "| " << severityNames[i] << ": "
+                << severityCounts[i].load(std::memory_order_relaxed) << '\n';
+    }
+
+    std::cerr << "| Dropped: " << dropped.load(std::memory_order_relaxed)
+              << '\n';
+    std::cerr << "| Untracked IDs: "
+              << untracked.load(std::memory_order_relaxed) << '\n';
+    std::cerr << "| Rate limited: "
+              << unidentified.suppressed.load(std::memory_order_relaxed)
+              << '\n';
+
+    for (auto&& id : ids) {
+      auto name = idNames.find(id.messageId);
+
+      std::cerr << "| # " << id.messageId;
+
+      if (name != idNames.end()) {
+        std::cerr << " " << name->second;
+      }
+
+      std::cerr << ": " << id.total << " (" << id.total - 1 << " repeats)"
+                << '\n';
+    }
+
+    std::cerr.flush();
+  }
+};
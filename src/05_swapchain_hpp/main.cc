@@ -2,12 +2,21 @@
  * バリデーションレイヤーを有効にする
  */
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
 #include <limits>
+#include <map>
 #include <memory>
 #include <optional>
-#include <set>
+#include <random>
+#include <sstream>
+#include <span>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -18,12 +27,30 @@
 #include <SDL.h>
 #include <SDL_vulkan.h>
 
+#include "builtin_shaders.hh"
+#include "config.hh"
 #include "console.hh"
-
-// MoltenVKサポート用のコードを有効/無効にする
-#define SUPPORT_MOLTENVK 1
-// バリエーションレイヤー有効/無効
-#define ENABLE_VALIDATION 1
+#include "defragmenter.hh"
+#include "deletion_queue.hh"
+#include "host_memory_import.hh"
+#include "log_sink.hh"
+#include "memory_allocator.hh"
+#include "perf_report.hh"
+#include "physical_device_info.hh"
+#include "pipeline_cache.hh"
+#include "pipeline_compiler.hh"
+#include "pipeline_library.hh"
+#include "pipeline_manifest.hh"
+#include "queue_topology.hh"
+#include "residency_manager.hh"
+#include "resource_registry.hh"
+#include "shader_object.hh"
+#ifdef SHADER_HOT_RELOAD
+#include "shader_watcher.hh"
+#endif
+#include "staging_ring.hh"
+#include "texture_uploader.hh"
+#include "tracer.hh"
 
 class SDLApplication {
  public:
@@ -39,48 +66,464 @@ class SDLApplication {
 class Application : public SDLApplication {
  public:
   static constexpr char NAME[] = "05_swapchain_hpp";
+  static constexpr char VALIDATION_LAYER_NAME[] = "VK_LAYER_KHRONOS_validation";
   static constexpr uint32_t WIDTH = 960;
   static constexpr uint32_t HEIGHT = 570;
+  // 同時に処理できるフレーム数の上限
+  static constexpr uint32_t MAX_FRAMES_IN_FLIGHT = 4;
+  static constexpr vk::DeviceSize STAGING_RING_SIZE = 32 << 20;
+  // ステージングのベンチマークの転送先のサイズ
+  static constexpr vk::DeviceSize STAGING_TARGET_BUFFER_SIZE = 16 << 20;
+  static constexpr uint32_t STAGING_TARGET_IMAGE_SIZE = 1024;
+  // レジデンシーのデモで作成するバッファーのサイズ
+  static constexpr vk::DeviceSize RESIDENCY_DEMO_BUFFER_SIZE = 4 << 20;
+  // デフラグメンテーションのデモで、1フレームに入れ替えるバッファーの数
+  static constexpr uint32_t DEFRAG_DEMO_CHURN = 4;
+  // 描画のベンチマークで、1つのコマンドバッファーに記録する描画の数
+  static constexpr uint32_t DRAW_BENCHMARK_COUNT = 10000;
+  static constexpr uint32_t STAGING_TILE_SIZE = 32;
+
+  // フレームごとに必要な同期オブジェクトとコマンドバッファー
+  struct Frame {
+    vk::raii::CommandBuffer commandBuffer{nullptr};
+    // スワップチェーンイメージの取得完了を通知する
+    vk::raii::Semaphore imageAvailableSemaphore{nullptr};
+    // このフレームのサブミットの完了を通知する
+    vk::raii::Fence inFlightFence{nullptr};
+    // inFlightFenceが待っているサブミットの通し番号
+    uint64_t submitSerial = 0;
+  };
+
+  // 再作成によって古くなったスワップチェーン
+  // まだプレゼンテーション中かもしれないので、GPUが追いつくまで破棄を遅らせる
+  struct RetiredSwapchain {
+    std::shared_ptr<vk::raii::SwapchainKHR> swapchain;
+    std::vector<vk::raii::Semaphore> renderFinishedSemaphores;
+    std::vector<vk::raii::Semaphore> presentReadySemaphores;
+    std::vector<vk::raii::CommandBuffer> ownershipAcquireCommandBuffers;
+    std::vector<vk::raii::Fence> ownershipAcquireFences;
+    // この通し番号のサブミットが完了し、所有権を受け取るサブミットも完了したら破棄できる
+    uint64_t retireSerial;
+  };
+
+  // ステージングのベンチマークの転送先
+  // リソースはresourceRegistryが持つ
+  struct StagingTarget {
+    BufferHandle buffer;
+    ImageHandle image;
+    // アップロードするデータ
+    std::vector<uint8_t> data;
+    std::mt19937 random;
+  };
+
+  // マテリアルの描画の方法
+  enum class DrawBackend {
+    // パイプラインライブラリーからリンクしたパイプライン
+    ePipeline,
+    // VK_EXT_shader_objectのシェーダーと動的な状態
+    eShaderObject,
+  };
+
+  // 描画のデモの描画先と、描画の方法ごとのパイプラインやシェーダー
+  // パイプラインはVK_EXT_graphics_pipeline_library、シェーダーはVK_EXT_shader_objectが使える場合だけ作成する
+  // イメージはresourceRegistryが持つ
+  struct PipelineLibraryDemo {
+    // 描画する組み合わせ (それぞれの状態のインデックス)
+    struct Material {
+      size_t preRasterization;
+      size_t fragmentShader;
+      size_t fragmentOutput;
+    };
+
+    ImageHandle image;
+    vk::Extent2D extent;
+    // 描画先のフォーマット (フラグメント出力の状態にも記録する)
+    vk::Format format = vk::Format::eR8G8B8A8Unorm;
+    std::shared_ptr<vk::raii::ImageView> imageView;
+    std::shared_ptr<vk::raii::RenderPass> renderPass;
+    std::shared_ptr<vk::raii::Framebuffer> framebuffer;
+    std::shared_ptr<vk::raii::PipelineLayout> pipelineLayout;
+    VertexInputState vertexInput;
+    std::vector<PreRasterizationState> preRasterizations;
+    std::vector<FragmentShaderState> fragmentShaders;
+    std::vector<FragmentOutputState> fragmentOutputs;
+    std::vector<Material> materials;
+    // 状態と同じ順 (VK_EXT_graphics_pipeline_libraryが使えなければ空)
+    std::shared_ptr<GraphicsPipelineLibrary> library;
+    std::shared_ptr<vk::raii::Pipeline> vertexInputLibrary;
+    std::vector<std::shared_ptr<vk::raii::Pipeline>> preRasterizationLibraries;
+    std::vector<std::shared_ptr<vk::raii::Pipeline>> fragmentShaderLibraries;
+    std::vector<std::shared_ptr<vk::raii::Pipeline>> fragmentOutputLibraries;
+    // シェーダーの再コンパイル後に作り直し中のライブラリー (キーは状態のインデックス)
+    std::map<size_t, PipelineFuture> preRasterizationReloads;
+    std::map<size_t, PipelineFuture> fragmentShaderReloads;
+    // materialsと同じ順
+    std::vector<std::shared_ptr<LinkedPipeline>> pipelines;
+    // 状態と同じ順 (VK_EXT_shader_objectが使えなければ空)
+    std::shared_ptr<ShaderObjectRenderer> shaderObjects;
+    std::vector<std::shared_ptr<vk::raii::ShaderEXT>> vertexShaders;
+    std::vector<std::shared_ptr<vk::raii::ShaderEXT>> fragmentShaderObjects;
+  };
 
  private:
   std::shared_ptr<SDL_Window> window;
   vk::raii::Context context;
+  // インスタンスの破棄時にもメッセージが届くので、インスタンスより先に宣言する
+  std::shared_ptr<LogSink> logSink;
+  std::shared_ptr<PerfReport> perfReport;
   std::shared_ptr<vk::raii::Instance> instance;
   std::shared_ptr<vk::raii::DebugUtilsMessengerEXT> debugMessenger;
   std::shared_ptr<vk::raii::SurfaceKHR> surface;
   std::shared_ptr<vk::raii::PhysicalDevice> physicalDevice;
+  // 選択した物理デバイスについて、初期化時に取得した情報
+  std::shared_ptr<PhysicalDeviceInfo> physicalDeviceInfo;
   std::shared_ptr<vk::raii::Device> device;
+  // デバイスメモリーはすべてここから割り当てる
+  std::shared_ptr<MemoryAllocator> allocator;
+  // GPUが使い終わるまで、手放したリソースの破棄を遅らせる
+  // 他のオブジェクトの破棄時にも使うので、それより先に宣言する
+  std::shared_ptr<DeletionQueue> deletionQueue;
+  // バッファー、イメージ、サンプラーは世代付きのハンドルで参照する
+  std::shared_ptr<ResourceRegistry> resourceRegistry;
+  // 小さなアップロードをまとめて転送のキューにサブミットする
+  std::shared_ptr<StagingRing> stagingRing;
+  std::shared_ptr<StagingTarget> stagingTarget;
+  // 既存のホストメモリーをバッファーとして使えるようにする
+  std::shared_ptr<HostMemoryImporter> hostMemoryImporter;
+  std::shared_ptr<TextureUploader> textureUploader;
+  // ヒープの予算を超えたら、使われていないバッファーをホストから見えるメモリーに追い出す
+  std::shared_ptr<ResidencyManager> residencyManager;
+  std::vector<BufferHandle> residencyDemoBuffers;
+  // 使用率の低いブロックのリソースを毎フレーム少しずつ詰め直す
+  std::shared_ptr<Defragmenter> defragmenter;
+  std::vector<BufferHandle> defragDemoBuffers;
+  std::mt19937 defragRandom;
+  // パイプラインはすべてこのキャッシュを通して作成する
+  std::shared_ptr<PipelineCache> pipelineCache;
+  // パイプラインをワーカースレッドで作成する
+  std::shared_ptr<PipelineCompiler> pipelineCompiler;
+  // 作成したパイプラインの記述を記録し、次の起動で事前に作成する
+  std::shared_ptr<PipelineManifest> pipelineManifest;
+  // 作成が終わるまでは、代わりのパイプラインでディスパッチする
+  std::vector<PipelineFuture> compileDemoPipelines;
+  std::shared_ptr<vk::raii::Pipeline> compileDemoFallback;
+  uint64_t compileDemoFallbackCount = 0;
+  // シェーダーの再コンパイル後に作り直し中のパイプライン (キーはcompileDemoPipelinesのインデックス)
+  std::map<size_t, PipelineFuture> compileDemoReloads;
+  // 高速リンクしたパイプラインで描画し、最適化したリンクが終わったものから置き換える
+  std::shared_ptr<PipelineLibraryDemo> pipelineLibraryDemo;
+  uint64_t fastLinkedDrawCount = 0;
+  uint64_t optimizedDrawCount = 0;
+#ifdef SHADER_HOT_RELOAD
+  // シェーダーのソースの変更を監視し、ワーカースレッドで再コンパイルする
+  std::shared_ptr<ShaderWatcher> shaderWatcher;
+#endif
+  // 再コンパイルしたシェーダーの数
+  // SPIR-Vはパイプラインの記述や状態が持つので、使われなくなれば解放される
+  uint64_t reloadedShaderCount = 0;
+  uint64_t reloadedPipelineCount = 0;
+  // 役割ごとのキューファミリーとキューの割り当て
+  QueueTopology queueTopology;
   std::shared_ptr<vk::raii::Queue> graphicsQueue;
   std::optional<uint32_t> graphicsQueueFamilyIndex;
+  // 専用のファミリーが無い場合は、グラフィックスのファミリーのキューになる
+  std::shared_ptr<vk::raii::Queue> computeQueue;
+  std::shared_ptr<vk::raii::Queue> transferQueue;
   std::shared_ptr<vk::raii::Queue> presentQueue;
   std::optional<uint32_t> presentQueueFamilyIndex;
+  // 所有権を受け取るコマンドバッファーを確保する、プレゼンテーションのキューファミリーのプール
+  // リタイアしたスワップチェーンもコマンドバッファーを持つので、それより先に宣言する
+  std::shared_ptr<vk::raii::CommandPool> presentCommandPool;
   std::shared_ptr<vk::raii::SwapchainKHR> swapchain;
+  std::deque<RetiredSwapchain> retiredSwapchains;
+  // ウィンドウサイズの変更などで、スワップチェーンの再作成が必要になった
+  bool swapchainDirty = false;
+  std::vector<vk::Image> swapchainImages;
+  vk::Format swapchainImageFormat;
+  vk::Extent2D swapchainImageExtent;
+  // 描画完了を通知するセマフォはプレゼンテーションが終わるまで再利用できないので、スワップチェーンイメージごとに持つ
+  std::vector<vk::raii::Semaphore> renderFinishedSemaphores;
+  // 所有権を移動する場合に、プレゼンテーションのキューで所有権を受け取ったことを通知する
+  std::vector<vk::raii::Semaphore> presentReadySemaphores;
+  // イメージごとに、プレゼンテーションのキューで所有権を受け取るコマンドを記録しておく
+  std::vector<vk::raii::CommandBuffer> ownershipAcquireCommandBuffers;
+  // 所有権を受け取るサブミットの完了を通知する
+  // プレゼンテーションのキューへのサブミットはフレームのフェンスでは観測できないので、別に持つ
+  std::vector<vk::raii::Fence> ownershipAcquireFences;
+  // 各スワップチェーンイメージを最後に使用したフレームのフェンス
+  std::vector<vk::Fence> imagesInFlight;
+  std::shared_ptr<vk::raii::CommandPool> commandPool;
+  std::vector<Frame> frames;
+  uint32_t currentFrame = 0;
+  uint64_t frameCount = 0;
+  // グラフィックスキューへのサブミットの通し番号
+  // 同じキューへのサブミットは順に完了するので、完了済みの最大値だけを覚えておけばよい
+  uint64_t submitSerial = 0;
+  uint64_t completedSerial = 0;
+
+  // 同時に処理するフレーム数 (1からMAX_FRAMES_IN_FLIGHT)
+  uint32_t framesInFlight = 2;
+  // SDLのoffscreenドライバーとVK_EXT_headless_surfaceを使用する
+  bool headless = false;
+  // 指定したフレーム数を描画したら終了する
+  std::optional<uint64_t> frameLimit;
+  // 指定した回数だけウィンドウサイズを変更し、再作成時のフレーム時間を計測する
+  std::optional<uint32_t> resizeBenchmarkCount;
+  // IDで重複を除けないデバッグメッセージを、1秒あたり何件まで出力するか
+  uint32_t logRateLimit = 10;
+  // パフォーマンス警告のレポートの出力先 (F9キーでも書き出す)
+  std::optional<std::string> perfReportPath;
+  // 使用する物理デバイスのインデックス (指定した場合は評価より優先する)
+  std::optional<size_t> deviceIndex;
+  // 役割ごとのキューの優先度
+  QueuePriorities queuePriorities;
+  // グラフィックスとプレゼンテーションのキューファミリーが異なる場合の、スワップチェーンイメージの共有方法
+  // eConcurrentは所有権の移動が不要だが、イメージの圧縮が無効になるなど帯域幅を消費する場合がある
+  vk::SharingMode swapchainSharingMode = vk::SharingMode::eExclusive;
+  // デバイスメモリーの割り当てと解放の記録の出力先 (bench_allocatorで再生する)
+  std::optional<std::string> allocationTracePath;
+  // 毎フレーム、指定した回数の小さなアップロードを行い、スループットを計測する
+  std::optional<uint32_t> stagingBenchmarkUploads;
+  // 比較のため、アップロードごとにサブミットする
+  bool stagingPerUpload = false;
+  // 指定したサイズ (MiB) のデータで、インポートとコピーの時間を比べる
+  std::optional<uint32_t> importBenchmarkSize;
+  // 多数の小さなテクスチャーと少数の大きなテクスチャーで、アップロードの時間を比べる
+  bool textureBenchmark = false;
+  // デバイスローカルなヒープの予算を、指定したサイズ (MiB) に制限する
+  std::optional<uint32_t> memoryBudgetLimit;
+  // 指定した数のバッファーを作成し、毎フレーム一部だけを使って追い出しと復帰を試す
+  std::optional<uint32_t> residencyDemoCount;
+  // 指定した数のバッファーを作成して半分を解放し、入れ替えながらデフラグメンテーションを試す
+  std::optional<uint32_t> defragDemoCount;
+  Defragmenter::Budget defragBudget;
+  // パイプラインキャッシュの保存先 (指定した場合は、起動時に読み込む)
+  std::optional<std::string> pipelineCachePath;
+  // 指定した数のコンピュートパイプラインを作成し、キャッシュの有無で時間を比べる
+  std::optional<uint32_t> pipelineBenchmarkCount;
+  // パイプラインの記述の記録先 (指定した場合は、前回記録したものを起動時に作成する)
+  std::optional<std::string> pipelineManifestPath;
+  // パイプラインを作成するワーカースレッドの数 (0の時はハードウェアのスレッド数から決める)
+  uint32_t pipelineThreadCount = 0;
+  // 指定した数のパイプラインの作成を依頼し、作成が終わったものから毎フレームのディスパッチに使う
+  std::optional<uint32_t> compileDemoCount;
+  // パイプラインライブラリーから組み合わせごとのパイプラインをリンクし、一括での作成と時間を比べる
+  bool libraryDemo = false;
+  // 描画のデモで、毎フレームの描画に使う方法
+  DrawBackend drawBackend = DrawBackend::ePipeline;
+  // --draw-backendを指定した場合は、--pipeline-library-demoが無くても描画のデモを行う
+  bool drawBackendSelected = false;
+  // シェーダーのソースを監視し、変更されたら使っているパイプラインを作り直して置き換える (開発用)
+  bool shaderHotReload = false;
+  std::vector<double> resizeFrameTimes;
+  std::vector<double> steadyFrameTimes;
+  Config config;
+  // configと利用可能なレイヤー/エクステンションから決定した値
+  bool validationEnabled = false;
+  bool portabilityEnabled = false;
+  // VK_KHR_get_physical_device_properties2 (エクステンションのプロパティの取得に使う)
+  bool properties2Enabled = false;
+  // VK_KHR_external_memory_capabilities (Vulkan 1.0では、VK_KHR_external_memoryが依存する)
+  bool externalMemoryCapabilitiesEnabled = false;
+  bool externalMemoryHostEnabled = false;
+  bool hostImageCopyEnabled = false;
+  bool memoryBudgetEnabled = false;
+  bool pipelineCreationFeedbackEnabled = false;
+  bool graphicsPipelineLibraryEnabled = false;
+  bool shaderObjectEnabled = false;
 
  public:
   void run(const std::vector<std::string>& args) {
+    parseArguments(args);
+
+    if (config.trace.has_value()) {
+      Tracer::get().start(*config.trace);
+    }
+
     initialize();
     loop();
     finalize();
+    Tracer::get().stop();
   }
 
  private:
   void initialize() {
+    TRACE_SCOPE("initialize");
+
     initializeWindow();
     initializeInstance();
     initializeSurface();
     initializeDevice();
+
+    if (pipelineManifestPath.has_value()) {
+      initializePipelineManifest();
+    }
+
     initializeSwapchain();
+    initializeFrames();
+
+    if (stagingBenchmarkUploads.has_value()) {
+      initializeStagingBenchmark();
+    }
+
+    if (importBenchmarkSize.has_value()) {
+      runImportBenchmark();
+    }
+
+    if (textureBenchmark) {
+      runTextureBenchmark();
+    }
+
+    if (pipelineBenchmarkCount.has_value()) {
+      runPipelineBenchmark();
+    }
+
+    if (compileDemoCount.has_value()) {
+      initializeCompileDemo();
+    }
+
+    if (libraryDemo || drawBackendSelected) {
+      initializeDrawDemo();
+    }
+
+    if (residencyDemoCount.has_value()) {
+      initializeResidencyDemo();
+    }
+
+    if (defragDemoCount.has_value()) {
+      initializeDefragDemo();
+    }
+
+    if (shaderHotReload) {
+      initializeShaderHotReload();
+    }
+  }
+
+  void parseArguments(const std::vector<std::string>& args) {
+    config = Config::parse(args);
+
+    // Configが認識しなかった引数は、このステップ固有のオプションとして解釈する
+    const std::vector<std::string>& rest = config.unparsed;
+
+    for (size_t i = 0; i < rest.size(); i++) {
+      const std::string& arg = rest[i];
+
+      if (arg == "--frames-in-flight" && i + 1 < rest.size()) {
+        framesInFlight = static_cast<uint32_t>(std::stoul(rest[++i]));
+      } else if (arg == "--frames" && i + 1 < rest.size()) {
+        frameLimit = std::stoull(rest[++i]);
+      } else if (arg == "--resize-benchmark" && i + 1 < rest.size()) {
+        resizeBenchmarkCount = static_cast<uint32_t>(std::stoul(rest[++i]));
+      } else if (arg == "--log-rate-limit" && i + 1 < rest.size()) {
+        logRateLimit = static_cast<uint32_t>(std::stoul(rest[++i]));
+      } else if (arg == "--perf-report" && i + 1 < rest.size()) {
+        perfReportPath = rest[++i];
+      } else if (arg == "--device" && i + 1 < rest.size()) {
+        deviceIndex = std::stoul(rest[++i]);
+      } else if (arg == "--queue-priority" && i + 1 < rest.size()) {
+        queuePriorities.parse(rest[++i]);
+      } else if (arg == "--swapchain-sharing" && i + 1 < rest.size()) {
+        const std::string& mode = rest[++i];
+
+        if (mode == "exclusive") {
+          swapchainSharingMode = vk::SharingMode::eExclusive;
+        } else if (mode == "concurrent") {
+          swapchainSharingMode = vk::SharingMode::eConcurrent;
+        } else {
+          throw std::runtime_error("Unknown swapchain sharing mode: " + mode);
+        }
+      } else if (arg == "--allocation-trace" && i + 1 < rest.size()) {
+        allocationTracePath = rest[++i];
+      } else if (arg == "--staging-benchmark" && i + 1 < rest.size()) {
+        stagingBenchmarkUploads = static_cast<uint32_t>(std::stoul(rest[++i]));
+      } else if (arg == "--import-benchmark" && i + 1 < rest.size()) {
+        importBenchmarkSize = static_cast<uint32_t>(std::stoul(rest[++i]));
+      } else if (arg == "--texture-benchmark") {
+        textureBenchmark = true;
+      } else if (arg == "--memory-budget" && i + 1 < rest.size()) {
+        memoryBudgetLimit = static_cast<uint32_t>(std::stoul(rest[++i]));
+      } else if (arg == "--residency-demo" && i + 1 < rest.size()) {
+        residencyDemoCount = static_cast<uint32_t>(std::stoul(rest[++i]));
+      } else if (arg == "--defrag-demo" && i + 1 < rest.size()) {
+        defragDemoCount = static_cast<uint32_t>(std::stoul(rest[++i]));
+      } else if (arg == "--defrag-moves" && i + 1 < rest.size()) {
+        defragBudget.maxMoves = static_cast<uint32_t>(std::stoul(rest[++i]));
+      } else if (arg == "--defrag-bytes" && i + 1 < rest.size()) {
+        defragBudget.maxBytes = vk::DeviceSize{std::stoull(rest[++i])} << 20;
+      } else if (arg == "--defrag-time" && i + 1 < rest.size()) {
+        defragBudget.maxTime = std::chrono::microseconds(std::stoul(rest[++i]));
+      } else if (arg == "--pipeline-cache" && i + 1 < rest.size()) {
+        pipelineCachePath = rest[++i];
+      } else if (arg == "--pipeline-benchmark" && i + 1 < rest.size()) {
+        pipelineBenchmarkCount = static_cast<uint32_t>(std::stoul(rest[++i]));
+      } else if (arg == "--pipeline-manifest" && i + 1 < rest.size()) {
+        pipelineManifestPath = rest[++i];
+      } else if (arg == "--pipeline-threads" && i + 1 < rest.size()) {
+        pipelineThreadCount = static_cast<uint32_t>(std::stoul(rest[++i]));
+      } else if (arg == "--compile-demo" && i + 1 < rest.size()) {
+        compileDemoCount = static_cast<uint32_t>(std::stoul(rest[++i]));
+      } else if (arg == "--pipeline-library-demo") {
+        libraryDemo = true;
+      } else if (arg == "--draw-backend" && i + 1 < rest.size()) {
+        const std::string& backend = rest[++i];
+
+        if (backend == "pipeline") {
+          drawBackend = DrawBackend::ePipeline;
+        } else if (backend == "shader-object") {
+          drawBackend = DrawBackend::eShaderObject;
+        } else {
+          throw std::runtime_error("Unknown draw backend: " + backend);
+        }
+
+        drawBackendSelected = true;
+      } else if (arg == "--shader-hot-reload") {
+        shaderHotReload = true;
+      } else if (arg == "--staging-per-upload") {
+        stagingPerUpload = true;
+      } else if (arg == "--headless") {
+        headless = true;
+      } else {
+        throw std::runtime_error("Unknown argument: " + arg);
+      }
+    }
+
+    if (framesInFlight < 1 || framesInFlight > MAX_FRAMES_IN_FLIGHT) {
+      throw std::runtime_error("--frames-in-flight must be between 1 and " +
+                               std::to_string(MAX_FRAMES_IN_FLIGHT));
+    }
   }
 
   void initializeWindow() {
+    TRACE_SCOPE("initializeWindow");
+
+    if (headless) {
+      // コンストラクタで初期化済みのビデオサブシステムをoffscreenドライバーで初期化し直す
+      SDL_QuitSubSystem(SDL_INIT_VIDEO);
+      SDL_SetHint(SDL_HINT_VIDEODRIVER, "offscreen");
+    }
+
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
       throw std::runtime_error(SDL_GetError());
     }
 
+    // SDL_VIDEODRIVER=offscreenで起動された場合もヘッドレスとして扱う
+    const char* videoDriver = SDL_GetCurrentVideoDriver();
+
+    if (videoDriver != nullptr && std::strcmp(videoDriver, "offscreen") == 0) {
+      headless = true;
+    }
+
+    // offscreenドライバーはVulkanをサポートしないので、ヘッドレス時はSDL_WINDOW_VULKANを指定しない
+    Uint32 windowFlags =
+        SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI;
+
+    if (!headless) {
+      windowFlags |= SDL_WINDOW_VULKAN;
+    }
+
     window = std::shared_ptr<SDL_Window>(
-        SDL_CreateWindow(
-            NAME, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT,
-            SDL_WINDOW_SHOWN | SDL_WINDOW_VULKAN | SDL_WINDOW_ALLOW_HIGHDPI),
+        SDL_CreateWindow(NAME, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                         WIDTH, HEIGHT, windowFlags),
         [](auto window) { SDL_DestroyWindow(window); });
 
     if (window == nullptr) {
@@ -89,6 +532,8 @@ class Application : public SDLApplication {
   }
 
   void initializeInstance() {
+    TRACE_SCOPE("initializeInstance");
+
     // *Infoと名付けられた構造体は、言わば関数への引数をまとめたもの
     // vk::ApplicationInfoは、アプリケーションの情報を指定する構造体
     vk::ApplicationInfo appInfo{
@@ -103,6 +548,30 @@ class Application : public SDLApplication {
         // 使用するAPIのバージョン
         /* apiVersion = */ VK_API_VERSION_1_0};
 
+    validationEnabled =
+        config.enableValidation(isLayerAvailable(VALIDATION_LAYER_NAME));
+    portabilityEnabled = config.enablePortability(
+        isExtensionAvailable(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME));
+    properties2Enabled = isExtensionAvailable(
+        VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+    externalMemoryCapabilitiesEnabled =
+        properties2Enabled &&
+        isExtensionAvailable(
+            VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME);
+
+    if (validationEnabled) {
+      // メッセージの出力はバックグラウンドスレッドで行う
+      logSink = std::make_shared<LogSink>(logRateLimit);
+
+      if (perfReportPath.has_value()) {
+        perfReport = std::make_shared<PerfReport>();
+      }
+    } else if (perfReportPath.has_value()) {
+      std::cout << Console::fgYellow << "# "
+                << "Validation is disabled; no performance report is written"
+                << Console::fgDefault << std::endl;
+    }
+
     vk::InstanceCreateFlags instanceFlags = getInstanceFlags();
     showInstanceFlags("Instance flags", instanceFlags);
 
@@ -118,253 +587,2484 @@ class Application : public SDLApplication {
     std::vector<const char*> layerNames = getRequiredLayers();
     showLayers("Required instance layers", layerNames);
 
-    // インスタンスの設定
-    vk::InstanceCreateInfo instanceInfo{
-        // インスタンスのフラグ
-        /* flags = */ instanceFlags,
-        // アプリケーションの情報
-        /* pApplicationInfo = */ &appInfo,
-        // 有効化するレイヤーを登録する
-        /* pEnabledLayerNames = */ layerNames,
-        // 有効化するエクステンションを登録する
-        /* pEnabledExtensionNames = */ extensionNames};
+    // インスタンスの設定
+    vk::InstanceCreateInfo instanceInfo{
+        // インスタンスのフラグ
+        /* flags = */ instanceFlags,
+        // アプリケーションの情報
+        /* pApplicationInfo = */ &appInfo,
+        // 有効化するレイヤーを登録する
+        /* pEnabledLayerNames = */ layerNames,
+        // 有効化するエクステンションを登録する
+        /* pEnabledExtensionNames = */ extensionNames};
+
+    // バリデーションレイヤーの出力をコールバックで受け取る為には、vk::DebugUtilsMessengerを作らなければならない
+    vk::DebugUtilsMessengerCreateInfoEXT messengerInfo{
+        /* flags = */ {},
+        /* messageSeverity = */
+        vk::DebugUtilsMessageSeverityFlagsEXT(config.messageSeverity),
+        /* messageType = */ vk::DebugUtilsMessageTypeFlagBitsEXT::eGeneral |
+            vk::DebugUtilsMessageTypeFlagBitsEXT::eValidation |
+            vk::DebugUtilsMessageTypeFlagBitsEXT::ePerformance,
+        /* pfnUserCallback = */ &messageCallBack,
+        /* pUserData = */ this};
+
+    // パフォーマンス警告はBest Practicesの検証を有効にした時に出力される
+    std::array<vk::ValidationFeatureEnableEXT, 1> enabledValidationFeatures{
+        vk::ValidationFeatureEnableEXT::eBestPractices};
+    vk::ValidationFeaturesEXT validationFeatures{
+        /* pEnabledValidationFeatures = */ enabledValidationFeatures,
+        /* pDisabledValidationFeatures = */ {}};
+
+    // エクステンションとレイヤーを登録するだけでは、インスタンス生成/削除時のバリデーションが行われない
+    // インスタンス生成/削除時のバリデーションを有効にするには、vk::InstanceCreateInfoのpNextにvk::DebugUtilsMessengerCreateInfoEXTへのポインターを与える必要がある
+    // Vulkan-Hppでは、vk::StructureChainによってpNextを設定する
+    vk::StructureChain<vk::InstanceCreateInfo,
+                       vk::DebugUtilsMessengerCreateInfoEXT,
+                       vk::ValidationFeaturesEXT>
+        instanceChain{instanceInfo, messengerInfo, validationFeatures};
+
+    if (!validationEnabled) {
+      // バリデーションを使用しない場合は、pNextからvk::DebugUtilsMessengerCreateInfoEXTを外す
+      instanceChain.unlink<vk::DebugUtilsMessengerCreateInfoEXT>();
+    }
+
+    if (!perfReport) {
+      instanceChain.unlink<vk::ValidationFeaturesEXT>();
+    }
+
+    // vkCreateInstance(pCreateInfo, pAllocator, pInstance)に相当
+    {
+      TRACE_SCOPE("vkCreateInstance");
+      instance = std::make_shared<vk::raii::Instance>(
+          context, instanceChain.get<vk::InstanceCreateInfo>());
+    }
+
+    std::cout << Console::fgGreen << "# "
+              << "vkCreateInstance() succeeded" << Console::fgDefault
+              << std::endl;
+
+    if (validationEnabled) {
+      // vkCreateDebugUtilsMessengerEXT(instance, pCreateInfo, pAllocator,
+      // pMessenger)に相当
+      // vk::DebugUtilsMessengerを作成する
+      debugMessenger = std::make_shared<vk::raii::DebugUtilsMessengerEXT>(
+          *instance, messengerInfo);
+    }
+  }
+
+  void initializeSurface() {
+    TRACE_SCOPE("initializeSurface");
+
+    if (headless) {
+      // VK_EXT_headless_surfaceによって、ウィンドウシステムを介さないサーフェイスを作成する
+      surface = std::make_shared<vk::raii::SurfaceKHR>(
+          *instance, vk::HeadlessSurfaceCreateInfoEXT{});
+
+      std::cout << Console::fgGreen << "# "
+                << "vkCreateHeadlessSurfaceEXT() succeeded"
+                << Console::fgDefault << std::endl;
+      return;
+    }
+
+    VkSurfaceKHR cSurface;
+    // ウィンドウの描画サーフェイスを作成する
+    SDL_bool sResult =
+        SDL_Vulkan_CreateSurface(window.get(), **instance, &cSurface);
+    surface = std::make_shared<vk::raii::SurfaceKHR>(*instance, cSurface);
+
+    if (sResult != SDL_TRUE) {
+      throw std::runtime_error("SDL_Vulkan_CreateSurface() failed");
+    } else {
+      std::cout << Console::fgGreen << "# "
+                << "SDL_Vulkan_CreateSurface() succeeded" << Console::fgDefault
+                << std::endl;
+    }
+  }
+
+  void initializeDevice() {
+    TRACE_SCOPE("initializeDevice");
+
+    vk::raii::PhysicalDevices devices(*instance);
+
+    // すべてのデバイスの情報を並列に取得し、評価する
+    std::vector<PhysicalDeviceInfo> infos =
+        PhysicalDeviceInfo::probeAll(devices, *surface);
+    DeviceScoringPolicy scoringPolicy =
+        defaultDeviceScoringPolicy(getDeviceRequirements());
+    std::vector<std::optional<int64_t>> scores;
+
+    for (auto&& info : infos) {
+      scores.push_back(scoringPolicy(info));
+    }
+
+    showPhysicalDevices("Available physical devices", infos, scores);
+
+    // 使用する物理デバイスを選択する
+    size_t selected = selectPhysicalDevice(scores);
+    physicalDevice =
+        std::make_shared<vk::raii::PhysicalDevice>(devices[selected]);
+    physicalDeviceInfo = std::make_shared<PhysicalDeviceInfo>(infos[selected]);
+    showPhysicalDevice("Selected physical device", *physicalDeviceInfo);
+    showExtensions("Available device extensions",
+                   physicalDeviceInfo->extensions);
+
+    showQueueFamilies("Queue families", physicalDeviceInfo->queueFamilies);
+
+    // 役割ごとに、使用するキューファミリーとキューを決める
+    // 専用の転送/コンピュートファミリーがあれば、描画と並行して処理できる
+    queueTopology = QueueTopology::plan(*physicalDeviceInfo, queuePriorities);
+    showQueueTopology("Queue topology", queueTopology);
+
+    graphicsQueueFamilyIndex = queueTopology[QueueRole::eGraphics].familyIndex;
+    presentQueueFamilyIndex = queueTopology[QueueRole::ePresent].familyIndex;
+
+    // vk::DeviceQueueCreateInfoには論理デバイスと共に作成するキューの情報を格納する
+    // キューファミリーごとに、作成するキューの数だけ優先度 (0から1、1の時に最高) を並べる
+    // 優先度が高いキューの命令が優先されて処理される場合がある
+    std::vector<vk::DeviceQueueCreateInfo> queueCreateInfos =
+        queueTopology.getQueueCreateInfos();
+
+    // ホストメモリーのインポートは、サポートしていれば有効化する
+    // 有効でなければ、ステージングリングを通したコピーで代用する
+    externalMemoryHostEnabled =
+        externalMemoryCapabilitiesEnabled &&
+        physicalDeviceInfo->hasExtension(
+            VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME) &&
+        physicalDeviceInfo->hasExtension(
+            VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+
+    // ホストからイメージへの直接のコピーは、エクステンションとフィーチャーの両方が必要となる
+    hostImageCopyEnabled =
+        properties2Enabled &&
+        physicalDeviceInfo->hasExtension(
+            VK_KHR_COPY_COMMANDS_2_EXTENSION_NAME) &&
+        physicalDeviceInfo->hasExtension(
+            VK_KHR_FORMAT_FEATURE_FLAGS_2_EXTENSION_NAME) &&
+        physicalDeviceInfo->hasExtension(
+            VK_EXT_HOST_IMAGE_COPY_EXTENSION_NAME) &&
+        physicalDevice
+            ->getFeatures2KHR<vk::PhysicalDeviceFeatures2,
+                              vk::PhysicalDeviceHostImageCopyFeaturesEXT>()
+            .get<vk::PhysicalDeviceHostImageCopyFeaturesEXT>()
+            .hostImageCopy;
+
+    // ヒープの予算と使用量の取得は、サポートしていれば有効化する
+    // 有効でなければ、ヒープの容量とアロケーターの使用量から見積もる
+    memoryBudgetEnabled =
+        properties2Enabled &&
+        physicalDeviceInfo->hasExtension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
+    // パイプラインの作成時にキャッシュにヒットしたかの取得は、サポートしていれば有効化する
+    pipelineCreationFeedbackEnabled = physicalDeviceInfo->hasExtension(
+        VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME);
+
+    // パイプラインライブラリーは、エクステンションとフィーチャーの両方が必要となる
+    graphicsPipelineLibraryEnabled =
+        properties2Enabled &&
+        physicalDeviceInfo->hasExtension(
+            VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME) &&
+        physicalDeviceInfo->hasExtension(
+            VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME) &&
+        physicalDevice
+            ->getFeatures2KHR<
+                vk::PhysicalDeviceFeatures2,
+                vk::PhysicalDeviceGraphicsPipelineLibraryFeaturesEXT>()
+            .get<vk::PhysicalDeviceGraphicsPipelineLibraryFeaturesEXT>()
+            .graphicsPipelineLibrary;
+
+    // シェーダーオブジェクトは、動的レンダリングのフィーチャーも必要となる
+    shaderObjectEnabled =
+        properties2Enabled &&
+        std::all_of(ShaderObjectRenderer::REQUIRED_EXTENSIONS.begin(),
+                    ShaderObjectRenderer::REQUIRED_EXTENSIONS.end(),
+                    [&](const char* name) {
+                      return physicalDeviceInfo->hasExtension(name);
+                    });
+
+    if (shaderObjectEnabled) {
+      auto features = physicalDevice->getFeatures2KHR<
+          vk::PhysicalDeviceFeatures2,
+          vk::PhysicalDeviceShaderObjectFeaturesEXT,
+          vk::PhysicalDeviceDynamicRenderingFeaturesKHR>();
+      shaderObjectEnabled =
+          features.get<vk::PhysicalDeviceShaderObjectFeaturesEXT>()
+              .shaderObject &&
+          features.get<vk::PhysicalDeviceDynamicRenderingFeaturesKHR>()
+              .dynamicRendering;
+    }
+
+    std::vector<const char*> deviceExtensionNames =
+        getRequiredDeviceExtensions(*physicalDeviceInfo);
+    showExtensions("Required device extensions", deviceExtensionNames);
+
+    // 評価時に要求したフィーチャーを有効化する
+    vk::PhysicalDeviceFeatures enabledFeatures =
+        getDeviceRequirements().features;
+
+    vk::DeviceCreateInfo deviceInfo{
+        /* flags = */ {},
+        // デバイスと同時に作成するキューの情報を登録する
+        /* pQueueCreateInfos = */ queueCreateInfos,
+        // enabledLayerCount, ppEnabledLayerNamesは非推奨であり無視される
+        /* ppEnabledLayerNames = */ nullptr,
+        // 有効化するデバイスエクステンションを登録する
+        /* ppEnabledExtensionNames = */ deviceExtensionNames,
+        // 有効化するデバイスフィーチャー
+        /* pEnabledFeatures = */ &enabledFeatures};
+
+    // 1.0のフィーチャーに含まれないものは、pNextにつなげて有効化する
+    vk::PhysicalDeviceHostImageCopyFeaturesEXT hostImageCopyFeatures{
+        /* hostImageCopy = */ VK_TRUE};
+    vk::PhysicalDeviceGraphicsPipelineLibraryFeaturesEXT
+        graphicsPipelineLibraryFeatures{
+            /* graphicsPipelineLibrary = */ VK_TRUE};
+    vk::PhysicalDeviceShaderObjectFeaturesEXT shaderObjectFeatures{
+        /* shaderObject = */ VK_TRUE};
+    vk::PhysicalDeviceDynamicRenderingFeaturesKHR dynamicRenderingFeatures{
+        /* dynamicRendering = */ VK_TRUE};
+
+    if (hostImageCopyEnabled) {
+      hostImageCopyFeatures.pNext = const_cast<void*>(deviceInfo.pNext);
+      deviceInfo.pNext = &hostImageCopyFeatures;
+    }
+
+    if (graphicsPipelineLibraryEnabled) {
+      graphicsPipelineLibraryFeatures.pNext =
+          const_cast<void*>(deviceInfo.pNext);
+      deviceInfo.pNext = &graphicsPipelineLibraryFeatures;
+    }
+
+    if (shaderObjectEnabled) {
+      shaderObjectFeatures.pNext = const_cast<void*>(deviceInfo.pNext);
+      dynamicRenderingFeatures.pNext = &shaderObjectFeatures;
+      deviceInfo.pNext = &dynamicRenderingFeatures;
+    }
+
+    // vkCreateDevice(physicalDevice, pCreateInfo, pAllocator, pDevice)に相当
+    // 論理デバイスを作成する
+    {
+      TRACE_SCOPE("vkCreateDevice");
+      device = std::make_shared<vk::raii::Device>(*physicalDevice, deviceInfo);
+    }
+
+    std::cout << Console::fgGreen << "# "
+              << "vkCreateDevice() succeeded" << Console::fgDefault
+              << std::endl;
+
+    // vkGetDeviceQueue(device, queueFamilyIndex, queueIndex, pQueue)に相当
+    // 作成したキューを取得する
+    // queueIndexはキューファミリー内のキューのインデックス
+    graphicsQueue = getQueue(QueueRole::eGraphics);
+    std::cout << "# "
+              << "Obtained graphics queue: " << **graphicsQueue << std::endl;
+
+    computeQueue = getQueue(QueueRole::eAsyncCompute);
+    std::cout << "# "
+              << "Obtained async-compute queue: " << **computeQueue
+              << std::endl;
+
+    transferQueue = getQueue(QueueRole::eTransfer);
+    std::cout << "# "
+              << "Obtained transfer queue: " << **transferQueue << std::endl;
+
+    presentQueue = getQueue(QueueRole::ePresent);
+    std::cout << "# "
+              << "Obtained present queue: " << **presentQueue << std::endl;
+
+    allocator = std::make_shared<MemoryAllocator>(device, *physicalDevice);
+
+    if (allocationTracePath.has_value()) {
+      allocator->recordTrace(*allocationTracePath);
+    }
+
+    showMemoryTypeTables("Memory type preferences", *allocator);
+
+    deletionQueue = std::make_shared<DeletionQueue>(allocator);
+    resourceRegistry =
+        std::make_shared<ResourceRegistry>(device, allocator, deletionQueue);
+
+    // 専用の転送ファミリーがあれば、そのキューでグラフィックスと並行して転送する
+    stagingRing = std::make_shared<StagingRing>(
+        device, allocator, transferQueue,
+        queueTopology[QueueRole::eTransfer].familyIndex,
+        physicalDeviceInfo->properties.limits, STAGING_RING_SIZE,
+        MAX_FRAMES_IN_FLIGHT);
+
+    // コピーしたバッファーは、転送とグラフィックスのキューから使う
+    std::vector<uint32_t> importQueueFamilyIndices{
+        queueTopology[QueueRole::eTransfer].familyIndex};
+
+    if (importQueueFamilyIndices[0] != *graphicsQueueFamilyIndex) {
+      importQueueFamilyIndices.push_back(*graphicsQueueFamilyIndex);
+    }
+
+    hostMemoryImporter = std::make_shared<HostMemoryImporter>(
+        device, *physicalDevice, allocator, stagingRing,
+        importQueueFamilyIndices, externalMemoryHostEnabled);
+    textureUploader = std::make_shared<TextureUploader>(
+        device, *physicalDevice, allocator, stagingRing,
+        importQueueFamilyIndices, hostImageCopyEnabled);
+
+    std::optional<vk::DeviceSize> budgetLimit;
+
+    if (memoryBudgetLimit.has_value()) {
+      budgetLimit = vk::DeviceSize{*memoryBudgetLimit} << 20;
+    }
+
+    // 追い出しのコピーは転送のキューで行う
+    residencyManager = std::make_shared<ResidencyManager>(
+        device, physicalDevice, allocator, deletionQueue, resourceRegistry,
+        transferQueue, queueTopology[QueueRole::eTransfer].familyIndex,
+        importQueueFamilyIndices, memoryBudgetEnabled, budgetLimit,
+        MAX_FRAMES_IN_FLIGHT);
+    defragmenter = std::make_shared<Defragmenter>(
+        device, allocator, resourceRegistry, transferQueue,
+        queueTopology[QueueRole::eTransfer].familyIndex,
+        importQueueFamilyIndices, defragBudget, MAX_FRAMES_IN_FLIGHT);
+
+    initializePipelineCache();
+    pipelineCompiler = std::make_shared<PipelineCompiler>(
+        device, pipelineCache, pipelineThreadCount);
+  }
+
+  // 保存先が指定されていれば、前回の実行で保存したキャッシュを読み込む
+  void initializePipelineCache() {
+    const vk::PhysicalDeviceProperties& properties =
+        physicalDeviceInfo->properties;
+
+    if (!pipelineCachePath.has_value()) {
+      pipelineCache = std::make_shared<PipelineCache>(
+          device, properties, pipelineCreationFeedbackEnabled);
+      return;
+    }
+
+    pipelineCache = PipelineCache::open(device, properties,
+                                        pipelineCreationFeedbackEnabled,
+                                        *pipelineCachePath);
+
+    if (pipelineCache->getRejectionReason().has_value()) {
+      std::cout << Console::fgYellow << "# "
+                << "Discarded pipeline cache " << *pipelineCachePath << ": "
+                << *pipelineCache->getRejectionReason() << Console::fgDefault
+                << std::endl;
+    } else {
+      std::cout << "# "
+                << "Loaded pipeline cache " << *pipelineCachePath << ": "
+                << pipelineCache->getStatistics().loadedBytes << " bytes"
+                << std::endl;
+    }
+  }
+
+  // 前回の実行で記録したパイプラインを、最初のフレームより前にワーカースレッドで作成する
+  // 作成したパイプラインは破棄するが、パイプラインキャッシュに残るので、
+  // 同じ記述で再び作成する時はキャッシュにヒットする
+  void initializePipelineManifest() {
+    TRACE_SCOPE("initializePipelineManifest");
+
+    const vk::PhysicalDeviceProperties& properties =
+        physicalDeviceInfo->properties;
+    std::shared_ptr<PipelineManifest> recorded;
+
+    try {
+      recorded = PipelineManifest::read(*pipelineManifestPath);
+    } catch (const std::runtime_error& e) {
+      std::cout << Console::fgYellow << "# "
+                << "Discarded pipeline manifest: " << e.what()
+                << Console::fgDefault << std::endl;
+    }
+
+    if (recorded) {
+      if (auto reason = recorded->validateDevice(properties)) {
+        std::cout << Console::fgYellow << "# "
+                  << "Discarded pipeline manifest " << *pipelineManifestPath
+                  << ": " << *reason << Console::fgDefault << std::endl;
+        recorded.reset();
+      }
+    }
+
+    pipelineManifest =
+        recorded ? recorded : std::make_shared<PipelineManifest>(properties);
+    pipelineCompiler->setRecordCallback(
+        [manifest = pipelineManifest](
+            const ComputePipelineDescription& description) {
+          manifest->record(description);
+        });
+
+    if (recorded) {
+      warmUpPipelines();
+    }
+  }
+
+  void warmUpPipelines() {
+    std::vector<ComputePipelineDescription> descriptions =
+        pipelineManifest->getComputePipelines();
+    PipelineCache::Statistics before = pipelineCache->getStatistics();
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<PipelineFuture> futures;
+
+    for (auto&& description : descriptions) {
+      futures.push_back(pipelineCompiler->submit(description));
+    }
+
+    waitForWarmUp("compute", futures, before, start);
+  }
+
+  // 記録したグラフィックスパイプラインのライブラリーを作成し、最適化したリンクまでを
+  // デモのライブラリーより前にワーカースレッドで行う
+  // デモと同じパイプラインレイアウトとレンダーパスで作成するので、デモの作成はキャッシュにヒットする
+  void warmUpGraphicsPipelines(const PipelineLibraryDemo& demo) {
+    std::vector<GraphicsPipelineDescription> descriptions =
+        pipelineManifest->getGraphicsPipelines();
+
+    if (descriptions.empty()) {
+      return;
+    }
+
+    PipelineCache::Statistics before = pipelineCache->getStatistics();
+    auto start = std::chrono::steady_clock::now();
+
+    // デモのライブラリーの統計に含めないよう、別に作る
+    auto library = std::make_shared<GraphicsPipelineLibrary>(
+        device, pipelineCache, pipelineCompiler, **demo.pipelineLayout,
+        **demo.renderPass);
+    std::vector<PipelineFuture> futures;
+
+    for (auto&& description : descriptions) {
+      // 別のフォーマットで記録したものは、デモのレンダーパスと互換でない
+      if (description.fragmentOutput.colorFormat != demo.format) {
+        continue;
+      }
+
+      futures.push_back(pipelineCompiler->submit(
+          [library, description] {
+            return library->createLinked(description);
+          },
+          **demo.pipelineLayout));
+    }
+
+    waitForWarmUp("graphics", futures, before, start);
+  }
+
+  void waitForWarmUp(const char* kind,
+                     const std::vector<PipelineFuture>& futures,
+                     const PipelineCache::Statistics& before,
+                     std::chrono::steady_clock::time_point start) {
+    size_t failedCount = 0;
+
+    for (auto&& future : futures) {
+      try {
+        future.get();
+      } catch (const vk::SystemError&) {
+        failedCount++;
+      }
+    }
+
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    PipelineCache::Statistics after = pipelineCache->getStatistics();
+
+    std::cout << "# "
+              << "Warmed up " << futures.size() << " " << kind
+              << " pipelines from " << *pipelineManifestPath << " in "
+              << elapsed.count() << " ms ("
+              << pipelineCompiler->getWorkerCount() << " workers, "
+              << after.hitCount - before.hitCount << " cache hits, "
+              << failedCount << " failed)" << std::endl;
+  }
+
+  // 役割に割り当てたキューを取得する
+  std::shared_ptr<vk::raii::Queue> getQueue(QueueRole role) {
+    const QueueAssignment& assignment = queueTopology[role];
+    return std::make_shared<vk::raii::Queue>(*device, assignment.familyIndex,
+                                             assignment.queueIndex);
+  }
+
+  void initializeSwapchain() {
+    TRACE_SCOPE("initializeSwapchain");
+
+    auto capabilities = physicalDevice->getSurfaceCapabilitiesKHR(**surface);
+    auto formats = physicalDevice->getSurfaceFormatsKHR(**surface);
+    auto presentModes = physicalDevice->getSurfacePresentModesKHR(**surface);
+
+    showSurfaceCapabilities("Surface capabilities", capabilities);
+    showSurfaceFormats("Surface formats", formats);
+    showSurfacePresentModes("Surface present modes", presentModes);
+
+    if (needsOwnershipTransfer()) {
+      presentCommandPool = std::make_shared<vk::raii::CommandPool>(
+          *device, vk::CommandPoolCreateInfo{
+                       /* flags = */ {},
+                       /* queueFamilyIndex = */ *presentQueueFamilyIndex});
+    }
+
+    createSwapchain();
+
+    std::cout << Console::fgGreen << "# "
+              << "vkCreateSwapchainKHR() succeeded" << Console::fgDefault
+              << std::endl;
+    std::cout << "# "
+              << "Swapchain images: " << swapchainImages.size() << std::endl;
+    std::cout << "# "
+              << "Swapchain sharing: "
+              << (*graphicsQueueFamilyIndex == *presentQueueFamilyIndex
+                      ? "exclusive (same queue family)"
+                  : needsOwnershipTransfer() ? "exclusive (ownership transfer)"
+                                             : "concurrent")
+              << std::endl;
+  }
+
+  // スワップチェーンイメージを排他的に使用し、グラフィックスからプレゼンテーションのキューファミリーへ所有権を移動するか
+  bool needsOwnershipTransfer() const {
+    return *graphicsQueueFamilyIndex != *presentQueueFamilyIndex &&
+           swapchainSharingMode == vk::SharingMode::eExclusive;
+  }
+
+  // スワップチェーンを作成する
+  // 既存のスワップチェーンがあれば、oldSwapchainとして渡して再作成する
+  void createSwapchain() {
+    TRACE_SCOPE("createSwapchain");
+
+    auto capabilities = physicalDevice->getSurfaceCapabilitiesKHR(**surface);
+    auto formats = physicalDevice->getSurfaceFormatsKHR(**surface);
+    auto presentModes = physicalDevice->getSurfacePresentModesKHR(**surface);
+
+    uint32_t imageCount = selectSwapchainImageCount(capabilities);
+    vk::SurfaceFormatKHR surfaceFormat = selectSwapchainSurfaceFormat(formats);
+    vk::PresentModeKHR presentMode = selectSwapchainPresentMode(presentModes);
+    vk::Extent2D imageExtent = selectSwapchainImageExtent(capabilities);
+    // 今のところパイプラインが無いので、vkCmdClearColorImage()で直接イメージに書き込む
+    vk::ImageUsageFlags imageUsage = vk::ImageUsageFlagBits::eColorAttachment |
+                                     vk::ImageUsageFlagBits::eTransferDst;
+
+    if ((capabilities.supportedUsageFlags & imageUsage) != imageUsage) {
+      throw std::runtime_error(
+          "Surface does not support VK_IMAGE_USAGE_TRANSFER_DST_BIT");
+    }
+
+    // キューファミリーが異なっても、eExclusiveであれば所有権の移動によって共有する
+    vk::SharingMode imageSharingMode = vk::SharingMode::eExclusive;
+    std::vector<uint32_t> queueFamilyIndices;
+
+    if (*graphicsQueueFamilyIndex != *presentQueueFamilyIndex &&
+        swapchainSharingMode == vk::SharingMode::eConcurrent) {
+      imageSharingMode = vk::SharingMode::eConcurrent;
+      queueFamilyIndices.push_back(*graphicsQueueFamilyIndex);
+      queueFamilyIndices.push_back(*presentQueueFamilyIndex);
+    }
+
+    vk::SwapchainCreateInfoKHR swapchainInfo{
+        /* flags = */ {},
+        /* surface = */ **surface,
+        /* minImageCount = */ imageCount,
+        /* imageFormat = */ surfaceFormat.format,
+        /* imageColorSpace = */ surfaceFormat.colorSpace,
+        /* imageExtent = */ imageExtent,
+        /* imageArrayLayers = */ 1,
+        /* imageUsage = */ imageUsage,
+        /* imageSharingMode = */ imageSharingMode,
+        /* queueFamilyIndices = */ queueFamilyIndices,
+        /* preTransform = */ capabilities.currentTransform,
+        /* compositeAlpha = */ vk::CompositeAlphaFlagBitsKHR::eOpaque,
+        /* presentMode = */ presentMode,
+        /* clipped = */ true,
+        // 古いスワップチェーンを渡すと、実装はそのリソースを再利用できる
+        // 渡したスワップチェーンはリタイア状態になり、以後イメージを取得できない
+        /* oldSwapchain = */ swapchain ? **swapchain : vk::SwapchainKHR{},
+    };
+
+    auto newSwapchain =
+        std::make_shared<vk::raii::SwapchainKHR>(*device, swapchainInfo);
+
+    if (swapchain) {
+      // vkDeviceWaitIdle()で待つ代わりに、古いスワップチェーンを破棄待ちのキューに入れる
+      // プレゼンテーションの完了はフェンスで観測できないので、新しいスワップチェーンでframesInFlight回サブミットし、それが完了するまで待つ
+      retiredSwapchains.push_back(
+          RetiredSwapchain{std::move(swapchain),
+                           std::move(renderFinishedSemaphores),
+                           std::move(presentReadySemaphores),
+                           std::move(ownershipAcquireCommandBuffers),
+                           std::move(ownershipAcquireFences),
+                           submitSerial + framesInFlight});
+    }
+
+    swapchain = std::move(newSwapchain);
+
+    swapchainImageFormat = surfaceFormat.format;
+    swapchainImageExtent = imageExtent;
+
+    // vkGetSwapchainImagesKHR(device, swapchain, pSwapchainImageCount,
+    // pSwapchainImages)に相当
+    swapchainImages.clear();
+
+    for (auto&& image : swapchain->getImages()) {
+      swapchainImages.push_back(vk::Image(image));
+    }
+
+    renderFinishedSemaphores.clear();
+
+    for (size_t i = 0; i < swapchainImages.size(); i++) {
+      renderFinishedSemaphores.emplace_back(*device,
+                                            vk::SemaphoreCreateInfo{});
+    }
+
+    presentReadySemaphores.clear();
+    ownershipAcquireCommandBuffers.clear();
+    ownershipAcquireFences.clear();
+
+    if (needsOwnershipTransfer()) {
+      vk::CommandBufferAllocateInfo allocateInfo{
+          /* commandPool = */ **presentCommandPool,
+          /* level = */ vk::CommandBufferLevel::ePrimary,
+          /* commandBufferCount = */
+          static_cast<uint32_t>(swapchainImages.size())};
+      vk::raii::CommandBuffers commandBuffers(*device, allocateInfo);
+
+      for (size_t i = 0; i < swapchainImages.size(); i++) {
+        presentReadySemaphores.emplace_back(*device,
+                                            vk::SemaphoreCreateInfo{});
+        recordOwnershipAcquire(commandBuffers[i], swapchainImages[i]);
+        ownershipAcquireCommandBuffers.push_back(std::move(commandBuffers[i]));
+        ownershipAcquireFences.emplace_back(
+            *device, vk::FenceCreateInfo{vk::FenceCreateFlagBits::eSignaled});
+      }
+    }
+
+    imagesInFlight.assign(swapchainImages.size(), vk::Fence{});
+    swapchainDirty = false;
+  }
+
+  // 描画可能なサイズであればスワップチェーンを再作成する
+  bool recreateSwapchain() {
+    TRACE_SCOPE("recreateSwapchain");
+
+    int width, height;
+    getDrawableSize(width, height);
+
+    // 最小化中などでサイズが0の場合は作成できないので、後で再試行する
+    if (width == 0 || height == 0) {
+      return false;
+    }
+
+    createSwapchain();
+    return true;
+  }
+
+  // 完了したサブミットより前にリタイアしたスワップチェーンを破棄する
+  void collectRetiredSwapchains() {
+    while (!retiredSwapchains.empty() &&
+           retiredSwapchains.front().retireSerial <= completedSerial) {
+      // 所有権を受け取るサブミットが実行中であれば、次のフレームで再確認する
+      for (auto&& fence : retiredSwapchains.front().ownershipAcquireFences) {
+        if (fence.getStatus() != vk::Result::eSuccess) {
+          return;
+        }
+      }
+
+      retiredSwapchains.pop_front();
+    }
+  }
+
+  void initializeFrames() {
+    TRACE_SCOPE("initializeFrames");
+
+    // コマンドバッファーはフレームごとにリセットして再記録する
+    vk::CommandPoolCreateInfo poolInfo{
+        /* flags = */ vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+        /* queueFamilyIndex = */ *graphicsQueueFamilyIndex};
+    commandPool = std::make_shared<vk::raii::CommandPool>(*device, poolInfo);
+
+    vk::CommandBufferAllocateInfo allocateInfo{
+        /* commandPool = */ **commandPool,
+        /* level = */ vk::CommandBufferLevel::ePrimary,
+        /* commandBufferCount = */ framesInFlight};
+    vk::raii::CommandBuffers commandBuffers(*device, allocateInfo);
+
+    frames.clear();
+
+    for (uint32_t i = 0; i < framesInFlight; i++) {
+      Frame frame;
+      frame.commandBuffer = std::move(commandBuffers[i]);
+      frame.imageAvailableSemaphore =
+          vk::raii::Semaphore(*device, vk::SemaphoreCreateInfo{});
+      // 最初のフレームで待たないように、シグナル状態で作成する
+      frame.inFlightFence = vk::raii::Fence(
+          *device, vk::FenceCreateInfo{vk::FenceCreateFlagBits::eSignaled});
+      frames.push_back(std::move(frame));
+    }
+
+    std::cout << "# "
+              << "Frames in flight: " << framesInFlight << std::endl;
+  }
+
+  void initializeStagingBenchmark() {
+    TRACE_SCOPE("initializeStagingBenchmark");
+
+    uint32_t transferFamilyIndex =
+        queueTopology[QueueRole::eTransfer].familyIndex;
+
+    // 転送とグラフィックスのキューファミリーが異なる場合は、両方から使えるようにする
+    std::vector<uint32_t> queueFamilyIndices{transferFamilyIndex};
+
+    if (transferFamilyIndex != *graphicsQueueFamilyIndex) {
+      queueFamilyIndices.push_back(*graphicsQueueFamilyIndex);
+    }
+
+    vk::SharingMode sharingMode = queueFamilyIndices.size() > 1
+                                      ? vk::SharingMode::eConcurrent
+                                      : vk::SharingMode::eExclusive;
+
+    stagingTarget = std::make_shared<StagingTarget>();
+    stagingTarget->buffer = resourceRegistry->createBuffer(
+        vk::BufferCreateInfo{
+            /* flags = */ {},
+            /* size = */ STAGING_TARGET_BUFFER_SIZE,
+            /* usage = */ vk::BufferUsageFlagBits::eTransferDst |
+                vk::BufferUsageFlagBits::eVertexBuffer,
+            /* sharingMode = */ sharingMode,
+            /* queueFamilyIndices = */ queueFamilyIndices},
+        MemoryUsage::eGpuOnly);
+    stagingTarget->image = resourceRegistry->createImage(
+        vk::ImageCreateInfo{
+            /* flags = */ {},
+            /* imageType = */ vk::ImageType::e2D,
+            /* format = */ vk::Format::eR8G8B8A8Unorm,
+            /* extent = */
+            vk::Extent3D{STAGING_TARGET_IMAGE_SIZE, STAGING_TARGET_IMAGE_SIZE,
+                         1},
+            /* mipLevels = */ 1,
+            /* arrayLayers = */ 1,
+            /* samples = */ vk::SampleCountFlagBits::e1,
+            /* tiling = */ vk::ImageTiling::eOptimal,
+            /* usage = */ vk::ImageUsageFlagBits::eTransferDst |
+                vk::ImageUsageFlagBits::eSampled,
+            /* sharingMode = */ sharingMode,
+            /* queueFamilyIndices = */ queueFamilyIndices},
+        MemoryUsage::eGpuOnly);
+
+    // 最大のアップロードのサイズ分の乱数を用意しておく
+    stagingTarget->data.resize(16 << 10);
+
+    for (auto&& byte : stagingTarget->data) {
+      byte = static_cast<uint8_t>(stagingTarget->random());
+    }
+
+    // イメージへのコピーのために、転送のキューでレイアウトを移行しておく
+    vk::raii::CommandPool pool(
+        *device, vk::CommandPoolCreateInfo{
+                     vk::CommandPoolCreateFlagBits::eTransient,
+                     transferFamilyIndex});
+    vk::raii::CommandBuffers commandBuffers(
+        *device, vk::CommandBufferAllocateInfo{
+                     *pool, vk::CommandBufferLevel::ePrimary, 1});
+    vk::raii::CommandBuffer& commandBuffer = commandBuffers[0];
+
+    commandBuffer.begin(vk::CommandBufferBeginInfo{
+        vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+
+    vk::ImageMemoryBarrier toTransferDst{
+        /* srcAccessMask = */ {},
+        /* dstAccessMask = */ vk::AccessFlagBits::eTransferWrite,
+        /* oldLayout = */ vk::ImageLayout::eUndefined,
+        /* newLayout = */ vk::ImageLayout::eTransferDstOptimal,
+        /* srcQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+        /* dstQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+        /* image = */ resourceRegistry->getImage(stagingTarget->image),
+        /* subresourceRange = */
+        vk::ImageSubresourceRange{
+            /* aspectMask = */ vk::ImageAspectFlagBits::eColor,
+            /* baseMipLevel = */ 0,
+            /* levelCount = */ 1,
+            /* baseArrayLayer = */ 0,
+            /* layerCount = */ 1}};
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe,
+                                  vk::PipelineStageFlagBits::eTransfer, {},
+                                  nullptr, nullptr, toTransferDst);
+    commandBuffer.end();
+
+    vk::SubmitInfo submitInfo;
+    submitInfo.setCommandBuffers(*commandBuffer);
+    transferQueue->submit(submitInfo);
+    transferQueue->waitIdle();
+
+    std::cout << "# "
+              << "Staging benchmark: " << *stagingBenchmarkUploads
+              << " uploads/frame, "
+              << (stagingPerUpload ? "one submit per upload"
+                                   : "one submit per frame")
+              << ", transfer family " << transferFamilyIndex
+              << (queueTopology[QueueRole::eTransfer].dedicatedFamily
+                      ? " (dedicated)"
+                      : "")
+              << std::endl;
+  }
+
+  // 同じデータをインポートした場合とコピーした場合で、バッファーを使えるようになるまでの時間を比べる
+  void runImportBenchmark() {
+    TRACE_SCOPE("runImportBenchmark");
+
+    vk::DeviceSize size = vk::DeviceSize{*importBenchmarkSize} << 20;
+    // インポートできない場合も、ページ境界に揃える
+    vk::DeviceSize alignment = std::max<vk::DeviceSize>(
+        hostMemoryImporter->getImportAlignment(), 4096);
+
+    // mmapしたファイルの代わりに、アライメントを揃えた領域を用意する
+    std::vector<uint8_t> storage(size + alignment);
+    uint8_t* data = storage.data() +
+                    (alignment - reinterpret_cast<uintptr_t>(storage.data()) %
+                                     alignment) %
+                        alignment;
+
+    for (vk::DeviceSize i = 0; i < size; i++) {
+      data[i] = static_cast<uint8_t>(i * 7);
+    }
+
+    std::cout << "# "
+              << "Host memory import benchmark: " << *importBenchmarkSize
+              << " MiB, alignment " << hostMemoryImporter->getImportAlignment()
+              << std::endl;
+
+    auto measure = [&](const char* name, auto&& create) {
+      auto start = std::chrono::steady_clock::now();
+      HostBuffer buffer = create();
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      bool imported = buffer.importedMemory != nullptr;
+      hostMemoryImporter->destroyBuffer(buffer);
+
+      std::cout << "| " << name << ": " << elapsed.count() * 1000.0 << " ms ("
+                << size / elapsed.count() / 1e6 << " MB/s, "
+                << (imported ? "imported" : "copied") << ")" << std::endl;
+    };
+
+    vk::BufferUsageFlags usage = vk::BufferUsageFlagBits::eStorageBuffer;
+
+    if (hostMemoryImporter->isImportSupported()) {
+      measure("Import", [&] {
+        return hostMemoryImporter->createBuffer(data, size, usage);
+      });
+    } else {
+      std::cout << Console::fgYellow << "# "
+                << VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME
+                << " is not available; only the copy is measured"
+                << Console::fgDefault << std::endl;
+    }
+
+    measure("Copy", [&] {
+      return hostMemoryImporter->copyBuffer(data, size, usage);
+    });
+  }
+
+  // ホストからの直接のコピーとステージングリングを通したコピーで、アップロードの時間を比べる
+  void runTextureBenchmark() {
+    TRACE_SCOPE("runTextureBenchmark");
+
+    struct Case {
+      const char* name;
+      uint32_t count;
+      uint32_t size;
+    };
+
+    std::array<Case, 2> cases{Case{"Small", 1024, 64},
+                              Case{"Large", 4, 2048}};
+
+    // すべてのテクスチャーで同じテクセルを使う
+    std::vector<uint8_t> texels(2048 * 2048 * TextureUploader::TEXEL_SIZE);
+
+    for (size_t i = 0; i < texels.size(); i++) {
+      texels[i] = static_cast<uint8_t>(i * 7);
+    }
+
+    std::cout << "# "
+              << "Texture upload benchmark" << std::endl;
+
+    if (!textureUploader->isHostCopySupported()) {
+      std::cout << Console::fgYellow << "# "
+                << VK_EXT_HOST_IMAGE_COPY_EXTENSION_NAME
+                << " is not available; only the staged path is measured"
+                << Console::fgDefault << std::endl;
+    }
+
+    for (auto&& benchmarkCase : cases) {
+      std::vector<TextureSource> sources(
+          benchmarkCase.count,
+          TextureSource{benchmarkCase.size, benchmarkCase.size, texels.data()});
+      double bytes = static_cast<double>(benchmarkCase.count) *
+                     benchmarkCase.size * benchmarkCase.size *
+                     TextureUploader::TEXEL_SIZE;
+
+      for (bool useHostCopy : {true, false}) {
+        if (useHostCopy && !textureUploader->isHostCopySupported()) {
+          continue;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<Texture> textures =
+            textureUploader->upload(sources, useHostCopy);
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        textureUploader->destroy(textures);
+
+        std::cout << "| " << benchmarkCase.name << " (" << benchmarkCase.count
+                  << " x " << benchmarkCase.size << "x" << benchmarkCase.size
+                  << "), " << (useHostCopy ? "host copy" : "staged") << ": "
+                  << elapsed.count() * 1000.0 << " ms ("
+                  << bytes / elapsed.count() / 1e6 << " MB/s)" << std::endl;
+      }
+    }
+  }
+
+  // 特殊化定数だけが異なるコンピュートパイプラインを作成し、キャッシュの有無で時間を比べる
+  // 空のキャッシュ (コールド) と、そのデータで初期化したキャッシュ (ウォーム) で作成した後、
+  // 起動時に読み込んだキャッシュで作成する (2回目以降の実行では、前回のデータでウォームになる)
+  // lavapipeでは、MESA_SHADER_CACHE_DISABLE=trueでドライバー自身のキャッシュを無効にして比べる
+  void runPipelineBenchmark() {
+    TRACE_SCOPE("runPipelineBenchmark");
+
+    // ワークグループのサイズが異なれば、異なるパイプラインになる
+    const vk::PhysicalDeviceLimits& limits =
+        physicalDeviceInfo->properties.limits;
+    uint32_t count =
+        std::min({*pipelineBenchmarkCount, limits.maxComputeWorkGroupSize[0],
+                  limits.maxComputeWorkGroupInvocations});
+
+    std::span<const uint32_t> code =
+        BuiltinShaders::get("empty.comp", BuiltinShaders::EMPTY_COMPUTE);
+    vk::raii::ShaderModule shaderModule(
+        *device, vk::ShaderModuleCreateInfo{/* flags = */ {},
+                                            /* codeSize = */ code.size_bytes(),
+                                            /* pCode = */ code.data()});
+    vk::raii::PipelineLayout pipelineLayout(*device,
+                                            vk::PipelineLayoutCreateInfo{});
+
+    std::cout << "# "
+              << "Pipeline cache benchmark: " << count << " compute pipelines"
+              << std::endl;
+
+    auto measure = [&](const char* name, PipelineCache& cache) {
+      PipelineCache::Statistics before = cache.getStatistics();
+      auto start = std::chrono::steady_clock::now();
+
+      for (uint32_t i = 0; i < count; i++) {
+        uint32_t localSizeX = i + 1;
+        vk::SpecializationMapEntry entry{/* constantID = */ 0,
+                                         /* offset = */ 0,
+                                         /* size = */ sizeof(localSizeX)};
+        vk::SpecializationInfo specialization{
+            /* mapEntryCount = */ 1, /* pMapEntries = */ &entry,
+            /* dataSize = */ sizeof(localSizeX), /* pData = */ &localSizeX};
+        vk::PipelineShaderStageCreateInfo stage{
+            /* flags = */ {},
+            /* stage = */ vk::ShaderStageFlagBits::eCompute,
+            /* module = */ *shaderModule,
+            /* pName = */ "main",
+            /* pSpecializationInfo = */ &specialization};
+
+        // 作成時間だけを計測するので、すぐに破棄する
+        cache.createComputePipeline(vk::ComputePipelineCreateInfo{
+            /* flags = */ {}, /* stage = */ stage,
+            /* layout = */ *pipelineLayout});
+      }
+
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      PipelineCache::Statistics after = cache.getStatistics();
+
+      std::cout << "| " << name << ": " << elapsed.count() << " ms ("
+                << elapsed.count() / count << " ms/pipeline";
+
+      if (cache.isCreationFeedbackEnabled()) {
+        std::cout << ", " << after.hitCount - before.hitCount << " / "
+                  << after.feedbackCount - before.feedbackCount << " hits";
+      }
+
+      std::cout << ")" << std::endl;
+    };
+
+    PipelineCache cold(device, physicalDeviceInfo->properties,
+                       pipelineCreationFeedbackEnabled);
+    measure("Cold", cold);
+
+    PipelineCache warm(device, physicalDeviceInfo->properties,
+                       pipelineCreationFeedbackEnabled, cold.getData());
+    measure("Warm", warm);
+
+    measure(pipelineCachePath.has_value() ? "Loaded from disk" : "Device cache",
+            *pipelineCache);
+  }
+
+  // 4回に1回はイメージのタイル、それ以外はバッファーの小さな範囲をアップロードする
+  void uploadStagingBenchmark() {
+    TRACE_SCOPE("uploadStagingBenchmark");
+
+    std::mt19937& random = stagingTarget->random;
+    const uint8_t* data = stagingTarget->data.data();
+    constexpr uint32_t tilesPerRow =
+        STAGING_TARGET_IMAGE_SIZE / STAGING_TILE_SIZE;
+
+    for (uint32_t i = 0; i < *stagingBenchmarkUploads; i++) {
+      if (i % 4 == 3) {
+        uint32_t tile = random() % (tilesPerRow * tilesPerRow);
+        vk::BufferImageCopy region{
+            /* bufferOffset = */ 0,
+            /* bufferRowLength = */ 0,
+            /* bufferImageHeight = */ 0,
+            /* imageSubresource = */
+            vk::ImageSubresourceLayers{vk::ImageAspectFlagBits::eColor, 0, 0,
+                                       1},
+            /* imageOffset = */
+            vk::Offset3D{
+                static_cast<int32_t>(tile % tilesPerRow * STAGING_TILE_SIZE),
+                static_cast<int32_t>(tile / tilesPerRow * STAGING_TILE_SIZE),
+                0},
+            /* imageExtent = */
+            vk::Extent3D{STAGING_TILE_SIZE, STAGING_TILE_SIZE, 1}};
+        stagingRing->uploadImage(
+            resourceRegistry->getImage(stagingTarget->image),
+            vk::ImageLayout::eTransferDstOptimal, region, 4, data,
+            STAGING_TILE_SIZE * STAGING_TILE_SIZE * 4);
+      } else {
+        // 64 Bから16 KiBまで
+        vk::DeviceSize size = vk::DeviceSize{64} << (random() % 9);
+        vk::DeviceSize offset = random() % (STAGING_TARGET_BUFFER_SIZE - size);
+        offset &= ~vk::DeviceSize{3};
+        stagingRing->uploadBuffer(
+            resourceRegistry->getBuffer(stagingTarget->buffer), offset, data,
+            size);
+      }
+
+      if (stagingPerUpload) {
+        stagingRing->flush();
+      }
+    }
+
+    stagingRing->flush();
+  }
+
+  void showStagingStatistics(const char* message, double seconds) {
+    const StagingRing::Statistics& stats = stagingRing->getStatistics();
+    double frames = static_cast<double>(std::max<uint64_t>(frameCount, 1));
+
+    std::cout << "# " << message << ":" << std::endl;
+    std::cout << "| Throughput: " << stats.uploadBytes / seconds / 1e6
+              << " MB/s" << std::endl;
+    std::cout << "| Uploads/frame: " << stats.uploadCount / frames
+              << std::endl;
+    std::cout << "| Submits/frame: " << stats.submitCount / frames
+              << std::endl;
+    std::cout << "| Copy commands/frame: " << stats.copyCommandCount / frames
+              << std::endl;
+    std::cout << "| Overlap barriers/frame: "
+              << stats.overlapBarrierCount / frames << std::endl;
+    std::cout << "| Stalls: " << stats.stallCount << std::endl;
+  }
+
+  // ワークグループのサイズだけが異なるコンピュートパイプラインの作成を依頼する
+  void initializeCompileDemo() {
+    TRACE_SCOPE("initializeCompileDemo");
+
+    // 描画のコマンドバッファーに記録するので、グラフィックスのファミリーでディスパッチできること
+    if (!(physicalDeviceInfo->queueFamilies[*graphicsQueueFamilyIndex]
+              .queueFlags &
+          vk::QueueFlagBits::eCompute)) {
+      throw std::runtime_error(
+          "--compile-demo requires compute support on the graphics queue");
+    }
+
+    const vk::PhysicalDeviceLimits& limits =
+        physicalDeviceInfo->properties.limits;
+    uint32_t count =
+        std::min({*compileDemoCount, limits.maxComputeWorkGroupSize[0],
+                  limits.maxComputeWorkGroupInvocations});
+
+    ComputePipelineDescription description{
+        /* code = */
+        BuiltinShaders::get("empty.comp", BuiltinShaders::EMPTY_COMPUTE),
+        /* entryPoint = */ "main",
+        /* specializationConstants = */ {1},
+        /* pushConstantSize = */ 0,
+        /* shaderName = */ "empty.comp"};
+
+    // 代わりのパイプラインだけは、作成が終わるまで待つ
+    compileDemoFallback = pipelineCompiler->submit(description).get();
+
+    for (uint32_t i = 0; i < count; i++) {
+      description.specializationConstants = {i + 1};
+      compileDemoPipelines.push_back(pipelineCompiler->submit(description));
+    }
+
+    // 別の利用者が同じ記述を依頼した場合を模して、もう一度依頼する
+    // 作成中のものは新たに作成せず、同じfutureが返る
+    for (uint32_t i = 0; i < count; i++) {
+      description.specializationConstants = {i + 1};
+      pipelineCompiler->submit(description);
+    }
+
+    std::cout << "# "
+              << "Submitted " << count << " pipelines to "
+              << pipelineCompiler->getWorkerCount() << " workers" << std::endl;
+  }
+
+  // 作成が終わっていなければ、待たずに代わりのパイプラインを使う
+  void dispatchCompileDemo(vk::raii::CommandBuffer& commandBuffer) {
+    const PipelineFuture& future =
+        compileDemoPipelines[frameCount % compileDemoPipelines.size()];
+    vk::Pipeline pipeline = future.getOr(**compileDemoFallback);
+
+    if (pipeline == **compileDemoFallback) {
+      compileDemoFallbackCount++;
+    }
+
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline);
+    commandBuffer.dispatch(1, 1, 1);
+  }
+
+  // 頂点シェーダーの縮小率、フラグメントシェーダーの色、ブレンドの有無の組み合わせ (マテリアル) を描画する
+  // スワップチェーンイメージはクリアしかしていないので、オフスクリーンのイメージに描画する
+  // 描画の方法は使えるものから選び、両方使える場合は描画のCPUの時間を比べる
+  void initializeDrawDemo() {
+    TRACE_SCOPE("initializeDrawDemo");
+
+    if (libraryDemo && !graphicsPipelineLibraryEnabled) {
+      std::cout << Console::fgYellow << "# "
+                << VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME
+                << " is not available; --pipeline-library-demo is ignored"
+                << Console::fgDefault << std::endl;
+    }
+
+    if (drawBackend == DrawBackend::eShaderObject && !shaderObjectEnabled) {
+      std::cout << Console::fgYellow << "# "
+                << VK_EXT_SHADER_OBJECT_EXTENSION_NAME
+                << " is not available; drawing with pipelines"
+                << Console::fgDefault << std::endl;
+      drawBackend = DrawBackend::ePipeline;
+    }
+
+    if (drawBackend == DrawBackend::ePipeline &&
+        !graphicsPipelineLibraryEnabled) {
+      if (!shaderObjectEnabled) {
+        std::cout << Console::fgYellow << "# "
+                  << "No draw backend is available; the draw demo is skipped"
+                  << Console::fgDefault << std::endl;
+        return;
+      }
+
+      std::cout << Console::fgYellow << "# "
+                << VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME
+                << " is not available; drawing with shader objects"
+                << Console::fgDefault << std::endl;
+      drawBackend = DrawBackend::eShaderObject;
+    }
+
+    auto demo = std::make_shared<PipelineLibraryDemo>();
+    initializeDemoTarget(*demo);
+
+    // 浮動小数点数の特殊化定数は、ビット列をそのまま渡す
+    for (float scale : {1.0f, 0.5f}) {
+      demo->preRasterizations.push_back(PreRasterizationState{
+          /* code = */
+          BuiltinShaders::get("fullscreen.vert",
+                              BuiltinShaders::FULLSCREEN_VERTEX),
+          /* specializationConstants = */ {std::bit_cast<uint32_t>(scale)},
+          /* cullMode = */ vk::CullModeFlagBits::eNone,
+          /* shaderName = */ "fullscreen.vert"});
+    }
+
+    for (auto&& color : std::vector<std::array<float, 3>>{
+             {1.0f, 0.0f, 0.0f},
+             {0.0f, 1.0f, 0.0f},
+             {0.0f, 0.0f, 1.0f},
+             {1.0f, 1.0f, 1.0f}}) {
+      demo->fragmentShaders.push_back(FragmentShaderState{
+          /* code = */
+          BuiltinShaders::get("solid.frag.hlsl",
+                              BuiltinShaders::SOLID_FRAGMENT),
+          /* specializationConstants = */
+          {std::bit_cast<uint32_t>(color[0]), std::bit_cast<uint32_t>(color[1]),
+           std::bit_cast<uint32_t>(color[2])},
+          /* shaderName = */ "solid.frag.hlsl"});
+    }
+
+    demo->fragmentOutputs = {
+        FragmentOutputState{/* blendEnabled = */ false,
+                            /* colorFormat = */ demo->format},
+        FragmentOutputState{/* blendEnabled = */ true,
+                            /* colorFormat = */ demo->format}};
+
+    for (size_t i = 0; i < demo->preRasterizations.size(); i++) {
+      for (size_t j = 0; j < demo->fragmentShaders.size(); j++) {
+        for (size_t k = 0; k < demo->fragmentOutputs.size(); k++) {
+          demo->materials.push_back(PipelineLibraryDemo::Material{
+              /* preRasterization = */ i,
+              /* fragmentShader = */ j,
+              /* fragmentOutput = */ k});
+        }
+      }
+    }
+
+    if (graphicsPipelineLibraryEnabled) {
+      initializeDemoPipelines(*demo);
+    }
+
+    if (shaderObjectEnabled) {
+      initializeDemoShaderObjects(*demo);
+    }
+
+    pipelineLibraryDemo = std::move(demo);
+
+    if (graphicsPipelineLibraryEnabled && shaderObjectEnabled) {
+      runDrawBenchmark();
+    }
+
+    std::cout << "# "
+              << "Drawing with "
+              << (drawBackend == DrawBackend::eShaderObject ? "shader objects"
+                                                            : "pipelines")
+              << std::endl;
+  }
+
+  void initializeDemoTarget(PipelineLibraryDemo& demo) {
+    demo.extent = vk::Extent2D{256, 256};
+    demo.image = resourceRegistry->createImage(
+        vk::ImageCreateInfo{
+            /* flags = */ {},
+            /* imageType = */ vk::ImageType::e2D,
+            /* format = */ demo.format,
+            /* extent = */
+            vk::Extent3D{demo.extent.width, demo.extent.height, 1},
+            /* mipLevels = */ 1,
+            /* arrayLayers = */ 1,
+            /* samples = */ vk::SampleCountFlagBits::e1,
+            /* tiling = */ vk::ImageTiling::eOptimal,
+            /* usage = */ vk::ImageUsageFlagBits::eColorAttachment},
+        MemoryUsage::eGpuOnly);
+    demo.imageView = std::make_shared<vk::raii::ImageView>(
+        *device, vk::ImageViewCreateInfo{
+                     /* flags = */ {},
+                     /* image = */ resourceRegistry->getImage(demo.image),
+                     /* viewType = */ vk::ImageViewType::e2D,
+                     /* format = */ demo.format,
+                     /* components = */ {},
+                     /* subresourceRange = */
+                     vk::ImageSubresourceRange{
+                         /* aspectMask = */ vk::ImageAspectFlagBits::eColor,
+                         /* baseMipLevel = */ 0,
+                         /* levelCount = */ 1,
+                         /* baseArrayLayer = */ 0,
+                         /* layerCount = */ 1}});
+
+    // 毎フレームクリアするので、前の内容は不要
+    vk::AttachmentDescription attachment{
+        /* flags = */ {},
+        /* format = */ demo.format,
+        /* samples = */ vk::SampleCountFlagBits::e1,
+        /* loadOp = */ vk::AttachmentLoadOp::eClear,
+        /* storeOp = */ vk::AttachmentStoreOp::eStore,
+        /* stencilLoadOp = */ vk::AttachmentLoadOp::eDontCare,
+        /* stencilStoreOp = */ vk::AttachmentStoreOp::eDontCare,
+        /* initialLayout = */ vk::ImageLayout::eUndefined,
+        /* finalLayout = */ vk::ImageLayout::eColorAttachmentOptimal};
+    vk::AttachmentReference colorReference{
+        /* attachment = */ 0,
+        /* layout = */ vk::ImageLayout::eColorAttachmentOptimal};
+    vk::SubpassDescription subpass{
+        /* flags = */ {},
+        /* pipelineBindPoint = */ vk::PipelineBindPoint::eGraphics,
+        /* inputAttachments = */ {},
+        /* colorAttachments = */ colorReference};
+    // 前のフレームの書き込みが終わってから、レイアウトの遷移とクリアを行う
+    vk::SubpassDependency dependency{
+        /* srcSubpass = */ VK_SUBPASS_EXTERNAL,
+        /* dstSubpass = */ 0,
+        /* srcStageMask = */ vk::PipelineStageFlagBits::eColorAttachmentOutput,
+        /* dstStageMask = */ vk::PipelineStageFlagBits::eColorAttachmentOutput,
+        /* srcAccessMask = */ vk::AccessFlagBits::eColorAttachmentWrite,
+        /* dstAccessMask = */ vk::AccessFlagBits::eColorAttachmentWrite};
+    demo.renderPass = std::make_shared<vk::raii::RenderPass>(
+        *device, vk::RenderPassCreateInfo{/* flags = */ {},
+                                          /* attachments = */ attachment,
+                                          /* subpasses = */ subpass,
+                                          /* dependencies = */ dependency});
+    demo.framebuffer = std::make_shared<vk::raii::Framebuffer>(
+        *device, vk::FramebufferCreateInfo{
+                     /* flags = */ {},
+                     /* renderPass = */ **demo.renderPass,
+                     /* attachments = */ **demo.imageView,
+                     /* width = */ demo.extent.width,
+                     /* height = */ demo.extent.height,
+                     /* layers = */ 1});
+    demo.pipelineLayout = std::make_shared<vk::raii::PipelineLayout>(
+        *device, vk::PipelineLayoutCreateInfo{});
+  }
+
+  // 部分ごとにライブラリーを作成してマテリアルごとにリンクし、一括での作成と時間を比べる
+  void initializeDemoPipelines(PipelineLibraryDemo& demo) {
+    demo.library = std::make_shared<GraphicsPipelineLibrary>(
+        device, pipelineCache, pipelineCompiler, **demo.pipelineLayout,
+        **demo.renderPass);
+
+    if (pipelineManifest) {
+      demo.library->setRecordCallback(
+          [manifest = pipelineManifest](
+              const GraphicsPipelineDescription& description) {
+            manifest->record(description);
+          });
+      warmUpGraphicsPipelines(demo);
+    }
+
+    demo.vertexInputLibrary = demo.library->createLibrary(demo.vertexInput);
+
+    for (auto&& state : demo.preRasterizations) {
+      demo.preRasterizationLibraries.push_back(
+          demo.library->createLibrary(state));
+    }
+
+    for (auto&& state : demo.fragmentShaders) {
+      demo.fragmentShaderLibraries.push_back(
+          demo.library->createLibrary(state));
+    }
+
+    for (auto&& state : demo.fragmentOutputs) {
+      demo.fragmentOutputLibraries.push_back(
+          demo.library->createLibrary(state));
+    }
+
+    // ライブラリーの作成後、初めて使うマテリアルで待つのは高速リンクの時間だけになる
+    std::vector<double> linkTimes;
+    auto linkStart = std::chrono::steady_clock::now();
+
+    for (auto&& material : demo.materials) {
+      auto start = std::chrono::steady_clock::now();
+      demo.pipelines.push_back(linkDemoMaterial(demo, material));
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      linkTimes.push_back(elapsed.count());
+    }
+
+    // 最適化したリンクは高速リンクと同時に始まるので、リンクの開始からの時間を計測する
+    for (auto&& pipeline : demo.pipelines) {
+      pipeline->wait();
+    }
+
+    std::chrono::duration<double, std::milli> optimizedElapsed =
+        std::chrono::steady_clock::now() - linkStart;
+    GraphicsPipelineLibrary::Statistics stats = demo.library->getStatistics();
+
+    // 比較のため、同じ組み合わせを一括で作成する
+    // 先に作成したライブラリーがキャッシュにヒットしないよう、空のキャッシュを使う
+    auto monolithicCache = std::make_shared<PipelineCache>(
+        device, physicalDeviceInfo->properties,
+        pipelineCreationFeedbackEnabled);
+    GraphicsPipelineLibrary monolithic(device, monolithicCache,
+                                       pipelineCompiler, **demo.pipelineLayout,
+                                       **demo.renderPass);
+    std::vector<double> monolithicTimes;
+
+    for (auto&& material : demo.materials) {
+      auto start = std::chrono::steady_clock::now();
+      // 作成時間だけを計測するので、すぐに破棄する
+      monolithic.createMonolithic(
+          demo.vertexInput, demo.preRasterizations[material.preRasterization],
+          demo.fragmentShaders[material.fragmentShader],
+          demo.fragmentOutputs[material.fragmentOutput]);
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      monolithicTimes.push_back(elapsed.count());
+    }
+
+    size_t count = demo.pipelines.size();
+    double monolithicTotal = 0.0;
+
+    for (double time : monolithicTimes) {
+      monolithicTotal += time;
+    }
+
+    std::cout << "# "
+              << "Graphics pipeline library: " << stats.libraryCount
+              << " libraries, " << count << " pipelines" << std::endl;
+    std::cout << "| Libraries: " << stats.libraryMilliseconds << " ms"
+              << std::endl;
+    std::cout << "| Fast link: " << stats.fastLinkMilliseconds << " ms ("
+              << stats.fastLinkMilliseconds / count << " ms/pipeline)"
+              << std::endl;
+    std::cout << "| Optimized link: " << optimizedElapsed.count()
+              << " ms until all finished ("
+              << pipelineCompiler->getWorkerCount() << " workers)"
+              << std::endl;
+    std::cout << "| Monolithic: " << monolithicTotal << " ms ("
+              << monolithicTotal / count << " ms/pipeline)" << std::endl;
+
+    showFrameTimes("First use with fast link", linkTimes);
+    showFrameTimes("First use with monolithic pipelines", monolithicTimes);
+  }
+
+  // 高速リンクしたパイプラインを返し、ワーカースレッドで最適化したリンクを始める
+  static std::shared_ptr<LinkedPipeline> linkDemoMaterial(
+      const PipelineLibraryDemo& demo,
+      const PipelineLibraryDemo::Material& material) {
+    return demo.library->link(
+        GraphicsPipelineLibrary::Libraries{
+            /* vertexInput = */ demo.vertexInputLibrary,
+            /* preRasterization = */
+            demo.preRasterizationLibraries[material.preRasterization],
+            /* fragmentShader = */
+            demo.fragmentShaderLibraries[material.fragmentShader],
+            /* fragmentOutput = */
+            demo.fragmentOutputLibraries[material.fragmentOutput]},
+        GraphicsPipelineDescription{
+            /* vertexInput = */ demo.vertexInput,
+            /* preRasterization = */
+            demo.preRasterizations[material.preRasterization],
+            /* fragmentShader = */
+            demo.fragmentShaders[material.fragmentShader],
+            /* fragmentOutput = */
+            demo.fragmentOutputs[material.fragmentOutput]});
+  }
+
+  // シェーダーはマテリアルで初めて使う時に作成し、その時間を初めて使う時の待ち時間とする
+  void initializeDemoShaderObjects(PipelineLibraryDemo& demo) {
+    demo.shaderObjects = std::make_shared<ShaderObjectRenderer>(device);
+    demo.vertexShaders.resize(demo.preRasterizations.size());
+    demo.fragmentShaderObjects.resize(demo.fragmentShaders.size());
+
+    std::vector<double> firstUseTimes;
+
+    for (auto&& material : demo.materials) {
+      auto start = std::chrono::steady_clock::now();
+      auto& vertexShader = demo.vertexShaders[material.preRasterization];
+      auto& fragmentShader =
+          demo.fragmentShaderObjects[material.fragmentShader];
+
+      if (!vertexShader) {
+        vertexShader = demo.shaderObjects->createShader(
+            demo.preRasterizations[material.preRasterization]);
+      }
+
+      if (!fragmentShader) {
+        fragmentShader = demo.shaderObjects->createShader(
+            demo.fragmentShaders[material.fragmentShader]);
+      }
+
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      firstUseTimes.push_back(elapsed.count());
+    }
+
+    ShaderObjectRenderer::Statistics stats =
+        demo.shaderObjects->getStatistics();
+
+    std::cout << "# "
+              << "Shader objects: " << stats.shaderCount << " shaders in "
+              << stats.shaderMilliseconds << " ms for "
+              << demo.materials.size() << " materials" << std::endl;
+    showFrameTimes("First use with shader objects", firstUseTimes);
+  }
+
+  // マテリアルを切り替えながら描画を記録し、1回の描画あたりのCPUの時間を比べる
+  // 記録したコマンドバッファーはサブミットし、完了を待つ
+  // パイプラインは最適化したリンクの結果と比べる (毎フレームの描画も、いずれはそれに置き換わる)
+  void runDrawBenchmark() {
+    TRACE_SCOPE("runDrawBenchmark");
+
+    size_t fastLinkedCount = 0;
+
+    for (auto&& pipeline : pipelineLibraryDemo->pipelines) {
+      pipeline->wait();
+
+      if (!pipeline->isOptimized()) {
+        fastLinkedCount++;
+      }
+    }
+
+    // 最適化したリンクに失敗したものは、高速リンクしたもので代わりに描画する
+    if (fastLinkedCount > 0) {
+      std::cout << Console::fgYellow << "# " << fastLinkedCount
+                << " pipelines failed the optimized link; benchmarking them "
+                   "fast-linked"
+                << Console::fgDefault << std::endl;
+    }
+
+    vk::raii::CommandBuffers commandBuffers(
+        *device, vk::CommandBufferAllocateInfo{
+                     /* commandPool = */ **commandPool,
+                     /* level = */ vk::CommandBufferLevel::ePrimary,
+                     /* commandBufferCount = */ 1});
+    vk::raii::CommandBuffer& commandBuffer = commandBuffers[0];
+
+    std::cout << "# "
+              << "Draw submission benchmark: " << DRAW_BENCHMARK_COUNT
+              << " draws" << std::endl;
+
+    for (DrawBackend backend :
+         {DrawBackend::ePipeline, DrawBackend::eShaderObject}) {
+      commandBuffer.begin(vk::CommandBufferBeginInfo{
+          vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+
+      auto start = std::chrono::steady_clock::now();
+      drawMaterials(commandBuffer, backend, 0, DRAW_BENCHMARK_COUNT);
+      std::chrono::duration<double, std::micro> elapsed =
+          std::chrono::steady_clock::now() - start;
+
+      commandBuffer.end();
+      graphicsQueue->submit(vk::SubmitInfo{
+          /* waitSemaphores = */ {},
+          /* waitDstStageMask = */ {},
+          /* commandBuffers = */ *commandBuffer});
+      graphicsQueue->waitIdle();
+      commandBuffer.reset();
+
+      std::cout << "| "
+                << (backend == DrawBackend::eShaderObject ? "Shader objects"
+                                                          : "Pipelines")
+                << ": " << elapsed.count() / 1000.0 << " ms ("
+                << elapsed.count() / DRAW_BENCHMARK_COUNT << " us/draw)"
+                << std::endl;
+    }
+  }
+
+  // 最適化したリンクが終わっていなければ、高速リンクしたパイプラインで描画する
+  void drawPipelineLibraryDemo(vk::raii::CommandBuffer& commandBuffer) {
+    const PipelineLibraryDemo& demo = *pipelineLibraryDemo;
+
+    if (drawBackend == DrawBackend::ePipeline) {
+      const LinkedPipeline& pipeline =
+          *demo.pipelines[frameCount % demo.pipelines.size()];
+
+      // 判定の後に最適化したリンクが終わった場合は、高速リンクしたものとして数えるだけ
+      (pipeline.isOptimized() ? optimizedDrawCount : fastLinkedDrawCount)++;
+    }
+
+    drawMaterials(commandBuffer, drawBackend, frameCount, 1);
+  }
+
+  // materialsのfirst番目から順に (一周したら先頭に戻る) count回描画する
+  void drawMaterials(vk::raii::CommandBuffer& commandBuffer,
+                     DrawBackend backend,
+                     uint64_t first,
+                     uint32_t count) {
+    const PipelineLibraryDemo& demo = *pipelineLibraryDemo;
+    size_t materialCount = demo.materials.size();
+    vk::ClearValue clearValue{
+        vk::ClearColorValue{std::array<float, 4>{0.0f, 0.0f, 0.0f, 1.0f}}};
+    vk::Rect2D renderArea{/* offset = */ {0, 0}, /* extent = */ demo.extent};
+
+    if (backend == DrawBackend::ePipeline) {
+      commandBuffer.beginRenderPass(
+          vk::RenderPassBeginInfo{/* renderPass = */ **demo.renderPass,
+                                  /* framebuffer = */ **demo.framebuffer,
+                                  /* renderArea = */ renderArea,
+                                  /* clearValues = */ clearValue},
+          vk::SubpassContents::eInline);
+
+      // ビューポートとシザーは、パイプラインを切り替えても動的な状態として残る
+      commandBuffer.setViewport(
+          0, vk::Viewport{/* x = */ 0.0f, /* y = */ 0.0f,
+                          /* width = */ static_cast<float>(demo.extent.width),
+                          /* height = */
+                          static_cast<float>(demo.extent.height),
+                          /* minDepth = */ 0.0f, /* maxDepth = */ 1.0f});
+      commandBuffer.setScissor(0, renderArea);
+
+      for (uint64_t i = first; i < first + count; i++) {
+        commandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics,
+                                   demo.pipelines[i % materialCount]->get());
+        commandBuffer.draw(3, 1, 0, 0);
+      }
+
+      commandBuffer.endRenderPass();
+      return;
+    }
+
+    // レンダーパスの代わりに、前のフレームの書き込みとの依存関係とレイアウトの遷移をバリアで行う
+    vk::ImageMemoryBarrier toColorAttachment{
+        /* srcAccessMask = */ vk::AccessFlagBits::eColorAttachmentWrite,
+        /* dstAccessMask = */ vk::AccessFlagBits::eColorAttachmentWrite,
+        /* oldLayout = */ vk::ImageLayout::eUndefined,
+        /* newLayout = */ vk::ImageLayout::eColorAttachmentOptimal,
+        /* srcQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+        /* dstQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+        /* image = */ resourceRegistry->getImage(demo.image),
+        /* subresourceRange = */
+        vk::ImageSubresourceRange{
+            /* aspectMask = */ vk::ImageAspectFlagBits::eColor,
+            /* baseMipLevel = */ 0,
+            /* levelCount = */ 1,
+            /* baseArrayLayer = */ 0,
+            /* layerCount = */ 1}};
+    commandBuffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eColorAttachmentOutput,
+        vk::PipelineStageFlagBits::eColorAttachmentOutput, {}, nullptr,
+        nullptr, toColorAttachment);
+
+    vk::RenderingAttachmentInfoKHR colorAttachment{
+        /* imageView = */ **demo.imageView,
+        /* imageLayout = */ vk::ImageLayout::eColorAttachmentOptimal,
+        /* resolveMode = */ vk::ResolveModeFlagBits::eNone,
+        /* resolveImageView = */ nullptr,
+        /* resolveImageLayout = */ vk::ImageLayout::eUndefined,
+        /* loadOp = */ vk::AttachmentLoadOp::eClear,
+        /* storeOp = */ vk::AttachmentStoreOp::eStore,
+        /* clearValue = */ clearValue};
+    commandBuffer.beginRenderingKHR(
+        vk::RenderingInfoKHR{/* flags = */ {},
+                             /* renderArea = */ renderArea,
+                             /* layerCount = */ 1,
+                             /* viewMask = */ 0,
+                             /* colorAttachments = */ colorAttachment});
+
+    // マテリアルが毎回変わるので、状態もすべて設定し直す
+    for (uint64_t i = first; i < first + count; i++) {
+      const PipelineLibraryDemo::Material& material =
+          demo.materials[i % materialCount];
+      demo.shaderObjects->bind(
+          commandBuffer, *demo.vertexShaders[material.preRasterization],
+          *demo.fragmentShaderObjects[material.fragmentShader],
+          demo.vertexInput, demo.preRasterizations[material.preRasterization],
+          demo.fragmentOutputs[material.fragmentOutput], demo.extent);
+      commandBuffer.draw(3, 1, 0, 0);
+    }
+
+    commandBuffer.endRenderingKHR();
+  }
+
+  // 再コンパイルしたSPIR-Vはビルドディレクトリーの.spvにも書き込むので、SHADER_DIRECTORYが必要となる
+  void initializeShaderHotReload() {
+#ifdef SHADER_HOT_RELOAD
+    shaderWatcher = std::make_shared<ShaderWatcher>(
+        SHADER_SOURCE_DIRECTORY, SHADER_DIRECTORY, GLSLC_EXECUTABLE);
+    std::cout << "# "
+              << "Watching " << shaderWatcher->getSourceDirectory()
+              << std::endl;
+
+    if (pipelineLibraryDemo && drawBackend == DrawBackend::eShaderObject) {
+      std::cout << Console::fgYellow << "# "
+                << "Shader objects are not reloaded; draw with pipelines to "
+                   "see changes"
+                << Console::fgDefault << std::endl;
+    }
+#else
+    std::cout << Console::fgYellow << "# "
+              << "--shader-hot-reload requires SHADER_LOOSE_FILES on Linux; "
+                 "ignored"
+              << Console::fgDefault << std::endl;
+#endif
+  }
+
+  // 再コンパイルが終わったシェーダーについて、それを使うパイプラインの作り直しを依頼する
+  void pollShaderWatcher() {
+#ifdef SHADER_HOT_RELOAD
+    if (!shaderWatcher) {
+      return;
+    }
+
+    for (auto&& result : shaderWatcher->poll()) {
+      if (result.code.empty()) {
+        std::cout << Console::fgYellow << "# "
+                  << "Failed to compile " << result.fileName
+                  << Console::fgDefault << std::endl;
+        std::istringstream log(result.log);
+
+        for (std::string line; std::getline(log, line);) {
+          std::cout << "| " << line << std::endl;
+        }
+
+        continue;
+      }
+
+      std::cout << "# "
+                << "Recompiled " << result.fileName << " in "
+                << result.milliseconds << " ms" << std::endl;
+      reloadShader(result.fileName, std::move(result.code));
+    }
+#endif
+  }
+
+  // 作り直しはワーカースレッドで行い、描画のスレッドは待たない
+  // 作り直しが終わる前に再び変更された場合は、新しい方だけを使う
+  void reloadShader(const std::string& fileName, std::vector<uint32_t> code) {
+    ShaderCode shader(std::move(code));
+    reloadedShaderCount++;
+
+    if (fileName == "empty.comp") {
+      for (size_t i = 0; i < compileDemoPipelines.size(); i++) {
+        ComputePipelineDescription description{
+            /* code = */ shader,
+            /* entryPoint = */ "main",
+            /* specializationConstants = */ {static_cast<uint32_t>(i + 1)},
+            /* pushConstantSize = */ 0,
+            /* shaderName = */ fileName};
+        compileDemoReloads.insert_or_assign(
+            i, pipelineCompiler->submit(description));
+      }
+    }
+
+    // シェーダーオブジェクトは作り直さないので、パイプラインが無ければ何もしない
+    if (!pipelineLibraryDemo || !pipelineLibraryDemo->library) {
+      return;
+    }
+
+    PipelineLibraryDemo& demo = *pipelineLibraryDemo;
+
+    if (fileName == "fullscreen.vert") {
+      for (size_t i = 0; i < demo.preRasterizations.size(); i++) {
+        demo.preRasterizations[i].code = shader;
+        demo.preRasterizationReloads.insert_or_assign(
+            i, submitDemoLibrary(demo, demo.preRasterizations[i]));
+      }
+    } else if (fileName == "solid.frag.hlsl") {
+      for (size_t i = 0; i < demo.fragmentShaders.size(); i++) {
+        demo.fragmentShaders[i].code = shader;
+        demo.fragmentShaderReloads.insert_or_assign(
+            i, submitDemoLibrary(demo, demo.fragmentShaders[i]));
+      }
+    }
+  }
+
+  template <typename State>
+  PipelineFuture submitDemoLibrary(const PipelineLibraryDemo& demo,
+                                   const State& state) {
+    return pipelineCompiler->submit(
+        [library = demo.library, state] {
+          return library->createLibrary(state);
+        },
+        **demo.pipelineLayout);
+  }
+
+  // 作り直しが終わったものから置き換える (フレームの境界で呼ぶ)
+  // 古いパイプラインは実行中のフレームが使っているかもしれないので、deletionQueueで破棄する
+  void applyShaderReloads() {
+    std::erase_if(compileDemoReloads, [this](auto& reload) {
+      auto& [index, future] = reload;
+
+      if (!future.isReady()) {
+        return false;
+      }
+
+      if (getReloadedPipeline(future)) {
+        PipelineFuture previous =
+            std::exchange(compileDemoPipelines[index], future);
+
+        // 作成が終わっていないか失敗していれば、代わりのパイプラインを使っていた
+        if (std::shared_ptr<vk::raii::Pipeline> pipeline = previous.tryGet()) {
+          deletionQueue->push(pipeline);
+        }
+
+        reloadedPipelineCount++;
+      }
+
+      return true;
+    });
+
+    if (pipelineLibraryDemo) {
+      applyLibraryReloads(pipelineLibraryDemo->preRasterizationReloads,
+                          pipelineLibraryDemo->preRasterizationLibraries,
+                          &PipelineLibraryDemo::Material::preRasterization);
+      applyLibraryReloads(pipelineLibraryDemo->fragmentShaderReloads,
+                          pipelineLibraryDemo->fragmentShaderLibraries,
+                          &PipelineLibraryDemo::Material::fragmentShader);
+    }
+  }
+
+  // 置き換えたライブラリーを使うマテリアルは高速リンクし直し、最適化したリンクが終わればそちらを使う
+  void applyLibraryReloads(
+      std::map<size_t, PipelineFuture>& reloads,
+      std::vector<std::shared_ptr<vk::raii::Pipeline>>& libraries,
+      size_t PipelineLibraryDemo::Material::*stateIndex) {
+    PipelineLibraryDemo& demo = *pipelineLibraryDemo;
+
+    std::erase_if(reloads, [&](auto& reload) {
+      auto& [index, future] = reload;
+
+      if (!future.isReady()) {
+        return false;
+      }
+
+      if (std::shared_ptr<vk::raii::Pipeline> library =
+              getReloadedPipeline(future)) {
+        deletionQueue->push(std::exchange(libraries[index], library));
+
+        for (size_t i = 0; i < demo.materials.size(); i++) {
+          if (demo.materials[i].*stateIndex == index) {
+            deletionQueue->push(std::exchange(
+                demo.pipelines[i], linkDemoMaterial(demo, demo.materials[i])));
+            reloadedPipelineCount++;
+          }
+        }
+      }
+
+      return true;
+    });
+  }
+
+  // 作り直しに失敗していれば (シェーダーのエラーなど)、メッセージを出力してnullptrを返す
+  static std::shared_ptr<vk::raii::Pipeline> getReloadedPipeline(
+      const PipelineFuture& future) {
+    try {
+      return future.get();
+    } catch (const std::exception& e) {
+      std::cout << Console::fgYellow << "# "
+                << "Failed to rebuild a pipeline: " << e.what()
+                << Console::fgDefault << std::endl;
+      return nullptr;
+    }
+  }
+
+  void initializeResidencyDemo() {
+    TRACE_SCOPE("initializeResidencyDemo");
+
+    for (uint32_t i = 0; i < *residencyDemoCount; i++) {
+      residencyDemoBuffers.push_back(residencyManager->createBuffer(
+          RESIDENCY_DEMO_BUFFER_SIZE, vk::BufferUsageFlagBits::eStorageBuffer));
+    }
+
+    std::cout << "# "
+              << "Residency demo: " << *residencyDemoCount << " buffers of "
+              << (RESIDENCY_DEMO_BUFFER_SIZE >> 20) << " MiB" << std::endl;
+  }
+
+  // 4分の1ずつ、使うバッファーをずらしていく
+  void useResidencyDemoBuffers() {
+    size_t count = residencyDemoBuffers.size();
+    size_t window = std::max<size_t>(count / 4, 1);
+
+    for (size_t i = 0; i < window; i++) {
+      size_t index = (frameCount / 16 * window + i) % count;
+      residencyManager->use(residencyDemoBuffers[index]);
+    }
+  }
+
+  void showResidencyStatistics(const char* message) {
+    const std::vector<ResidencyManager::HeapBudget>& budgets =
+        residencyManager->getHeapBudgets();
+    const ResidencyManager::Statistics& stats =
+        residencyManager->getStatistics();
+
+    std::cout << "# " << message
+              << (memoryBudgetEnabled ? " (VK_EXT_memory_budget)"
+                                      : " (estimated)")
+              << ":" << std::endl;
+
+    for (size_t i = 0; i < budgets.size(); i++) {
+      std::cout << "| Heap " << i
+                << (budgets[i].deviceLocal ? " (device local)" : "") << ": "
+                << (budgets[i].usage >> 20) << " / "
+                << (budgets[i].budget >> 20) << " MiB" << std::endl;
+    }
+
+    std::cout << "| Evictions: " << stats.evictionCount << " ("
+              << (stats.evictedBytes >> 20) << " MiB)" << std::endl;
+    std::cout << "| Restores: " << stats.restoreCount << " ("
+              << (stats.restoredBytes >> 20) << " MiB)" << std::endl;
+  }
+
+  // 64 KiBから2 MiBまでのバッファーを作成する
+  BufferHandle createDefragDemoBuffer() {
+    vk::DeviceSize size = vk::DeviceSize{64 << 10} << (defragRandom() % 6);
+    return defragmenter->createBuffer(size,
+                                      vk::BufferUsageFlagBits::eStorageBuffer,
+                                      MemoryUsage::eGpuOnly);
+  }
+
+  void initializeDefragDemo() {
+    TRACE_SCOPE("initializeDefragDemo");
+
+    for (uint32_t i = 0; i < *defragDemoCount; i++) {
+      defragDemoBuffers.push_back(createDefragDemoBuffer());
+    }
+
+    // 1つおきに解放して、ブロックに穴を空ける
+    size_t kept = 0;
+
+    for (size_t i = 0; i < defragDemoBuffers.size(); i++) {
+      if (i % 2 == 0) {
+        defragDemoBuffers[kept++] = defragDemoBuffers[i];
+      } else {
+        defragmenter->destroy(defragDemoBuffers[i]);
+      }
+    }
+
+    defragDemoBuffers.resize(kept);
+
+    std::cout << "# "
+              << "Defragmentation demo: " << defragDemoBuffers.size()
+              << " buffers" << std::endl;
+    showFragmentation();
+  }
+
+  // コンテンツのストリーミングを模して、毎フレーム一部のバッファーを作り直す
+  void churnDefragDemoBuffers() {
+    if (defragDemoBuffers.empty()) {
+      return;
+    }
+
+    for (uint32_t i = 0; i < DEFRAG_DEMO_CHURN; i++) {
+      size_t index = defragRandom() % defragDemoBuffers.size();
+      defragmenter->destroy(defragDemoBuffers[index]);
+      defragDemoBuffers[index] = createDefragDemoBuffer();
+    }
+  }
+
+  void showFragmentation() {
+    std::vector<MemoryAllocator::HeapStatistics> heaps =
+        allocator->getStatistics();
+    std::vector<MemoryAllocator::FragmentationStatistics> fragmentation =
+        allocator->getFragmentationStatistics();
+
+    for (size_t i = 0; i < fragmentation.size(); i++) {
+      if (heaps[i].blockCount == 0) {
+        continue;
+      }
+
+      std::cout << "| Heap " << i << ": " << heaps[i].blockCount
+                << " blocks, " << (fragmentation[i].freeBytes >> 10)
+                << " KiB free, fragmentation "
+                << fragmentation[i].getFragmentation() * 100.0 << "%"
+                << std::endl;
+    }
+  }
+
+  void showDeletionStatistics(const char* message) {
+    const DeletionQueue::Statistics& stats = deletionQueue->getStatistics();
+
+    std::cout << "# " << message << ":" << std::endl;
+    std::cout << "| Destroyed: " << stats.destroyedCount << " in "
+              << stats.batchCount << " batches" << std::endl;
+    std::cout << "| Peak pending: " << stats.peakPendingCount << std::endl;
+  }
+
+  void showCompileStatistics(const char* message) {
+    PipelineCompiler::Statistics stats = pipelineCompiler->getStatistics();
+    uint64_t finished = std::max<uint64_t>(
+        stats.compiledCount + stats.failedCount, 1);
+
+    std::cout << "# " << message << ": "
+              << pipelineCompiler->getWorkerCount() << " workers"
+              << std::endl;
+    std::cout << "| Submitted: " << stats.submittedCount << " ("
+              << stats.deduplicatedCount << " deduplicated)" << std::endl;
+    std::cout << "| Compiled: " << stats.compiledCount << " ("
+              << stats.failedCount << " failed, "
+              << stats.compileMilliseconds / finished << " ms/pipeline)"
+              << std::endl;
+    std::cout << "| Peak queue length: " << stats.peakQueueLength
+              << std::endl;
+    std::cout << "| Fallback dispatches: " << compileDemoFallbackCount
+              << " / " << frameCount << " frames" << std::endl;
+  }
+
+  void showPipelineCacheStatistics(const char* message) {
+    PipelineCache::Statistics stats = pipelineCache->getStatistics();
+
+    std::cout << "# " << message << ":" << std::endl;
+    std::cout << "| Pipelines: " << stats.pipelineCount << " in "
+              << stats.creationMilliseconds << " ms" << std::endl;
+    showPipelineCacheHits(stats);
+    std::cout << "| Loaded: " << stats.loadedBytes << " bytes" << std::endl;
+    std::cout << "| Saved: " << stats.savedBytes << " bytes ("
+              << stats.saveCount << " times"
+              << (pipelineCachePath.has_value() ? ")" : ", no path)")
+              << std::endl;
+  }
+
+  void showPipelineCacheHits(const PipelineCache::Statistics& stats) {
+    if (!pipelineCreationFeedbackEnabled) {
+      std::cout << "| Cache hits: unknown ("
+                << VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME
+                << " is not available)" << std::endl;
+      return;
+    }
+
+    double rate = stats.feedbackCount > 0
+                      ? 100.0 * stats.hitCount / stats.feedbackCount
+                      : 0.0;
+    std::cout << "| Cache hits: " << stats.hitCount << " / "
+              << stats.feedbackCount << " (" << rate << "%)" << std::endl;
+  }
+
+  void showDefragStatistics(const char* message) {
+    const Defragmenter::Statistics& stats = defragmenter->getStatistics();
+    double frames = static_cast<double>(std::max<uint64_t>(frameCount, 1));
+
+    std::cout << "# " << message << ":" << std::endl;
+    std::cout << "| Moves: " << stats.moveCount << " ("
+              << (stats.movedBytes >> 20) << " MiB, "
+              << stats.moveCount / frames << "/frame)" << std::endl;
+    std::cout << "| Batches: " << stats.batchCount << std::endl;
+    std::cout << "| Time limit reached: " << stats.timeLimitCount
+              << std::endl;
+    showFragmentation();
+  }
+
+  static VKAPI_ATTR VkBool32 VKAPI_CALL
+  messageCallBack(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
+                  VkDebugUtilsMessageTypeFlagsEXT messageType,
+                  const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData,
+                  void* pUserData) {
+    auto app = static_cast<Application*>(pUserData);
+
+    if (app->perfReport &&
+        (messageType & VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT) != 0) {
+      app->perfReport->record(*pCallbackData);
+    }
+
+    // ドライバーのスレッドで出力を待たないように、リングバッファーにコピーするだけにする
+    app->logSink->push(messageSeverity, pCallbackData->messageIdNumber,
+                       pCallbackData->pMessageIdName, pCallbackData->pMessage);
+
+    return VK_FALSE;
+  }
+
+  void loop() {
+    SDL_Event event;
+    bool shouldQuit = false;
+    auto startTime = std::chrono::steady_clock::now();
+
+    while (!shouldQuit) {
+      // 最小化中は描画せず、イベントが来るまで待つ
+      if ((SDL_GetWindowFlags(window.get()) & SDL_WINDOW_MINIMIZED) != 0) {
+        if (SDL_WaitEvent(nullptr) == 0) {
+          throw std::runtime_error(SDL_GetError());
+        }
+      }
+
+      while (SDL_PollEvent(&event)) {
+        switch (event.type) {
+          case SDL_QUIT:
+            shouldQuit = true;
+            break;
+          case SDL_WINDOWEVENT:
+            if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+              swapchainDirty = true;
+            }
+            break;
+          case SDL_KEYDOWN:
+            if (event.key.keysym.sym == SDLK_F9) {
+              writePerfReport();
+            }
+            break;
+        }
+      }
+
+      if (frameLimit.has_value() && frameCount >= *frameLimit) {
+        shouldQuit = true;
+      }
+
+      if (resizeBenchmarkCount.has_value()) {
+        if (resizeFrameTimes.size() >= *resizeBenchmarkCount) {
+          shouldQuit = true;
+        } else if (frameCount % 2 == 0) {
+          // 2フレームに1回、ウィンドウサイズを交互に変更する
+          bool shrink = (frameCount / 2) % 2 == 0;
+          SDL_SetWindowSize(window.get(), shrink ? WIDTH * 3 / 4 : WIDTH,
+                            shrink ? HEIGHT * 3 / 4 : HEIGHT);
+          // ドライバーによってはイベントが届かないので、直接再作成を要求する
+          swapchainDirty = true;
+        }
+      }
+
+      if (!shouldQuit &&
+          (SDL_GetWindowFlags(window.get()) & SDL_WINDOW_MINIMIZED) == 0) {
+        auto frameStart = std::chrono::steady_clock::now();
+        bool recreating = swapchainDirty;
+
+        if (stagingBenchmarkUploads.has_value()) {
+          uploadStagingBenchmark();
+        }
+
+        // このフレームで手放したリソースは、このフレームのサブミットが完了してから破棄する
+        deletionQueue->beginFrame(submitSerial + 1);
+        residencyManager->beginFrame(frameCount);
+
+        if (residencyDemoCount.has_value()) {
+          useResidencyDemoBuffers();
+        }
+
+        if (defragDemoCount.has_value()) {
+          churnDefragDemoBuffers();
+        }
+
+        defragmenter->update(frameCount);
+        pipelineCache->saveIfDue();
+        pollShaderWatcher();
+        applyShaderReloads();
+
+        drawFrame();
+
+        std::chrono::duration<double, std::milli> frameTime =
+            std::chrono::steady_clock::now() - frameStart;
+
+        if (resizeBenchmarkCount.has_value()) {
+          (recreating ? resizeFrameTimes : steadyFrameTimes)
+              .push_back(frameTime.count());
+        }
+      }
+    }
+
+    stagingRing->waitIdle();
+    device->waitIdle();
+    retiredSwapchains.clear();
+
+    if (stagingTarget) {
+      resourceRegistry->destroy(stagingTarget->buffer);
+      resourceRegistry->destroy(stagingTarget->image);
+      stagingTarget.reset();
+    }
+
+    for (BufferHandle handle : residencyDemoBuffers) {
+      residencyManager->destroyBuffer(handle);
+    }
+
+    residencyDemoBuffers.clear();
+    defragmenter->waitIdle();
+
+    for (BufferHandle handle : defragDemoBuffers) {
+      defragmenter->destroy(handle);
+    }
 
-#if ENABLE_VALIDATION
-    // バリデーションレイヤーの出力をコールバックで受け取る為には、vk::DebugUtilsMessengerを作らなければならない
-    vk::DebugUtilsMessengerCreateInfoEXT messengerInfo{
-        /* flags = */ {},
-        /* messageSeverity = */
-        vk::DebugUtilsMessageSeverityFlagBitsEXT::eVerbose |
-            /*vk::DebugUtilsMessageSeverityFlagBitsEXT::eInfo |*/
-            vk::DebugUtilsMessageSeverityFlagBitsEXT::eWarning |
-            vk::DebugUtilsMessageSeverityFlagBitsEXT::eError,
-        /* messageType = */ vk::DebugUtilsMessageTypeFlagBitsEXT::eGeneral |
-            vk::DebugUtilsMessageTypeFlagBitsEXT::eValidation |
-            vk::DebugUtilsMessageTypeFlagBitsEXT::ePerformance,
-        /* pfnUserCallback = */ &messageCallBack,
-        /* pUserData = */ nullptr};
-#endif
+    defragDemoBuffers.clear();
+    // 最適化したリンクや作り直し中のライブラリーが、パイプラインレイアウトを使い終わるまで待つ
+    pipelineCompiler->waitIdle();
+    compileDemoPipelines.clear();
+    compileDemoReloads.clear();
+    compileDemoFallback.reset();
 
-    // エクステンションとレイヤーを登録するだけでは、インスタンス生成/削除時のバリデーションが行われない
-    // インスタンス生成/削除時のバリデーションを有効にするには、vk::InstanceCreateInfoのpNextにvk::DebugUtilsMessengerCreateInfoEXTへのポインターを与える必要がある
-    // Vulkan-Hppでは、vk::StructureChainによってpNextを設定する
-    vk::StructureChain<vk::InstanceCreateInfo,
-                       vk::DebugUtilsMessengerCreateInfoEXT>
-        instanceChain{instanceInfo, messengerInfo};
+    if (pipelineLibraryDemo) {
+      resourceRegistry->destroy(pipelineLibraryDemo->image);
+      pipelineLibraryDemo.reset();
+    }
 
-    // vkCreateInstance(pCreateInfo, pAllocator, pInstance)に相当
-    instance = std::make_shared<vk::raii::Instance>(
-        context, instanceChain.get<vk::InstanceCreateInfo>());
+    // デバイスはアイドルなので、すべて完了している
+    deletionQueue->collect(submitSerial + 1);
 
-    std::cout << Console::fgGreen << "# "
-              << "vkCreateInstance() succeeded" << Console::fgDefault
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - startTime;
+    std::cout << "# "
+              << "Rendered " << frameCount << " frames in " << elapsed.count()
+              << " s (" << frameCount / elapsed.count() << " frames/s, "
+              << framesInFlight << " frames in flight, "
+              << vk::to_string(swapchainSharingMode) << " sharing)"
               << std::endl;
 
-#if ENABLE_VALIDATION
-    // vkCreateDebugUtilsMessengerEXT(instance, pCreateInfo, pAllocator,
-    // pMessenger)に相当
-    // vk::DebugUtilsMessengerを作成する
-    debugMessenger = std::make_shared<vk::raii::DebugUtilsMessengerEXT>(
-        *instance, messengerInfo);
-#endif
-  }
+    if (resizeBenchmarkCount.has_value()) {
+      showFrameTimes("Frames with swapchain recreation", resizeFrameTimes);
+      showFrameTimes("Frames without swapchain recreation", steadyFrameTimes);
+    }
 
-  void initializeSurface() {
-    VkSurfaceKHR cSurface;
-    // ウィンドウの描画サーフェイスを作成する
-    SDL_bool sResult =
-        SDL_Vulkan_CreateSurface(window.get(), **instance, &cSurface);
-    surface = std::make_shared<vk::raii::SurfaceKHR>(*instance, cSurface);
+    if (stagingBenchmarkUploads.has_value()) {
+      showStagingStatistics("Staging uploads", elapsed.count());
+    }
 
-    if (sResult != SDL_TRUE) {
-      throw std::runtime_error("SDL_Vulkan_CreateSurface() failed");
-    } else {
-      std::cout << Console::fgGreen << "# "
-                << "SDL_Vulkan_CreateSurface() succeeded" << Console::fgDefault
+    showResidencyStatistics("Memory budget");
+    showDeletionStatistics("Deferred destruction");
+
+    if (defragDemoCount.has_value()) {
+      showDefragStatistics("Defragmentation");
+    }
+
+    if (compileDemoCount.has_value()) {
+      showCompileStatistics("Background pipeline compilation");
+    }
+
+    if ((libraryDemo || drawBackendSelected) &&
+        drawBackend == DrawBackend::ePipeline) {
+      std::cout << "# "
+                << "Pipeline library draws: " << optimizedDrawCount
+                << " optimized, " << fastLinkedDrawCount << " fast-linked"
                 << std::endl;
     }
+
+    if (shaderHotReload) {
+      std::cout << "# "
+                << "Shader reloads: " << reloadedShaderCount
+                << " shaders, " << reloadedPipelineCount
+                << " pipelines replaced" << std::endl;
+    }
   }
 
-  void initializeDevice() {
-    vk::raii::PhysicalDevices devices(*instance);
+  static void showFrameTimes(const char* message, std::vector<double> times) {
+    std::cout << "# " << message << ": " << times.size() << std::endl;
 
-    showPhysicalDevices("Available physical devices", devices);
+    if (times.empty()) {
+      return;
+    }
 
-    // 使用する物理デバイスを選択する
-    physicalDevice = std::make_shared<vk::raii::PhysicalDevice>(
-        selectPhysicalDevice(devices, *surface));
-    showPhysicalDevice("Selected physical device", *physicalDevice);
-    showExtensions("Available device extensions",
-                   physicalDevice->enumerateDeviceExtensionProperties());
-
-    showQueueFamilies("Queue families",
-                      physicalDevice->getQueueFamilyProperties());
-
-    // 有効化するキューファミリーのインデックスを格納する
-    // セットに格納することで、インデックスは重複しない
-    std::set<uint32_t> queueFamilyIndices;
-    // グラフィックス命令をサポートするキューファミリーのインデックスを取得する
-    graphicsQueueFamilyIndex =
-        findQueueFamilyIndex(*physicalDevice, vk::QueueFlagBits::eGraphics);
-    queueFamilyIndices.insert(*graphicsQueueFamilyIndex);
-    // プレゼンテーションをサポートするキューファミリーのインデックスを取得する
-    presentQueueFamilyIndex =
-        findPresentQueueFamilyIndex(*physicalDevice, *surface);
-    queueFamilyIndices.insert(*presentQueueFamilyIndex);
+    std::sort(times.begin(), times.end());
 
-    // vk::DeviceQueueCreateInfoには論理デバイスと共に作成するキューの情報を格納する
-    std::vector<vk::DeviceQueueCreateInfo> queueCreateInfos;
+    auto percentile = [&](double p) {
+      size_t index = static_cast<size_t>(p * (times.size() - 1) + 0.5);
+      return times[index];
+    };
 
-    std::vector<float> queuePriorities{1.0f};
+    std::cout << "| p50: " << percentile(0.50) << " ms" << std::endl;
+    std::cout << "| p99: " << percentile(0.99) << " ms" << std::endl;
+    std::cout << "| max: " << times.back() << " ms" << std::endl;
+  }
 
-    for (auto&& index : queueFamilyIndices) {
-      vk::DeviceQueueCreateInfo queueInfo{
-          /* flags = */ {},
-          // キューをどのキューファミリーから作成するかを指定する
-          // vkGetPhysicalDeviceQueueFamilyProperties()が返すpQueueFamilyPropertiesへのインデックスである
-          /* queueFamilyIndex = */ index,
-          // キューの優先度を指定する
-          // 優先度は0から1であり、1の時に最高
-          // 優先度が高いキューの命令が優先されて処理される場合がある
-          /* pQueuePriorities = */ queuePriorities};
-      queueCreateInfos.push_back(queueInfo);
+  void drawFrame() {
+    if (swapchainDirty && !recreateSwapchain()) {
+      return;
     }
 
-    std::vector<const char*> deviceExtensionNames =
-        getRequiredDeviceExtensions(*physicalDevice);
-    showExtensions("Required device extensions", deviceExtensionNames);
+    Frame& frame = frames[currentFrame];
 
-    vk::PhysicalDeviceFeatures enabledFeatures{};
+    if (perfReport) {
+      perfReport->beginFrame(frameCount);
+    }
 
-    vk::DeviceCreateInfo deviceInfo{
-        /* flags = */ {},
-        // デバイスと同時に作成するキューの情報を登録する
-        /* pQueueCreateInfos = */ queueCreateInfos,
-        // enabledLayerCount, ppEnabledLayerNamesは非推奨であり無視される
-        /* ppEnabledLayerNames = */ nullptr,
-        // 有効化するデバイスエクステンションを登録する
-        /* ppEnabledExtensionNames = */ deviceExtensionNames,
-        // 有効化するデバイスフィーチャー
-        /* pEnabledFeatures = */ &enabledFeatures};
+    // vkWaitForFences(device, fenceCount, pFences, waitAll, timeout)に相当
+    // このフレームを前回使用したサブミットの完了を待つ
+    waitForFence(*frame.inFlightFence);
+    completedSerial = std::max(completedSerial, frame.submitSerial);
+    collectRetiredSwapchains();
+    deletionQueue->collect(completedSerial);
+
+    uint32_t imageIndex;
+
+    try {
+      // vkAcquireNextImageKHR(device, swapchain, timeout, semaphore, fence,
+      // pImageIndex)に相当
+      // イメージが使用可能になるとimageAvailableSemaphoreがシグナルされる
+      auto [acquireResult, acquiredIndex] = swapchain->acquireNextImage(
+          std::numeric_limits<uint64_t>::max(), *frame.imageAvailableSemaphore);
+
+      // eSuboptimalKHRの場合もイメージは取得できているので、このフレームは描画して提示する
+      if (acquireResult == vk::Result::eSuboptimalKHR) {
+        swapchainDirty = true;
+      }
 
-    // vkCreateDevice(physicalDevice, pCreateInfo, pAllocator, pDevice)に相当
-    // 論理デバイスを作成する
-    device = std::make_shared<vk::raii::Device>(*physicalDevice, deviceInfo);
+      imageIndex = acquiredIndex;
+    } catch (const vk::OutOfDateKHRError&) {
+      // イメージは取得されず、セマフォもシグナルされないので、再作成してから次のフレームで描画する
+      swapchainDirty = true;
+      return;
+    }
 
-    std::cout << Console::fgGreen << "# "
-              << "vkCreateDevice() succeeded" << Console::fgDefault
-              << std::endl;
+    // 同じイメージを別のフレームがまだ使用していれば、その完了を待つ
+    if (imagesInFlight[imageIndex]) {
+      waitForFence(imagesInFlight[imageIndex]);
+    }
 
-    // vkGetDeviceQueue(device, queueFamilyIndex, queueIndex, pQueue)に相当
-    // 作成したキューを取得する
-    // queueIndexはキューファミリー内のキューのインデックス
-    graphicsQueue = std::make_shared<vk::raii::Queue>(
-        *device, *graphicsQueueFamilyIndex, 0);
-    std::cout << "# "
-              << "Obtained graphics queue: " << **graphicsQueue << std::endl;
+    imagesInFlight[imageIndex] = *frame.inFlightFence;
 
-    presentQueue =
-        std::make_shared<vk::raii::Queue>(*device, *presentQueueFamilyIndex, 0);
-    std::cout << "# "
-              << "Obtained present queue: " << **presentQueue << std::endl;
-  }
+    device->resetFences({*frame.inFlightFence});
 
-  void initializeSwapchain() {
-    auto capabilities = physicalDevice->getSurfaceCapabilitiesKHR(**surface);
-    auto formats = physicalDevice->getSurfaceFormatsKHR(**surface);
-    auto presentModes = physicalDevice->getSurfacePresentModesKHR(**surface);
+    frame.commandBuffer.reset();
+    recordCommandBuffer(frame.commandBuffer, swapchainImages[imageIndex]);
 
-    showSurfaceCapabilities("Surface capabilities", capabilities);
-    showSurfaceFormats("Surface formats", formats);
-    showSurfacePresentModes("Surface present modes", presentModes);
+    std::vector<vk::Semaphore> waitSemaphores{*frame.imageAvailableSemaphore};
+    // 書き込みはvkCmdClearColorImage()で行うので、転送ステージの前で待つ
+    std::vector<vk::PipelineStageFlags> waitStages{
+        vk::PipelineStageFlagBits::eTransfer};
 
-    uint32_t imageCount = selectSwapchainImageCount(capabilities);
-    vk::SurfaceFormatKHR surfaceFormat = selectSwapchainSurfaceFormat(formats);
-    vk::PresentModeKHR presentMode = selectSwapchainPresentMode(presentModes);
-    vk::Extent2D imageExtent = selectSwapchainImageExtent(capabilities);
-    vk::SharingMode imageSharingMode;
-    std::vector<uint32_t> queueFamilyIndices;
+    // デフラグメンテーションのコピーが終わるまで、移動中のリソースを使わない
+    if (vk::Semaphore semaphore = defragmenter->takeSignalSemaphore()) {
+      waitSemaphores.push_back(semaphore);
+      waitStages.push_back(vk::PipelineStageFlagBits::eAllCommands);
+    }
 
-    if (*graphicsQueueFamilyIndex != *presentQueueFamilyIndex) {
-      imageSharingMode = vk::SharingMode::eConcurrent;
-      queueFamilyIndices.push_back(*graphicsQueueFamilyIndex);
-      queueFamilyIndices.push_back(*presentQueueFamilyIndex);
-    } else {
-      imageSharingMode = vk::SharingMode::eExclusive;
+    // 追い出しや戻しのコピーが終わるまで、移動したバッファーを使わない
+    if (vk::Semaphore semaphore = residencyManager->takeSignalSemaphore()) {
+      waitSemaphores.push_back(semaphore);
+      waitStages.push_back(vk::PipelineStageFlagBits::eAllCommands);
     }
 
-    vk::SwapchainCreateInfoKHR swapchainInfo{
-        /* flags = */ {},
-        /* surface = */ **surface,
-        /* minImageCount = */ imageCount,
-        /* imageFormat = */ surfaceFormat.format,
-        /* imageColorSpace = */ surfaceFormat.colorSpace,
-        /* imageExtent = */ imageExtent,
-        /* imageArrayLayers = */ 1,
-        /* imageUsage = */ vk::ImageUsageFlagBits::eColorAttachment,
-        /* imageSharingMode = */ imageSharingMode,
-        /* queueFamilyIndices = */ queueFamilyIndices,
-        /* preTransform = */ capabilities.currentTransform,
-        /* compositeAlpha = */ vk::CompositeAlphaFlagBitsKHR::eOpaque,
-        /* presentMode = */ presentMode,
-        /* clipped = */ true,
-        /* oldSwapchain = */ nullptr,
-    };
+    vk::CommandBuffer commandBuffer = *frame.commandBuffer;
+    vk::Semaphore signalSemaphore = *renderFinishedSemaphores[imageIndex];
+
+    vk::SubmitInfo submitInfo{
+        /* pWaitSemaphores = */ waitSemaphores,
+        /* pWaitDstStageMask = */ waitStages,
+        /* pCommandBuffers = */ commandBuffer,
+        /* pSignalSemaphores = */ signalSemaphore};
+
+    // vkQueueSubmit(queue, submitCount, pSubmits, fence)に相当
+    graphicsQueue->submit(submitInfo, *frame.inFlightFence);
+    frame.submitSerial = ++submitSerial;
+
+    vk::Semaphore presentWaitSemaphore = signalSemaphore;
+
+    if (needsOwnershipTransfer()) {
+      // プレゼンテーションのキューで所有権を受け取ってからプレゼンテーションする
+      vk::PipelineStageFlags acquireWaitStage =
+          vk::PipelineStageFlagBits::eAllCommands;
+      vk::CommandBuffer acquireCommandBuffer =
+          *ownershipAcquireCommandBuffers[imageIndex];
+      presentWaitSemaphore = *presentReadySemaphores[imageIndex];
+
+      // 前回このイメージの所有権を受け取ったサブミットが完了するまで、コマンドバッファーは再利用できない
+      vk::raii::Fence& acquireFence = ownershipAcquireFences[imageIndex];
+      waitForFence(*acquireFence);
+      device->resetFences({*acquireFence});
+
+      vk::SubmitInfo acquireInfo{
+          /* pWaitSemaphores = */ signalSemaphore,
+          /* pWaitDstStageMask = */ acquireWaitStage,
+          /* pCommandBuffers = */ acquireCommandBuffer,
+          /* pSignalSemaphores = */ presentWaitSemaphore};
+      presentQueue->submit(acquireInfo, *acquireFence);
+    }
 
-    swapchain =
-        std::make_shared<vk::raii::SwapchainKHR>(*device, swapchainInfo);
+    vk::SwapchainKHR presentSwapchain = **swapchain;
 
-    std::cout << Console::fgGreen << "# "
-              << "vkCreateSwapchainKHR() succeeded" << Console::fgDefault
-              << std::endl;
+    vk::PresentInfoKHR presentInfo{
+        /* pWaitSemaphores = */ presentWaitSemaphore,
+        /* pSwapchains = */ presentSwapchain,
+        /* pImageIndices = */ imageIndex};
+
+    try {
+      // vkQueuePresentKHR(queue, pPresentInfo)に相当
+      vk::Result presentResult = presentQueue->presentKHR(presentInfo);
+
+      if (presentResult == vk::Result::eSuboptimalKHR) {
+        swapchainDirty = true;
+      }
+    } catch (const vk::OutOfDateKHRError&) {
+      swapchainDirty = true;
+    }
+
+    currentFrame = (currentFrame + 1) % framesInFlight;
+    frameCount++;
   }
 
-  static VKAPI_ATTR VkBool32 VKAPI_CALL
-  messageCallBack(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
-                  VkDebugUtilsMessageTypeFlagsEXT messageType,
-                  const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData,
-                  void* pUserData) {
-    const char* color = "";
+  void recordCommandBuffer(vk::raii::CommandBuffer& commandBuffer,
+                           vk::Image image) {
+    commandBuffer.begin(vk::CommandBufferBeginInfo{
+        vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
 
-    if (messageSeverity == VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT) {
-      color = Console::fgYellow;
-    } else if (messageSeverity ==
-               VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT) {
-      color = Console::fgRed;
+    if (!compileDemoPipelines.empty()) {
+      dispatchCompileDemo(commandBuffer);
     }
 
-    std::cerr << color << "$ " << pCallbackData->pMessage << Console::fgDefault
-              << std::endl;
+    if (pipelineLibraryDemo) {
+      drawPipelineLibraryDemo(commandBuffer);
+    }
 
-    return VK_FALSE;
+    vk::ImageSubresourceRange range{
+        /* aspectMask = */ vk::ImageAspectFlagBits::eColor,
+        /* baseMipLevel = */ 0,
+        /* levelCount = */ 1,
+        /* baseArrayLayer = */ 0,
+        /* layerCount = */ 1};
+
+    // 前の内容は不要なので、eUndefinedから遷移させる
+    // srcStageMaskをセマフォの待機ステージと揃えることで、イメージ取得との依存関係を作る
+    vk::ImageMemoryBarrier toTransferDst{
+        /* srcAccessMask = */ {},
+        /* dstAccessMask = */ vk::AccessFlagBits::eTransferWrite,
+        /* oldLayout = */ vk::ImageLayout::eUndefined,
+        /* newLayout = */ vk::ImageLayout::eTransferDstOptimal,
+        /* srcQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+        /* dstQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+        /* image = */ image,
+        /* subresourceRange = */ range};
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                  vk::PipelineStageFlagBits::eTransfer, {},
+                                  nullptr, nullptr, toTransferDst);
+
+    // フレームが進んでいることが分かるように、色を変化させる
+    float t = static_cast<float>(frameCount % 256) / 255.0f;
+    vk::ClearColorValue clearColor{
+        std::array<float, 4>{t, 0.2f, 1.0f - t, 1.0f}};
+    commandBuffer.clearColorImage(image, vk::ImageLayout::eTransferDstOptimal,
+                                  clearColor, range);
+
+    // 所有権を移動する場合は、このバリアが解放の操作になる
+    vk::ImageMemoryBarrier toPresent =
+        getPresentBarrier(image, vk::AccessFlagBits::eTransferWrite);
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                  vk::PipelineStageFlagBits::eBottomOfPipe, {},
+                                  nullptr, nullptr, toPresent);
+
+    commandBuffer.end();
   }
 
-  void loop() {
-    SDL_Event event;
-    bool shouldQuit = false;
+  // プレゼンテーションのキューで所有権を受け取るコマンドを記録する
+  // 前回のサブミットの完了を待たずに同じイメージで再びサブミットされうるので、eSimultaneousUseを指定する
+  void recordOwnershipAcquire(vk::raii::CommandBuffer& commandBuffer,
+                              vk::Image image) {
+    commandBuffer.begin(vk::CommandBufferBeginInfo{
+        vk::CommandBufferUsageFlagBits::eSimultaneousUse});
+
+    // 取得の操作では、解放の操作と同じレイアウト遷移とキューファミリーを指定する
+    // 取得側のsrcAccessMaskは無視される
+    vk::ImageMemoryBarrier acquire = getPresentBarrier(image, {});
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands,
+                                  vk::PipelineStageFlagBits::eBottomOfPipe, {},
+                                  nullptr, nullptr, acquire);
+
+    commandBuffer.end();
+  }
 
-    while (!shouldQuit) {
-      while (SDL_PollEvent(&event)) {
-        switch (event.type) {
-          case SDL_QUIT:
-            shouldQuit = true;
-            break;
-        }
-      }
+  // プレゼンテーション用のレイアウトへ遷移させるバリア
+  vk::ImageMemoryBarrier getPresentBarrier(vk::Image image,
+                                           vk::AccessFlags srcAccessMask) {
+    bool transfer = needsOwnershipTransfer();
+
+    return vk::ImageMemoryBarrier{
+        /* srcAccessMask = */ srcAccessMask,
+        /* dstAccessMask = */ {},
+        /* oldLayout = */ vk::ImageLayout::eTransferDstOptimal,
+        /* newLayout = */ vk::ImageLayout::ePresentSrcKHR,
+        /* srcQueueFamilyIndex = */
+        transfer ? *graphicsQueueFamilyIndex : VK_QUEUE_FAMILY_IGNORED,
+        /* dstQueueFamilyIndex = */
+        transfer ? *presentQueueFamilyIndex : VK_QUEUE_FAMILY_IGNORED,
+        /* image = */ image,
+        /* subresourceRange = */
+        vk::ImageSubresourceRange{
+            /* aspectMask = */ vk::ImageAspectFlagBits::eColor,
+            /* baseMipLevel = */ 0,
+            /* levelCount = */ 1,
+            /* baseArrayLayer = */ 0,
+            /* layerCount = */ 1}};
+  }
+
+  void waitForFence(vk::Fence fence) {
+    vk::Result result = device->waitForFences(
+        {fence}, VK_TRUE, std::numeric_limits<uint64_t>::max());
 
-      // Render code here
+    if (result != vk::Result::eSuccess) {
+      throw std::runtime_error("vkWaitForFences() failed; result: " +
+                               vk::to_string(result));
     }
   }
 
-  void finalize() {}
+  void finalize() {
+    writePerfReport();
+    showMemoryStatistics("Device memory usage", *allocator);
+    pipelineCache->save();
+    showPipelineCacheStatistics("Pipeline cache");
+
+    if (pipelineManifest) {
+      pipelineManifest->write(*pipelineManifestPath);
+      std::cout << "# "
+                << "Pipeline manifest: " << pipelineManifest->getPipelineCount()
+                << " pipelines, " << pipelineManifest->getShaderCount()
+                << " shaders (" << *pipelineManifestPath << ")" << std::endl;
+    }
+  }
+
+  void writePerfReport() {
+    if (!perfReport) {
+      return;
+    }
+
+    if (!perfReport->write(*perfReportPath, frameCount)) {
+      return;
+    }
+
+    std::cout << "# "
+              << "Wrote performance report: " << *perfReportPath << std::endl;
+  }
 
   vk::InstanceCreateFlags getInstanceFlags() {
     vk::InstanceCreateFlags flags{};
 
-#if SUPPORT_MOLTENVK
-    // MoltenVKに対応する場合は、VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHRフラグを指定する
-    flags |= vk::InstanceCreateFlagBits::eEnumeratePortabilityKHR;
-#endif
+    if (portabilityEnabled) {
+      // MoltenVKに対応する場合は、VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHRフラグを指定する
+      flags |= vk::InstanceCreateFlagBits::eEnumeratePortabilityKHR;
+    }
 
     return flags;
   }
@@ -397,25 +3097,52 @@ class Application : public SDLApplication {
 
   // 必要となるエクステンションを取得する
   std::vector<const char*> getRequiredExtensions() {
-    // VulkanとSDLは、エクステンションを通じてやりとりするので、SDLからVulkanインスタンスに登録すべきエクステンションのリストを取得する
-    unsigned int sdlExtensionCount;
-    SDL_Vulkan_GetInstanceExtensions(window.get(), &sdlExtensionCount, nullptr);
+    std::vector<const char*> extensionNames;
 
-    std::vector<const char*> extensionNames(sdlExtensionCount);
+    if (headless) {
+      // ヘッドレス時はSDLを介さずにサーフェイスを作成する
+      extensionNames.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
+      extensionNames.push_back(VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME);
+    } else {
+      // VulkanとSDLは、エクステンションを通じてやりとりするので、SDLからVulkanインスタンスに登録すべきエクステンションのリストを取得する
+      unsigned int sdlExtensionCount;
+      SDL_Vulkan_GetInstanceExtensions(window.get(), &sdlExtensionCount,
+                                       nullptr);
 
-    SDL_Vulkan_GetInstanceExtensions(window.get(), &sdlExtensionCount,
-                                     extensionNames.data());
+      extensionNames.resize(sdlExtensionCount);
 
-#if SUPPORT_MOLTENVK
-    // MoltenVKに対応する場合は、以下のエクステンションが必要となる
-    extensionNames.push_back(
-        VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
-    extensionNames.push_back(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
-#endif
+      SDL_Vulkan_GetInstanceExtensions(window.get(), &sdlExtensionCount,
+                                       extensionNames.data());
+    }
 
-#if ENABLE_VALIDATION
-    extensionNames.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
-#endif
+    // MoltenVKに対応する場合と、デバイスエクステンションのプロパティを取得する場合に必要となる
+    if (portabilityEnabled || properties2Enabled) {
+      extensionNames.push_back(
+          VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+    }
+
+    if (portabilityEnabled) {
+      extensionNames.push_back(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
+    }
+
+    // デバイスのVK_KHR_external_memoryが依存する
+    if (externalMemoryCapabilitiesEnabled) {
+      extensionNames.push_back(
+          VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME);
+    }
+
+    if (validationEnabled) {
+      extensionNames.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+    }
+
+    if (perfReport) {
+      // vk::ValidationFeaturesEXTでBest Practicesを有効にするために必要
+      extensionNames.push_back(VK_EXT_VALIDATION_FEATURES_EXTENSION_NAME);
+    }
+
+    for (auto&& ext : config.extensions) {
+      extensionNames.push_back(ext.c_str());
+    }
 
     return extensionNames;
   }
@@ -441,13 +3168,37 @@ class Application : public SDLApplication {
     }
   }
 
+  bool isLayerAvailable(const char* name) {
+    for (auto&& layer : context.enumerateInstanceLayerProperties()) {
+      if (std::strcmp(layer.layerName.data(), name) == 0) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  bool isExtensionAvailable(const char* name) {
+    for (auto&& ext : context.enumerateInstanceExtensionProperties()) {
+      if (std::strcmp(ext.extensionName.data(), name) == 0) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
   // 必要なレイヤーを取得する
   std::vector<const char*> getRequiredLayers() {
     std::vector<const char*> layerNames;
 
-#if ENABLE_VALIDATION
-    layerNames.push_back("VK_LAYER_KHRONOS_validation");
-#endif
+    if (validationEnabled) {
+      layerNames.push_back(VALIDATION_LAYER_NAME);
+    }
+
+    for (auto&& layer : config.layers) {
+      layerNames.push_back(layer.c_str());
+    }
 
     return layerNames;
   }
@@ -458,24 +3209,33 @@ class Application : public SDLApplication {
            std::to_string(VK_VERSION_PATCH(version));
   }
 
-  static void showPhysicalDevices(const char* message,
-                                  const vk::raii::PhysicalDevices& devices) {
+  static void showPhysicalDevices(
+      const char* message,
+      const std::vector<PhysicalDeviceInfo>& infos,
+      const std::vector<std::optional<int64_t>>& scores) {
     std::cout << "# " << message << ":" << std::endl;
 
-    for (auto&& dev : devices) {
-      vk::PhysicalDeviceProperties props = dev.getProperties();
+    for (size_t i = 0; i < infos.size(); i++) {
+      const vk::PhysicalDeviceProperties& props = infos[i].properties;
 
-      std::cout << "| " << props.deviceName << " ["
+      std::cout << "| " << i << ": " << props.deviceName << " ["
                 << versionToString(props.apiVersion) << ", "
                 << props.driverVersion << ", " << props.vendorID << ", "
                 << props.deviceID << ", "
-                << static_cast<uint32_t>(props.deviceType) << "]" << std::endl;
+                << static_cast<uint32_t>(props.deviceType) << ", "
+                << (infos[i].deviceLocalMemorySize() >> 20) << " MiB]";
+
+      if (scores[i].has_value()) {
+        std::cout << " Score: " << *scores[i] << std::endl;
+      } else {
+        std::cout << " Unsuitable" << std::endl;
+      }
     }
   }
 
   static void showPhysicalDevice(const char* message,
-                                 vk::raii::PhysicalDevice& device) {
-    vk::PhysicalDeviceProperties props = device.getProperties();
+                                 const PhysicalDeviceInfo& info) {
+    const vk::PhysicalDeviceProperties& props = info.properties;
 
     std::cout << "# " << message << ": " << props.deviceName << " ["
               << versionToString(props.apiVersion) << ", "
@@ -500,6 +3260,69 @@ class Application : public SDLApplication {
     }
   }
 
+  static void showQueueTopology(const char* message,
+                                const QueueTopology& topology) {
+    std::cout << "# " << message << ":" << std::endl;
+
+    for (uint32_t i = 0; i < QUEUE_ROLE_COUNT; i++) {
+      auto role = static_cast<QueueRole>(i);
+      const QueueAssignment& assignment = topology[role];
+
+      std::cout << "| " << queueRoleToString(role) << ": family "
+                << assignment.familyIndex << ", queue "
+                << assignment.queueIndex << ", priority "
+                << topology.getPriority(role);
+
+      if (assignment.dedicatedFamily) {
+        std::cout << " (dedicated)";
+      }
+
+      if (assignment.shared) {
+        std::cout << " (shared)";
+      }
+
+      std::cout << std::endl;
+    }
+  }
+
+  static void showMemoryTypeTables(const char* message,
+                                   const MemoryAllocator& allocator) {
+    const char* usageNames[] = {"gpu-only", "upload", "readback"};
+
+    std::cout << "# " << message << ":" << std::endl;
+
+    for (uint32_t i = 0; i < MEMORY_USAGE_COUNT; i++) {
+      std::cout << "| " << usageNames[i] << ":";
+
+      for (uint32_t index :
+           allocator.getMemoryTypeTable(static_cast<MemoryUsage>(i))) {
+        std::cout << " " << index;
+      }
+
+      std::cout << std::endl;
+    }
+  }
+
+  static void showMemoryStatistics(const char* message,
+                                   MemoryAllocator& allocator) {
+    std::vector<MemoryAllocator::HeapStatistics> statistics =
+        allocator.getStatistics();
+
+    std::cout << "# " << message << ":" << std::endl;
+
+    for (size_t i = 0; i < statistics.size(); i++) {
+      auto&& stats = statistics[i];
+
+      std::cout << "| Heap " << i << ": " << stats.blockCount << " blocks ("
+                << (stats.blockBytes >> 10) << " KiB), "
+                << stats.allocationCount << " allocations ("
+                << (stats.allocationBytes >> 10) << " KiB), "
+                << stats.dedicatedCount << " dedicated ("
+                << (stats.dedicatedBytes >> 10) << " KiB), peak "
+                << (stats.peakBytes >> 10) << " KiB" << std::endl;
+    }
+  }
+
   static void showFlags(const std::vector<std::string>& flags) {
     if (flags.size() > 0) {
       std::cout << flags[0];
@@ -542,92 +3365,80 @@ class Application : public SDLApplication {
     return strings;
   }
 
-  // 条件を満たす一番最初のデバイスを返す
-  vk::raii::PhysicalDevice& selectPhysicalDevice(
-      vk::raii::PhysicalDevices& devices,
-      vk::raii::SurfaceKHR& surface) {
-    for (auto&& dev : devices) {
-      if (isSuitablePhysicalDevice(dev, surface)) {
-        return dev;
+  // 評価が最も高いデバイスのインデックスを返す
+  // --deviceで指定された場合は、条件を満たしていればそのデバイスを使う
+  size_t selectPhysicalDevice(
+      const std::vector<std::optional<int64_t>>& scores) {
+    if (deviceIndex.has_value()) {
+      if (*deviceIndex >= scores.size() || !scores[*deviceIndex].has_value()) {
+        throw std::runtime_error("Physical device " +
+                                 std::to_string(*deviceIndex) +
+                                 " is not suitable");
       }
-    }
-
-    throw std::runtime_error("No suitable physical device");
-  }
 
-  bool isSuitablePhysicalDevice(vk::raii::PhysicalDevice& device,
-                                vk::raii::SurfaceKHR& surface) {
-    std::optional<uint32_t> graphicsQueueFamily =
-        findQueueFamilyIndex(device, vk::QueueFlagBits::eGraphics);
-    std::optional<uint32_t> presentQueueFamily =
-        findPresentQueueFamilyIndex(device, surface);
-    return graphicsQueueFamily.has_value() && presentQueueFamily.has_value() &&
-           checkDeviceExtensionSupport(device);
-  }
-
-  // フラグの条件を満たす一番最初のキューファミリーのインデックスを返す
-  std::optional<uint32_t> findQueueFamilyIndex(vk::raii::PhysicalDevice& device,
-                                               vk::QueueFlags flags) {
-    std::vector<vk::QueueFamilyProperties> families =
-        device.getQueueFamilyProperties();
+      return *deviceIndex;
+    }
 
-    for (size_t i = 0; i < families.size(); i++) {
-      auto&& family = families[i];
+    std::vector<size_t> ranking = rankPhysicalDevices(scores);
 
-      if ((family.queueFlags & flags) != vk::QueueFlags{}) {
-        return static_cast<uint32_t>(i);
-      }
+    if (ranking.empty()) {
+      throw std::runtime_error("No suitable physical device");
     }
 
-    return std::nullopt;
+    return ranking[0];
   }
 
-  // プレゼンテーションをサポートする一番最初のキューファミリーのインデックスを返す
-  std::optional<uint32_t> findPresentQueueFamilyIndex(
-      vk::raii::PhysicalDevice& device,
-      vk::raii::SurfaceKHR& surface) {
-    std::vector<vk::QueueFamilyProperties> families =
-        device.getQueueFamilyProperties();
-
-    for (size_t i = 0; i < families.size(); i++) {
-      vk::Bool32 supported =
-          device.getSurfaceSupportKHR(static_cast<uint32_t>(i), *surface);
-
-      if (supported) {
-        return static_cast<uint32_t>(i);
-      }
-    }
-
-    return std::nullopt;
+  // デバイスが満たすべき条件
+  static DeviceRequirements getDeviceRequirements() {
+    DeviceRequirements requirements;
+    requirements.extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    return requirements;
   }
 
   std::vector<const char*> getRequiredDeviceExtensions(
-      const vk::raii::PhysicalDevice& physicalDevice) {
+      const PhysicalDeviceInfo& info) {
     std::vector<const char*> extensions;
 
     extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
 
-#if SUPPORT_MOLTENVK
-    extensions.push_back("VK_KHR_portability_subset");
-#endif
+    // VK_KHR_portability_subsetはサポートしているデバイスでのみ有効化する
+    // lavapipeなど、ポータビリティ実装でないデバイスはこのエクステンションを持たない
+    if (info.hasExtension("VK_KHR_portability_subset")) {
+      extensions.push_back("VK_KHR_portability_subset");
+    }
 
-    return extensions;
-  }
+    if (externalMemoryHostEnabled) {
+      // Vulkan 1.0では、VK_KHR_external_memoryも必要となる
+      extensions.push_back(VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME);
+      extensions.push_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+    }
+
+    if (hostImageCopyEnabled) {
+      extensions.push_back(VK_KHR_COPY_COMMANDS_2_EXTENSION_NAME);
+      extensions.push_back(VK_KHR_FORMAT_FEATURE_FLAGS_2_EXTENSION_NAME);
+      extensions.push_back(VK_EXT_HOST_IMAGE_COPY_EXTENSION_NAME);
+    }
+
+    if (memoryBudgetEnabled) {
+      extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    }
 
-  bool checkDeviceExtensionSupport(
-      const vk::raii::PhysicalDevice& physicalDevice) {
-    auto availableExtensions =
-        physicalDevice.enumerateDeviceExtensionProperties();
+    if (pipelineCreationFeedbackEnabled) {
+      extensions.push_back(VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME);
+    }
 
-    auto requiredExtensionsVec = getRequiredDeviceExtensions(physicalDevice);
-    std::set<std::string> requiredExtensions(requiredExtensionsVec.begin(),
-                                             requiredExtensionsVec.end());
+    if (graphicsPipelineLibraryEnabled) {
+      extensions.push_back(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+      extensions.push_back(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+    }
 
-    for (auto&& ext : availableExtensions) {
-      requiredExtensions.erase(ext.extensionName);
+    if (shaderObjectEnabled) {
+      extensions.insert(extensions.end(),
+                        ShaderObjectRenderer::REQUIRED_EXTENSIONS.begin(),
+                        ShaderObjectRenderer::REQUIRED_EXTENSIONS.end());
     }
 
-    return requiredExtensions.empty();
+    return extensions;
   }
 
   uint32_t selectSwapchainImageCount(
@@ -673,7 +3484,7 @@ class Application : public SDLApplication {
       return capabilities.currentExtent;
     } else {
       int width, height;
-      SDL_Vulkan_GetDrawableSize(window.get(), &width, &height);
+      getDrawableSize(width, height);
 
       vk::Extent2D extent{std::clamp(static_cast<uint32_t>(width),
                                      capabilities.minImageExtent.width,
@@ -686,6 +3497,15 @@ class Application : public SDLApplication {
     }
   }
 
+  void getDrawableSize(int& width, int& height) {
+    // ヘッドレス時はVulkan対応のウィンドウではないので、ウィンドウサイズを使用する
+    if (headless) {
+      SDL_GetWindowSize(window.get(), &width, &height);
+    } else {
+      SDL_Vulkan_GetDrawableSize(window.get(), &width, &height);
+    }
+  }
+
   void showSurfaceCapabilities(const char* message,
                                vk::SurfaceCapabilitiesKHR& cap) {
     std::cout << "# " << message << ":" << std::endl;
@@ -0,0 +1,624 @@
+/*
+ * デバイスメモリーの割り当て
+ *
+ * リソースごとにvkAllocateMemory()を呼ぶと、maxMemoryAllocationCount (4096程度の実装が多い) に
+ * すぐに達してしまうので、大きなブロックを確保し、その中をTLSFで切り分けて使う
+ * ブロックはメモリータイプとリニア/非リニアリソースの組ごとに持つ
+ * (同じブロックに混在させると、bufferImageGranularityを考慮しなければならない)
+ * ブロックの半分を超える大きなリソースには、専用の割り当てを行う
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include "tlsf.hh"
+#include "tracer.hh"
+
+// メモリーの用途
+enum class MemoryUsage : uint32_t {
+  // GPUのみが読み書きする (デバイスローカル)
+  eGpuOnly,
+  // CPUが書き込み、GPUが読み込む (ステージングバッファーなど)
+  eUpload,
+  // GPUが書き込み、CPUが読み込む
+  eReadback,
+};
+
+constexpr size_t MEMORY_USAGE_COUNT = 3;
+
+struct MemoryAllocation {
+  vk::DeviceMemory memory;
+  vk::DeviceSize offset = 0;
+  vk::DeviceSize size = 0;
+  uint32_t memoryTypeIndex = 0;
+  // ホストから見えるメモリーであれば、永続的にマップしたアドレス (offset適用済み)
+  void* mapped = nullptr;
+
+  // 以下は解放時に使用する
+  uint64_t id = 0;
+  bool dedicated = false;
+  uint32_t poolIndex = 0;
+  uint32_t blockIndex = 0;
+  Tlsf::Handle handle = 0;
+};
+
+class MemoryAllocator {
+ public:
+  // ヒープごとの使用状況
+  struct HeapStatistics {
+    // vkAllocateMemory()で確保したブロック
+    uint32_t blockCount = 0;
+    vk::DeviceSize blockBytes = 0;
+    // ブロック内の割り当て
+    uint32_t allocationCount = 0;
+    vk::DeviceSize allocationBytes = 0;
+    // 専用の割り当て
+    uint32_t dedicatedCount = 0;
+    vk::DeviceSize dedicatedBytes = 0;
+    // vkAllocateMemory()で確保した量の最大値
+    vk::DeviceSize peakBytes = 0;
+  };
+
+  // ヒープごとのブロック内の空き領域
+  struct FragmentationStatistics {
+    vk::DeviceSize freeBytes = 0;
+    // ブロックごとの最大の空き領域の合計
+    vk::DeviceSize largestFreeBytes = 0;
+
+    // 各ブロックの最大の空き領域に入らない空き領域の割合 (0であれば断片化していない)
+    double getFragmentation() const {
+      return freeBytes > 0 ? 1.0 - static_cast<double>(largestFreeBytes) /
+                                       static_cast<double>(freeBytes)
+                           : 0.0;
+    }
+  };
+
+  // ブロックの最大サイズ
+  static constexpr vk::DeviceSize MAX_BLOCK_SIZE = 64ull << 20;
+
+ private:
+  struct Block {
+    vk::raii::DeviceMemory memory;
+    Tlsf tlsf;
+    void* mapped;
+  };
+
+  // vkAllocateMemory()の回数が上限に達した (allocate()は次のメモリータイプを試す)
+  struct AllocationCountExceeded : std::runtime_error {
+    AllocationCountExceeded()
+        : std::runtime_error("maxMemoryAllocationCount exceeded") {}
+  };
+
+  // メモリータイプとリソースの種類の組ごとのブロック
+  struct Pool {
+    // 解放したブロックはnullptrにし、インデックスを変えない
+    std::vector<std::unique_ptr<Block>> blocks;
+    uint32_t emptyBlockCount = 0;
+  };
+
+  std::shared_ptr<vk::raii::Device> device;
+  vk::PhysicalDeviceMemoryProperties memoryProperties;
+  uint32_t maxAllocationCount;
+  vk::DeviceSize nonCoherentAtomSize;
+  // 用途ごとに、優先する順に並べたメモリータイプのインデックス
+  std::array<std::vector<uint32_t>, MEMORY_USAGE_COUNT> memoryTypeTables;
+  std::vector<vk::DeviceSize> blockSizes;
+
+  std::mutex mutex;
+  // メモリータイプ * 2 + (非リニアなら1)
+  std::vector<Pool> pools;
+  std::map<uint64_t, vk::raii::DeviceMemory> dedicatedMemories;
+  std::vector<HeapStatistics> heapStatistics;
+  // 現在のvkAllocateMemory()の回数
+  uint32_t deviceAllocationCount = 0;
+  uint64_t nextId = 1;
+  // 割り当てと解放の記録 (CPUのみのベンチマークで再生する)
+  std::ofstream trace;
+
+ public:
+  MemoryAllocator(std::shared_ptr<vk::raii::Device> device,
+                  const vk::raii::PhysicalDevice& physicalDevice)
+      : device(std::move(device)) {
+    memoryProperties = physicalDevice.getMemoryProperties();
+    vk::PhysicalDeviceLimits limits = physicalDevice.getProperties().limits;
+    maxAllocationCount = limits.maxMemoryAllocationCount;
+    nonCoherentAtomSize = limits.nonCoherentAtomSize;
+
+    memoryTypeTables[static_cast<size_t>(MemoryUsage::eGpuOnly)] =
+        buildMemoryTypeTable({}, vk::MemoryPropertyFlagBits::eDeviceLocal,
+                             vk::MemoryPropertyFlagBits::eHostVisible);
+    // デバイスローカルかつホストから見えるメモリー (BAR) は小さいことが多いので、ステージングには使わない
+    memoryTypeTables[static_cast<size_t>(MemoryUsage::eUpload)] =
+        buildMemoryTypeTable(vk::MemoryPropertyFlagBits::eHostVisible,
+                             vk::MemoryPropertyFlagBits::eHostCoherent,
+                             vk::MemoryPropertyFlagBits::eDeviceLocal |
+                                 vk::MemoryPropertyFlagBits::eHostCached);
+    memoryTypeTables[static_cast<size_t>(MemoryUsage::eReadback)] =
+        buildMemoryTypeTable(vk::MemoryPropertyFlagBits::eHostVisible,
+                             vk::MemoryPropertyFlagBits::eHostCached |
+                                 vk::MemoryPropertyFlagBits::eHostCoherent,
+                             {});
+
+    for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++) {
+      // 小さいヒープでは、ヒープの1/8をブロックのサイズにする
+      blockSizes.push_back(
+          std::min(MAX_BLOCK_SIZE, memoryProperties.memoryHeaps[i].size / 8));
+    }
+
+    pools.resize(memoryProperties.memoryTypeCount * 2);
+    heapStatistics.resize(memoryProperties.memoryHeapCount);
+  }
+
+  MemoryAllocator(const MemoryAllocator&) = delete;
+  MemoryAllocator& operator=(const MemoryAllocator&) = delete;
+
+  // 割り当てと解放をファイルに記録する
+  void recordTrace(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    trace.open(path);
+
+    if (!trace) {
+      throw std::runtime_error("Failed to open " + path);
+    }
+  }
+
+  // typeBitsに含まれるメモリータイプから、用途に最も適したものを返す
+  std::optional<uint32_t> findMemoryType(uint32_t typeBits,
+                                         MemoryUsage usage) const {
+    for (uint32_t index : memoryTypeTables[static_cast<size_t>(usage)]) {
+      if ((typeBits & (1u << index)) != 0) {
+        return index;
+      }
+    }
+
+    return std::nullopt;
+  }
+
+  const std::vector<uint32_t>& getMemoryTypeTable(MemoryUsage usage) const {
+    return memoryTypeTables[static_cast<size_t>(usage)];
+  }
+
+  // linearはバッファーやリニアタイリングのイメージであるか
+  MemoryAllocation allocate(const vk::MemoryRequirements& requirements,
+                            MemoryUsage usage,
+                            bool linear,
+                            bool dedicated = false) {
+    TRACE_SCOPE("MemoryAllocator::allocate");
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // 優先するメモリータイプが一杯であれば、次のメモリータイプを試す
+    for (uint32_t typeIndex : memoryTypeTables[static_cast<size_t>(usage)]) {
+      if ((requirements.memoryTypeBits & (1u << typeIndex)) == 0) {
+        continue;
+      }
+
+      uint32_t heapIndex = memoryProperties.memoryTypes[typeIndex].heapIndex;
+      bool useDedicated =
+          dedicated || requirements.size > blockSizes[heapIndex] / 2;
+      std::optional<MemoryAllocation> allocation;
+
+      try {
+        allocation = useDedicated
+                         ? allocateDedicated(requirements.size, typeIndex)
+                         : allocateFromPool(requirements, typeIndex, linear);
+      } catch (const vk::OutOfDeviceMemoryError&) {
+      } catch (const vk::OutOfHostMemoryError&) {
+      } catch (const AllocationCountExceeded&) {
+        // 他のメモリータイプであれば、既存のブロックに空きがあるかもしれない
+      }
+
+      if (allocation.has_value()) {
+        if (trace.is_open()) {
+          trace << "a " << allocation->id << " " << requirements.size << " "
+                << requirements.alignment << " " << typeIndex << "\n";
+        }
+
+        return *allocation;
+      }
+    }
+
+    throw std::runtime_error("Failed to allocate device memory of " +
+                             std::to_string(requirements.size) + " bytes");
+  }
+
+  void free(const MemoryAllocation& allocation) {
+    TRACE_SCOPE("MemoryAllocator::free");
+
+    std::lock_guard<std::mutex> lock(mutex);
+    freeLocked(allocation);
+  }
+
+  // まとめて解放する (ロックは1回だけ取る)
+  void free(const std::vector<MemoryAllocation>& allocations) {
+    if (allocations.empty()) {
+      return;
+    }
+
+    TRACE_SCOPE("MemoryAllocator::free");
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto&& allocation : allocations) {
+      freeLocked(allocation);
+    }
+  }
+
+  // バッファーを作成し、メモリーを割り当ててバインドする
+  std::pair<vk::raii::Buffer, MemoryAllocation> createBuffer(
+      const vk::BufferCreateInfo& bufferInfo,
+      MemoryUsage usage) {
+    vk::raii::Buffer buffer(*device, bufferInfo);
+    MemoryAllocation allocation =
+        allocate(buffer.getMemoryRequirements(), usage, true);
+    buffer.bindMemory(allocation.memory, allocation.offset);
+    return {std::move(buffer), allocation};
+  }
+
+  // イメージを作成し、メモリーを割り当ててバインドする
+  std::pair<vk::raii::Image, MemoryAllocation> createImage(
+      const vk::ImageCreateInfo& imageInfo,
+      MemoryUsage usage,
+      bool dedicated = false) {
+    vk::raii::Image image(*device, imageInfo);
+    MemoryAllocation allocation =
+        allocate(image.getMemoryRequirements(), usage,
+                 imageInfo.tiling == vk::ImageTiling::eLinear, dedicated);
+    image.bindMemory(allocation.memory, allocation.offset);
+    return {std::move(image), allocation};
+  }
+
+  // HOST_COHERENTでないメモリーに書き込んだ範囲をデバイスから見えるようにする
+  void flush(const MemoryAllocation& allocation,
+             vk::DeviceSize offset,
+             vk::DeviceSize size) {
+    vk::MemoryPropertyFlags flags =
+        memoryProperties.memoryTypes[allocation.memoryTypeIndex].propertyFlags;
+
+    if (flags & vk::MemoryPropertyFlagBits::eHostCoherent) {
+      return;
+    }
+
+    // 範囲はnonCoherentAtomSizeの倍数に揃える必要がある
+    // ブロックの中のオフセットで揃えるので、隣の割り当ての範囲も含まれうるが、問題は無い
+    vk::DeviceSize begin = allocation.offset + offset;
+    vk::DeviceSize end = begin + size;
+    begin -= begin % nonCoherentAtomSize;
+    end = (end + nonCoherentAtomSize - 1) / nonCoherentAtomSize *
+          nonCoherentAtomSize;
+
+    if (!allocation.dedicated) {
+      // 他のスレッドがallocate()でブロックを追加しうるので、ロックを取って読む
+      std::lock_guard<std::mutex> lock(mutex);
+      const Block& block =
+          *pools[allocation.poolIndex].blocks[allocation.blockIndex];
+      end = std::min(end, block.tlsf.getCapacity());
+    } else {
+      end = std::min(end, allocation.offset + allocation.size);
+    }
+
+    device->flushMappedMemoryRanges(
+        vk::MappedMemoryRange{allocation.memory, begin, end - begin});
+  }
+
+  std::vector<HeapStatistics> getStatistics() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return heapStatistics;
+  }
+
+  // ブロックを走査するので、毎フレーム呼ぶ場合は注意する
+  std::vector<FragmentationStatistics> getFragmentationStatistics() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<FragmentationStatistics> statistics(
+        memoryProperties.memoryHeapCount);
+
+    for (uint32_t poolIndex = 0; poolIndex < pools.size(); poolIndex++) {
+      FragmentationStatistics& stats =
+          statistics[memoryProperties.memoryTypes[poolIndex / 2].heapIndex];
+
+      for (auto&& block : pools[poolIndex].blocks) {
+        if (block) {
+          stats.freeBytes +=
+              block->tlsf.getCapacity() - block->tlsf.getUsedSize();
+          stats.largestFreeBytes += block->tlsf.getLargestFreeSize();
+        }
+      }
+    }
+
+    return statistics;
+  }
+
+  // 割り当てを含むブロックの使用率 (専用の割り当ては1)
+  double getBlockUsage(const MemoryAllocation& allocation) {
+    if (allocation.dedicated) {
+      return 1.0;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    return getUsage(*pools[allocation.poolIndex].blocks[allocation.blockIndex]);
+  }
+
+  // デフラグメンテーションの移動先を割り当てる
+  // allocationと同じプールの、allocationを含むブロックより使用率の高いブロックから割り当てる
+  // 新しいブロックは確保せず、収まらなければstd::nulloptを返す
+  std::optional<MemoryAllocation> allocateForMove(
+      const MemoryAllocation& allocation,
+      const vk::MemoryRequirements& requirements) {
+    if (allocation.dedicated ||
+        (requirements.memoryTypeBits & (1u << allocation.memoryTypeIndex)) ==
+            0) {
+      return std::nullopt;
+    }
+
+    TRACE_SCOPE("MemoryAllocator::allocateForMove");
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Pool& pool = pools[allocation.poolIndex];
+    double sourceUsage = getUsage(*pool.blocks[allocation.blockIndex]);
+
+    for (uint32_t i = 0; i < pool.blocks.size(); i++) {
+      Block* block = pool.blocks[i].get();
+
+      // 空のブロックも、移動元より使用率が低いので対象外となる
+      if (block == nullptr || i == allocation.blockIndex ||
+          getUsage(*block) <= sourceUsage) {
+        continue;
+      }
+
+      std::optional<Tlsf::Allocation> range =
+          block->tlsf.allocate(requirements.size, requirements.alignment);
+
+      if (range.has_value()) {
+        MemoryAllocation moved =
+            makeAllocation(*block, allocation.poolIndex, i, *range,
+                           requirements.size, allocation.memoryTypeIndex);
+
+        if (trace.is_open()) {
+          trace << "a " << moved.id << " " << requirements.size << " "
+                << requirements.alignment << " " << moved.memoryTypeIndex
+                << "\n";
+        }
+
+        return moved;
+      }
+    }
+
+    return std::nullopt;
+  }
+
+  const vk::PhysicalDeviceMemoryProperties& getMemoryProperties() const {
+    return memoryProperties;
+  }
+
+ private:
+  // required: 必須のフラグ
+  // preferred: あると望ましいフラグ
+  // unwanted: 無いと望ましいフラグ
+  std::vector<uint32_t> buildMemoryTypeTable(vk::MemoryPropertyFlags required,
+                                             vk::MemoryPropertyFlags preferred,
+                                             vk::MemoryPropertyFlags unwanted) {
+    std::vector<std::pair<uint32_t, uint32_t>> candidates;
+
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+      vk::MemoryPropertyFlags flags =
+          memoryProperties.memoryTypes[i].propertyFlags;
+
+      if ((flags & required) != required) {
+        continue;
+      }
+
+      // 足りないフラグと余計なフラグの数をコストとする
+      uint32_t cost = static_cast<uint32_t>(
+          std::popcount(static_cast<uint32_t>(preferred & ~flags)) +
+          std::popcount(static_cast<uint32_t>(unwanted & flags)));
+      candidates.emplace_back(cost, i);
+    }
+
+    // 同じコストであれば、インデックスの小さい方 (実装が推奨する順) を優先する
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](auto&& a, auto&& b) { return a.first < b.first; });
+
+    std::vector<uint32_t> table;
+
+    for (auto&& candidate : candidates) {
+      table.push_back(candidate.second);
+    }
+
+    return table;
+  }
+
+  HeapStatistics& getHeapStatistics(uint32_t typeIndex) {
+    return heapStatistics[memoryProperties.memoryTypes[typeIndex].heapIndex];
+  }
+
+  static double getUsage(const Block& block) {
+    return static_cast<double>(block.tlsf.getUsedSize()) /
+           static_cast<double>(block.tlsf.getCapacity());
+  }
+
+  // mutexをロックした状態で呼ぶ
+  void freeLocked(const MemoryAllocation& allocation) {
+    if (trace.is_open()) {
+      trace << "f " << allocation.id << "\n";
+    }
+
+    HeapStatistics& stats = getHeapStatistics(allocation.memoryTypeIndex);
+
+    if (allocation.dedicated) {
+      dedicatedMemories.erase(allocation.id);
+      deviceAllocationCount--;
+      stats.dedicatedCount--;
+      stats.dedicatedBytes -= allocation.size;
+      return;
+    }
+
+    Pool& pool = pools[allocation.poolIndex];
+    std::unique_ptr<Block>& block = pool.blocks[allocation.blockIndex];
+
+    stats.allocationCount--;
+    stats.allocationBytes -= block->tlsf.getSize(allocation.handle);
+    block->tlsf.free(allocation.handle);
+
+    if (block->tlsf.isEmpty()) {
+      // 割り当てと解放を繰り返した時にvkAllocateMemory()を呼び直さないよう、空のブロックを1つだけ残す
+      if (pool.emptyBlockCount > 0) {
+        stats.blockCount--;
+        stats.blockBytes -= block->tlsf.getCapacity();
+        deviceAllocationCount--;
+        block.reset();
+      } else {
+        pool.emptyBlockCount++;
+      }
+    }
+  }
+
+  // vkAllocateMemory()でメモリーを確保し、ホストから見えるメモリーであればマップする
+  std::pair<vk::raii::DeviceMemory, void*> allocateDeviceMemory(
+      vk::DeviceSize size,
+      uint32_t typeIndex) {
+    if (deviceAllocationCount >= maxAllocationCount) {
+      throw AllocationCountExceeded();
+    }
+
+    TRACE_SCOPE("vkAllocateMemory");
+
+    vk::raii::DeviceMemory memory(*device,
+                                  vk::MemoryAllocateInfo{size, typeIndex});
+    void* mapped = nullptr;
+
+    if (memoryProperties.memoryTypes[typeIndex].propertyFlags &
+        vk::MemoryPropertyFlagBits::eHostVisible) {
+      mapped = memory.mapMemory(0, VK_WHOLE_SIZE);
+    }
+
+    deviceAllocationCount++;
+
+    HeapStatistics& stats = getHeapStatistics(typeIndex);
+    vk::DeviceSize total = stats.blockBytes + stats.dedicatedBytes + size;
+    stats.peakBytes = std::max(stats.peakBytes, total);
+
+    return {std::move(memory), mapped};
+  }
+
+  std::optional<MemoryAllocation> allocateDedicated(vk::DeviceSize size,
+                                                    uint32_t typeIndex) {
+    auto [memory, mapped] = allocateDeviceMemory(size, typeIndex);
+
+    MemoryAllocation allocation;
+    allocation.memory = *memory;
+    allocation.size = size;
+    allocation.memoryTypeIndex = typeIndex;
+    allocation.mapped = mapped;
+    allocation.id = nextId++;
+    allocation.dedicated = true;
+
+    dedicatedMemories.emplace(allocation.id, std::move(memory));
+
+    HeapStatistics& stats = getHeapStatistics(typeIndex);
+    stats.dedicatedCount++;
+    stats.dedicatedBytes += size;
+
+    return allocation;
+  }
+
+  std::optional<MemoryAllocation> allocateFromPool(
+      const vk::MemoryRequirements& requirements,
+      uint32_t typeIndex,
+      bool linear) {
+    uint32_t poolIndex = typeIndex * 2 + (linear ? 0 : 1);
+    Pool& pool = pools[poolIndex];
+    HeapStatistics& stats = getHeapStatistics(typeIndex);
+
+    // 既存のブロックから探し、無ければブロックを追加する
+    for (uint32_t i = 0; i <= pool.blocks.size(); i++) {
+      if (i == pool.blocks.size()) {
+        uint32_t heapIndex = memoryProperties.memoryTypes[typeIndex].heapIndex;
+        vk::DeviceSize blockSize =
+            std::max(blockSizes[heapIndex], requirements.size);
+        auto [memory, mapped] = allocateDeviceMemory(blockSize, typeIndex);
+
+        // 解放済みのスロットがあれば再利用する
+        auto slot = std::find(pool.blocks.begin(), pool.blocks.end(), nullptr);
+        i = static_cast<uint32_t>(slot - pool.blocks.begin());
+
+        auto block = std::unique_ptr<Block>(
+            new Block{std::move(memory), Tlsf(blockSize), mapped});
+
+        if (slot == pool.blocks.end()) {
+          pool.blocks.push_back(std::move(block));
+        } else {
+          *slot = std::move(block);
+        }
+
+        pool.emptyBlockCount++;
+        stats.blockCount++;
+        stats.blockBytes += blockSize;
+      }
+
+      Block* block = pool.blocks[i].get();
+
+      if (block == nullptr) {
+        continue;
+      }
+
+      bool wasEmpty = block->tlsf.isEmpty();
+      std::optional<Tlsf::Allocation> range =
+          block->tlsf.allocate(requirements.size, requirements.alignment);
+
+      if (!range.has_value()) {
+        continue;
+      }
+
+      if (wasEmpty) {
+        pool.emptyBlockCount--;
+      }
+
+      return makeAllocation(*block, poolIndex, i, *range, requirements.size,
+                            typeIndex);
+    }
+
+    return std::nullopt;
+  }
+
+  // ブロック内に確保した範囲から割り当てを作る
+  MemoryAllocation makeAllocation(Block& block,
+                                  uint32_t poolIndex,
+                                  uint32_t blockIndex,
+                                  const Tlsf::Allocation& range,
+                                  vk::DeviceSize size,
+                                  uint32_t typeIndex) {
+    HeapStatistics& stats = getHeapStatistics(typeIndex);
+    stats.allocationCount++;
+    stats.allocationBytes += block.tlsf.getSize(range.handle);
+
+    MemoryAllocation allocation;
+    allocation.memory = *block.memory;
+    allocation.offset = range.offset;
+    allocation.size = size;
+    allocation.memoryTypeIndex = typeIndex;
+    allocation.mapped = block.mapped != nullptr
+                            ? static_cast<char*>(block.mapped) + range.offset
+                            : nullptr;
+    allocation.id = nextId++;
+    allocation.poolIndex = poolIndex;
+    allocation.blockIndex = blockIndex;
+    allocation.handle = range.handle;
+    return allocation;
+  }
+};
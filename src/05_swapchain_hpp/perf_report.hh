@@ -0,0 +1,291 @@
+/*
+ * デバッグメッセンジャーのパフォーマンス警告 (VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT) を集計する
+ *
+ * メッセージIDとオブジェクトハンドルの組ごとに、件数と発生したフレームを数え、
+ * 件数の多い順に並べたJSONとして書き出す
+ * 記録はドライバーのスレッドから呼ばれるので、LogSinkと同様にロックもメモリ確保もしない
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "console.hh"
+
+class PerfReport {
+ public:
+  // バケット数 (2のべき乗)
+  static constexpr size_t MAX_BUCKETS = 4096;
+  // レポートに含めるメッセージの最大長
+  static constexpr size_t MAX_MESSAGE_LENGTH = 512;
+  static constexpr size_t MAX_ID_NAME_LENGTH = 64;
+
+ private:
+  enum BucketState : uint32_t { eEmpty, eClaiming, eReady };
+
+  struct Bucket {
+    std::atomic<uint32_t> state{eEmpty};
+    // 以下のキーと最初のメッセージはstateがeReadyになる前に書き込まれ、以後変更されない
+    int32_t messageId = 0;
+    VkObjectType objectType = VK_OBJECT_TYPE_UNKNOWN;
+    uint64_t objectHandle = 0;
+    std::array<char, MAX_ID_NAME_LENGTH> idName{};
+    std::array<char, MAX_MESSAGE_LENGTH> message{};
+
+    std::atomic<uint64_t> count{0};
+    // 発生したフレーム数
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> firstFrame{0};
+    std::atomic<uint64_t> lastFrame{UINT64_MAX};
+    std::atomic<uint32_t> lastFrameCount{0};
+    std::atomic<uint32_t> maxPerFrame{0};
+  };
+
+  std::array<Bucket, MAX_BUCKETS> buckets;
+  std::atomic<uint64_t> currentFrame{0};
+  // バケットが足りずに集計できなかったメッセージ数
+  std::atomic<uint64_t> dropped{0};
+
+ public:
+  // フレームの開始時に呼ぶ
+  void beginFrame(uint64_t frame) {
+    currentFrame.store(frame, std::memory_order_relaxed);
+  }
+
+  // デバッグメッセンジャーのコールバックから呼ばれる
+  void record(const VkDebugUtilsMessengerCallbackDataEXT& data) {
+    VkObjectType objectType = VK_OBJECT_TYPE_UNKNOWN;
+    uint64_t objectHandle = 0;
+
+    // 最初のオブジェクトを、警告の原因となったオブジェクトとみなす
+    if (data.objectCount > 0 && data.pObjects != nullptr) {
+      objectType = data.pObjects[0].objectType;
+      objectHandle = data.pObjects[0].objectHandle;
+    }
+
+    Bucket* bucket = findBucket(data, objectType, objectHandle);
+
+    if (bucket == nullptr) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    uint64_t frame = currentFrame.load(std::memory_order_relaxed);
+    uint64_t last = bucket->lastFrame.load(std::memory_order_relaxed);
+
+    bucket->count.fetch_add(1, std::memory_order_relaxed);
+
+    if (last != frame && bucket->lastFrame.compare_exchange_strong(
+                             last, frame, std::memory_order_relaxed)) {
+      if (bucket->frames.fetch_add(1, std::memory_order_relaxed) == 0) {
+        bucket->firstFrame.store(frame, std::memory_order_relaxed);
+      }
+
+      bucket->lastFrameCount.store(0, std::memory_order_relaxed);
+    }
+
+    uint32_t perFrame =
+        bucket->lastFrameCount.fetch_add(1, std::memory_order_relaxed) + 1;
+    uint32_t max = bucket->maxPerFrame.load(std::memory_order_relaxed);
+
+    while (perFrame > max && !bucket->maxPerFrame.compare_exchange_weak(
+                                 max, perFrame, std::memory_order_relaxed)) {
+    }
+  }
+
+  // 件数の多い順に並べたJSONを書き出す
+  // 実行中にも呼ばれるので、書き出せなかった場合は例外を投げずに警告してfalseを返す
+  bool write(const std::string& path, uint64_t totalFrames) const {
+    struct Row {
+      const Bucket* bucket;
+      uint64_t count;
+    };
+
+    std::vector<Row> rows;
+
+    for (auto&& bucket : buckets) {
+      if (bucket.state.load(std::memory_order_acquire) == eReady) {
+        rows.push_back(
+            Row{&bucket, bucket.count.load(std::memory_order_relaxed)});
+      }
+    }
+
+    std::sort(rows.begin(), rows.end(),
+              [](auto&& a, auto&& b) { return a.count > b.count; });
+
+    std::ofstream out(path);
+
+    if (!out) {
+      std::cout << Console::fgYellow << "# "
+                << "Failed to open " << path << Console::fgDefault
+                << std::endl;
+      return false;
+    }
+
+    out << "{\n";
+    out << "  \"frames\": " << totalFrames << ",\n";
+    out << "  \"dropped\": " << dropped.load(std::memory_order_relaxed)
+        << ",\n";
+    out << "  \"warnings\": [";
+
+    for (size_t i = 0; i < rows.size(); i++) {
+      const Bucket& bucket = *rows[i].bucket;
+      uint64_t frames = bucket.frames.load(std::memory_order_relaxed);
+
+      out << (i == 0 ? "\n" : ",\n");
+      out << "    {\n";
+      out << "      \"rank\": " << i + 1 << ",\n";
+      out << "      \"messageId\": " << bucket.messageId << ",\n";
+      out << "      \"messageIdName\": " << quote(bucket.idName.data())
+          << ",\n";
+      out << "      \"objectType\": " << bucket.objectType << ",\n";
+      out << "      \"objectHandle\": " << quote(toHex(bucket.objectHandle))
+          << ",\n";
+      out << "      \"count\": " << rows[i].count << ",\n";
+      out << "      \"frames\": " << frames << ",\n";
+      out << "      \"firstFrame\": "
+          << bucket.firstFrame.load(std::memory_order_relaxed) << ",\n";
+      out << "      \"lastFrame\": "
+          << bucket.lastFrame.load(std::memory_order_relaxed) << ",\n";
+      out << "      \"maxPerFrame\": "
+          << bucket.maxPerFrame.load(std::memory_order_relaxed) << ",\n";
+      out << "      \"averagePerFrame\": "
+          << (frames > 0 ? static_cast<double>(rows[i].count) / frames : 0.0)
+          << ",\n";
+      out << "      \"message\": " << quote(bucket.message.data()) << "\n";
+      out << "    }";
+    }
+
+    out << (rows.empty() ? "]\n" : "\n  ]\n");
+    out << "}\n";
+    out.close();
+
+    if (!out) {
+      std::cout << Console::fgYellow << "# "
+                << "Failed to write " << path << Console::fgDefault
+                << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+
+ private:
+  // 開番地法のハッシュテーブルから (ID, オブジェクト) のバケットを探す
+  // 無ければ空きバケットを確保し、キーと最初のメッセージを書き込む
+  Bucket* findBucket(const VkDebugUtilsMessengerCallbackDataEXT& data,
+                     VkObjectType objectType,
+                     uint64_t objectHandle) {
+    uint64_t hash = static_cast<uint32_t>(data.messageIdNumber);
+    hash = (hash * 0x9e3779b97f4a7c15ull) ^ objectHandle;
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 32;
+
+    for (size_t i = 0; i < MAX_BUCKETS; i++) {
+      Bucket& bucket = buckets[(hash + i) & (MAX_BUCKETS - 1)];
+      uint32_t state = bucket.state.load(std::memory_order_acquire);
+
+      if (state == eEmpty) {
+        if (bucket.state.compare_exchange_strong(state, eClaiming,
+                                                 std::memory_order_acquire)) {
+          bucket.messageId = data.messageIdNumber;
+          bucket.objectType = objectType;
+          bucket.objectHandle = objectHandle;
+          copyString(bucket.idName, data.pMessageIdName);
+          copyString(bucket.message, data.pMessage);
+          bucket.state.store(eReady, std::memory_order_release);
+          return &bucket;
+        }
+      }
+
+      // 他のスレッドがキーを書き込み中であれば、書き終わるのを待つ
+      while (state == eClaiming) {
+        state = bucket.state.load(std::memory_order_acquire);
+      }
+
+      if (bucket.messageId == data.messageIdNumber &&
+          bucket.objectType == objectType &&
+          bucket.objectHandle == objectHandle) {
+        return &bucket;
+      }
+    }
+
+    return nullptr;
+  }
+
+  // 収まらない場合は、UTF-8の文字の途中で切らないように、その文字の先頭で切り捨てる
+  template <size_t N>
+  static void copyString(std::array<char, N>& dst, const char* src) {
+    size_t i = 0;
+
+    if (src != nullptr) {
+      for (; i < N - 1 && src[i] != '\0'; i++) {
+        dst[i] = src[i];
+      }
+
+      // src[i]は最初に切り捨てたバイトで、継続バイトであれば文字の途中
+      while (i > 0 && (static_cast<unsigned char>(src[i]) & 0xc0) == 0x80) {
+        i--;
+      }
+    }
+
+    dst[i] = '\0';
+  }
+
+  static std::string toHex(uint64_t value) {
+    char buffer[19];
+    std::snprintf(buffer, sizeof(buffer), "0x%016llx",
+                  static_cast<unsigned long long>(value));
+    return buffer;
+  }
+
+  // JSONの文字列リテラルにする
+  static std::string quote(const char* text) {
+    std::string quoted = "\"";
+
+    for (const char* p = text; *p != '\0'; p++) {
+      switch (*p) {
+        case '"':
+          quoted += "\\\"";
+          break;
+        case '\\':
+          quoted += "\\\\";
+          break;
+        case '\n':
+          quoted += "\\n";
+          break;
+        case '\r':
+          quoted += "\\r";
+          break;
+        case '\t':
+          quoted += "\\t";
+          break;
+        default:
+          if (static_cast<unsigned char>(*p) < 0x20) {
+            char buffer[7];
+            std::snprintf(buffer, sizeof(buffer), "\\u%04x", *p);
+            quoted += buffer;
+          } else {
+            quoted += *p;
+          }
+      }
+    }
+
+    return quoted + "\"";
+  }
+
+  static std::string quote(const std::string& text) {
+    return quote(text.c_str());
+  }
+};
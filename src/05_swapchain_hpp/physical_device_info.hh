@@ -0,0 +1,257 @@
+/*
+ * 物理デバイスの情報の取得と評価
+ *
+ * プロパティ、フィーチャー、メモリーヒープ、キューファミリー、エクステンションを
+ * デバイスごとに一度だけ取得し、以後はこの情報だけを使って判定する
+ * 取得はデバイスごとに並列に行う
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include "tracer.hh"
+
+struct PhysicalDeviceInfo {
+  // vk::raii::PhysicalDevices内のインデックス
+  size_t index = 0;
+  vk::PhysicalDeviceProperties properties;
+  vk::PhysicalDeviceFeatures features;
+  vk::PhysicalDeviceMemoryProperties memoryProperties;
+  std::vector<vk::QueueFamilyProperties> queueFamilies;
+  // キューファミリーごとに、サーフェイスへのプレゼンテーションをサポートするか
+  std::vector<bool> presentSupport;
+  // 名前順に並べたエクステンション
+  std::vector<vk::ExtensionProperties> extensions;
+
+  // デバイスの情報を取得する
+  // 物理デバイスへの問い合わせは外部同期を必要としないので、別スレッドから呼んでもよい
+  static PhysicalDeviceInfo probe(size_t index,
+                                  const vk::raii::PhysicalDevice& device,
+                                  const vk::raii::SurfaceKHR& surface) {
+    TRACE_SCOPE("PhysicalDeviceInfo::probe");
+
+    PhysicalDeviceInfo info;
+    info.index = index;
+    info.properties = device.getProperties();
+    info.features = device.getFeatures();
+    info.memoryProperties = device.getMemoryProperties();
+    info.queueFamilies = device.getQueueFamilyProperties();
+
+    for (uint32_t i = 0; i < info.queueFamilies.size(); i++) {
+      info.presentSupport.push_back(device.getSurfaceSupportKHR(i, *surface) ==
+                                    VK_TRUE);
+    }
+
+    info.extensions = device.enumerateDeviceExtensionProperties();
+    std::sort(info.extensions.begin(), info.extensions.end(),
+              [](auto&& a, auto&& b) {
+                return std::strcmp(a.extensionName.data(),
+                                   b.extensionName.data()) < 0;
+              });
+
+    return info;
+  }
+
+  // すべてのデバイスの情報を並列に取得する
+  static std::vector<PhysicalDeviceInfo> probeAll(
+      const vk::raii::PhysicalDevices& devices,
+      const vk::raii::SurfaceKHR& surface) {
+    TRACE_SCOPE("PhysicalDeviceInfo::probeAll");
+
+    std::vector<std::future<PhysicalDeviceInfo>> futures;
+
+    for (size_t i = 0; i < devices.size(); i++) {
+      futures.push_back(std::async(std::launch::async, [&, i] {
+        return probe(i, devices[i], surface);
+      }));
+    }
+
+    std::vector<PhysicalDeviceInfo> infos;
+
+    for (auto&& future : futures) {
+      infos.push_back(future.get());
+    }
+
+    return infos;
+  }
+
+  bool hasExtension(const char* name) const {
+    auto it = std::lower_bound(extensions.begin(), extensions.end(), name,
+                               [](auto&& ext, const char* value) {
+                                 return std::strcmp(ext.extensionName.data(),
+                                                    value) < 0;
+                               });
+    return it != extensions.end() &&
+           std::strcmp(it->extensionName.data(), name) == 0;
+  }
+
+  // requiredで有効になっているフィーチャーをすべてサポートしているか
+  bool hasFeatures(const vk::PhysicalDeviceFeatures& required) const {
+    // vk::PhysicalDeviceFeaturesはvk::Bool32のみを並べた構造体である
+    constexpr size_t count =
+        sizeof(vk::PhysicalDeviceFeatures) / sizeof(vk::Bool32);
+    auto available = reinterpret_cast<const vk::Bool32*>(&features);
+    auto requested = reinterpret_cast<const vk::Bool32*>(&required);
+
+    for (size_t i = 0; i < count; i++) {
+      if (requested[i] && !available[i]) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // フラグの条件を満たす一番最初のキューファミリーのインデックスを返す
+  std::optional<uint32_t> findQueueFamily(vk::QueueFlags flags) const {
+    for (uint32_t i = 0; i < queueFamilies.size(); i++) {
+      if ((queueFamilies[i].queueFlags & flags) != vk::QueueFlags{}) {
+        return i;
+      }
+    }
+
+    return std::nullopt;
+  }
+
+  // プレゼンテーションをサポートし、flagsをすべて持つ一番最初のキューファミリーのインデックスを返す
+  std::optional<uint32_t> findPresentQueueFamily(
+      vk::QueueFlags flags = {}) const {
+    for (uint32_t i = 0; i < presentSupport.size(); i++) {
+      if (presentSupport[i] && (queueFamilies[i].queueFlags & flags) == flags) {
+        return i;
+      }
+    }
+
+    return std::nullopt;
+  }
+
+  // 指定したフラグを持ち、除外するフラグを持たないキューファミリーの数
+  uint32_t countQueueFamilies(vk::QueueFlags flags,
+                              vk::QueueFlags excluded) const {
+    uint32_t count = 0;
+
+    for (auto&& family : queueFamilies) {
+      if ((family.queueFlags & flags) == flags &&
+          (family.queueFlags & excluded) == vk::QueueFlags{}) {
+        count++;
+      }
+    }
+
+    return count;
+  }
+
+  // デバイスローカルなヒープの合計サイズ
+  vk::DeviceSize deviceLocalMemorySize() const {
+    vk::DeviceSize size = 0;
+
+    for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++) {
+      auto&& heap = memoryProperties.memoryHeaps[i];
+
+      if (heap.flags & vk::MemoryHeapFlagBits::eDeviceLocal) {
+        size += heap.size;
+      }
+    }
+
+    return size;
+  }
+};
+
+// デバイスが満たすべき条件
+struct DeviceRequirements {
+  std::vector<std::string> extensions;
+  vk::PhysicalDeviceFeatures features;
+};
+
+// デバイスの評価方針
+// 条件を満たさないデバイスにはstd::nulloptを返し、それ以外は大きいほど優先する
+using DeviceScoringPolicy =
+    std::function<std::optional<int64_t>(const PhysicalDeviceInfo&)>;
+
+// 標準の評価方針
+// デバイスの種類 (ディスクリート > 統合 > 仮想 > CPU) を最優先し、
+// 次にデバイスローカルメモリーの容量、専用のコンピュート/転送キューの有無で比較する
+inline DeviceScoringPolicy defaultDeviceScoringPolicy(
+    DeviceRequirements requirements) {
+  return [requirements](
+             const PhysicalDeviceInfo& info) -> std::optional<int64_t> {
+    if (!info.findQueueFamily(vk::QueueFlagBits::eGraphics).has_value() ||
+        !info.findPresentQueueFamily().has_value()) {
+      return std::nullopt;
+    }
+
+    for (auto&& name : requirements.extensions) {
+      if (!info.hasExtension(name.c_str())) {
+        return std::nullopt;
+      }
+    }
+
+    if (!info.hasFeatures(requirements.features)) {
+      return std::nullopt;
+    }
+
+    int64_t typeScore = 0;
+
+    switch (info.properties.deviceType) {
+      case vk::PhysicalDeviceType::eDiscreteGpu:
+        typeScore = 4;
+        break;
+      case vk::PhysicalDeviceType::eIntegratedGpu:
+        typeScore = 3;
+        break;
+      case vk::PhysicalDeviceType::eVirtualGpu:
+        typeScore = 2;
+        break;
+      case vk::PhysicalDeviceType::eCpu:
+        typeScore = 1;
+        break;
+      default:
+        break;
+    }
+
+    // MiB単位のメモリー容量 (1 PiBで頭打ち) が種類の差を超えないようにする
+    int64_t memoryScore = static_cast<int64_t>(
+        std::min<vk::DeviceSize>(info.deviceLocalMemorySize() >> 20, 1 << 30));
+    int64_t queueScore = 0;
+
+    if (info.countQueueFamilies(vk::QueueFlagBits::eCompute,
+                                vk::QueueFlagBits::eGraphics) > 0) {
+      queueScore += 1;
+    }
+
+    if (info.countQueueFamilies(
+            vk::QueueFlagBits::eTransfer,
+            vk::QueueFlagBits::eGraphics | vk::QueueFlagBits::eCompute) > 0) {
+      queueScore += 1;
+    }
+
+    return (typeScore << 40) + (memoryScore << 2) + queueScore;
+  };
+}
+
+// 評価の高い順に、条件を満たすデバイスのインデックスを並べる
+inline std::vector<size_t> rankPhysicalDevices(
+    const std::vector<std::optional<int64_t>>& scores) {
+  std::vector<size_t> ranking;
+
+  for (size_t i = 0; i < scores.size(); i++) {
+    if (scores[i].has_value()) {
+      ranking.push_back(i);
+    }
+  }
+
+  // 同点の場合は列挙順を保つ
+  std::stable_sort(ranking.begin(), ranking.end(),
+                   [&](size_t a, size_t b) { return *scores[a] > *scores[b]; });
+
+  return ranking;
+}
@@ -0,0 +1,329 @@
+/*
+ * ディスクに保存するパイプラインキャッシュ
+ *
+ * 前回の実行で作成したパイプラインキャッシュのデータを、デバイスの作成時に読み込む
+ * データの先頭のヘッダー (VkPipelineCacheHeaderVersionOne) のベンダーID、デバイスID、
+ * pipelineCacheUUIDが今のデバイスと異なれば、ドライバーに渡さずに空のキャッシュで始める
+ *
+ * VK_EXT_pipeline_creation_feedbackが使えれば、パイプラインごとにキャッシュにヒットしたかを数える
+ *
+ * 定期的な保存は、描画のスレッドでデータの取得やファイルの書き込みを待たないように、ワーカースレッドで行う
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include "console.hh"
+#include "file_io.hh"
+#include "tracer.hh"
+
+class PipelineCache {
+ public:
+  // 前回の保存から新しいパイプラインを作成していれば、この間隔で保存する
+  static constexpr std::chrono::seconds SAVE_INTERVAL{30};
+
+  struct Statistics {
+    uint32_t pipelineCount = 0;
+    // VK_EXT_pipeline_creation_feedbackで結果が得られたパイプラインの数
+    uint32_t feedbackCount = 0;
+    // そのうち、パイプラインキャッシュにヒットしたものの数
+    uint32_t hitCount = 0;
+    // パイプラインの作成にかかった時間の合計
+    double creationMilliseconds = 0.0;
+    size_t loadedBytes = 0;
+    size_t savedBytes = 0;
+    uint32_t saveCount = 0;
+  };
+
+ private:
+  std::shared_ptr<vk::raii::Device> device;
+  vk::PhysicalDeviceProperties properties;
+  bool creationFeedbackEnabled;
+  std::optional<vk::raii::PipelineCache> cache;
+  // 保存先 (無ければ保存しない)
+  std::optional<std::string> path;
+  // 読み込んだデータを使わなかった理由
+  std::optional<std::string> rejectionReason;
+  // パイプラインはワーカースレッドからも作成するので、統計はロックして更新する
+  // (VkPipelineCache自体は、外部同期を指定しない限りスレッドセーフ)
+  mutable std::mutex mutex;
+  Statistics statistics;
+  // パイプラインを作成するたびに増やす
+  // 保存したデータがどこまでの作成を含むかを覚えておき、書き込みに成功した時だけ更新する
+  uint64_t generation = 0;
+  uint64_t savedGeneration = 0;
+  std::chrono::steady_clock::time_point lastSaveTime;
+  // 実行中の定期的な保存
+  std::future<void> pendingSave;
+
+ public:
+  // dataが今のデバイスのキャッシュであれば、それを初期値とする
+  // creationFeedbackEnabledは、VK_EXT_pipeline_creation_feedbackを有効にしたか
+  PipelineCache(std::shared_ptr<vk::raii::Device> device,
+                const vk::PhysicalDeviceProperties& properties,
+                bool creationFeedbackEnabled,
+                const std::vector<uint8_t>& data = {})
+      : device(std::move(device)),
+        properties(properties),
+        creationFeedbackEnabled(creationFeedbackEnabled),
+        lastSaveTime(std::chrono::steady_clock::now()) {
+    TRACE_SCOPE("PipelineCache::PipelineCache");
+
+    if (!data.empty()) {
+      rejectionReason = validateHeader(data, properties);
+    }
+
+    vk::PipelineCacheCreateInfo cacheInfo{};
+
+    if (!data.empty() && !rejectionReason.has_value()) {
+      cacheInfo.setInitialData<uint8_t>(data);
+      statistics.loadedBytes = data.size();
+    }
+
+    cache.emplace(*this->device, cacheInfo);
+  }
+
+  // pathから読み込み、終了時と定期的にpathに保存する
+  // ファイルが無ければ空のキャッシュで始める
+  static std::shared_ptr<PipelineCache> open(
+      std::shared_ptr<vk::raii::Device> device,
+      const vk::PhysicalDeviceProperties& properties,
+      bool creationFeedbackEnabled,
+      const std::string& path) {
+    std::vector<uint8_t> data;
+
+    {
+      TRACE_SCOPE("PipelineCache::read");
+      data = readFile(path).value_or(std::vector<uint8_t>());
+    }
+
+    auto cache = std::make_shared<PipelineCache>(
+        std::move(device), properties, creationFeedbackEnabled, data);
+    cache->path = path;
+    return cache;
+  }
+
+  ~PipelineCache() { waitForSave(); }
+
+  PipelineCache(const PipelineCache&) = delete;
+  PipelineCache& operator=(const PipelineCache&) = delete;
+
+  vk::PipelineCache get() const { return **cache; }
+
+  // 読み込んだデータを使わなかった場合は、その理由を返す
+  const std::optional<std::string>& getRejectionReason() const {
+    return rejectionReason;
+  }
+
+  bool isCreationFeedbackEnabled() const { return creationFeedbackEnabled; }
+
+  std::vector<uint8_t> getData() const { return cache->getData(); }
+
+  std::shared_ptr<vk::raii::Pipeline> createComputePipeline(
+      const vk::ComputePipelineCreateInfo& pipelineInfo) {
+    TRACE_SCOPE("PipelineCache::createComputePipeline");
+    return create(pipelineInfo, 1);
+  }
+
+  // パイプラインライブラリーとそのリンクも、これで作成する
+  std::shared_ptr<vk::raii::Pipeline> createGraphicsPipeline(
+      const vk::GraphicsPipelineCreateInfo& pipelineInfo) {
+    TRACE_SCOPE("PipelineCache::createGraphicsPipeline");
+    return create(pipelineInfo, pipelineInfo.stageCount);
+  }
+
+  // 前回の保存から新しいパイプラインを作成していて、SAVE_INTERVALが経過していれば
+  // ワーカースレッドで保存を始める (前回の保存が終わっていなければ何もしない)
+  void saveIfDue() {
+    if (!path.has_value()) {
+      return;
+    }
+
+    if (pendingSave.valid()) {
+      if (pendingSave.wait_for(std::chrono::seconds(0)) !=
+          std::future_status::ready) {
+        return;
+      }
+
+      pendingSave.get();
+    }
+
+    {
+      std::lock_guard lock(mutex);
+      auto now = std::chrono::steady_clock::now();
+
+      if (generation == savedGeneration || now - lastSaveTime < SAVE_INTERVAL) {
+        return;
+      }
+
+      lastSaveTime = now;
+    }
+
+    pendingSave = std::async(std::launch::async, [this] { write(); });
+  }
+
+  // 実行中の保存を待ってから、前回の保存から変化があれば保存する
+  // 保存先が無ければ何もしない
+  void save() {
+    if (!path.has_value()) {
+      return;
+    }
+
+    waitForSave();
+    write();
+  }
+
+  Statistics getStatistics() const {
+    std::lock_guard lock(mutex);
+    return statistics;
+  }
+
+  // dataが今のデバイスのキャッシュでなければ、その理由を返す
+  static std::optional<std::string> validateHeader(
+      const std::vector<uint8_t>& data,
+      const vk::PhysicalDeviceProperties& properties) {
+    // VkPipelineCacheHeaderVersionOneのメンバーは、パディング無しで並ぶ
+    struct Header {
+      uint32_t headerSize;
+      uint32_t headerVersion;
+      uint32_t vendorID;
+      uint32_t deviceID;
+      uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+    };
+
+    static_assert(sizeof(Header) == 32);
+
+    Header header;
+
+    if (data.size() < sizeof(header)) {
+      return "too small (" + std::to_string(data.size()) + " bytes)";
+    }
+
+    std::memcpy(&header, data.data(), sizeof(header));
+
+    if (header.headerVersion !=
+        static_cast<uint32_t>(vk::PipelineCacheHeaderVersion::eOne)) {
+      return "unknown header version " + std::to_string(header.headerVersion);
+    }
+
+    if (header.headerSize < sizeof(header) || header.headerSize > data.size()) {
+      return "invalid header size " + std::to_string(header.headerSize);
+    }
+
+    if (header.vendorID != properties.vendorID ||
+        header.deviceID != properties.deviceID) {
+      return "created by another device";
+    }
+
+    if (std::memcmp(header.pipelineCacheUUID,
+                    properties.pipelineCacheUUID.data(), VK_UUID_SIZE) != 0) {
+      // ドライバーの更新などで、キャッシュの互換性が無くなった
+      return "pipelineCacheUUID mismatch";
+    }
+
+    return std::nullopt;
+  }
+
+ private:
+  void waitForSave() {
+    if (pendingSave.valid()) {
+      pendingSave.get();
+    }
+  }
+
+  // 書き込みに失敗した場合は警告し、変化があったままにして次の保存で再び書き込む
+  void write() {
+    uint64_t target;
+
+    {
+      std::lock_guard lock(mutex);
+
+      if (generation == savedGeneration) {
+        return;
+      }
+
+      target = generation;
+    }
+
+    TRACE_SCOPE("PipelineCache::save");
+
+    try {
+      std::vector<uint8_t> data = cache->getData();
+      writeFileAtomically(*path, data);
+
+      std::lock_guard lock(mutex);
+      savedGeneration = std::max(savedGeneration, target);
+      statistics.savedBytes = data.size();
+      statistics.saveCount++;
+    } catch (const std::exception& e) {
+      std::cout << Console::fgYellow << "# "
+                << "Failed to save the pipeline cache: " << e.what()
+                << Console::fgDefault << std::endl;
+    }
+  }
+
+  template <typename CreateInfo>
+  std::shared_ptr<vk::raii::Pipeline> create(CreateInfo pipelineInfo,
+                                             uint32_t stageCount) {
+    // ステージごとの結果は、作成情報のステージと同じ数だけ用意する
+    vk::PipelineCreationFeedbackEXT pipelineFeedback{};
+    std::vector<vk::PipelineCreationFeedbackEXT> stageFeedbacks(stageCount);
+    vk::PipelineCreationFeedbackCreateInfoEXT feedbackInfo{};
+    feedbackInfo.setPPipelineCreationFeedback(&pipelineFeedback)
+        .setPipelineStageCreationFeedbackCount(stageCount)
+        .setPPipelineStageCreationFeedbacks(stageFeedbacks.data());
+
+    if (creationFeedbackEnabled) {
+      feedbackInfo.pNext = pipelineInfo.pNext;
+      pipelineInfo.pNext = &feedbackInfo;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto pipeline =
+        std::make_shared<vk::raii::Pipeline>(*device, *cache, pipelineInfo);
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::optional<vk::PipelineCreationFeedbackFlagsEXT> feedback;
+
+    if (creationFeedbackEnabled) {
+      feedback = pipelineFeedback.flags;
+    }
+
+    record(elapsed.count(), feedback);
+    return pipeline;
+  }
+
+  void record(double milliseconds,
+              std::optional<vk::PipelineCreationFeedbackFlagsEXT> feedback) {
+    std::lock_guard lock(mutex);
+    statistics.pipelineCount++;
+    statistics.creationMilliseconds += milliseconds;
+    generation++;
+
+    if (feedback.has_value() &&
+        (*feedback & vk::PipelineCreationFeedbackFlagBitsEXT::eValid)) {
+      statistics.feedbackCount++;
+
+      if (*feedback & vk::PipelineCreationFeedbackFlagBitsEXT::
+                          eApplicationPipelineCacheHit) {
+        statistics.hitCount++;
+      }
+    }
+  }
+};
@@ -0,0 +1,494 @@
+/*
+ * パイプラインのバックグラウンドでの作成
+ *
+ * パイプラインの作成はシェーダーのコンパイルを含み、描画のスレッドで行うとフレームが止まる
+ * 作成したいパイプラインの記述を渡すと、ワーカースレッドで作成し、終わるまでの間は
+ * 利用側が用意した代わりのパイプラインで描画できるように、完了を待たないfutureを返す
+ *
+ * 記述はすべて値で持ち、同じ記述の作成が進行中であれば、新たに作成せず同じfutureを返す
+ * パイプラインはデバイスのパイプラインキャッシュを通して作成する
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include "console.hh"
+#include "pipeline_cache.hh"
+#include "tracer.hh"
+
+// SPIR-V
+// 内容は変更しないので、コピーの間で共有して値として扱う
+class ShaderCode {
+  std::shared_ptr<const std::vector<uint32_t>> words;
+
+ public:
+  ShaderCode() = default;
+  ShaderCode(std::vector<uint32_t> words)
+      : words(std::make_shared<const std::vector<uint32_t>>(
+            std::move(words))) {}
+  // 呼び出し元のSPIR-Vは後で無効になりうるので、コピーを持つ
+  ShaderCode(std::span<const uint32_t> words)
+      : ShaderCode(std::vector<uint32_t>(words.begin(), words.end())) {}
+
+  operator std::span<const uint32_t>() const {
+    return words ? std::span<const uint32_t>(*words)
+                 : std::span<const uint32_t>();
+  }
+
+  const uint32_t* data() const { return words ? words->data() : nullptr; }
+  size_t size() const { return words ? words->size() : 0; }
+  size_t size_bytes() const { return size() * sizeof(uint32_t); }
+  bool empty() const { return size() == 0; }
+  const uint32_t* begin() const { return data(); }
+  const uint32_t* end() const { return data() + size(); }
+};
+
+// コンピュートパイプラインの記述
+struct ComputePipelineDescription {
+  ShaderCode code;
+  std::string entryPoint = "main";
+  // 特殊化定数 (IDは0から順に割り当てる)
+  std::vector<uint32_t> specializationConstants;
+  // プッシュ定数のサイズ (パイプラインレイアウトはサイズごとに共有する)
+  uint32_t pushConstantSize = 0;
+  // SPIR-Vの元になったシェーダーの名前 (マニフェストで、作り直したシェーダーの記録を置き換えるのに使う)
+  std::string shaderName;
+
+  bool operator==(const ComputePipelineDescription& other) const {
+    return std::equal(code.begin(), code.end(), other.code.begin(),
+                      other.code.end()) &&
+           entryPoint == other.entryPoint &&
+           specializationConstants == other.specializationConstants &&
+           pushConstantSize == other.pushConstantSize &&
+           shaderName == other.shaderName;
+  }
+
+  // FNV-1a
+  uint64_t hash() const {
+    uint64_t value = 0xcbf29ce484222325;
+
+    auto mix = [&](uint32_t word) {
+      for (int i = 0; i < 4; i++) {
+        value ^= (word >> (i * 8)) & 0xff;
+        value *= 0x100000001b3;
+      }
+    };
+
+    for (uint32_t word : code) {
+      mix(word);
+    }
+
+    for (char c : entryPoint) {
+      mix(static_cast<uint8_t>(c));
+    }
+
+    for (uint32_t constant : specializationConstants) {
+      mix(constant);
+    }
+
+    mix(pushConstantSize);
+
+    for (char c : shaderName) {
+      mix(static_cast<uint8_t>(c));
+    }
+
+    return value;
+  }
+
+  struct Hasher {
+    size_t operator()(const ComputePipelineDescription& description) const {
+      return static_cast<size_t>(description.hash());
+    }
+  };
+};
+
+// 作成中または作成済みのパイプライン
+class PipelineFuture {
+  std::shared_future<std::shared_ptr<vk::raii::Pipeline>> future;
+  vk::PipelineLayout layout;
+  // 作成の失敗を出力したか (コピーの間で共有し、1度だけ出力する)
+  std::shared_ptr<std::atomic<bool>> failureReported;
+
+ public:
+  PipelineFuture() = default;
+  PipelineFuture(std::shared_future<std::shared_ptr<vk::raii::Pipeline>> future,
+                 vk::PipelineLayout layout)
+      : future(std::move(future)),
+        layout(layout),
+        failureReported(std::make_shared<std::atomic<bool>>(false)) {}
+
+  bool valid() const { return future.valid(); }
+
+  // 作成が終わっていれば (失敗した場合も) trueを返す
+  bool isReady() const {
+    return future.valid() && future.wait_for(std::chrono::seconds(0)) ==
+                                 std::future_status::ready;
+  }
+
+  // 作成が終わるまで待つ (失敗していれば例外を投げる)
+  std::shared_ptr<vk::raii::Pipeline> get() const { return future.get(); }
+
+  // 作成が終わるまで待つ (失敗していても例外は投げない)
+  void wait() const { future.wait(); }
+
+  // 作成が終わっていれば結果を、まだか失敗していればnullptrを返す (待たない)
+  // 失敗は最初に気付いた時に1度だけ出力するので、描画のループから毎フレーム呼んでもよい
+  std::shared_ptr<vk::raii::Pipeline> tryGet() const {
+    if (!isReady() || failureReported->load(std::memory_order_relaxed)) {
+      return nullptr;
+    }
+
+    try {
+      return future.get();
+    } catch (const std::exception& e) {
+      if (!failureReported->exchange(true, std::memory_order_relaxed)) {
+        std::cout << Console::fgYellow << "# "
+                  << "Failed to create a pipeline: " << e.what()
+                  << Console::fgDefault << std::endl;
+      }
+
+      return nullptr;
+    }
+  }
+
+  // 作成が終わっていなければ (失敗した場合も)、待たずにfallbackを返す
+  vk::Pipeline getOr(vk::Pipeline fallback) const {
+    std::shared_ptr<vk::raii::Pipeline> pipeline = tryGet();
+    return pipeline ? **pipeline : fallback;
+  }
+
+  vk::PipelineLayout getLayout() const { return layout; }
+};
+
+class PipelineCompiler {
+ public:
+  struct Statistics {
+    uint64_t submittedCount = 0;
+    // 進行中の同じ記述に合流した数
+    uint64_t deduplicatedCount = 0;
+    uint64_t compiledCount = 0;
+    uint64_t failedCount = 0;
+    // ワーカースレッドでの作成時間の合計
+    double compileMilliseconds = 0.0;
+    size_t peakQueueLength = 0;
+  };
+
+ private:
+  using Promise = std::promise<std::shared_ptr<vk::raii::Pipeline>>;
+
+  struct Task {
+    // 記述で依頼したものは、完了時に進行中の一覧から外す
+    std::optional<ComputePipelineDescription> description;
+    std::function<std::shared_ptr<vk::raii::Pipeline>()> create;
+    std::shared_ptr<Promise> promise;
+  };
+
+  std::shared_ptr<vk::raii::Device> device;
+  std::shared_ptr<PipelineCache> pipelineCache;
+  // プッシュ定数のサイズごとのパイプラインレイアウト
+  std::map<uint32_t, vk::raii::PipelineLayout> layouts;
+  std::mutex mutex;
+  std::condition_variable condition;
+  // 作成中のものが無くなったことを、waitIdle()に通知する
+  std::condition_variable idleCondition;
+  size_t activeCount = 0;
+  std::deque<Task> queue;
+  // 作成中の記述と、その結果
+  std::unordered_map<ComputePipelineDescription,
+                     PipelineFuture,
+                     ComputePipelineDescription::Hasher>
+      inFlight;
+  Statistics statistics;
+  // 新たに作成する記述を受け取る (マニフェストへの記録に使う)
+  std::function<void(const ComputePipelineDescription&)> recordCallback;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+
+ public:
+  // workerCountが0であれば、ハードウェアのスレッド数から描画のスレッドの分を引いた数にする
+  PipelineCompiler(std::shared_ptr<vk::raii::Device> device,
+                   std::shared_ptr<PipelineCache> pipelineCache,
+                   uint32_t workerCount = 0)
+      : device(std::move(device)), pipelineCache(std::move(pipelineCache)) {
+    if (workerCount == 0) {
+      workerCount = std::max(2u, std::thread::hardware_concurrency()) - 1;
+    }
+
+    for (uint32_t i = 0; i < workerCount; i++) {
+      workers.emplace_back([this] { work(); });
+    }
+  }
+
+  // 作成を始めていないものは破棄し、作成中のものは終わるまで待つ
+  // 破棄したものを待っているfutureは、std::future_errorを投げる
+  ~PipelineCompiler() {
+    {
+      std::lock_guard lock(mutex);
+      stopping = true;
+      queue.clear();
+    }
+
+    condition.notify_all();
+
+    for (auto&& worker : workers) {
+      worker.join();
+    }
+  }
+
+  PipelineCompiler(const PipelineCompiler&) = delete;
+  PipelineCompiler& operator=(const PipelineCompiler&) = delete;
+
+  PipelineFuture submit(const ComputePipelineDescription& description) {
+    std::unique_lock lock(mutex);
+    statistics.submittedCount++;
+
+    if (auto it = inFlight.find(description); it != inFlight.end()) {
+      statistics.deduplicatedCount++;
+      return it->second;
+    }
+
+    auto promise = std::make_shared<Promise>();
+    vk::PipelineLayout layout = getLayout(description.pushConstantSize);
+    PipelineFuture future(promise->get_future().share(), layout);
+
+    inFlight.emplace(description, future);
+
+    if (recordCallback) {
+      recordCallback(description);
+    }
+
+    queue.push_back(Task{description,
+                         [this, description, layout] {
+                           return compile(description, layout);
+                         },
+                         std::move(promise)});
+    statistics.peakQueueLength =
+        std::max(statistics.peakQueueLength, queue.size());
+
+    lock.unlock();
+    condition.notify_one();
+    return future;
+  }
+
+  // 記述で表せないパイプライン (ライブラリーのリンクなど) を作成する
+  // 重複の排除もマニフェストへの記録もしない
+  PipelineFuture submit(
+      std::function<std::shared_ptr<vk::raii::Pipeline>()> create,
+      vk::PipelineLayout layout) {
+    auto promise = std::make_shared<Promise>();
+    PipelineFuture future(promise->get_future().share(), layout);
+
+    {
+      std::lock_guard lock(mutex);
+      statistics.submittedCount++;
+      queue.push_back(
+          Task{std::nullopt, std::move(create), std::move(promise)});
+      statistics.peakQueueLength =
+          std::max(statistics.peakQueueLength, queue.size());
+    }
+
+    condition.notify_one();
+    return future;
+  }
+
+  // 待たずに作成できない場合や、作成時間を計測する場合に、呼び出し元のスレッドで作成する
+  std::shared_ptr<vk::raii::Pipeline> compileNow(
+      const ComputePipelineDescription& description) {
+    vk::PipelineLayout layout;
+
+    {
+      std::lock_guard lock(mutex);
+      statistics.submittedCount++;
+      layout = getLayout(description.pushConstantSize);
+
+      if (recordCallback) {
+        recordCallback(description);
+      }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<vk::raii::Pipeline> pipeline;
+
+    try {
+      pipeline = compile(description, layout);
+    } catch (...) {
+      std::lock_guard lock(mutex);
+      statistics.failedCount++;
+      throw;
+    }
+
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::lock_guard lock(mutex);
+    statistics.compiledCount++;
+    statistics.compileMilliseconds += elapsed.count();
+    return pipeline;
+  }
+
+  // 待っているものと作成中のものが、すべて終わるまで待つ
+  // 作成に使うパイプラインレイアウトなどを破棄する前に呼ぶ
+  void waitIdle() {
+    std::unique_lock lock(mutex);
+    idleCondition.wait(lock,
+                       [this] { return queue.empty() && activeCount == 0; });
+  }
+
+  // 新たに作成する記述ごとに、ロックした状態で呼ばれる
+  void setRecordCallback(
+      std::function<void(const ComputePipelineDescription&)> callback) {
+    std::lock_guard lock(mutex);
+    recordCallback = std::move(callback);
+  }
+
+  // 待っているものと作成中のものの数
+  size_t getPendingCount() {
+    std::lock_guard lock(mutex);
+    return inFlight.size();
+  }
+
+  uint32_t getWorkerCount() const {
+    return static_cast<uint32_t>(workers.size());
+  }
+
+  Statistics getStatistics() {
+    std::lock_guard lock(mutex);
+    return statistics;
+  }
+
+ private:
+  // mutexをロックして呼ぶ
+  vk::PipelineLayout getLayout(uint32_t pushConstantSize) {
+    auto it = layouts.find(pushConstantSize);
+
+    if (it == layouts.end()) {
+      vk::PushConstantRange range{
+          /* stageFlags = */ vk::ShaderStageFlagBits::eCompute,
+          /* offset = */ 0,
+          /* size = */ pushConstantSize};
+      vk::PipelineLayoutCreateInfo layoutInfo{};
+
+      if (pushConstantSize > 0) {
+        layoutInfo.setPushConstantRanges(range);
+      }
+
+      it = layouts.emplace(pushConstantSize,
+                           vk::raii::PipelineLayout(*device, layoutInfo))
+               .first;
+    }
+
+    return *it->second;
+  }
+
+  void work() {
+    for (;;) {
+      std::unique_lock lock(mutex);
+      condition.wait(lock, [this] { return stopping || !queue.empty(); });
+
+      if (queue.empty()) {
+        return;
+      }
+
+      Task task = std::move(queue.front());
+      queue.pop_front();
+      activeCount++;
+      lock.unlock();
+
+      auto start = std::chrono::steady_clock::now();
+      std::shared_ptr<vk::raii::Pipeline> pipeline;
+      std::exception_ptr error;
+
+      try {
+        pipeline = task.create();
+      } catch (...) {
+        error = std::current_exception();
+      }
+
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+
+      // 結果を設定する前に進行中の一覧から外し、以降の同じ記述は新たに作成させる
+      lock.lock();
+
+      if (task.description.has_value()) {
+        inFlight.erase(*task.description);
+      }
+
+      (error ? statistics.failedCount : statistics.compiledCount)++;
+      statistics.compileMilliseconds += elapsed.count();
+      lock.unlock();
+
+      if (error) {
+        task.promise->set_exception(error);
+      } else {
+        task.promise->set_value(std::move(pipeline));
+      }
+
+      // waitIdle()から戻った時には、futureがすべて完了しているようにする
+      lock.lock();
+      activeCount--;
+
+      if (queue.empty() && activeCount == 0) {
+        idleCondition.notify_all();
+      }
+    }
+  }
+
+  std::shared_ptr<vk::raii::Pipeline> compile(
+      const ComputePipelineDescription& description,
+      vk::PipelineLayout layout) {
+    TRACE_SCOPE("PipelineCompiler::compile");
+
+    vk::raii::ShaderModule shaderModule(
+        *device, vk::ShaderModuleCreateInfo{
+                     /* flags = */ {},
+                     /* codeSize = */ description.code.size_bytes(),
+                     /* pCode = */ description.code.data()});
+
+    std::vector<vk::SpecializationMapEntry> entries;
+
+    for (uint32_t i = 0; i < description.specializationConstants.size(); i++) {
+      entries.push_back(vk::SpecializationMapEntry{
+          /* constantID = */ i,
+          /* offset = */ i * static_cast<uint32_t>(sizeof(uint32_t)),
+          /* size = */ sizeof(uint32_t)});
+    }
+
+    vk::SpecializationInfo specialization{
+        /* mapEntries = */ entries,
+        /* data = */ vk::ArrayProxyNoTemporaries<const uint32_t>(
+            description.specializationConstants)};
+    vk::PipelineShaderStageCreateInfo stage{
+        /* flags = */ {},
+        /* stage = */ vk::ShaderStageFlagBits::eCompute,
+        /* module = */ *shaderModule,
+        /* pName = */ description.entryPoint.c_str(),
+        /* pSpecializationInfo = */ entries.empty() ? nullptr
+                                                    : &specialization};
+
+    // シェーダーモジュールはパイプラインの作成後に破棄してよい
+    return pipelineCache->createComputePipeline(vk::ComputePipelineCreateInfo{
+        /* flags = */ {}, /* stage = */ stage, /* layout = */ layout});
+  }
+};
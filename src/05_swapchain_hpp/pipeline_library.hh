@@ -0,0 +1,408 @@
+/*
+ * VK_EXT_graphics_pipeline_libraryによるグラフィックスパイプラインの分割作成
+ *
+ * パイプラインを頂点入力、プリラスタライゼーション (頂点シェーダー)、フラグメントシェーダー、
+ * フラグメント出力の4つのライブラリーに分けて作成しておき、組み合わせが必要になった時にリンクする
+ * 一括で作成すると組み合わせごとにシェーダーをコンパイルし直すが、ライブラリーは部分ごとに1回で済む
+ *
+ * 最適化しないリンク (高速リンク) はコンパイルをしないので、描画のスレッドで待たずに行える
+ * 同時にワーカースレッドで最適化したリンクを行い、終わったらそちらに置き換える
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include "pipeline_cache.hh"
+#include "pipeline_compiler.hh"
+#include "tracer.hh"
+
+// 頂点バッファーは使わず、頂点シェーダーでgl_VertexIndexから位置を求める
+struct VertexInputState {
+  vk::PrimitiveTopology topology = vk::PrimitiveTopology::eTriangleList;
+};
+
+struct PreRasterizationState {
+  // 頂点シェーダーのSPIR-V
+  ShaderCode code;
+  // 特殊化定数 (IDは0から順に割り当てる)
+  std::vector<uint32_t> specializationConstants;
+  vk::CullModeFlags cullMode = vk::CullModeFlagBits::eNone;
+  // SPIR-Vの元になったシェーダーの名前 (ComputePipelineDescription::shaderNameと同じ)
+  std::string shaderName;
+};
+
+struct FragmentShaderState {
+  ShaderCode code;
+  std::vector<uint32_t> specializationConstants;
+  std::string shaderName;
+};
+
+struct FragmentOutputState {
+  bool blendEnabled = false;
+  // カラーアタッチメントのフォーマット
+  // ライブラリーに渡すレンダーパスと一致させる (マニフェストから再生する時に、互換なレンダーパスを作るのに使う)
+  vk::Format colorFormat = vk::Format::eR8G8B8A8Unorm;
+};
+
+// リンクしたパイプラインの元になった状態 (マニフェストへの記録と、事前の作成に使う)
+struct GraphicsPipelineDescription {
+  VertexInputState vertexInput;
+  PreRasterizationState preRasterization;
+  FragmentShaderState fragmentShader;
+  FragmentOutputState fragmentOutput;
+};
+
+// 高速リンクしたパイプラインと、最適化したリンクの結果
+class LinkedPipeline {
+  std::shared_ptr<vk::raii::Pipeline> fastLinked;
+  PipelineFuture optimized;
+
+ public:
+  LinkedPipeline(std::shared_ptr<vk::raii::Pipeline> fastLinked,
+                 PipelineFuture optimized)
+      : fastLinked(std::move(fastLinked)), optimized(std::move(optimized)) {}
+
+  // 最適化したリンクが終わっていればそれを、まだか失敗していれば高速リンクしたものを返す
+  // 置き換えた後も、実行中のフレームが使っているかもしれないので高速リンクしたものは破棄しない
+  vk::Pipeline get() const { return optimized.getOr(**fastLinked); }
+
+  bool isOptimized() const { return optimized.tryGet() != nullptr; }
+
+  // 最適化したリンクが終わるまで待つ (失敗していても例外は投げない)
+  void wait() const { optimized.wait(); }
+};
+
+class GraphicsPipelineLibrary {
+ public:
+  struct Libraries {
+    std::shared_ptr<vk::raii::Pipeline> vertexInput;
+    std::shared_ptr<vk::raii::Pipeline> preRasterization;
+    std::shared_ptr<vk::raii::Pipeline> fragmentShader;
+    std::shared_ptr<vk::raii::Pipeline> fragmentOutput;
+  };
+
+  struct Statistics {
+    uint32_t libraryCount = 0;
+    double libraryMilliseconds = 0.0;
+    uint32_t fastLinkCount = 0;
+    double fastLinkMilliseconds = 0.0;
+  };
+
+ private:
+  // パイプラインの作成情報と、それが指す構造体をまとめて持つ
+  struct CreateInfo {
+    vk::GraphicsPipelineCreateInfo pipeline{};
+    vk::GraphicsPipelineLibraryCreateInfoEXT library{};
+    vk::PipelineVertexInputStateCreateInfo vertexInput{};
+    vk::PipelineInputAssemblyStateCreateInfo inputAssembly{};
+    // ビューポートとシザーは動的に設定する
+    vk::PipelineViewportStateCreateInfo viewport{
+        /* flags = */ {},
+        /* viewportCount = */ 1,
+        /* pViewports = */ nullptr,
+        /* scissorCount = */ 1,
+        /* pScissors = */ nullptr};
+    std::array<vk::DynamicState, 2> dynamicStates{vk::DynamicState::eViewport,
+                                                  vk::DynamicState::eScissor};
+    vk::PipelineDynamicStateCreateInfo dynamic{};
+    vk::PipelineRasterizationStateCreateInfo rasterization{};
+    vk::PipelineMultisampleStateCreateInfo multisample{};
+    vk::PipelineColorBlendAttachmentState blendAttachment{};
+    vk::PipelineColorBlendStateCreateInfo colorBlend{};
+    // 頂点シェーダーとフラグメントシェーダー
+    std::vector<vk::raii::ShaderModule> modules;
+    std::array<std::vector<vk::SpecializationMapEntry>, 2> entries;
+    std::array<vk::SpecializationInfo, 2> specializations;
+    std::vector<vk::PipelineShaderStageCreateInfo> stages;
+
+    CreateInfo() = default;
+    CreateInfo(const CreateInfo&) = delete;
+    CreateInfo& operator=(const CreateInfo&) = delete;
+  };
+
+  std::shared_ptr<vk::raii::Device> device;
+  std::shared_ptr<PipelineCache> pipelineCache;
+  std::shared_ptr<PipelineCompiler> pipelineCompiler;
+  vk::PipelineLayout layout;
+  vk::RenderPass renderPass;
+  uint32_t subpass;
+  std::mutex mutex;
+  Statistics statistics;
+  // リンクする記述を受け取る (マニフェストへの記録に使う)
+  std::function<void(const GraphicsPipelineDescription&)> recordCallback;
+
+ public:
+  // すべてのライブラリーとリンクで、同じパイプラインレイアウトとレンダーパスを使う
+  GraphicsPipelineLibrary(std::shared_ptr<vk::raii::Device> device,
+                          std::shared_ptr<PipelineCache> pipelineCache,
+                          std::shared_ptr<PipelineCompiler> pipelineCompiler,
+                          vk::PipelineLayout layout,
+                          vk::RenderPass renderPass,
+                          uint32_t subpass = 0)
+      : device(std::move(device)),
+        pipelineCache(std::move(pipelineCache)),
+        pipelineCompiler(std::move(pipelineCompiler)),
+        layout(layout),
+        renderPass(renderPass),
+        subpass(subpass) {}
+
+  GraphicsPipelineLibrary(const GraphicsPipelineLibrary&) = delete;
+  GraphicsPipelineLibrary& operator=(const GraphicsPipelineLibrary&) = delete;
+
+  std::shared_ptr<vk::raii::Pipeline> createLibrary(
+      const VertexInputState& state) {
+    CreateInfo info;
+    setVertexInput(info, state);
+    return createLibrary(
+        info, vk::GraphicsPipelineLibraryFlagBitsEXT::eVertexInputInterface);
+  }
+
+  std::shared_ptr<vk::raii::Pipeline> createLibrary(
+      const PreRasterizationState& state) {
+    CreateInfo info;
+    setPreRasterization(info, state);
+    return createLibrary(
+        info, vk::GraphicsPipelineLibraryFlagBitsEXT::ePreRasterizationShaders);
+  }
+
+  std::shared_ptr<vk::raii::Pipeline> createLibrary(
+      const FragmentShaderState& state) {
+    CreateInfo info;
+    setFragmentShader(info, state);
+    return createLibrary(
+        info, vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentShader);
+  }
+
+  std::shared_ptr<vk::raii::Pipeline> createLibrary(
+      const FragmentOutputState& state) {
+    CreateInfo info;
+    setFragmentOutput(info, state);
+    return createLibrary(
+        info, vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentOutputInterface);
+  }
+
+  // 高速リンクしたパイプラインを返し、最適化したリンクをワーカースレッドに依頼する
+  // descriptionはlibrariesを作成した状態で、マニフェストへの記録に使う
+  std::shared_ptr<LinkedPipeline> link(
+      const Libraries& libraries,
+      const GraphicsPipelineDescription& description) {
+    TRACE_SCOPE("GraphicsPipelineLibrary::link");
+
+    {
+      std::lock_guard lock(mutex);
+
+      if (recordCallback) {
+        recordCallback(description);
+      }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<vk::raii::Pipeline> fastLinked =
+        linkNow(*pipelineCache, layout, libraries, {});
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    {
+      std::lock_guard lock(mutex);
+      statistics.fastLinkCount++;
+      statistics.fastLinkMilliseconds += elapsed.count();
+    }
+
+    // ライブラリーはリンクが終わるまでラムダが保持する
+    // パイプラインレイアウトは、LinkedPipeline::wait()で待つまで破棄しないこと
+    PipelineFuture optimized = pipelineCompiler->submit(
+        [cache = pipelineCache, layout = layout, libraries] {
+          return linkNow(*cache, layout, libraries,
+                         vk::PipelineCreateFlagBits::eLinkTimeOptimizationEXT);
+        },
+        layout);
+
+    return std::make_shared<LinkedPipeline>(std::move(fastLinked),
+                                            std::move(optimized));
+  }
+
+  // 記述のライブラリーを作成し、最適化したリンクまでを呼び出し元のスレッドで行う
+  // マニフェストから事前に作成して、パイプラインキャッシュに載せるために使う
+  std::shared_ptr<vk::raii::Pipeline> createLinked(
+      const GraphicsPipelineDescription& description) {
+    Libraries libraries{
+        /* vertexInput = */ createLibrary(description.vertexInput),
+        /* preRasterization = */ createLibrary(description.preRasterization),
+        /* fragmentShader = */ createLibrary(description.fragmentShader),
+        /* fragmentOutput = */ createLibrary(description.fragmentOutput)};
+    return linkNow(*pipelineCache, layout, libraries,
+                   vk::PipelineCreateFlagBits::eLinkTimeOptimizationEXT);
+  }
+
+  // 比較のため、ライブラリーを使わずに一括で作成する
+  std::shared_ptr<vk::raii::Pipeline> createMonolithic(
+      const VertexInputState& vertexInput,
+      const PreRasterizationState& preRasterization,
+      const FragmentShaderState& fragmentShader,
+      const FragmentOutputState& fragmentOutput) {
+    TRACE_SCOPE("GraphicsPipelineLibrary::createMonolithic");
+
+    CreateInfo info;
+    setVertexInput(info, vertexInput);
+    setPreRasterization(info, preRasterization);
+    setFragmentShader(info, fragmentShader);
+    setFragmentOutput(info, fragmentOutput);
+    info.pipeline.setStages(info.stages);
+    return pipelineCache->createGraphicsPipeline(info.pipeline);
+  }
+
+  Statistics getStatistics() {
+    std::lock_guard lock(mutex);
+    return statistics;
+  }
+
+  void setRecordCallback(
+      std::function<void(const GraphicsPipelineDescription&)> callback) {
+    std::lock_guard lock(mutex);
+    recordCallback = std::move(callback);
+  }
+
+ private:
+  std::shared_ptr<vk::raii::Pipeline> createLibrary(
+      CreateInfo& info,
+      vk::GraphicsPipelineLibraryFlagsEXT flags) {
+    TRACE_SCOPE("GraphicsPipelineLibrary::createLibrary");
+
+    // 最適化したリンクのために、リンク時の最適化に必要な情報を残しておく
+    info.library.flags = flags;
+    info.pipeline.pNext = &info.library;
+    info.pipeline.flags =
+        vk::PipelineCreateFlagBits::eLibraryKHR |
+        vk::PipelineCreateFlagBits::eRetainLinkTimeOptimizationInfoEXT;
+    info.pipeline.setStages(info.stages);
+
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<vk::raii::Pipeline> library =
+        pipelineCache->createGraphicsPipeline(info.pipeline);
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::lock_guard lock(mutex);
+    statistics.libraryCount++;
+    statistics.libraryMilliseconds += elapsed.count();
+    return library;
+  }
+
+  static std::shared_ptr<vk::raii::Pipeline> linkNow(
+      PipelineCache& pipelineCache,
+      vk::PipelineLayout layout,
+      const Libraries& libraries,
+      vk::PipelineCreateFlags flags) {
+    std::array<vk::Pipeline, 4> handles{
+        **libraries.vertexInput, **libraries.preRasterization,
+        **libraries.fragmentShader, **libraries.fragmentOutput};
+    vk::PipelineLibraryCreateInfoKHR libraryInfo{/* libraries = */ handles};
+
+    vk::GraphicsPipelineCreateInfo pipelineInfo{};
+    pipelineInfo.pNext = &libraryInfo;
+    pipelineInfo.flags = flags;
+    pipelineInfo.layout = layout;
+    return pipelineCache.createGraphicsPipeline(pipelineInfo);
+  }
+
+  void setVertexInput(CreateInfo& info, const VertexInputState& state) {
+    info.inputAssembly.topology = state.topology;
+    info.pipeline.pVertexInputState = &info.vertexInput;
+    info.pipeline.pInputAssemblyState = &info.inputAssembly;
+  }
+
+  void setPreRasterization(CreateInfo& info,
+                           const PreRasterizationState& state) {
+    addStage(info, vk::ShaderStageFlagBits::eVertex, state.code,
+             state.specializationConstants);
+
+    info.rasterization.polygonMode = vk::PolygonMode::eFill;
+    info.rasterization.cullMode = state.cullMode;
+    info.rasterization.frontFace = vk::FrontFace::eCounterClockwise;
+    info.rasterization.lineWidth = 1.0f;
+    info.dynamic.setDynamicStates(info.dynamicStates);
+
+    info.pipeline.pViewportState = &info.viewport;
+    info.pipeline.pRasterizationState = &info.rasterization;
+    info.pipeline.pDynamicState = &info.dynamic;
+    info.pipeline.layout = layout;
+    info.pipeline.renderPass = renderPass;
+    info.pipeline.subpass = subpass;
+  }
+
+  void setFragmentShader(CreateInfo& info, const FragmentShaderState& state) {
+    addStage(info, vk::ShaderStageFlagBits::eFragment, state.code,
+             state.specializationConstants);
+
+    info.pipeline.pMultisampleState = &info.multisample;
+    info.pipeline.layout = layout;
+    info.pipeline.renderPass = renderPass;
+    info.pipeline.subpass = subpass;
+  }
+
+  void setFragmentOutput(CreateInfo& info, const FragmentOutputState& state) {
+    // 有効にした場合は、アルファで重ねる
+    info.blendAttachment.blendEnable = state.blendEnabled;
+    info.blendAttachment.srcColorBlendFactor = vk::BlendFactor::eSrcAlpha;
+    info.blendAttachment.dstColorBlendFactor =
+        vk::BlendFactor::eOneMinusSrcAlpha;
+    info.blendAttachment.colorBlendOp = vk::BlendOp::eAdd;
+    info.blendAttachment.srcAlphaBlendFactor = vk::BlendFactor::eOne;
+    info.blendAttachment.dstAlphaBlendFactor = vk::BlendFactor::eZero;
+    info.blendAttachment.alphaBlendOp = vk::BlendOp::eAdd;
+    info.blendAttachment.colorWriteMask =
+        vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG |
+        vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA;
+    info.colorBlend.setAttachments(info.blendAttachment);
+
+    info.pipeline.pColorBlendState = &info.colorBlend;
+    info.pipeline.pMultisampleState = &info.multisample;
+    info.pipeline.renderPass = renderPass;
+    info.pipeline.subpass = subpass;
+  }
+
+  void addStage(CreateInfo& info,
+                vk::ShaderStageFlagBits stage,
+                std::span<const uint32_t> code,
+                const std::vector<uint32_t>& constants) {
+    size_t index = info.stages.size();
+    std::vector<vk::SpecializationMapEntry>& entries = info.entries[index];
+
+    for (uint32_t i = 0; i < constants.size(); i++) {
+      entries.push_back(vk::SpecializationMapEntry{
+          /* constantID = */ i,
+          /* offset = */ i * static_cast<uint32_t>(sizeof(uint32_t)),
+          /* size = */ sizeof(uint32_t)});
+    }
+
+    info.specializations[index] = vk::SpecializationInfo{
+        /* mapEntries = */ entries,
+        /* data = */ vk::ArrayProxyNoTemporaries<const uint32_t>(constants)};
+
+    info.modules.emplace_back(
+        *device, vk::ShaderModuleCreateInfo{
+                     /* flags = */ {},
+                     /* codeSize = */ code.size_bytes(),
+                     /* pCode = */ code.data()});
+    info.stages.push_back(vk::PipelineShaderStageCreateInfo{
+        /* flags = */ {},
+        /* stage = */ stage,
+        /* module = */ *info.modules.back(),
+        /* pName = */ "main",
+        /* pSpecializationInfo = */ entries.empty()
+            ? nullptr
+            : &info.specializations[index]});
+  }
+};
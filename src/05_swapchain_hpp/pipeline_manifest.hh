@@ -0,0 +1,507 @@
+/*
+ * 作成したパイプラインの記述の記録 (マニフェスト)
+ *
+ * パイプラインキャッシュはドライバーが作ったバイナリーを保存するが、どのパイプラインが
+ * 必要になるかは分からないので、次の起動で事前に作成するために記述そのものを記録する
+ * コンピュートパイプラインと、パイプラインライブラリーからリンクしたグラフィックスパイプラインを記録する
+ * 同じSPIR-Vを使う記述が多いので、シェーダーは1つずつだけ持ち、記述からはインデックスで参照する
+ *
+ * シェーダーの名前がある記述は、SPIR-Vの代わりに名前で同じパイプラインかを判断する
+ * シェーダーを作り直した後の記録は古い記録を置き換えるので、ホットリロードを繰り返しても増えない
+ * 名前が無ければ、SPIR-Vの内容も含めて区別する
+ *
+ * 形式 (すべてリトルエンディアン)
+ *   ヘッダー: マジック、形式のバージョン、ベンダーID、デバイスID、pipelineCacheUUID、
+ *             シェーダーの数、コンピュートパイプラインの数、グラフィックスパイプラインの数
+ *   シェーダー: ワード数、SPIR-V
+ *   シェーダーの参照: シェーダーの名前の長さと文字列、シェーダーのインデックス
+ *   コンピュートパイプライン: シェーダーの参照、エントリーポイントの長さと文字列、
+ *                             特殊化定数の数と値、プッシュ定数のサイズ
+ *   グラフィックスパイプライン: トポロジー、
+ *                               頂点シェーダーの参照、特殊化定数の数と値、カリングのモード、
+ *                               フラグメントシェーダーの参照、特殊化定数の数と値、
+ *                               ブレンドの有無、カラーアタッチメントのフォーマット
+ * 記録したデバイスとドライバーでなければ、事前に作成しても同じキャッシュにならないので使わない
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include "file_io.hh"
+#include "pipeline_compiler.hh"
+#include "pipeline_library.hh"
+#include "tracer.hh"
+
+class PipelineManifest {
+ public:
+  // "PMAN"
+  static constexpr uint32_t MAGIC = 0x4e414d50;
+  static constexpr uint32_t VERSION = 3;
+
+ private:
+  uint32_t vendorID;
+  uint32_t deviceID;
+  std::array<uint8_t, VK_UUID_SIZE> pipelineCacheUUID;
+  // 記録した記述のcodeは、ここのSPIR-Vを共有する
+  // 置き換えられて参照されなくなったシェーダーも残るが、書き出さない
+  std::vector<ShaderCode> shaders;
+  // SPIR-Vのハッシュから、同じ内容のシェーダーのインデックス
+  std::unordered_multimap<uint64_t, uint32_t> shaderIndices;
+  // 記述のcodeから、シェーダーのインデックス
+  std::unordered_map<const uint32_t*, uint32_t> shaderIndexByCode;
+  std::vector<ComputePipelineDescription> computePipelines;
+  std::vector<GraphicsPipelineDescription> graphicsPipelines;
+  // 記述の識別 (identify()) から、上のインデックス
+  std::unordered_map<std::string, size_t> computeIndices;
+  std::unordered_map<std::string, size_t> graphicsIndices;
+  // パイプラインはワーカースレッドからも記録する
+  mutable std::mutex mutex;
+  // 前回の保存から記録が変わった
+  bool dirty = false;
+
+  struct Writer {
+    std::vector<uint8_t> data;
+
+    void writeBytes(const void* source, size_t size) {
+      auto bytes = static_cast<const uint8_t*>(source);
+      data.insert(data.end(), bytes, bytes + size);
+    }
+
+    void write(uint32_t value) { writeBytes(&value, sizeof(value)); }
+
+    void writeString(std::string_view text) {
+      write(static_cast<uint32_t>(text.size()));
+      writeBytes(text.data(), text.size());
+    }
+
+    void writeValues(const std::vector<uint32_t>& values) {
+      write(static_cast<uint32_t>(values.size()));
+
+      for (uint32_t value : values) {
+        write(value);
+      }
+    }
+  };
+
+  // シェーダーの参照を書き出す (名前とSPIR-V)
+  using ShaderWriter = std::function<
+      void(Writer&, const std::string&, std::span<const uint32_t>)>;
+
+ public:
+  explicit PipelineManifest(const vk::PhysicalDeviceProperties& properties)
+      : vendorID(properties.vendorID),
+        deviceID(properties.deviceID),
+        pipelineCacheUUID(properties.pipelineCacheUUID) {}
+
+  // ファイルが無ければnullptrを返し、形式が正しくなければ例外を投げる
+  static std::shared_ptr<PipelineManifest> read(const std::string& path) {
+    TRACE_SCOPE("PipelineManifest::read");
+
+    std::optional<std::vector<uint8_t>> data = readFile(path);
+
+    if (!data.has_value()) {
+      return nullptr;
+    }
+
+    Reader reader{*data};
+
+    if (reader.read() != MAGIC) {
+      throw std::runtime_error("Not a pipeline manifest: " + path);
+    }
+
+    if (uint32_t version = reader.read(); version != VERSION) {
+      throw std::runtime_error("Unsupported pipeline manifest version " +
+                               std::to_string(version) + ": " + path);
+    }
+
+    vk::PhysicalDeviceProperties properties;
+    properties.vendorID = reader.read();
+    properties.deviceID = reader.read();
+    reader.readBytes(properties.pipelineCacheUUID.data(), VK_UUID_SIZE);
+
+    auto manifest = std::make_shared<PipelineManifest>(properties);
+    uint32_t shaderCount = reader.read();
+    uint32_t computeCount = reader.read();
+    uint32_t graphicsCount = reader.read();
+
+    for (uint32_t i = 0; i < shaderCount; i++) {
+      std::vector<uint32_t> code(reader.readCount(sizeof(uint32_t)));
+      reader.readBytes(code.data(), code.size() * sizeof(uint32_t));
+      manifest->addShader(std::move(code));
+    }
+
+    // シェーダーの名前を読み、codeに参照するシェーダーを設定する
+    auto readShader = [&](ShaderCode& code) {
+      std::string name = reader.readString();
+      uint32_t shaderIndex = reader.read();
+
+      if (shaderIndex >= shaderCount) {
+        throw std::runtime_error("Invalid shader index in " + path);
+      }
+
+      code = manifest->shaders[shaderIndex];
+      return name;
+    };
+
+    for (uint32_t i = 0; i < computeCount; i++) {
+      ComputePipelineDescription description;
+      description.shaderName = readShader(description.code);
+      description.entryPoint = reader.readString();
+      description.specializationConstants = reader.readValues();
+      description.pushConstantSize = reader.read();
+      manifest->add(description);
+    }
+
+    for (uint32_t i = 0; i < graphicsCount; i++) {
+      GraphicsPipelineDescription description;
+      description.vertexInput.topology =
+          static_cast<vk::PrimitiveTopology>(reader.read());
+
+      PreRasterizationState& preRasterization = description.preRasterization;
+      preRasterization.shaderName = readShader(preRasterization.code);
+      preRasterization.specializationConstants = reader.readValues();
+      preRasterization.cullMode = vk::CullModeFlags(reader.read());
+
+      FragmentShaderState& fragmentShader = description.fragmentShader;
+      fragmentShader.shaderName = readShader(fragmentShader.code);
+      fragmentShader.specializationConstants = reader.readValues();
+
+      description.fragmentOutput.blendEnabled = reader.read() != 0;
+      description.fragmentOutput.colorFormat =
+          static_cast<vk::Format>(reader.read());
+      manifest->add(description);
+    }
+
+    // 読み込んだ時点では、ファイルと同じ内容
+    manifest->dirty = false;
+    return manifest;
+  }
+
+  // 記録したデバイスと異なれば、その理由を返す
+  std::optional<std::string> validateDevice(
+      const vk::PhysicalDeviceProperties& properties) const {
+    if (vendorID != properties.vendorID || deviceID != properties.deviceID) {
+      return "recorded on another device";
+    }
+
+    if (!std::equal(pipelineCacheUUID.begin(), pipelineCacheUUID.end(),
+                    properties.pipelineCacheUUID.begin())) {
+      return "pipelineCacheUUID mismatch";
+    }
+
+    return std::nullopt;
+  }
+
+  // 記録済みでない記述であれば追加し、同じパイプラインの記録があれば置き換える
+  void record(const ComputePipelineDescription& description) {
+    std::lock_guard lock(mutex);
+
+    // 同じ内容のシェーダーは、記録済みのSPIR-Vを共有する
+    ComputePipelineDescription copy = description;
+    copy.code = shaders[findOrAddShader(description.code)];
+    add(copy);
+  }
+
+  void record(const GraphicsPipelineDescription& description) {
+    std::lock_guard lock(mutex);
+
+    GraphicsPipelineDescription copy = description;
+    copy.preRasterization.code =
+        shaders[findOrAddShader(description.preRasterization.code)];
+    copy.fragmentShader.code =
+        shaders[findOrAddShader(description.fragmentShader.code)];
+    add(copy);
+  }
+
+  std::vector<ComputePipelineDescription> getComputePipelines() const {
+    std::lock_guard lock(mutex);
+    return computePipelines;
+  }
+
+  std::vector<GraphicsPipelineDescription> getGraphicsPipelines() const {
+    std::lock_guard lock(mutex);
+    return graphicsPipelines;
+  }
+
+  size_t getPipelineCount() const {
+    std::lock_guard lock(mutex);
+    return computePipelines.size() + graphicsPipelines.size();
+  }
+
+  // 記録が参照しているシェーダーの数
+  size_t getShaderCount() const {
+    std::lock_guard lock(mutex);
+    return collectShaders().size();
+  }
+
+  // 前回の保存から記録が変わっていなければ何もしない
+  void write(const std::string& path) {
+    TRACE_SCOPE("PipelineManifest::write");
+
+    std::vector<uint8_t> data;
+
+    {
+      std::lock_guard lock(mutex);
+
+      if (!dirty) {
+        return;
+      }
+
+      data = serialize();
+      dirty = false;
+    }
+
+    writeFileAtomically(path, data);
+  }
+
+ private:
+  struct Reader {
+    const std::vector<uint8_t>& data;
+    size_t offset = 0;
+
+    void readBytes(void* destination, size_t size) {
+      if (size > data.size() - offset) {
+        throw std::runtime_error("Truncated pipeline manifest");
+      }
+
+      std::memcpy(destination, data.data() + offset, size);
+      offset += size;
+    }
+
+    uint32_t read() {
+      uint32_t value;
+      readBytes(&value, sizeof(value));
+      return value;
+    }
+
+    // 要素の数を読み、残りのデータに収まらなければ確保する前に例外を投げる
+    uint32_t readCount(size_t elementSize) {
+      uint32_t count = read();
+
+      if (count > (data.size() - offset) / elementSize) {
+        throw std::runtime_error("Truncated pipeline manifest");
+      }
+
+      return count;
+    }
+
+    std::string readString() {
+      std::string text(readCount(1), '\0');
+      readBytes(text.data(), text.size());
+      return text;
+    }
+
+    std::vector<uint32_t> readValues() {
+      std::vector<uint32_t> values(readCount(sizeof(uint32_t)));
+
+      for (uint32_t& value : values) {
+        value = read();
+      }
+
+      return values;
+    }
+  };
+
+  // 以下はmutexをロックして呼ぶ (read()では作成中のマニフェストに対して呼ぶ)
+
+  // 同じパイプラインの記録が無ければ追加し、あれば内容が変わった場合に置き換える
+  // 記述のcodeは、shadersのSPIR-Vを共有していること
+  template <typename Description>
+  void add(const Description& description) {
+    std::vector<Description>& pipelines = getPipelines<Description>();
+    auto [it, inserted] = getIndices<Description>().try_emplace(
+        identify(description, false), pipelines.size());
+
+    if (inserted) {
+      pipelines.push_back(description);
+      dirty = true;
+    } else if (identify(pipelines[it->second], true) !=
+               identify(description, true)) {
+      pipelines[it->second] = description;
+      dirty = true;
+    }
+  }
+
+  template <typename Description>
+  std::vector<Description>& getPipelines() {
+    if constexpr (std::is_same_v<Description, ComputePipelineDescription>) {
+      return computePipelines;
+    } else {
+      return graphicsPipelines;
+    }
+  }
+
+  template <typename Description>
+  std::unordered_map<std::string, size_t>& getIndices() {
+    if constexpr (std::is_same_v<Description, ComputePipelineDescription>) {
+      return computeIndices;
+    } else {
+      return graphicsIndices;
+    }
+  }
+
+  // 記述を書き出したバイト列を、比較のためのキーとする
+  // シェーダーは名前で区別し、名前が無いかincludeCodeであればSPIR-Vでも区別する
+  template <typename Description>
+  std::string identify(const Description& description, bool includeCode) const {
+    Writer writer;
+    writeDescription(writer, description,
+                     [&](Writer& w, const std::string& name,
+                         std::span<const uint32_t> code) {
+                       w.writeString(name);
+
+                       if (name.empty() || includeCode) {
+                         w.write(shaderIndexByCode.at(code.data()));
+                       }
+                     });
+    return std::string(writer.data.begin(), writer.data.end());
+  }
+
+  static void writeDescription(Writer& writer,
+                               const ComputePipelineDescription& description,
+                               const ShaderWriter& writeShader) {
+    writeShader(writer, description.shaderName, description.code);
+    writer.writeString(description.entryPoint);
+    writer.writeValues(description.specializationConstants);
+    writer.write(description.pushConstantSize);
+  }
+
+  static void writeDescription(Writer& writer,
+                               const GraphicsPipelineDescription& description,
+                               const ShaderWriter& writeShader) {
+    const PreRasterizationState& preRasterization =
+        description.preRasterization;
+    const FragmentShaderState& fragmentShader = description.fragmentShader;
+
+    writer.write(static_cast<uint32_t>(description.vertexInput.topology));
+    writeShader(writer, preRasterization.shaderName, preRasterization.code);
+    writer.writeValues(preRasterization.specializationConstants);
+    writer.write(static_cast<uint32_t>(preRasterization.cullMode));
+    writeShader(writer, fragmentShader.shaderName, fragmentShader.code);
+    writer.writeValues(fragmentShader.specializationConstants);
+    writer.write(description.fragmentOutput.blendEnabled ? 1 : 0);
+    writer.write(static_cast<uint32_t>(description.fragmentOutput.colorFormat));
+  }
+
+  // 記録が参照しているシェーダーのインデックスを、shadersの順で返す
+  std::vector<uint32_t> collectShaders() const {
+    std::vector<bool> used(shaders.size(), false);
+
+    auto use = [&](std::span<const uint32_t> code) {
+      used[shaderIndexByCode.at(code.data())] = true;
+    };
+
+    for (auto&& pipeline : computePipelines) {
+      use(pipeline.code);
+    }
+
+    for (auto&& pipeline : graphicsPipelines) {
+      use(pipeline.preRasterization.code);
+      use(pipeline.fragmentShader.code);
+    }
+
+    std::vector<uint32_t> indices;
+
+    for (uint32_t i = 0; i < shaders.size(); i++) {
+      if (used[i]) {
+        indices.push_back(i);
+      }
+    }
+
+    return indices;
+  }
+
+  std::vector<uint8_t> serialize() const {
+    std::vector<uint32_t> used = collectShaders();
+    Writer writer;
+
+    writer.write(MAGIC);
+    writer.write(VERSION);
+    writer.write(vendorID);
+    writer.write(deviceID);
+    writer.writeBytes(pipelineCacheUUID.data(), VK_UUID_SIZE);
+    writer.write(static_cast<uint32_t>(used.size()));
+    writer.write(static_cast<uint32_t>(computePipelines.size()));
+    writer.write(static_cast<uint32_t>(graphicsPipelines.size()));
+
+    // 参照されているシェーダーだけを詰めて書き出す
+    std::unordered_map<const uint32_t*, uint32_t> writtenIndexByCode;
+
+    for (uint32_t i = 0; i < used.size(); i++) {
+      const ShaderCode& shader = shaders[used[i]];
+      writer.write(static_cast<uint32_t>(shader.size()));
+      writer.writeBytes(shader.data(), shader.size() * sizeof(uint32_t));
+      writtenIndexByCode.emplace(shader.data(), i);
+    }
+
+    ShaderWriter writeShader = [&](Writer& w, const std::string& name,
+                                   std::span<const uint32_t> code) {
+      w.writeString(name);
+      w.write(writtenIndexByCode.at(code.data()));
+    };
+
+    for (auto&& pipeline : computePipelines) {
+      writeDescription(writer, pipeline, writeShader);
+    }
+
+    for (auto&& pipeline : graphicsPipelines) {
+      writeDescription(writer, pipeline, writeShader);
+    }
+
+    return std::move(writer.data);
+  }
+
+  uint32_t findOrAddShader(std::span<const uint32_t> code) {
+    uint64_t hash = hashCode(code);
+    auto [begin, end] = shaderIndices.equal_range(hash);
+
+    for (auto it = begin; it != end; ++it) {
+      const ShaderCode& shader = shaders[it->second];
+
+      if (std::equal(shader.begin(), shader.end(), code.begin(), code.end())) {
+        return it->second;
+      }
+    }
+
+    return addShader(ShaderCode(code));
+  }
+
+  uint32_t addShader(ShaderCode code) {
+    uint32_t index = static_cast<uint32_t>(shaders.size());
+    shaderIndices.emplace(hashCode(code), index);
+    shaderIndexByCode.emplace(code.data(), index);
+    shaders.push_back(std::move(code));
+    return index;
+  }
+
+  // ComputePipelineDescription::hash()と同じFNV-1a
+  static uint64_t hashCode(std::span<const uint32_t> code) {
+    uint64_t value = 0xcbf29ce484222325;
+
+    for (uint32_t word : code) {
+      for (int i = 0; i < 4; i++) {
+        value ^= (word >> (i * 8)) & 0xff;
+        value *= 0x100000001b3;
+      }
+    }
+
+    return value;
+  }
+};
@@ -0,0 +1,283 @@
+/*
+ * キューの構成
+ *
+ * グラフィックス、非同期コンピュート、転送、プレゼンテーションの役割ごとに、
+ * どのキューファミリーの何番目のキューを使うかを決める
+ * 専用のファミリー (コンピュートのみ、転送のみ) があればそちらを優先し、
+ * 同じファミリーを使う役割には、キューが足りる限り別のキューを割り当てる
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include "physical_device_info.hh"
+#include "tracer.hh"
+
+enum class QueueRole : uint32_t {
+  eGraphics,
+  eAsyncCompute,
+  eTransfer,
+  ePresent
+};
+
+constexpr size_t QUEUE_ROLE_COUNT = 4;
+
+inline const char* queueRoleToString(QueueRole role) {
+  switch (role) {
+    case QueueRole::eGraphics:
+      return "graphics";
+    case QueueRole::eAsyncCompute:
+      return "async-compute";
+    case QueueRole::eTransfer:
+      return "transfer";
+    case QueueRole::ePresent:
+      return "present";
+  }
+
+  return "unknown";
+}
+
+inline std::optional<QueueRole> queueRoleFromString(const std::string& name) {
+  for (uint32_t i = 0; i < QUEUE_ROLE_COUNT; i++) {
+    if (name == queueRoleToString(static_cast<QueueRole>(i))) {
+      return static_cast<QueueRole>(i);
+    }
+  }
+
+  return std::nullopt;
+}
+
+// 役割ごとのキューの優先度 (0から1)
+struct QueuePriorities {
+  std::array<float, QUEUE_ROLE_COUNT> values{1.0f, 0.5f, 0.5f, 1.0f};
+
+  float& operator[](QueueRole role) {
+    return values[static_cast<size_t>(role)];
+  }
+
+  float operator[](QueueRole role) const {
+    return values[static_cast<size_t>(role)];
+  }
+
+  // "graphics=1.0,transfer=0.25" の形式で上書きする
+  void parse(const std::string& text) {
+    size_t begin = 0;
+
+    while (begin < text.size()) {
+      size_t end = text.find(',', begin);
+
+      if (end == std::string::npos) {
+        end = text.size();
+      }
+
+      std::string item = text.substr(begin, end - begin);
+      size_t equal = item.find('=');
+      std::optional<QueueRole> role;
+
+      if (equal != std::string::npos) {
+        role = queueRoleFromString(item.substr(0, equal));
+      }
+
+      if (!role.has_value()) {
+        throw std::runtime_error("Invalid queue priority: " + item);
+      }
+
+      float value = std::stof(item.substr(equal + 1));
+
+      if (value < 0.0f || value > 1.0f) {
+        throw std::runtime_error("Queue priority must be between 0 and 1: " +
+                                 item);
+      }
+
+      (*this)[*role] = value;
+      begin = end + 1;
+    }
+  }
+};
+
+struct QueueAssignment {
+  uint32_t familyIndex = 0;
+  // キューファミリー内のキューのインデックス
+  uint32_t queueIndex = 0;
+  // 他の役割と同じキューを使うか (その場合、サブミットは同じスレッドから行う)
+  bool shared = false;
+  // 他の役割を持たない専用のファミリーか
+  bool dedicatedFamily = false;
+};
+
+class QueueTopology {
+  std::array<QueueAssignment, QUEUE_ROLE_COUNT> assignments;
+  // キューファミリーごとに、作成するキューの優先度
+  std::map<uint32_t, std::vector<float>> familyPriorities;
+
+ public:
+  // 物理デバイスの情報から、役割ごとのキューを決める
+  static QueueTopology plan(const PhysicalDeviceInfo& info,
+                            const QueuePriorities& priorities) {
+    TRACE_SCOPE("QueueTopology::plan");
+
+    QueueTopology topology;
+
+    // グラフィックスとプレゼンテーションを両方サポートするファミリーがあれば優先する
+    // 同じファミリーであれば、スワップチェーンイメージの所有権を移動する必要が無い
+    std::optional<uint32_t> graphicsFamily =
+        info.findPresentQueueFamily(vk::QueueFlagBits::eGraphics);
+
+    if (!graphicsFamily.has_value()) {
+      graphicsFamily = info.findQueueFamily(vk::QueueFlagBits::eGraphics);
+    }
+
+    std::optional<uint32_t> presentFamily = info.findPresentQueueFamily();
+
+    if (graphicsFamily.has_value() && info.presentSupport[*graphicsFamily]) {
+      presentFamily = graphicsFamily;
+    }
+
+    if (!graphicsFamily.has_value() || !presentFamily.has_value()) {
+      throw std::runtime_error("No graphics or present queue family");
+    }
+
+    // グラフィックスを持たないコンピュートファミリー
+    std::optional<uint32_t> computeFamily = findDedicatedFamily(
+        info, vk::QueueFlagBits::eCompute, vk::QueueFlagBits::eGraphics);
+    // グラフィックスもコンピュートも持たない転送ファミリー
+    std::optional<uint32_t> transferFamily = findDedicatedFamily(
+        info, vk::QueueFlagBits::eTransfer,
+        vk::QueueFlagBits::eGraphics | vk::QueueFlagBits::eCompute);
+
+    // 専用のファミリーが無ければ、グラフィックスのファミリーがコンピュートを持てばそれを使う
+    // 仕様が保証するのは、グラフィックスとコンピュートの両方を持つファミリーがどれか1つあることだけで、
+    // プレゼンテーションのために選んだグラフィックスのファミリーがコンピュートを持つとは限らない
+    std::optional<uint32_t> asyncComputeFamily = computeFamily;
+
+    if (!asyncComputeFamily.has_value()) {
+      if (info.queueFamilies[*graphicsFamily].queueFlags &
+          vk::QueueFlagBits::eCompute) {
+        asyncComputeFamily = graphicsFamily;
+      } else {
+        asyncComputeFamily = info.findQueueFamily(vk::QueueFlagBits::eCompute);
+      }
+    }
+
+    if (!asyncComputeFamily.has_value()) {
+      throw std::runtime_error("No compute queue family");
+    }
+
+    topology.assign(info, QueueRole::eGraphics, *graphicsFamily, false,
+                    priorities);
+    topology.assign(info, QueueRole::eAsyncCompute, *asyncComputeFamily,
+                    computeFamily.has_value(), priorities);
+
+    // 専用の転送ファミリーが無ければ、コンピュートのファミリーを使う
+    // 転送は、グラフィックスかコンピュートを持つファミリーであれば暗黙にサポートされる
+    topology.assign(info, QueueRole::eTransfer,
+                    transferFamily.value_or(*asyncComputeFamily),
+                    transferFamily.has_value(), priorities);
+
+    if (*presentFamily == *graphicsFamily) {
+      // 同じファミリーであれば、グラフィックスのキューでそのままプレゼンテーションする
+      topology.share(QueueRole::ePresent, QueueRole::eGraphics);
+    } else {
+      topology.assign(info, QueueRole::ePresent, *presentFamily, false,
+                      priorities);
+    }
+
+    return topology;
+  }
+
+  const QueueAssignment& operator[](QueueRole role) const {
+    return assignments[static_cast<size_t>(role)];
+  }
+
+  // キューの優先度 (共有する場合は、共有する役割の中で最も高い値)
+  float getPriority(QueueRole role) const {
+    const QueueAssignment& assignment = (*this)[role];
+    return familyPriorities.at(assignment.familyIndex)[assignment.queueIndex];
+  }
+
+  // vk::DeviceCreateInfoに渡すキューの情報
+  // 優先度の配列を参照するので、QueueTopologyより長く使ってはいけない
+  std::vector<vk::DeviceQueueCreateInfo> getQueueCreateInfos() const {
+    std::vector<vk::DeviceQueueCreateInfo> queueCreateInfos;
+
+    for (auto&& [familyIndex, priorities] : familyPriorities) {
+      queueCreateInfos.push_back(vk::DeviceQueueCreateInfo{
+          /* flags = */ {},
+          /* queueFamilyIndex = */ familyIndex,
+          /* pQueuePriorities = */ priorities});
+    }
+
+    return queueCreateInfos;
+  }
+
+ private:
+  static std::optional<uint32_t> findDedicatedFamily(
+      const PhysicalDeviceInfo& info,
+      vk::QueueFlags flags,
+      vk::QueueFlags excluded) {
+    for (uint32_t i = 0; i < info.queueFamilies.size(); i++) {
+      vk::QueueFlags familyFlags = info.queueFamilies[i].queueFlags;
+
+      if ((familyFlags & flags) == flags &&
+          (familyFlags & excluded) == vk::QueueFlags{}) {
+        return i;
+      }
+    }
+
+    return std::nullopt;
+  }
+
+  // ファミリー内の次のキューを割り当てる
+  // キューが足りなければ、最後に割り当てたキューを共有する
+  void assign(const PhysicalDeviceInfo& info,
+              QueueRole role,
+              uint32_t familyIndex,
+              bool dedicatedFamily,
+              const QueuePriorities& priorities) {
+    std::vector<float>& familyQueues = familyPriorities[familyIndex];
+    uint32_t queueCount = info.queueFamilies[familyIndex].queueCount;
+    QueueAssignment& assignment = assignments[static_cast<size_t>(role)];
+
+    assignment.familyIndex = familyIndex;
+    assignment.dedicatedFamily = dedicatedFamily;
+    assignment.shared = false;
+
+    if (familyQueues.size() < queueCount) {
+      assignment.queueIndex = static_cast<uint32_t>(familyQueues.size());
+      familyQueues.push_back(priorities[role]);
+      return;
+    }
+
+    assignment.queueIndex = static_cast<uint32_t>(familyQueues.size() - 1);
+    assignment.shared = true;
+    // 共有するキューの優先度は、高い方に合わせる
+    familyQueues.back() = std::max(familyQueues.back(), priorities[role]);
+    markShared(familyIndex, assignment.queueIndex);
+  }
+
+  void share(QueueRole role, QueueRole with) {
+    QueueAssignment& assignment = assignments[static_cast<size_t>(role)];
+    assignment = (*this)[with];
+    assignment.shared = true;
+    markShared(assignment.familyIndex, assignment.queueIndex);
+  }
+
+  void markShared(uint32_t familyIndex, uint32_t queueIndex) {
+    for (auto&& assignment : assignments) {
+      if (assignment.familyIndex == familyIndex &&
+          assignment.queueIndex == queueIndex) {
+        assignment.shared = true;
+      }
+    }
+  }
+};
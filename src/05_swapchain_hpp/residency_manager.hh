@@ -0,0 +1,458 @@
+/*
+ * メモリーの予算とレジデンシーの管理
+ *
+ * フレームごとにヒープの予算と使用量を取得し (VK_EXT_memory_budgetが無ければヒープの容量から見積もる)、
+ * デバイスローカルなヒープが予算を超えていれば、最も長く使われていないバッファーを
+ * ホストから見えるメモリーに移して (追い出して) 空きを作る
+ * 追い出したバッファーもGPUから読めるが遅いので、使われた時に予算に余裕があれば戻す
+ *
+ * ドライバーが報告する使用量はブロック単位なので、バッファーを追い出しても
+ * ブロックが解放されるまで減らない
+ * そのため、アロケーターのブロックの分はアロケーターが割り当てた量 (破棄待ちの分を除く) で置き換える
+ *
+ * バッファーはResourceRegistryに登録し、そのハンドルで参照させる
+ * 移動してもハンドルは変わらないが、vk::Bufferが変わるので、利用側は毎フレームuse()で取得し直す
+ * 移動のコピーはフレームの間に記録しておき、takeSignalSemaphore()でまとめてサブミットする
+ * 描画のサブミットでそのセマフォを待つので、描画のスレッドはコピーの完了を待たない
+ * 移動中にGPUが書き込んだ内容は失われるので、主に読み込み専用のバッファーを対象とする
+ * 移動前のバッファーとコピーのコマンドバッファーは、実行中のフレームが終わるまで破棄待ちのキューに入れておく
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include "deletion_queue.hh"
+#include "memory_allocator.hh"
+#include "resource_registry.hh"
+#include "tracer.hh"
+
+class ResidencyManager {
+  // 移動に使う情報 (バッファーとその割り当てはregistryが持つ)
+  struct Resource {
+    vk::DeviceSize size = 0;
+    vk::BufferUsageFlags usage;
+    uint64_t lastUsedFrame = 0;
+    bool evicted = false;
+  };
+
+ public:
+  struct HeapBudget {
+    // このプロセスが使ってよい量と、使用している量
+    vk::DeviceSize budget = 0;
+    vk::DeviceSize usage = 0;
+    // VK_EXT_memory_budgetから取得した値か (falseの場合は見積もり)
+    bool reported = false;
+    bool deviceLocal = false;
+  };
+
+  struct Statistics {
+    uint64_t evictionCount = 0;
+    vk::DeviceSize evictedBytes = 0;
+    uint64_t restoreCount = 0;
+    vk::DeviceSize restoredBytes = 0;
+    // 現在追い出されているバッファー
+    uint32_t evictedResources = 0;
+  };
+
+  // 予算のこの割合を超えたら追い出し、この割合まで減らす
+  static constexpr double EVICT_THRESHOLD = 0.95;
+  static constexpr double EVICT_TARGET = 0.85;
+  // VK_EXT_memory_budgetが無い場合に、ヒープの容量のうち予算とみなす割合
+  static constexpr double ESTIMATED_BUDGET_RATIO = 0.8;
+
+ private:
+  std::shared_ptr<vk::raii::Device> device;
+  std::shared_ptr<vk::raii::PhysicalDevice> physicalDevice;
+  std::shared_ptr<MemoryAllocator> allocator;
+  std::shared_ptr<DeletionQueue> deletionQueue;
+  std::shared_ptr<ResourceRegistry> registry;
+  std::shared_ptr<vk::raii::Queue> queue;
+  std::shared_ptr<vk::raii::CommandPool> commandPool;
+  // このフレームの移動のコピーを記録中のコマンドバッファー (無ければnullptr)
+  std::shared_ptr<vk::raii::CommandBuffer> commandBuffer;
+  // コピーの完了を描画のサブミットに通知する
+  vk::raii::Semaphore semaphore{nullptr};
+  std::vector<uint32_t> queueFamilyIndices;
+  bool memoryBudgetEnabled;
+  // テスト用に、デバイスローカルなヒープの予算をこの値に制限する
+  std::optional<vk::DeviceSize> budgetLimit;
+  // GPUがまだ使っているかもしれないフレーム数
+  uint32_t framesInFlight;
+
+  // このマネージャーで作成したバッファー
+  std::map<BufferHandle, Resource> resources;
+  std::vector<HeapBudget> heapBudgets;
+  uint64_t currentFrame = 0;
+  Statistics statistics;
+
+ public:
+  ResidencyManager(std::shared_ptr<vk::raii::Device> device,
+                   std::shared_ptr<vk::raii::PhysicalDevice> physicalDevice,
+                   std::shared_ptr<MemoryAllocator> allocator,
+                   std::shared_ptr<DeletionQueue> deletionQueue,
+                   std::shared_ptr<ResourceRegistry> registry,
+                   std::shared_ptr<vk::raii::Queue> queue,
+                   uint32_t queueFamilyIndex,
+                   std::vector<uint32_t> queueFamilyIndices,
+                   bool memoryBudgetEnabled,
+                   std::optional<vk::DeviceSize> budgetLimit,
+                   uint32_t framesInFlight)
+      : device(std::move(device)),
+        physicalDevice(std::move(physicalDevice)),
+        allocator(std::move(allocator)),
+        deletionQueue(std::move(deletionQueue)),
+        registry(std::move(registry)),
+        queue(std::move(queue)),
+        queueFamilyIndices(std::move(queueFamilyIndices)),
+        memoryBudgetEnabled(memoryBudgetEnabled),
+        budgetLimit(budgetLimit),
+        framesInFlight(framesInFlight) {
+    commandPool = std::make_shared<vk::raii::CommandPool>(
+        *this->device,
+        vk::CommandPoolCreateInfo{vk::CommandPoolCreateFlagBits::eTransient,
+                                  queueFamilyIndex});
+    semaphore = vk::raii::Semaphore(*this->device, vk::SemaphoreCreateInfo{});
+    updateBudgets();
+  }
+
+  ~ResidencyManager() {
+    while (!resources.empty()) {
+      destroyBuffer(resources.begin()->first);
+    }
+  }
+
+  ResidencyManager(const ResidencyManager&) = delete;
+  ResidencyManager& operator=(const ResidencyManager&) = delete;
+
+  // デバイスローカルなバッファーを作成する
+  // 予算を超える場合は、先に他のバッファーを追い出す
+  BufferHandle createBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage) {
+    makeRoom(size);
+
+    Resource resource;
+    resource.size = size;
+    // 移動のため、転送元と転送先にもできるようにする
+    resource.usage = usage | vk::BufferUsageFlagBits::eTransferSrc |
+                     vk::BufferUsageFlagBits::eTransferDst;
+    resource.lastUsedFrame = currentFrame;
+
+    BufferHandle handle =
+        registry->createBuffer(getBufferInfo(resource), MemoryUsage::eGpuOnly);
+    heapBudgets[getHeapIndex(handle)].usage += getAllocation(handle).size;
+    resources.emplace(handle, resource);
+    return handle;
+  }
+
+  void destroyBuffer(BufferHandle handle) {
+    Resource& resource = resources.at(handle);
+
+    if (resource.evicted) {
+      statistics.evictedResources--;
+    }
+
+    registry->destroy(handle);
+    resources.erase(handle);
+  }
+
+  // フレームの開始時に呼ぶ
+  // 予算を取得し直し、超えているヒープから追い出す (コピーはtakeSignalSemaphore()でサブミットする)
+  void beginFrame(uint64_t frame) {
+    TRACE_SCOPE("ResidencyManager::beginFrame");
+
+    currentFrame = frame;
+    updateBudgets();
+
+    for (uint32_t i = 0; i < heapBudgets.size(); i++) {
+      const HeapBudget& heap = heapBudgets[i];
+
+      if (heap.deviceLocal &&
+          heap.usage > static_cast<vk::DeviceSize>(heap.budget *
+                                                   EVICT_THRESHOLD)) {
+        evict(i, heap.usage - static_cast<vk::DeviceSize>(heap.budget *
+                                                          EVICT_TARGET));
+      }
+    }
+
+    if (Tracer::isEnabled()) {
+      recordCounters();
+    }
+  }
+
+  // このフレームでバッファーを使うことを知らせ、現在のvk::Bufferを返す
+  // 追い出されていて、予算に余裕があればデバイスローカルなメモリーに戻す
+  vk::Buffer use(BufferHandle handle) {
+    Resource& resource = resources.at(handle);
+    resource.lastUsedFrame = currentFrame;
+
+    if (resource.evicted && hasRoom(resource.size)) {
+      restore(handle);
+    }
+
+    return registry->getBuffer(handle);
+  }
+
+  vk::Buffer getBuffer(BufferHandle handle) const {
+    return registry->getBuffer(handle);
+  }
+
+  bool isEvicted(BufferHandle handle) const {
+    return resources.at(handle).evicted;
+  }
+
+  // このフレームで記録した移動のコピーをサブミットし、完了でシグナルするセマフォを返す (無ければnullptr)
+  // use()は移動先のバッファーをすぐに返すので、それを使う描画のサブミットで必ず待つこと
+  vk::Semaphore takeSignalSemaphore() {
+    if (!commandBuffer) {
+      return nullptr;
+    }
+
+    commandBuffer->end();
+
+    vk::SubmitInfo submitInfo;
+    submitInfo.setCommandBuffers(**commandBuffer);
+    submitInfo.setSignalSemaphores(*semaphore);
+    queue->submit(submitInfo);
+
+    // コピーはこのセマフォを待つ描画のサブミットより先に終わるので、移動前のバッファーと一緒に破棄する
+    deletionQueue->push(std::move(commandBuffer));
+    return *semaphore;
+  }
+
+  const std::vector<HeapBudget>& getHeapBudgets() const { return heapBudgets; }
+  const Statistics& getStatistics() const { return statistics; }
+
+ private:
+  void updateBudgets() {
+    const vk::PhysicalDeviceMemoryProperties& properties =
+        allocator->getMemoryProperties();
+    heapBudgets.assign(properties.memoryHeapCount, HeapBudget{});
+
+    std::vector<MemoryAllocator::HeapStatistics> stats =
+        allocator->getStatistics();
+    std::vector<vk::DeviceSize> pendingBytes(properties.memoryHeapCount, 0);
+
+    for (uint32_t i = 0; i < properties.memoryTypeCount; i++) {
+      pendingBytes[properties.memoryTypes[i].heapIndex] +=
+          deletionQueue->getPendingBytes(i);
+    }
+
+    // アロケーターが割り当てている量 (破棄待ちの分は、まもなく解放されるので除く)
+    std::vector<vk::DeviceSize> allocatedBytes(properties.memoryHeapCount, 0);
+
+    for (uint32_t i = 0; i < properties.memoryHeapCount; i++) {
+      vk::DeviceSize allocated =
+          stats[i].allocationBytes + stats[i].dedicatedBytes;
+      allocatedBytes[i] = allocated - std::min(allocated, pendingBytes[i]);
+    }
+
+    if (memoryBudgetEnabled) {
+      auto chain = physicalDevice->getMemoryProperties2KHR<
+          vk::PhysicalDeviceMemoryProperties2,
+          vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+      auto&& budget = chain.get<vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+
+      for (uint32_t i = 0; i < properties.memoryHeapCount; i++) {
+        // ブロックの空きはドライバーの使用量に含まれるが、割り当てに使えるので除く
+        vk::DeviceSize reserved = stats[i].blockBytes + stats[i].dedicatedBytes;
+        vk::DeviceSize usage = budget.heapUsage[i];
+        heapBudgets[i].budget = budget.heapBudget[i];
+        heapBudgets[i].usage =
+            usage - std::min(usage, reserved) + allocatedBytes[i];
+        heapBudgets[i].reported = true;
+      }
+    } else {
+      // 他のプロセスの使用量は分からないので、このアロケーターの使用量だけを数える
+      for (uint32_t i = 0; i < properties.memoryHeapCount; i++) {
+        heapBudgets[i].budget = static_cast<vk::DeviceSize>(
+            properties.memoryHeaps[i].size * ESTIMATED_BUDGET_RATIO);
+        heapBudgets[i].usage = allocatedBytes[i];
+      }
+    }
+
+    for (uint32_t i = 0; i < properties.memoryHeapCount; i++) {
+      heapBudgets[i].deviceLocal =
+          static_cast<bool>(properties.memoryHeaps[i].flags &
+                            vk::MemoryHeapFlagBits::eDeviceLocal);
+
+      if (heapBudgets[i].deviceLocal && budgetLimit.has_value()) {
+        heapBudgets[i].budget = std::min(heapBudgets[i].budget, *budgetLimit);
+      }
+    }
+  }
+
+  const MemoryAllocation& getAllocation(BufferHandle handle) const {
+    return registry->get(handle).allocation;
+  }
+
+  uint32_t getHeapIndex(BufferHandle handle) const {
+    return allocator->getMemoryProperties()
+        .memoryTypes[getAllocation(handle).memoryTypeIndex]
+        .heapIndex;
+  }
+
+  // デバイスローカルなヒープに、sizeバイトを追加しても予算に収まるか
+  bool hasRoom(vk::DeviceSize size) const {
+    for (auto&& heap : heapBudgets) {
+      if (heap.deviceLocal &&
+          heap.usage + size >
+              static_cast<vk::DeviceSize>(heap.budget * EVICT_THRESHOLD)) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // 新しいバッファーのために、予算を超える分を追い出す
+  void makeRoom(vk::DeviceSize size) {
+    for (uint32_t i = 0; i < heapBudgets.size(); i++) {
+      const HeapBudget& heap = heapBudgets[i];
+      auto limit = static_cast<vk::DeviceSize>(heap.budget * EVICT_THRESHOLD);
+
+      if (heap.deviceLocal && heap.usage + size > limit) {
+        evict(i, heap.usage + size - limit);
+      }
+    }
+  }
+
+  vk::BufferCreateInfo getBufferInfo(const Resource& resource) const {
+    return vk::BufferCreateInfo{
+        /* flags = */ {},
+        /* size = */ resource.size,
+        /* usage = */ resource.usage,
+        /* sharingMode = */
+        queueFamilyIndices.size() > 1 ? vk::SharingMode::eConcurrent
+                                      : vk::SharingMode::eExclusive,
+        /* queueFamilyIndices = */ queueFamilyIndices};
+  }
+
+  // ヒープから、最も長く使われていないバッファーを合計bytes以上追い出す
+  void evict(uint32_t heapIndex, vk::DeviceSize bytes) {
+    TRACE_SCOPE("ResidencyManager::evict");
+
+    // 統合GPUのように、追い出し先も同じヒープであれば意味が無い
+    const vk::PhysicalDeviceMemoryProperties& properties =
+        allocator->getMemoryProperties();
+    const std::vector<uint32_t>& uploadTypes =
+        allocator->getMemoryTypeTable(MemoryUsage::eUpload);
+
+    if (uploadTypes.empty() ||
+        properties.memoryTypes[uploadTypes[0]].heapIndex == heapIndex) {
+      return;
+    }
+
+    std::vector<BufferHandle> candidates;
+
+    for (auto&& [handle, resource] : resources) {
+      // GPUがまだ使っているかもしれないバッファーは動かさない
+      if (!resource.evicted && getHeapIndex(handle) == heapIndex &&
+          resource.lastUsedFrame + framesInFlight <= currentFrame) {
+        candidates.push_back(handle);
+      }
+    }
+
+    std::sort(candidates.begin(), candidates.end(),
+              [&](BufferHandle a, BufferHandle b) {
+                return resources.at(a).lastUsedFrame <
+                       resources.at(b).lastUsedFrame;
+              });
+
+    std::vector<BufferHandle> victims;
+    vk::DeviceSize freed = 0;
+
+    for (BufferHandle handle : candidates) {
+      if (freed >= bytes) {
+        break;
+      }
+
+      victims.push_back(handle);
+      freed += resources.at(handle).size;
+    }
+
+    move(victims, MemoryUsage::eUpload);
+
+    for (BufferHandle handle : victims) {
+      Resource& resource = resources.at(handle);
+      resource.evicted = true;
+      statistics.evictionCount++;
+      statistics.evictedBytes += resource.size;
+      statistics.evictedResources++;
+    }
+  }
+
+  void restore(BufferHandle handle) {
+    TRACE_SCOPE("ResidencyManager::restore");
+
+    move({handle}, MemoryUsage::eGpuOnly);
+
+    Resource& resource = resources.at(handle);
+    resource.evicted = false;
+    statistics.restoreCount++;
+    statistics.restoredBytes += resource.size;
+    statistics.evictedResources--;
+  }
+
+  // バッファーを別の用途のメモリーに作り直し、内容をコピーするコマンドを記録する
+  // サブミットはtakeSignalSemaphore()で行い、元のバッファーは実行中のフレームが終わるまで破棄しない
+  void move(const std::vector<BufferHandle>& handles, MemoryUsage usage) {
+    if (handles.empty()) {
+      return;
+    }
+
+    if (!commandBuffer) {
+      vk::raii::CommandBuffers commandBuffers(
+          *device, vk::CommandBufferAllocateInfo{
+                       **commandPool, vk::CommandBufferLevel::ePrimary, 1});
+      commandBuffer = std::make_shared<vk::raii::CommandBuffer>(
+          std::move(commandBuffers[0]));
+      commandBuffer->begin(vk::CommandBufferBeginInfo{
+          vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    } else {
+      // 同じフレームで追い出したバッファーを戻す場合に、先のコピーの完了を待つ
+      commandBuffer->pipelineBarrier(
+          vk::PipelineStageFlagBits::eTransfer,
+          vk::PipelineStageFlagBits::eTransfer, {},
+          vk::MemoryBarrier{vk::AccessFlagBits::eTransferWrite,
+                            vk::AccessFlagBits::eTransferRead |
+                                vk::AccessFlagBits::eTransferWrite},
+          {}, {});
+    }
+
+    for (BufferHandle handle : handles) {
+      const Resource& resource = resources.at(handle);
+      auto [buffer, allocation] =
+          allocator->createBuffer(getBufferInfo(resource), usage);
+      commandBuffer->copyBuffer(registry->getBuffer(handle), *buffer,
+                                vk::BufferCopy{0, 0, resource.size});
+
+      // 移動前のバッファーは、registryが破棄待ちのキューに移す
+      heapBudgets[getHeapIndex(handle)].usage -= getAllocation(handle).size;
+      registry->replace(handle, std::move(buffer), allocation);
+      heapBudgets[getHeapIndex(handle)].usage += allocation.size;
+    }
+  }
+
+  // ヒープごとの予算と使用量をMiB単位でトレースに記録する
+  void recordCounters() {
+    for (uint32_t i = 0; i < heapBudgets.size(); i++) {
+      Tracer::get().counter(
+          "Heap " + std::to_string(i),
+          {{"budget", static_cast<double>(heapBudgets[i].budget >> 20)},
+           {"usage", static_cast<double>(heapBudgets[i].usage >> 20)}});
+    }
+
+    Tracer::get().counter(
+        "Residency",
+        {{"evicted", static_cast<double>(statistics.evictedResources)}});
+  }
+};
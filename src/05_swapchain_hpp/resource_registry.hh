@@ -0,0 +1,187 @@
+/*
+ * リソースの登録簿
+ *
+ * バッファー、イメージ、サンプラーを種類ごとのスロットマップに持ち、世代付きのハンドルで参照させる
+ * std::shared_ptrと違って参照カウントを持たないので、破棄は登録簿に明示的に依頼する
+ * 破棄したリソースは破棄待ちのキューに移し、GPUが使い終わってからメモリーを返す
+ * 破棄済みのハンドルで参照すると例外を投げる
+ * 移動するリソース (ResidencyManager、Defragmenter) もここに持ち、replace()で中身を差し替えるので、
+ * 移動してもハンドルはそのまま使える (vk::Buffer/vk::Imageは変わるので、使う時に取得し直す)
+ */
+
+#pragma once
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include "deletion_queue.hh"
+#include "memory_allocator.hh"
+#include "slot_map.hh"
+
+struct BufferResource {
+  vk::raii::Buffer buffer;
+  MemoryAllocation allocation;
+  vk::DeviceSize size;
+};
+
+struct ImageResource {
+  vk::raii::Image image;
+  MemoryAllocation allocation;
+  vk::Format format;
+  vk::Extent3D extent;
+};
+
+struct SamplerResource {
+  vk::raii::Sampler sampler;
+};
+
+using BufferHandle = SlotMap<BufferResource>::Handle;
+using ImageHandle = SlotMap<ImageResource>::Handle;
+using SamplerHandle = SlotMap<SamplerResource>::Handle;
+
+class ResourceRegistry {
+  std::shared_ptr<vk::raii::Device> device;
+  std::shared_ptr<MemoryAllocator> allocator;
+  std::shared_ptr<DeletionQueue> deletionQueue;
+  SlotMap<BufferResource> buffers;
+  SlotMap<ImageResource> images;
+  SlotMap<SamplerResource> samplers;
+
+ public:
+  ResourceRegistry(std::shared_ptr<vk::raii::Device> device,
+                   std::shared_ptr<MemoryAllocator> allocator,
+                   std::shared_ptr<DeletionQueue> deletionQueue)
+      : device(std::move(device)),
+        allocator(std::move(allocator)),
+        deletionQueue(std::move(deletionQueue)) {}
+
+  // 残っているリソースは破棄待ちのキューに移す
+  ~ResourceRegistry() {
+    while (!buffers.empty()) {
+      destroy(buffers.getHandle(0));
+    }
+
+    while (!images.empty()) {
+      destroy(images.getHandle(0));
+    }
+
+    while (!samplers.empty()) {
+      destroy(samplers.getHandle(0));
+    }
+  }
+
+  ResourceRegistry(const ResourceRegistry&) = delete;
+  ResourceRegistry& operator=(const ResourceRegistry&) = delete;
+
+  BufferHandle createBuffer(const vk::BufferCreateInfo& bufferInfo,
+                            MemoryUsage usage) {
+    auto [buffer, allocation] = allocator->createBuffer(bufferInfo, usage);
+    return buffers.emplace(
+        BufferResource{std::move(buffer), allocation, bufferInfo.size});
+  }
+
+  ImageHandle createImage(const vk::ImageCreateInfo& imageInfo,
+                          MemoryUsage usage,
+                          bool dedicated = false) {
+    auto [image, allocation] =
+        allocator->createImage(imageInfo, usage, dedicated);
+    return images.emplace(ImageResource{std::move(image), allocation,
+                                        imageInfo.format, imageInfo.extent});
+  }
+
+  SamplerHandle createSampler(const vk::SamplerCreateInfo& samplerInfo) {
+    return samplers.emplace(
+        SamplerResource{vk::raii::Sampler(*device, samplerInfo)});
+  }
+
+  // 移動先のバッファーに差し替え、移動前のものは破棄待ちのキューに移す
+  void replace(BufferHandle handle,
+               vk::raii::Buffer buffer,
+               const MemoryAllocation& allocation) {
+    BufferResource& resource = get(handle);
+    deletionQueue->push(
+        std::make_shared<vk::raii::Buffer>(std::move(resource.buffer)),
+        resource.allocation);
+    resource.buffer = std::move(buffer);
+    resource.allocation = allocation;
+  }
+
+  void replace(ImageHandle handle,
+               vk::raii::Image image,
+               const MemoryAllocation& allocation) {
+    ImageResource& resource = get(handle);
+    deletionQueue->push(
+        std::make_shared<vk::raii::Image>(std::move(resource.image)),
+        resource.allocation);
+    resource.image = std::move(image);
+    resource.allocation = allocation;
+  }
+
+  void destroy(BufferHandle handle) {
+    BufferResource& resource = get(handle);
+    deletionQueue->push(
+        std::make_shared<vk::raii::Buffer>(std::move(resource.buffer)),
+        resource.allocation);
+    buffers.erase(handle);
+  }
+
+  void destroy(ImageHandle handle) {
+    ImageResource& resource = get(handle);
+    deletionQueue->push(
+        std::make_shared<vk::raii::Image>(std::move(resource.image)),
+        resource.allocation);
+    images.erase(handle);
+  }
+
+  void destroy(SamplerHandle handle) {
+    SamplerResource& resource = get(handle);
+    deletionQueue->push(
+        std::make_shared<vk::raii::Sampler>(std::move(resource.sampler)));
+    samplers.erase(handle);
+  }
+
+  BufferResource& get(BufferHandle handle) {
+    return lookup(buffers, handle, "buffer");
+  }
+
+  ImageResource& get(ImageHandle handle) {
+    return lookup(images, handle, "image");
+  }
+
+  SamplerResource& get(SamplerHandle handle) {
+    return lookup(samplers, handle, "sampler");
+  }
+
+  vk::Buffer getBuffer(BufferHandle handle) { return *get(handle).buffer; }
+  vk::Image getImage(ImageHandle handle) { return *get(handle).image; }
+  vk::Sampler getSampler(SamplerHandle handle) { return *get(handle).sampler; }
+
+  bool contains(BufferHandle handle) const { return buffers.contains(handle); }
+  bool contains(ImageHandle handle) const { return images.contains(handle); }
+  bool contains(SamplerHandle handle) const {
+    return samplers.contains(handle);
+  }
+
+  size_t getBufferCount() const { return buffers.size(); }
+  size_t getImageCount() const { return images.size(); }
+  size_t getSamplerCount() const { return samplers.size(); }
+
+ private:
+  template <typename T>
+  static T& lookup(SlotMap<T>& map,
+                   typename SlotMap<T>::Handle handle,
+                   const char* kind) {
+    T* resource = map.find(handle);
+
+    if (resource == nullptr) {
+      throw std::runtime_error("Stale " + std::string(kind) + " handle: " +
+                               std::to_string(handle.getValue()));
+    }
+
+    return *resource;
+  }
+};
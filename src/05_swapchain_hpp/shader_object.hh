@@ -0,0 +1,175 @@
+/*
+ * VK_EXT_shader_objectによるパイプラインを使わない描画
+ *
+ * シェーダーをステージごとにVkShaderEXTとして作成しておき、描画時にバインドする
+ * パイプラインの状態はすべて動的に設定するので、シェーダーと状態の組み合わせごとの作成が要らない
+ * 初めて使う組み合わせでも、作成済みのシェーダーであれば待たずに描画できる
+ *
+ * レンダーパスは使えないので、VK_KHR_dynamic_renderingで描画する
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include "pipeline_library.hh"
+#include "tracer.hh"
+
+class ShaderObjectRenderer {
+ public:
+  // Vulkan 1.0では、VK_KHR_dynamic_renderingとその依存先も必要となる
+  static constexpr std::array<const char*, 6> REQUIRED_EXTENSIONS{
+      VK_EXT_SHADER_OBJECT_EXTENSION_NAME,
+      VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME,
+      VK_KHR_DEPTH_STENCIL_RESOLVE_EXTENSION_NAME,
+      VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME,
+      VK_KHR_MULTIVIEW_EXTENSION_NAME,
+      VK_KHR_MAINTENANCE_2_EXTENSION_NAME};
+
+  struct Statistics {
+    uint32_t shaderCount = 0;
+    double shaderMilliseconds = 0.0;
+  };
+
+ private:
+  std::shared_ptr<vk::raii::Device> device;
+  std::mutex mutex;
+  Statistics statistics;
+
+ public:
+  explicit ShaderObjectRenderer(std::shared_ptr<vk::raii::Device> device)
+      : device(std::move(device)) {}
+
+  ShaderObjectRenderer(const ShaderObjectRenderer&) = delete;
+  ShaderObjectRenderer& operator=(const ShaderObjectRenderer&) = delete;
+
+  // 他のシェーダーとはリンクしないので、どのフラグメントシェーダーとも組み合わせられる
+  std::shared_ptr<vk::raii::ShaderEXT> createShader(
+      const PreRasterizationState& state) {
+    return createShader(vk::ShaderStageFlagBits::eVertex,
+                        vk::ShaderStageFlagBits::eFragment, state.code,
+                        state.specializationConstants);
+  }
+
+  std::shared_ptr<vk::raii::ShaderEXT> createShader(
+      const FragmentShaderState& state) {
+    return createShader(vk::ShaderStageFlagBits::eFragment, {}, state.code,
+                        state.specializationConstants);
+  }
+
+  // シェーダーをバインドし、描画に必要な状態をすべて設定する
+  // テッセレーションとジオメトリーシェーダーのフィーチャーは有効化していないので、それらのステージはバインドしない
+  void bind(vk::raii::CommandBuffer& commandBuffer,
+            const vk::raii::ShaderEXT& vertexShader,
+            const vk::raii::ShaderEXT& fragmentShader,
+            const VertexInputState& vertexInput,
+            const PreRasterizationState& preRasterization,
+            const FragmentOutputState& fragmentOutput,
+            vk::Extent2D extent) const {
+    std::array<vk::ShaderStageFlagBits, 2> stages{
+        vk::ShaderStageFlagBits::eVertex, vk::ShaderStageFlagBits::eFragment};
+    std::array<vk::ShaderEXT, 2> shaders{*vertexShader, *fragmentShader};
+    commandBuffer.bindShadersEXT(stages, shaders);
+
+    // 頂点バッファーは使わない
+    commandBuffer.setVertexInputEXT({}, {});
+    commandBuffer.setPrimitiveTopologyEXT(vertexInput.topology);
+    commandBuffer.setPrimitiveRestartEnableEXT(VK_FALSE);
+
+    vk::Viewport viewport{/* x = */ 0.0f,
+                          /* y = */ 0.0f,
+                          /* width = */ static_cast<float>(extent.width),
+                          /* height = */ static_cast<float>(extent.height),
+                          /* minDepth = */ 0.0f,
+                          /* maxDepth = */ 1.0f};
+    vk::Rect2D scissor{/* offset = */ {0, 0}, /* extent = */ extent};
+    commandBuffer.setViewportWithCountEXT(viewport);
+    commandBuffer.setScissorWithCountEXT(scissor);
+    commandBuffer.setRasterizerDiscardEnableEXT(VK_FALSE);
+    commandBuffer.setPolygonModeEXT(vk::PolygonMode::eFill);
+    commandBuffer.setCullModeEXT(preRasterization.cullMode);
+    commandBuffer.setFrontFaceEXT(vk::FrontFace::eCounterClockwise);
+    commandBuffer.setDepthBiasEnableEXT(VK_FALSE);
+
+    vk::SampleMask sampleMask = ~0u;
+    commandBuffer.setRasterizationSamplesEXT(vk::SampleCountFlagBits::e1);
+    commandBuffer.setSampleMaskEXT(vk::SampleCountFlagBits::e1, sampleMask);
+    commandBuffer.setAlphaToCoverageEnableEXT(VK_FALSE);
+
+    // 深度とステンシルのアタッチメントは使わない
+    commandBuffer.setDepthTestEnableEXT(VK_FALSE);
+    commandBuffer.setDepthWriteEnableEXT(VK_FALSE);
+    commandBuffer.setStencilTestEnableEXT(VK_FALSE);
+
+    // GraphicsPipelineLibraryのフラグメント出力と同じく、有効にした場合はアルファで重ねる
+    vk::Bool32 blendEnabled = fragmentOutput.blendEnabled;
+    vk::ColorBlendEquationEXT equation{
+        /* srcColorBlendFactor = */ vk::BlendFactor::eSrcAlpha,
+        /* dstColorBlendFactor = */ vk::BlendFactor::eOneMinusSrcAlpha,
+        /* colorBlendOp = */ vk::BlendOp::eAdd,
+        /* srcAlphaBlendFactor = */ vk::BlendFactor::eOne,
+        /* dstAlphaBlendFactor = */ vk::BlendFactor::eZero,
+        /* alphaBlendOp = */ vk::BlendOp::eAdd};
+    vk::ColorComponentFlags writeMask =
+        vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG |
+        vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA;
+    commandBuffer.setColorBlendEnableEXT(0, blendEnabled);
+    commandBuffer.setColorBlendEquationEXT(0, equation);
+    commandBuffer.setColorWriteMaskEXT(0, writeMask);
+  }
+
+  Statistics getStatistics() {
+    std::lock_guard lock(mutex);
+    return statistics;
+  }
+
+ private:
+  std::shared_ptr<vk::raii::ShaderEXT> createShader(
+      vk::ShaderStageFlagBits stage,
+      vk::ShaderStageFlags nextStage,
+      std::span<const uint32_t> code,
+      const std::vector<uint32_t>& constants) {
+    TRACE_SCOPE("ShaderObjectRenderer::createShader");
+
+    std::vector<vk::SpecializationMapEntry> entries;
+
+    for (uint32_t i = 0; i < constants.size(); i++) {
+      entries.push_back(vk::SpecializationMapEntry{
+          /* constantID = */ i,
+          /* offset = */ i * static_cast<uint32_t>(sizeof(uint32_t)),
+          /* size = */ sizeof(uint32_t)});
+    }
+
+    vk::SpecializationInfo specialization{
+        /* mapEntries = */ entries,
+        /* data = */ vk::ArrayProxyNoTemporaries<const uint32_t>(constants)};
+
+    vk::ShaderCreateInfoEXT shaderInfo{};
+    shaderInfo.setStage(stage)
+        .setNextStage(nextStage)
+        .setCodeType(vk::ShaderCodeTypeEXT::eSpirv)
+        .setCodeSize(code.size_bytes())
+        .setPCode(code.data())
+        .setPName("main")
+        .setPSpecializationInfo(entries.empty() ? nullptr : &specialization);
+
+    auto start = std::chrono::steady_clock::now();
+    auto shader = std::make_shared<vk::raii::ShaderEXT>(*device, shaderInfo);
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::lock_guard lock(mutex);
+    statistics.shaderCount++;
+    statistics.shaderMilliseconds += elapsed.count();
+    return shader;
+  }
+};
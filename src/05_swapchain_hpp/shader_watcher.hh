@@ -0,0 +1,254 @@
+/*
+ * シェーダーのソースの変更の監視と再コンパイル (開発用)
+ *
+ * inotifyでソースのディレクトリーを監視し、書き込まれたファイルを監視のスレッドでSPIR-Vにコンパイルする
+ * 結果は描画のスレッドがフレームの境界でpoll()で受け取るので、コンパイルを待って描画が止まることは無い
+ * コンパイルしたSPIR-Vは出力先の.spvも置き換えるので、次の起動でも使われる
+ *
+ * エディターによっては一時ファイルに書いてから名前を変えるので、IN_MOVED_TOも監視する
+ * 保存1回で複数のイベントが届くことがあるので、少し待ってから同じファイルをまとめてコンパイルする
+ */
+
+#pragma once
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <regex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "file_io.hh"
+#include "tracer.hh"
+
+class ShaderWatcher {
+ public:
+  // 同じファイルへのイベントをまとめるために待つ時間
+  static constexpr std::chrono::milliseconds DEBOUNCE_TIME{100};
+
+  struct Result {
+    // ソースのファイル名 (ディレクトリーを含まない)
+    std::string fileName;
+    // コンパイルに失敗した場合は空
+    std::vector<uint32_t> code;
+    // コンパイラーの出力
+    std::string log;
+    double milliseconds = 0.0;
+  };
+
+ private:
+  std::string sourceDirectory;
+  std::string outputDirectory;
+  std::string compiler;
+  int inotifyFd = -1;
+  // デストラクターから監視のスレッドを止めるためのパイプ
+  std::array<int, 2> stopPipe{-1, -1};
+  std::mutex mutex;
+  std::vector<Result> results;
+  std::thread watcher;
+
+ public:
+  // compilerはglslcのパス
+  ShaderWatcher(std::string sourceDirectory,
+                std::string outputDirectory,
+                std::string compiler)
+      : sourceDirectory(std::move(sourceDirectory)),
+        outputDirectory(std::move(outputDirectory)),
+        compiler(std::move(compiler)) {
+    inotifyFd = inotify_init1(IN_CLOEXEC);
+
+    if (inotifyFd < 0) {
+      throw std::runtime_error(std::string("inotify_init1() failed: ") +
+                               std::strerror(errno));
+    }
+
+    if (inotify_add_watch(inotifyFd, this->sourceDirectory.c_str(),
+                          IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+      int error = errno;
+      close(inotifyFd);
+      throw std::runtime_error("Failed to watch " + this->sourceDirectory +
+                               ": " + std::strerror(error));
+    }
+
+    if (pipe(stopPipe.data()) != 0) {
+      int error = errno;
+      close(inotifyFd);
+      throw std::runtime_error(std::string("pipe() failed: ") +
+                               std::strerror(error));
+    }
+
+    watcher = std::thread([this] { watch(); });
+  }
+
+  ~ShaderWatcher() {
+    char stop = 0;
+    [[maybe_unused]] ssize_t written = write(stopPipe[1], &stop, 1);
+    watcher.join();
+
+    close(stopPipe[0]);
+    close(stopPipe[1]);
+    close(inotifyFd);
+  }
+
+  ShaderWatcher(const ShaderWatcher&) = delete;
+  ShaderWatcher& operator=(const ShaderWatcher&) = delete;
+
+  const std::string& getSourceDirectory() const { return sourceDirectory; }
+
+  // 前回から後にコンパイルが終わったものを返す (待たない)
+  std::vector<Result> poll() {
+    std::lock_guard lock(mutex);
+    return std::exchange(results, {});
+  }
+
+ private:
+  void watch() {
+    for (;;) {
+      std::set<std::string> changed;
+
+      if (!waitForChanges(changed, -1)) {
+        return;
+      }
+
+      // 続けて届くイベントを待ってまとめる
+      while (!changed.empty() &&
+             waitForChanges(changed, static_cast<int>(DEBOUNCE_TIME.count()))) {
+      }
+
+      for (auto&& fileName : changed) {
+        Result result = compile(fileName);
+        std::lock_guard lock(mutex);
+        results.push_back(std::move(result));
+      }
+    }
+  }
+
+  // イベントが届けばchangedに追加してtrueを返す
+  // タイムアウトした場合と、止めるように言われた場合はfalseを返す
+  bool waitForChanges(std::set<std::string>& changed, int timeout) {
+    std::array<pollfd, 2> fds{pollfd{inotifyFd, POLLIN, 0},
+                              pollfd{stopPipe[0], POLLIN, 0}};
+
+    if (::poll(fds.data(), fds.size(), timeout) <= 0 ||
+        (fds[1].revents & POLLIN)) {
+      return false;
+    }
+
+    alignas(inotify_event) char buffer[4096];
+    ssize_t size = read(inotifyFd, buffer, sizeof(buffer));
+
+    for (ssize_t offset = 0; offset < size;) {
+      auto event = reinterpret_cast<const inotify_event*>(buffer + offset);
+      offset += sizeof(inotify_event) + event->len;
+
+      if (event->len > 0 && getStage(event->name).has_value()) {
+        changed.insert(event->name);
+      }
+    }
+
+    return true;
+  }
+
+  // ファイル名 (name.stage、name.stage.hlsl) からステージを返す
+  // シェーダーのソースでなければ (エディターの一時ファイルなど) nulloptを返す
+  static std::optional<std::string> getStage(const std::string& fileName) {
+    static const std::regex pattern(
+        R"(^[A-Za-z0-9_]+\.(vert|frag|comp)(\.hlsl)?$)");
+    std::smatch match;
+
+    if (!std::regex_match(fileName, match, pattern)) {
+      return std::nullopt;
+    }
+
+    return match[1].str();
+  }
+
+  // CMakeLists.txtのビルド時のコンパイルと同じオプションでコンパイルする
+  Result compile(const std::string& fileName) {
+    TRACE_SCOPE("ShaderWatcher::compile");
+
+    Result result;
+    result.fileName = fileName;
+
+    std::string stage = *getStage(fileName);
+    std::string output = outputDirectory + "/" + fileName + ".spv";
+    std::string temporaryOutput = output + ".tmp";
+    std::string command =
+        quote(compiler) + " --target-env=vulkan1.0 -O -o " +
+        quote(temporaryOutput);
+
+    if (fileName.ends_with(".hlsl")) {
+      command += " -x hlsl -fshader-stage=" + stage;
+    }
+
+    command += " " + quote(sourceDirectory + "/" + fileName) + " 2>&1";
+
+    auto start = std::chrono::steady_clock::now();
+    FILE* pipe = popen(command.c_str(), "r");
+
+    if (pipe == nullptr) {
+      result.log = std::string("popen() failed: ") + std::strerror(errno);
+      return result;
+    }
+
+    char buffer[256];
+
+    while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
+      result.log += buffer;
+    }
+
+    int status = pclose(pipe);
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    result.milliseconds = elapsed.count();
+
+    if (status != 0) {
+      return result;
+    }
+
+    // 監視のスレッドで例外を投げるとstd::terminate()になるので、ファイルの読み書きの失敗も
+    // コンパイルの失敗として返す
+    try {
+      std::optional<std::vector<uint8_t>> data = readFile(temporaryOutput);
+      std::remove(temporaryOutput.c_str());
+
+      if (!data.has_value() || data->empty() ||
+          data->size() % sizeof(uint32_t) != 0) {
+        result.log += "Invalid SPIR-V: " + temporaryOutput;
+        return result;
+      }
+
+      result.code.resize(data->size() / sizeof(uint32_t));
+      std::memcpy(result.code.data(), data->data(), data->size());
+      writeFileAtomically(output, *data);
+    } catch (const std::exception& e) {
+      result.code.clear();
+      result.log += e.what();
+    }
+
+    return result;
+  }
+
+  // シェルの引数として、単一引用符で囲む
+  static std::string quote(const std::string& argument) {
+    std::string quoted = "'";
+
+    for (char c : argument) {
+      quoted += c == '\'' ? std::string(R"('\'')") : std::string(1, c);
+    }
+
+    return quoted + "'";
+  }
+};
@@ -0,0 +1,10 @@
+#version 450
+
+// 画面全体を覆う三角形を描く頂点シェーダー (頂点バッファーは使わない)
+// 特殊化定数0で三角形を縮小するので、値ごとに異なるパイプラインになる
+layout(constant_id = 0) const float SCALE = 1.0;
+
+void main() {
+  vec2 p = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+  gl_Position = vec4((p * 2.0 - 1.0) * SCALE, 0.0, 1.0);
+}
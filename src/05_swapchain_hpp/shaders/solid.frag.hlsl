@@ -0,0 +1,9 @@
+// 特殊化定数0から2で指定した色で塗るフラグメントシェーダー
+// HLSLのシェーダーもビルドできることを示すため、HLSLで書いている
+[[vk::constant_id(0)]] const float R = 1.0;
+[[vk::constant_id(1)]] const float G = 1.0;
+[[vk::constant_id(2)]] const float B = 1.0;
+
+float4 main() : SV_Target0 {
+  return float4(R, G, B, 1.0);
+}
@@ -0,0 +1,180 @@
+/*
+ * 世代付きハンドルで要素を参照するスロットマップ
+ *
+ * ハンドルは32ビットで、下位20ビットがスロットのインデックス、上位12ビットが世代
+ * 要素を削除するとスロットの世代を進めるので、古いハンドルで参照すると見つからない
+ * 要素は配列に詰めて持ち (削除時は末尾の要素で埋める)、走査はメモリー上を順に進む
+ * 参照カウントもハッシュも使わず、検索は配列を2回引くだけで済む
+ *
+ * 要素のアドレスは削除によって変わるので、ポインターを保持せずハンドルで持つ
+ * スレッドセーフではない
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+template <typename T>
+class SlotMap {
+ public:
+  static constexpr uint32_t INDEX_BITS = 20;
+  static constexpr uint32_t INDEX_MASK = (1u << INDEX_BITS) - 1;
+  static constexpr uint32_t GENERATION_MASK = (1u << (32 - INDEX_BITS)) - 1;
+  // 同時に持てる要素の数
+  static constexpr uint32_t CAPACITY = INDEX_MASK + 1;
+
+  // 要素の型ごとに異なる型になるので、別の種類のハンドルを取り違えるとコンパイルエラーになる
+  class Handle {
+    // 世代は1から始まるので、0は無効なハンドルを表す
+    uint32_t value = 0;
+
+   public:
+    Handle() = default;
+    explicit Handle(uint32_t value) : value(value) {}
+
+    Handle(uint32_t index, uint32_t generation)
+        : value((generation << INDEX_BITS) | index) {}
+
+    uint32_t getIndex() const { return value & INDEX_MASK; }
+    uint32_t getGeneration() const { return value >> INDEX_BITS; }
+    uint32_t getValue() const { return value; }
+
+    explicit operator bool() const { return value != 0; }
+    bool operator==(const Handle& other) const = default;
+    bool operator<(const Handle& other) const { return value < other.value; }
+  };
+
+ private:
+  struct Slot {
+    uint32_t generation = 1;
+    // 使用中であれば、要素の配列でのインデックス
+    uint32_t denseIndex = 0;
+    bool occupied = false;
+  };
+
+  std::vector<T> values;
+  // 要素の配列と同じ順に、要素を指すスロットのインデックス
+  std::vector<uint32_t> denseToSlot;
+  std::vector<Slot> slots;
+  // 空いているスロット
+  // 同じスロットばかり再利用すると世代がすぐに一周するので、先に空いたものから使う
+  std::deque<uint32_t> freeSlots;
+
+ public:
+  template <typename... Args>
+  Handle emplace(Args&&... args) {
+    uint32_t slotIndex;
+
+    if (!freeSlots.empty()) {
+      slotIndex = freeSlots.front();
+      freeSlots.pop_front();
+    } else {
+      if (slots.size() >= CAPACITY) {
+        throw std::length_error("SlotMap is full");
+      }
+
+      slotIndex = static_cast<uint32_t>(slots.size());
+      slots.emplace_back();
+    }
+
+    values.emplace_back(std::forward<Args>(args)...);
+    denseToSlot.push_back(slotIndex);
+
+    Slot& slot = slots[slotIndex];
+    slot.denseIndex = static_cast<uint32_t>(values.size() - 1);
+    slot.occupied = true;
+    return Handle(slotIndex, slot.generation);
+  }
+
+  Handle insert(T value) { return emplace(std::move(value)); }
+
+  // 古いハンドルであればfalseを返す
+  bool erase(Handle handle) {
+    if (!contains(handle)) {
+      return false;
+    }
+
+    uint32_t slotIndex = handle.getIndex();
+    Slot& slot = slots[slotIndex];
+    uint32_t last = static_cast<uint32_t>(values.size() - 1);
+
+    // 末尾の要素を削除した位置に移す
+    if (slot.denseIndex != last) {
+      values[slot.denseIndex] = std::move(values[last]);
+      denseToSlot[slot.denseIndex] = denseToSlot[last];
+      slots[denseToSlot[last]].denseIndex = slot.denseIndex;
+    }
+
+    values.pop_back();
+    denseToSlot.pop_back();
+
+    slot.occupied = false;
+    slot.generation++;
+
+    // 世代が一周したスロットは、古いハンドルと区別できないので再利用しない
+    if (slot.generation <= GENERATION_MASK) {
+      freeSlots.push_back(slotIndex);
+    }
+
+    return true;
+  }
+
+  bool contains(Handle handle) const {
+    uint32_t index = handle.getIndex();
+    return index < slots.size() && slots[index].occupied &&
+           slots[index].generation == handle.getGeneration();
+  }
+
+  // 古いハンドルであればnullptrを返す
+  T* find(Handle handle) {
+    return contains(handle) ? &values[slots[handle.getIndex()].denseIndex]
+                            : nullptr;
+  }
+
+  const T* find(Handle handle) const {
+    return contains(handle) ? &values[slots[handle.getIndex()].denseIndex]
+                            : nullptr;
+  }
+
+  // 古いハンドルであれば例外を投げる
+  T& at(Handle handle) {
+    T* value = find(handle);
+
+    if (value == nullptr) {
+      throw std::out_of_range("Stale SlotMap handle");
+    }
+
+    return *value;
+  }
+
+  const T& at(Handle handle) const {
+    const T* value = find(handle);
+
+    if (value == nullptr) {
+      throw std::out_of_range("Stale SlotMap handle");
+    }
+
+    return *value;
+  }
+
+  // 要素の配列のインデックスから、その要素のハンドルを返す
+  Handle getHandle(size_t denseIndex) const {
+    uint32_t slotIndex = denseToSlot[denseIndex];
+    return Handle(slotIndex, slots[slotIndex].generation);
+  }
+
+  size_t size() const { return values.size(); }
+  bool empty() const { return values.empty(); }
+
+  // 要素の配列を走査する (順序は挿入順とは限らない)
+  typename std::vector<T>::iterator begin() { return values.begin(); }
+  typename std::vector<T>::iterator end() { return values.end(); }
+  typename std::vector<T>::const_iterator begin() const {
+    return values.begin();
+  }
+  typename std::vector<T>::const_iterator end() const { return values.end(); }
+};
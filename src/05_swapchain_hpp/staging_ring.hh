@@ -0,0 +1,465 @@
+/*
+ * ステージング用のリングバッファー
+ *
+ * ホストから見えるバッファーを一度だけマップし、小さなアップロードを先頭から順に詰めていく
+ * flush()で、転送先ごとに1回のvkCmdCopyBuffer()/vkCmdCopyBufferToImage()にまとめてサブミットする
+ * 同じ転送先で範囲が重なるアップロードは1つのコマンドにまとめられないので、別のグループに分け、
+ * グループの間にバリアを置いて追加した順に書き込む
+ * サブミットごとにフェンスを持ち、GPUが読み終わった領域から再利用する
+ *
+ * 転送先のリソースは、転送のキューファミリーから使える必要がある
+ * (VK_SHARING_MODE_CONCURRENTで作成するか、利用側で所有権を移動する)
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include "console.hh"
+#include "memory_allocator.hh"
+#include "tracer.hh"
+
+class StagingRing {
+ public:
+  struct Statistics {
+    uint64_t uploadCount = 0;
+    uint64_t uploadBytes = 0;
+    uint64_t submitCount = 0;
+    // vkCmdCopyBuffer()とvkCmdCopyBufferToImage()の呼び出し回数
+    uint64_t copyCommandCount = 0;
+    // 範囲の重なりのために、グループの間に記録したバリアの数
+    uint64_t overlapBarrierCount = 0;
+    // リングが一杯で、GPUの完了を待った回数
+    uint64_t stallCount = 0;
+  };
+
+ private:
+  // サブミットごとのコマンドバッファーとフェンス
+  struct Slot {
+    vk::raii::CommandBuffer commandBuffer{nullptr};
+    vk::raii::Fence fence{nullptr};
+    // このサブミットが読む領域の終わり (リング上の通算の位置)
+    uint64_t end = 0;
+    bool pending = false;
+  };
+
+  // 転送先ごとにまとめたコピー
+  // グループ内では、同じ転送先の範囲は重ならない
+  struct CopyGroup {
+    std::map<vk::Buffer, std::vector<vk::BufferCopy>> bufferCopies;
+    std::map<std::pair<vk::Image, vk::ImageLayout>,
+             std::vector<vk::BufferImageCopy>>
+        imageCopies;
+  };
+
+  std::shared_ptr<vk::raii::Device> device;
+  std::shared_ptr<MemoryAllocator> allocator;
+  std::shared_ptr<vk::raii::Queue> queue;
+  std::shared_ptr<vk::raii::CommandPool> commandPool;
+  std::shared_ptr<vk::raii::Buffer> buffer;
+  MemoryAllocation allocation;
+  vk::DeviceSize capacity;
+  vk::DeviceSize optimalOffsetAlignment;
+  std::vector<Slot> slots;
+  uint32_t currentSlot = 0;
+
+  // 書き込み位置と、GPUがまだ読んでいる領域の先頭
+  // 折り返しを扱いやすくするため、リング上の位置ではなく通算の位置で持つ
+  uint64_t head = 0;
+  uint64_t tail = 0;
+  // まだサブミットしていない領域の先頭
+  uint64_t batchBegin = 0;
+
+  // まだサブミットしていないコピー (この順に記録する)
+  std::vector<CopyGroup> copyGroups;
+  // コピーの前後に記録するイメージのレイアウトの移行
+  std::vector<vk::ImageMemoryBarrier> preCopyBarriers;
+  std::vector<vk::ImageMemoryBarrier> postCopyBarriers;
+
+  Statistics statistics;
+
+ public:
+  StagingRing(std::shared_ptr<vk::raii::Device> device,
+              std::shared_ptr<MemoryAllocator> allocator,
+              std::shared_ptr<vk::raii::Queue> queue,
+              uint32_t queueFamilyIndex,
+              const vk::PhysicalDeviceLimits& limits,
+              vk::DeviceSize capacity,
+              uint32_t slotCount)
+      : device(std::move(device)),
+        allocator(std::move(allocator)),
+        queue(std::move(queue)),
+        capacity(capacity),
+        optimalOffsetAlignment(limits.optimalBufferCopyOffsetAlignment) {
+    auto [stagingBuffer, stagingAllocation] = this->allocator->createBuffer(
+        vk::BufferCreateInfo{
+            /* flags = */ {},
+            /* size = */ capacity,
+            /* usage = */ vk::BufferUsageFlagBits::eTransferSrc,
+            /* sharingMode = */ vk::SharingMode::eExclusive},
+        MemoryUsage::eUpload);
+    buffer = std::make_shared<vk::raii::Buffer>(std::move(stagingBuffer));
+    allocation = stagingAllocation;
+
+    if (allocation.mapped == nullptr) {
+      throw std::runtime_error("Staging memory is not host visible");
+    }
+
+    commandPool = std::make_shared<vk::raii::CommandPool>(
+        *this->device,
+        vk::CommandPoolCreateInfo{
+            vk::CommandPoolCreateFlagBits::eResetCommandBuffer |
+                vk::CommandPoolCreateFlagBits::eTransient,
+            queueFamilyIndex});
+
+    vk::raii::CommandBuffers commandBuffers(
+        *this->device,
+        vk::CommandBufferAllocateInfo{**commandPool,
+                                      vk::CommandBufferLevel::ePrimary,
+                                      slotCount});
+
+    for (auto&& commandBuffer : commandBuffers) {
+      Slot slot;
+      slot.commandBuffer = std::move(commandBuffer);
+      slot.fence = vk::raii::Fence(*this->device, vk::FenceCreateInfo{});
+      slots.push_back(std::move(slot));
+    }
+  }
+
+  ~StagingRing() {
+    // デストラクターからは例外を投げられないので、失敗しても出力して破棄を続ける
+    try {
+      waitIdle();
+    } catch (const std::exception& e) {
+      std::cerr << Console::fgYellow << "# "
+                << "Failed to wait for staging uploads: " << e.what()
+                << Console::fgDefault << std::endl;
+    }
+
+    slots.clear();
+    buffer.reset();
+    allocator->free(allocation);
+  }
+
+  StagingRing(const StagingRing&) = delete;
+  StagingRing& operator=(const StagingRing&) = delete;
+
+  // バッファーへのアップロードを追加する
+  void uploadBuffer(vk::Buffer dstBuffer,
+                    vk::DeviceSize dstOffset,
+                    const void* data,
+                    vk::DeviceSize size) {
+    vk::DeviceSize offset = write(data, size, 4);
+    vk::BufferCopy region{offset, dstOffset, size};
+
+    // 範囲が重なるコピーを含む最後のグループより後に入れる
+    size_t groupIndex = copyGroups.size();
+
+    while (groupIndex > 0) {
+      auto& copies = copyGroups[groupIndex - 1].bufferCopies;
+
+      if (auto it = copies.find(dstBuffer);
+          it != copies.end() &&
+          std::any_of(it->second.begin(), it->second.end(),
+                      [&](auto&& other) { return overlaps(region, other); })) {
+        break;
+      }
+
+      groupIndex--;
+    }
+
+    getCopyGroup(groupIndex).bufferCopies[dstBuffer].push_back(region);
+  }
+
+  // イメージへのアップロードを追加する
+  // texelSizeはテクセル (圧縮フォーマットではブロック) のバイト数
+  // regionのbufferOffsetは無視する (リング上の位置で上書きする)
+  void uploadImage(vk::Image dstImage,
+                   vk::ImageLayout dstLayout,
+                   vk::BufferImageCopy region,
+                   vk::DeviceSize texelSize,
+                   const void* data,
+                   vk::DeviceSize size) {
+    // バッファーからイメージへのコピーのオフセットは、テクセルのサイズと4の倍数でなければならない
+    // (3、6、12バイトのフォーマットもあるので、2の累乗に揃えるだけでは足りない)
+    vk::DeviceSize alignment =
+        std::lcm(std::lcm(texelSize, vk::DeviceSize{4}),
+                 std::max<vk::DeviceSize>(optimalOffsetAlignment, 1));
+    region.bufferOffset = write(data, size, alignment);
+
+    size_t groupIndex = copyGroups.size();
+
+    while (groupIndex > 0) {
+      bool overlapping = false;
+
+      // 同じイメージであれば、レイアウトが異なっても重なりを確認する
+      for (auto&& [dst, regions] : copyGroups[groupIndex - 1].imageCopies) {
+        overlapping = overlapping ||
+                      (dst.first == dstImage &&
+                       std::any_of(regions.begin(), regions.end(),
+                                   [&](auto&& other) {
+                                     return overlaps(region, other);
+                                   }));
+      }
+
+      if (overlapping) {
+        break;
+      }
+
+      groupIndex--;
+    }
+
+    getCopyGroup(groupIndex).imageCopies[{dstImage, dstLayout}].push_back(
+        region);
+  }
+
+  // 次のflush()で、コピーの前に記録するバリア (レイアウトをeTransferDstOptimalにする)
+  void addPreCopyBarrier(const vk::ImageMemoryBarrier& barrier) {
+    preCopyBarriers.push_back(barrier);
+  }
+
+  // 次のflush()で、コピーの後に記録するバリア (使用時のレイアウトにする)
+  void addPostCopyBarrier(const vk::ImageMemoryBarrier& barrier) {
+    postCopyBarriers.push_back(barrier);
+  }
+
+  // 追加したアップロードをまとめてサブミットする
+  // signalSemaphoreを指定すると、コピーの完了時にシグナルする
+  void flush(vk::Semaphore signalSemaphore = {}) {
+    if (head == batchBegin && preCopyBarriers.empty() &&
+        postCopyBarriers.empty()) {
+      return;
+    }
+
+    TRACE_SCOPE("StagingRing::flush");
+
+    if (head != batchBegin) {
+      flushMappedRange(batchBegin, head);
+    }
+
+    Slot& slot = slots[currentSlot];
+    slot.commandBuffer.reset();
+    slot.commandBuffer.begin(vk::CommandBufferBeginInfo{
+        vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+
+    if (!preCopyBarriers.empty()) {
+      slot.commandBuffer.pipelineBarrier(
+          vk::PipelineStageFlagBits::eTopOfPipe,
+          vk::PipelineStageFlagBits::eTransfer, {}, nullptr, nullptr,
+          preCopyBarriers);
+    }
+
+    for (size_t i = 0; i < copyGroups.size(); i++) {
+      // 前のグループの書き込みが終わってから、重なる範囲に書き込む
+      if (i > 0) {
+        slot.commandBuffer.pipelineBarrier(
+            vk::PipelineStageFlagBits::eTransfer,
+            vk::PipelineStageFlagBits::eTransfer, {},
+            vk::MemoryBarrier{vk::AccessFlagBits::eTransferWrite,
+                              vk::AccessFlagBits::eTransferWrite},
+            nullptr, nullptr);
+        statistics.overlapBarrierCount++;
+      }
+
+      for (auto&& [dstBuffer, regions] : copyGroups[i].bufferCopies) {
+        slot.commandBuffer.copyBuffer(**buffer, dstBuffer, regions);
+        statistics.copyCommandCount++;
+      }
+
+      for (auto&& [dst, regions] : copyGroups[i].imageCopies) {
+        slot.commandBuffer.copyBufferToImage(**buffer, dst.first, dst.second,
+                                             regions);
+        statistics.copyCommandCount++;
+      }
+    }
+
+    // 他のキューでの使用は、signalSemaphoreで同期する
+    if (!postCopyBarriers.empty()) {
+      slot.commandBuffer.pipelineBarrier(
+          vk::PipelineStageFlagBits::eTransfer,
+          vk::PipelineStageFlagBits::eBottomOfPipe, {}, nullptr, nullptr,
+          postCopyBarriers);
+    }
+
+    slot.commandBuffer.end();
+
+    vk::SubmitInfo submitInfo;
+    submitInfo.setCommandBuffers(*slot.commandBuffer);
+
+    if (signalSemaphore) {
+      submitInfo.setSignalSemaphores(signalSemaphore);
+    }
+
+    queue->submit(submitInfo, *slot.fence);
+    slot.end = head;
+    slot.pending = true;
+    statistics.submitCount++;
+
+    copyGroups.clear();
+    preCopyBarriers.clear();
+    postCopyBarriers.clear();
+    batchBegin = head;
+
+    // 次のスロットが使用中であれば、完了を待つ
+    currentSlot = (currentSlot + 1) % slots.size();
+
+    if (slots[currentSlot].pending) {
+      statistics.stallCount++;
+      retire(slots[currentSlot]);
+    }
+  }
+
+  // サブミットしたコピーがすべて完了するまで待つ
+  void waitIdle() {
+    flush();
+
+    while (retireOldest()) {
+    }
+  }
+
+  const Statistics& getStatistics() const { return statistics; }
+  vk::DeviceSize getCapacity() const { return capacity; }
+
+ private:
+  CopyGroup& getCopyGroup(size_t index) {
+    if (index == copyGroups.size()) {
+      copyGroups.emplace_back();
+    }
+
+    return copyGroups[index];
+  }
+
+  static bool overlaps(const vk::BufferCopy& a, const vk::BufferCopy& b) {
+    return a.dstOffset < b.dstOffset + b.size &&
+           b.dstOffset < a.dstOffset + a.size;
+  }
+
+  // 同じミップレベルで、配列のレイヤーと領域がともに重なるか
+  static bool overlaps(const vk::BufferImageCopy& a,
+                       const vk::BufferImageCopy& b) {
+    const vk::ImageSubresourceLayers& sa = a.imageSubresource;
+    const vk::ImageSubresourceLayers& sb = b.imageSubresource;
+
+    auto intersects = [](int64_t beginA, int64_t sizeA, int64_t beginB,
+                         int64_t sizeB) {
+      return beginA < beginB + sizeB && beginB < beginA + sizeA;
+    };
+
+    return (sa.aspectMask & sb.aspectMask) && sa.mipLevel == sb.mipLevel &&
+           intersects(sa.baseArrayLayer, sa.layerCount, sb.baseArrayLayer,
+                      sb.layerCount) &&
+           intersects(a.imageOffset.x, a.imageExtent.width, b.imageOffset.x,
+                      b.imageExtent.width) &&
+           intersects(a.imageOffset.y, a.imageExtent.height, b.imageOffset.y,
+                      b.imageExtent.height) &&
+           intersects(a.imageOffset.z, a.imageExtent.depth, b.imageOffset.z,
+                      b.imageExtent.depth);
+  }
+
+  // リングにデータを書き込み、バッファー内のオフセットを返す
+  vk::DeviceSize write(const void* data,
+                       vk::DeviceSize size,
+                       vk::DeviceSize alignment) {
+    if (size > capacity) {
+      throw std::runtime_error("Upload of " + std::to_string(size) +
+                               " bytes exceeds the staging ring");
+    }
+
+    uint64_t position = reserve(size, alignment);
+    vk::DeviceSize offset = position % capacity;
+    std::memcpy(static_cast<char*>(allocation.mapped) + offset, data, size);
+
+    statistics.uploadCount++;
+    statistics.uploadBytes += size;
+    return offset;
+  }
+
+  uint64_t reserve(vk::DeviceSize size, vk::DeviceSize alignment) {
+    while (true) {
+      // GPUが読んでいる領域も書き込み中の領域も無ければ、先頭から使い直す
+      if (head == tail) {
+        head = tail = batchBegin = 0;
+      }
+
+      // 揃えるのはバッファー内のオフセット (alignmentは容量の約数とは限らない)
+      uint64_t offset = head % capacity;
+      uint64_t alignedOffset = (offset + alignment - 1) / alignment * alignment;
+      uint64_t position = head - offset + alignedOffset;
+
+      // 末尾に収まらなければ、先頭に折り返す
+      if (alignedOffset + size > capacity) {
+        position = head - offset + capacity;
+      }
+
+      if (position + size - tail <= capacity) {
+        head = position + size;
+        return position;
+      }
+
+      // 空きが無ければ、最も古いサブミットの完了を待つ
+      // サブミット中のものが無ければ、書き込み中の分をサブミットしてから待つ
+      statistics.stallCount++;
+
+      if (!retireOldest()) {
+        flush();
+        retireOldest();
+      }
+    }
+  }
+
+  bool retireOldest() {
+    for (size_t i = 1; i <= slots.size(); i++) {
+      Slot& slot = slots[(currentSlot + i) % slots.size()];
+
+      if (slot.pending) {
+        retire(slot);
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void retire(Slot& slot) {
+    TRACE_SCOPE("StagingRing::retire");
+
+    vk::Result result = device->waitForFences(
+        {*slot.fence}, VK_TRUE, std::numeric_limits<uint64_t>::max());
+
+    if (result != vk::Result::eSuccess) {
+      throw std::runtime_error("Failed to wait for staging fence: " +
+                               vk::to_string(result));
+    }
+
+    device->resetFences({*slot.fence});
+    slot.pending = false;
+    tail = std::max(tail, slot.end);
+  }
+
+  // HOST_COHERENTでないメモリーであれば、書き込んだ範囲をフラッシュする
+  void flushMappedRange(uint64_t begin, uint64_t end) {
+    vk::DeviceSize beginOffset = begin % capacity;
+
+    if (end - begin > capacity - beginOffset) {
+      // 折り返している
+      allocator->flush(allocation, beginOffset, capacity - beginOffset);
+      allocator->flush(allocation, 0,
+                       end - begin - (capacity - beginOffset));
+    } else {
+      allocator->flush(allocation, beginOffset, end - begin);
+    }
+  }
+};
@@ -0,0 +1,288 @@
+/*
+ * テクスチャーのアップロード
+ *
+ * VK_EXT_host_image_copyが使えれば、ワーカースレッドからvkCopyMemoryToImageEXT()で
+ * CPUのメモリーから直接イメージに書き込む
+ * ステージングバッファーもコマンドバッファーもバリアも要らず、レイアウトの移行もホストで行う
+ * 使えない場合は、ステージングリングを通してvkCmdCopyBufferToImage()でコピーする
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan_raii.hpp>
+
+#include "memory_allocator.hh"
+#include "staging_ring.hh"
+#include "tracer.hh"
+
+// アップロードするテクセル (R8G8B8A8、行の間に隙間は無い)
+struct TextureSource {
+  uint32_t width;
+  uint32_t height;
+  const void* data;
+};
+
+struct Texture {
+  std::shared_ptr<vk::raii::Image> image;
+  MemoryAllocation allocation;
+  vk::ImageLayout layout;
+};
+
+class TextureUploader {
+ public:
+  static constexpr vk::Format FORMAT = vk::Format::eR8G8B8A8Unorm;
+  static constexpr vk::DeviceSize TEXEL_SIZE = 4;
+
+ private:
+  std::shared_ptr<vk::raii::Device> device;
+  std::shared_ptr<MemoryAllocator> allocator;
+  std::shared_ptr<StagingRing> stagingRing;
+  // イメージを使うキューファミリー
+  std::vector<uint32_t> queueFamilyIndices;
+  // ホストからコピーできる場合に、コピー先とするレイアウト
+  std::optional<vk::ImageLayout> hostCopyLayout;
+  uint32_t workerCount;
+
+ public:
+  // hostImageCopyEnabledは、VK_EXT_host_image_copyとhostImageCopyフィーチャーを有効にしたか
+  TextureUploader(std::shared_ptr<vk::raii::Device> device,
+                  const vk::raii::PhysicalDevice& physicalDevice,
+                  std::shared_ptr<MemoryAllocator> allocator,
+                  std::shared_ptr<StagingRing> stagingRing,
+                  std::vector<uint32_t> queueFamilyIndices,
+                  bool hostImageCopyEnabled)
+      : device(std::move(device)),
+        allocator(std::move(allocator)),
+        stagingRing(std::move(stagingRing)),
+        queueFamilyIndices(std::move(queueFamilyIndices)) {
+    workerCount = std::max(1u, std::thread::hardware_concurrency());
+
+    if (hostImageCopyEnabled) {
+      hostCopyLayout = selectHostCopyLayout(physicalDevice);
+    }
+  }
+
+  bool isHostCopySupported() const { return hostCopyLayout.has_value(); }
+
+  // テクスチャーを作成してアップロードする
+  // 返したイメージは、シェーダーから読めるレイアウトになっている
+  std::vector<Texture> upload(const std::vector<TextureSource>& sources,
+                              bool useHostCopy) {
+    TRACE_SCOPE("TextureUploader::upload");
+
+    useHostCopy = useHostCopy && isHostCopySupported();
+    std::vector<Texture> textures;
+
+    for (auto&& source : sources) {
+      textures.push_back(createTexture(source, useHostCopy));
+    }
+
+    if (useHostCopy) {
+      uploadOnHost(sources, textures);
+    } else {
+      uploadStaged(sources, textures);
+    }
+
+    return textures;
+  }
+
+  void destroy(std::vector<Texture>& textures) {
+    for (auto&& texture : textures) {
+      texture.image.reset();
+      allocator->free(texture.allocation);
+    }
+
+    textures.clear();
+  }
+
+ private:
+  // コピー先にできるレイアウトから、シェーダーで読むのに適したものを選ぶ
+  static std::optional<vk::ImageLayout> selectHostCopyLayout(
+      const vk::raii::PhysicalDevice& physicalDevice) {
+    // R8G8B8A8でホストからのコピーをサポートしているか
+    auto formatProperties = physicalDevice.getFormatProperties2KHR<
+        vk::FormatProperties2, vk::FormatProperties3>(FORMAT);
+
+    if (!(formatProperties.get<vk::FormatProperties3>().optimalTilingFeatures &
+          vk::FormatFeatureFlagBits2::eHostImageTransferEXT)) {
+      return std::nullopt;
+    }
+
+    // レイアウトの配列は、数を取得してから改めて取得する
+    vk::PhysicalDeviceHostImageCopyPropertiesEXT hostImageCopyProperties;
+    vk::PhysicalDeviceProperties2 properties;
+    properties.pNext = &hostImageCopyProperties;
+    getProperties2(physicalDevice, properties);
+
+    std::vector<vk::ImageLayout> layouts(
+        hostImageCopyProperties.copyDstLayoutCount);
+    hostImageCopyProperties.pCopyDstLayouts = layouts.data();
+    getProperties2(physicalDevice, properties);
+
+    for (vk::ImageLayout layout : {vk::ImageLayout::eShaderReadOnlyOptimal,
+                                   vk::ImageLayout::eGeneral}) {
+      if (std::find(layouts.begin(), layouts.end(), layout) != layouts.end()) {
+        return layout;
+      }
+    }
+
+    return std::nullopt;
+  }
+
+  // Vulkan-Hppの関数は配列のポインターを渡せないので、直接呼び出す
+  static void getProperties2(const vk::raii::PhysicalDevice& physicalDevice,
+                             vk::PhysicalDeviceProperties2& properties) {
+    physicalDevice.getDispatcher()->vkGetPhysicalDeviceProperties2KHR(
+        static_cast<VkPhysicalDevice>(*physicalDevice),
+        reinterpret_cast<VkPhysicalDeviceProperties2*>(&properties));
+  }
+
+  Texture createTexture(const TextureSource& source, bool useHostCopy) {
+    vk::ImageUsageFlags usage = vk::ImageUsageFlagBits::eSampled;
+    usage |= useHostCopy ? vk::ImageUsageFlagBits::eHostTransferEXT
+                         : vk::ImageUsageFlagBits::eTransferDst;
+
+    auto [image, allocation] = allocator->createImage(
+        vk::ImageCreateInfo{
+            /* flags = */ {},
+            /* imageType = */ vk::ImageType::e2D,
+            /* format = */ FORMAT,
+            /* extent = */ vk::Extent3D{source.width, source.height, 1},
+            /* mipLevels = */ 1,
+            /* arrayLayers = */ 1,
+            /* samples = */ vk::SampleCountFlagBits::e1,
+            /* tiling = */ vk::ImageTiling::eOptimal,
+            /* usage = */ usage,
+            /* sharingMode = */
+            queueFamilyIndices.size() > 1 ? vk::SharingMode::eConcurrent
+                                          : vk::SharingMode::eExclusive,
+            /* queueFamilyIndices = */ queueFamilyIndices},
+        MemoryUsage::eGpuOnly);
+
+    Texture texture;
+    texture.image = std::make_shared<vk::raii::Image>(std::move(image));
+    texture.allocation = allocation;
+    texture.layout = useHostCopy ? *hostCopyLayout
+                                 : vk::ImageLayout::eShaderReadOnlyOptimal;
+    return texture;
+  }
+
+  static vk::ImageSubresourceRange getSubresourceRange() {
+    return vk::ImageSubresourceRange{
+        /* aspectMask = */ vk::ImageAspectFlagBits::eColor,
+        /* baseMipLevel = */ 0,
+        /* levelCount = */ 1,
+        /* baseArrayLayer = */ 0,
+        /* layerCount = */ 1};
+  }
+
+  // テクスチャーをワーカースレッドに振り分け、ホストでコピーする
+  // 異なるイメージへのコピーは、外部同期なしに並列に行える
+  void uploadOnHost(const std::vector<TextureSource>& sources,
+                    std::vector<Texture>& textures) {
+    uint32_t threadCount =
+        std::min(workerCount, static_cast<uint32_t>(sources.size()));
+    std::vector<std::future<void>> futures;
+
+    for (uint32_t t = 0; t < threadCount; t++) {
+      futures.push_back(std::async(std::launch::async, [&, t] {
+        TRACE_SCOPE("TextureUploader::uploadOnHost");
+
+        for (size_t i = t; i < sources.size(); i += threadCount) {
+          copyOnHost(sources[i], textures[i]);
+        }
+      }));
+    }
+
+    for (auto&& future : futures) {
+      future.get();
+    }
+  }
+
+  void copyOnHost(const TextureSource& source, const Texture& texture) {
+    vk::HostImageLayoutTransitionInfoEXT transition{
+        /* image = */ **texture.image,
+        /* oldLayout = */ vk::ImageLayout::eUndefined,
+        /* newLayout = */ texture.layout,
+        /* subresourceRange = */ getSubresourceRange()};
+    device->transitionImageLayoutEXT(transition);
+
+    vk::MemoryToImageCopyEXT region{
+        /* pHostPointer = */ source.data,
+        /* memoryRowLength = */ 0,
+        /* memoryImageHeight = */ 0,
+        /* imageSubresource = */
+        vk::ImageSubresourceLayers{vk::ImageAspectFlagBits::eColor, 0, 0, 1},
+        /* imageOffset = */ vk::Offset3D{0, 0, 0},
+        /* imageExtent = */ vk::Extent3D{source.width, source.height, 1}};
+    device->copyMemoryToImageEXT(vk::CopyMemoryToImageInfoEXT{
+        /* flags = */ {},
+        /* dstImage = */ **texture.image,
+        /* dstImageLayout = */ texture.layout,
+        /* regions = */ region});
+  }
+
+  // ステージングリングでコピーし、完了するまで待つ
+  // リングに収まらない大きなテクスチャーは、行ごとに分割する
+  void uploadStaged(const std::vector<TextureSource>& sources,
+                    std::vector<Texture>& textures) {
+    vk::DeviceSize chunkSize = stagingRing->getCapacity() / 2;
+
+    for (size_t i = 0; i < sources.size(); i++) {
+      const TextureSource& source = sources[i];
+      vk::Image image = **textures[i].image;
+
+      stagingRing->addPreCopyBarrier(vk::ImageMemoryBarrier{
+          /* srcAccessMask = */ {},
+          /* dstAccessMask = */ vk::AccessFlagBits::eTransferWrite,
+          /* oldLayout = */ vk::ImageLayout::eUndefined,
+          /* newLayout = */ vk::ImageLayout::eTransferDstOptimal,
+          /* srcQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+          /* dstQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+          /* image = */ image,
+          /* subresourceRange = */ getSubresourceRange()});
+
+      vk::DeviceSize rowSize = source.width * TEXEL_SIZE;
+      uint32_t rowsPerChunk = static_cast<uint32_t>(
+          std::max<vk::DeviceSize>(1, chunkSize / rowSize));
+      auto bytes = static_cast<const char*>(source.data);
+
+      for (uint32_t y = 0; y < source.height; y += rowsPerChunk) {
+        uint32_t rows = std::min(rowsPerChunk, source.height - y);
+        vk::BufferImageCopy region{
+            /* bufferOffset = */ 0,
+            /* bufferRowLength = */ 0,
+            /* bufferImageHeight = */ 0,
+            /* imageSubresource = */
+            vk::ImageSubresourceLayers{vk::ImageAspectFlagBits::eColor, 0, 0,
+                                       1},
+            /* imageOffset = */ vk::Offset3D{0, static_cast<int32_t>(y), 0},
+            /* imageExtent = */ vk::Extent3D{source.width, rows, 1}};
+        stagingRing->uploadImage(image, vk::ImageLayout::eTransferDstOptimal,
+                                 region, TEXEL_SIZE, bytes + y * rowSize,
+                                 rows * rowSize);
+      }
+
+      stagingRing->addPostCopyBarrier(vk::ImageMemoryBarrier{
+          /* srcAccessMask = */ vk::AccessFlagBits::eTransferWrite,
+          /* dstAccessMask = */ {},
+          /* oldLayout = */ vk::ImageLayout::eTransferDstOptimal,
+          /* newLayout = */ textures[i].layout,
+          /* srcQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+          /* dstQueueFamilyIndex = */ VK_QUEUE_FAMILY_IGNORED,
+          /* image = */ image,
+          /* subresourceRange = */ getSubresourceRange()});
+    }
+
+    stagingRing->waitIdle();
+  }
+};
@@ -0,0 +1,295 @@
+/*
+ * TLSF (Two-Level Segregated Fit) によるオフセットの割り当て
+ *
+ * 大きな領域 (デバイスメモリーのブロックなど) の中で、オフセットとサイズだけを管理する
+ * 空き領域はサイズの対数 (第1レベル) とその範囲を16等分した区間 (第2レベル) で分類し、
+ * ビットマップを引くことで、割り当ても解放も定数時間で行う
+ * Vulkanに依存しないので、CPUのみのベンチマークからも使用できる
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+class Tlsf {
+ public:
+  // 割り当てを識別するハンドル (内部のブロックのインデックス)
+  using Handle = uint32_t;
+
+  struct Allocation {
+    Handle handle;
+    uint64_t offset;
+  };
+
+ private:
+  static constexpr uint32_t SL_LOG2 = 4;
+  static constexpr uint32_t SL_COUNT = 1u << SL_LOG2;
+  static constexpr uint32_t FL_COUNT = 64;
+  static constexpr Handle NONE = std::numeric_limits<Handle>::max();
+
+  struct Block {
+    uint64_t offset;
+    uint64_t size;
+    // 領域内で隣接するブロック
+    Handle prevPhysical = NONE;
+    Handle nextPhysical = NONE;
+    // 同じ区間の空きブロックのリスト
+    Handle prevFree = NONE;
+    Handle nextFree = NONE;
+    bool free = false;
+  };
+
+  uint64_t capacity;
+  std::vector<Block> blocks;
+  // 再利用できるblocksのインデックス
+  std::vector<Handle> unusedBlocks;
+  uint64_t flBitmap = 0;
+  uint32_t slBitmaps[FL_COUNT] = {};
+  Handle freeLists[FL_COUNT][SL_COUNT];
+
+  uint64_t usedSize = 0;
+  uint32_t allocationCount = 0;
+
+ public:
+  explicit Tlsf(uint64_t capacity) : capacity(capacity) {
+    for (auto&& lists : freeLists) {
+      for (auto&& head : lists) {
+        head = NONE;
+      }
+    }
+
+    Handle block = newBlock(0, capacity);
+    insertFree(block);
+  }
+
+  // alignmentは2のべき乗
+  std::optional<Allocation> allocate(uint64_t size, uint64_t alignment = 1) {
+    if (size == 0 || size > capacity) {
+      return std::nullopt;
+    }
+
+    // 先頭をalignmentに揃えられるよう、余分に確保できるブロックを探す
+    uint64_t searchSize = size + alignment - 1;
+    uint32_t fl, sl;
+    mappingSearch(searchSize, fl, sl);
+
+    Handle handle = findSuitable(fl, sl);
+
+    if (handle == NONE) {
+      return std::nullopt;
+    }
+
+    removeFree(handle);
+
+    uint64_t alignedOffset =
+        (blocks[handle].offset + alignment - 1) & ~(alignment - 1);
+    uint64_t padding = alignedOffset - blocks[handle].offset;
+
+    // 先頭の余りを空きブロックとして切り離す
+    if (padding > 0) {
+      Handle front = split(handle, padding);
+      std::swap(front, handle);
+      insertFree(front);
+    }
+
+    // 後ろの余りを空きブロックとして切り離す
+    if (blocks[handle].size > size) {
+      Handle back = split(handle, size);
+      insertFree(back);
+    }
+
+    usedSize += blocks[handle].size;
+    allocationCount++;
+
+    return Allocation{handle, blocks[handle].offset};
+  }
+
+  void free(Handle handle) {
+    usedSize -= blocks[handle].size;
+    allocationCount--;
+
+    // 隣接する空きブロックと結合する
+    Handle prev = blocks[handle].prevPhysical;
+
+    if (prev != NONE && blocks[prev].free) {
+      removeFree(prev);
+      handle = merge(prev, handle);
+    }
+
+    Handle next = blocks[handle].nextPhysical;
+
+    if (next != NONE && blocks[next].free) {
+      removeFree(next);
+      handle = merge(handle, next);
+    }
+
+    insertFree(handle);
+  }
+
+  uint64_t getSize(Handle handle) const { return blocks[handle].size; }
+  uint64_t getCapacity() const { return capacity; }
+  uint64_t getUsedSize() const { return usedSize; }
+  uint32_t getAllocationCount() const { return allocationCount; }
+  bool isEmpty() const { return allocationCount == 0; }
+
+  // 最大の空きブロックのサイズ (断片化の指標)
+  uint64_t getLargestFreeSize() const {
+    if (flBitmap == 0) {
+      return 0;
+    }
+
+    uint32_t fl = 63 - std::countl_zero(flBitmap);
+    uint32_t sl = 31 - std::countl_zero(slBitmaps[fl]);
+    uint64_t largest = 0;
+
+    for (Handle h = freeLists[fl][sl]; h != NONE; h = blocks[h].nextFree) {
+      largest = std::max(largest, blocks[h].size);
+    }
+
+    return largest;
+  }
+
+ private:
+  // サイズが属する区間
+  static void mapping(uint64_t size, uint32_t& fl, uint32_t& sl) {
+    if (size < SL_COUNT) {
+      // 小さいサイズは第1レベル0に線形に並べる
+      fl = 0;
+      sl = static_cast<uint32_t>(size);
+    } else {
+      uint32_t log2 = static_cast<uint32_t>(std::bit_width(size)) - 1;
+      sl = static_cast<uint32_t>(size >> (log2 - SL_LOG2)) ^ SL_COUNT;
+      fl = log2 - SL_LOG2 + 1;
+    }
+  }
+
+  // 区間内のどのブロックでもsize以上になるよう、次の区間の先頭まで切り上げる
+  static void mappingSearch(uint64_t size, uint32_t& fl, uint32_t& sl) {
+    if (size >= SL_COUNT) {
+      uint32_t log2 = static_cast<uint32_t>(std::bit_width(size)) - 1;
+      size += (uint64_t{1} << (log2 - SL_LOG2)) - 1;
+    }
+
+    mapping(size, fl, sl);
+  }
+
+  Handle findSuitable(uint32_t fl, uint32_t sl) const {
+    if (fl >= FL_COUNT) {
+      return NONE;
+    }
+
+    uint32_t slMap = sl < SL_COUNT ? slBitmaps[fl] & (~0u << sl) : 0;
+
+    if (slMap == 0) {
+      uint64_t flMap =
+          fl + 1 < FL_COUNT ? flBitmap & (~uint64_t{0} << (fl + 1)) : 0;
+
+      if (flMap == 0) {
+        return NONE;
+      }
+
+      fl = static_cast<uint32_t>(std::countr_zero(flMap));
+      slMap = slBitmaps[fl];
+    }
+
+    sl = static_cast<uint32_t>(std::countr_zero(slMap));
+    return freeLists[fl][sl];
+  }
+
+  Handle newBlock(uint64_t offset, uint64_t size) {
+    Handle handle;
+
+    if (!unusedBlocks.empty()) {
+      handle = unusedBlocks.back();
+      unusedBlocks.pop_back();
+      blocks[handle] = Block{};
+    } else {
+      handle = static_cast<Handle>(blocks.size());
+      blocks.push_back(Block{});
+    }
+
+    blocks[handle].offset = offset;
+    blocks[handle].size = size;
+    return handle;
+  }
+
+  // ブロックを先頭のsizeバイトと残りに分け、残りのブロックを返す
+  Handle split(Handle handle, uint64_t size) {
+    Handle rest =
+        newBlock(blocks[handle].offset + size, blocks[handle].size - size);
+    Block& block = blocks[handle];
+
+    blocks[rest].prevPhysical = handle;
+    blocks[rest].nextPhysical = block.nextPhysical;
+
+    if (block.nextPhysical != NONE) {
+      blocks[block.nextPhysical].prevPhysical = rest;
+    }
+
+    block.nextPhysical = rest;
+    block.size = size;
+    return rest;
+  }
+
+  // 隣接する2つのブロックを結合し、前のブロックを返す
+  Handle merge(Handle front, Handle back) {
+    blocks[front].size += blocks[back].size;
+    blocks[front].nextPhysical = blocks[back].nextPhysical;
+
+    if (blocks[back].nextPhysical != NONE) {
+      blocks[blocks[back].nextPhysical].prevPhysical = front;
+    }
+
+    unusedBlocks.push_back(back);
+    return front;
+  }
+
+  void insertFree(Handle handle) {
+    uint32_t fl, sl;
+    mapping(blocks[handle].size, fl, sl);
+
+    Block& block = blocks[handle];
+    block.free = true;
+    block.prevFree = NONE;
+    block.nextFree = freeLists[fl][sl];
+
+    if (block.nextFree != NONE) {
+      blocks[block.nextFree].prevFree = handle;
+    }
+
+    freeLists[fl][sl] = handle;
+    flBitmap |= uint64_t{1} << fl;
+    slBitmaps[fl] |= 1u << sl;
+  }
+
+  void removeFree(Handle handle) {
+    uint32_t fl, sl;
+    mapping(blocks[handle].size, fl, sl);
+
+    Block& block = blocks[handle];
+    block.free = false;
+
+    if (block.prevFree != NONE) {
+      blocks[block.prevFree].nextFree = block.nextFree;
+    } else {
+      freeLists[fl][sl] = block.nextFree;
+    }
+
+    if (block.nextFree != NONE) {
+      blocks[block.nextFree].prevFree = block.prevFree;
+    }
+
+    if (freeLists[fl][sl] == NONE) {
+      slBitmaps[fl] &= ~(1u << sl);
+
+      if (slBitmaps[fl] == 0) {
+        flBitmap &= ~(uint64_t{1} << fl);
+      }
+    }
+  }
+};